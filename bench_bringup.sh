@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Device bring-up latency of simple_vhost_server with pipelined and
+# lockstep control planes. Each client connects, negotiates features,
+# shares its memory table and sets up a TX vring, then reports the time
+# from connect() until the backend acknowledged the last setup request.
+# Batches of clients start at once to mimic many VMs booting together.
+#
+# Usage: ./bench_bringup.sh [ROUNDS] [CONCURRENCY...]
+#   ROUNDS       batches per concurrency level (default 5)
+#   CONCURRENCY  clients started at once (default 1 16 64 256)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+OUT_DIR=$(mktemp -d /tmp/vhost-user-bringup.XXXXXX)
+ROUNDS="${1:-5}"
+shift
+LEVELS="${*:-1 16 64 256}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+rm -f "$SOCKET_PATH"
+./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+SERVER_PID=$!
+for i in {1..50}; do
+    [ -S "$SOCKET_PATH" ] && break
+    sleep 0.1
+done
+
+# Prints: samples failures avg p50 p99 max (microseconds)
+run_level() {
+    local clients="$1" flags="$2"
+    local failures=0
+
+    rm -f "$OUT_DIR"/*
+    for round in $(seq "$ROUNDS"); do
+        local pids=()
+        for c in $(seq "$clients"); do
+            ./vhost_user_client --mem-size 2 --tx-packets 1 --ring-size 64 $flags \
+                "$SOCKET_PATH" > "$OUT_DIR/$round.$c" 2>&1 &
+            pids+=($!)
+        done
+        for pid in "${pids[@]}"; do
+            wait "$pid" || failures=$((failures + 1))
+        done
+    done
+
+    # Bring-up: 180.2us, 12 requests in 2 round trips (pipelined)
+    cat "$OUT_DIR"/* | awk '/^Bring-up:/ { sub("us,", "", $2); print $2 }' | sort -n |
+        awk -v failures="$failures" '
+            { v[NR] = $1; sum += $1 }
+            END {
+                if (NR == 0) { print 0, failures, "-", "-", "-", "-"; exit }
+                printf "%d %d %.1f %.1f %.1f %.1f\n", NR, failures, sum / NR,
+                       v[int((NR - 1) * 0.50) + 1], v[int((NR - 1) * 0.99) + 1], v[NR]
+            }'
+}
+
+printf "%-8s %-10s %8s %6s %10s %10s %10s %10s\n" \
+       "clients" "mode" "samples" "fail" "avg us" "p50 us" "p99 us" "max us"
+for clients in $LEVELS; do
+    for mode in lockstep pipelined; do
+        flags=$([ "$mode" = lockstep ] && echo --lockstep)
+        read -r samples failures avg p50 p99 max <<< "$(run_level "$clients" "$flags")"
+        printf "%-8s %-10s %8s %6s %10s %10s %10s %10s\n" \
+               "$clients" "$mode" "$samples" "$failures" "$avg" "$p50" "$p99" "$max"
+    done
+done
+
+kill -INT "$SERVER_PID"
+wait "$SERVER_PID"
+rm -rf "$OUT_DIR"
+rm -f "$SOCKET_PATH" "$LOG_FILE"
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Loopback packet rate of simple_vhost_server with dirty page logging off
+# and on. With --dirty-log the client shares a bitmap (SET_LOG_BASE) and
+# negotiates VHOST_F_LOG_ALL, so the backend marks every page it writes.
+#
+# Usage: ./bench_dirty_log.sh [DURATION] [FRAME_SIZES...]
+#   DURATION     seconds per run (default 2)
+#   FRAME_SIZES  frame sizes in bytes (default 64 512 1518)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+DURATION="${1:-2}"
+shift
+SIZES="${*:-64 512 1518}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+run_one() {
+    local size="$1" flags="$2"
+    local client_out server_pid
+
+    rm -f "$SOCKET_PATH"
+    ./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+    server_pid=$!
+    for i in {1..50}; do
+        [ -S "$SOCKET_PATH" ] && break
+        sleep 0.1
+    done
+
+    client_out=$(./vhost_user_client --traffic --pkt-size "$size" $flags \
+                 --duration "$DURATION" "$SOCKET_PATH" 2>&1)
+    kill -INT "$server_pid"
+    wait "$server_pid"
+
+    # TX: N packets, X Mpps, Y Gbit/s
+    tx=$(echo "$client_out" | awk '/^TX:/ { print $4 }')
+    rx=$(echo "$client_out" | awk '/^RX:/ { print $4 }')
+    # Dirty log: N pages marked (XMB)
+    pages=$(echo "$client_out" | awk '/^Dirty log:/ { print $3 }')
+    echo "$tx $rx ${pages:--}"
+}
+
+printf "%-6s %-6s %10s %10s %12s\n" "size" "log" "TX Mpps" "RX Mpps" "dirty pages"
+for size in $SIZES; do
+    for mode in off on; do
+        flags=$([ "$mode" = on ] && echo --dirty-log)
+        read -r tx rx pages <<< "$(run_one "$size" "$flags")"
+        printf "%-6s %-6s %10s %10s %12s\n" "$size" "$mode" "${tx:--}" "${rx:--}" "$pages"
+    done
+done
+
+rm -f "$SOCKET_PATH" "$LOG_FILE"
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Kicks and interrupts per million frames with and without
+# VIRTIO_RING_F_EVENT_IDX, on split and packed rings, at several packet
+# rates. Without event indexes the only suppression is the NO_NOTIFY /
+# NO_INTERRUPT flags, which each side sets while it polls.
+#
+# Usage: ./bench_event_idx.sh [DURATION] [RATES...]
+#   DURATION  seconds per run (default 2)
+#   RATES     frames per second, 0 for unpaced (default 10000 100000 1000000 0)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+DURATION="${1:-2}"
+shift
+RATES="${*:-10000 100000 1000000 0}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+rm -f "$SOCKET_PATH"
+./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+SERVER_PID=$!
+trap 'kill -INT $SERVER_PID 2>/dev/null; rm -f "$SOCKET_PATH" "$LOG_FILE"' EXIT
+for i in {1..50}; do
+    [ -S "$SOCKET_PATH" ] && break
+    sleep 0.1
+done
+
+run_one() {
+    local client_out
+
+    client_out=$(./vhost_user_client --traffic --rate "$1" --duration "$DURATION" \
+                 $2 "$SOCKET_PATH" 2>&1)
+    # TX: N packets, X Mpps, ...
+    # Notifications: K kicks, I interrupts (X per million frames sent)
+    echo "$client_out" | awk '
+        /^TX:/ { tx = $2; mpps = $4 }
+        /^Notifications:/ { kicks = $2; ints = $4 }
+        END {
+            if (tx > 0) {
+                printf "%s %.0f %.0f %.0f\n", mpps, kicks * 1e6 / tx, ints * 1e6 / tx,
+                       (kicks + ints) * 1e6 / tx
+            }
+        }'
+}
+
+printf "%-7s %-10s %10s %8s %12s %12s %12s\n" \
+       "ring" "event_idx" "rate" "Mpps" "kicks/M" "irqs/M" "total/M"
+for ring in split packed; do
+    for event_idx in off on; do
+        opts=""
+        [ "$ring" = packed ] && opts="--packed"
+        [ "$event_idx" = on ] && opts="$opts --event-idx"
+        for rate in $RATES; do
+            read -r mpps kicks irqs total <<< "$(run_one "$rate" "$opts")"
+            printf "%-7s %-10s %10s %8s %12s %12s %12s\n" "$ring" "$event_idx" \
+                   "$([ "$rate" = 0 ] && echo max || echo "$rate")" \
+                   "${mpps:--}" "${kicks:--}" "${irqs:--}" "${total:--}"
+        done
+    done
+done
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# TX throughput of frames handed over in several descriptors, each taking a
+# ring slot or all of them sharing one through a VIRTIO_RING_F_INDIRECT_DESC
+# table, on split and packed rings of 256 and 1024 slots. The frames are
+# 1518 bytes: the virtio-net header in one descriptor and the frame spread
+# over the others.
+#
+# Usage: ./bench_indirect.sh [DURATION] [SEGS...]
+#   DURATION  seconds per run (default 2)
+#   SEGS      descriptors per frame (default 2 4 8)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+DURATION="${1:-2}"
+shift
+SEGS="${*:-2 4 8}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+rm -f "$SOCKET_PATH"
+./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+SERVER_PID=$!
+trap 'kill -INT $SERVER_PID 2>/dev/null; rm -f "$SOCKET_PATH" "$LOG_FILE"' EXIT
+for i in {1..50}; do
+    [ -S "$SOCKET_PATH" ] && break
+    sleep 0.1
+done
+
+run_one() {
+    # TX: N packets, X Mpps, Y Gbit/s
+    ./vhost_user_client --traffic --pkt-size 1518 --duration "$DURATION" \
+        $1 "$SOCKET_PATH" 2>&1 | awk '/^TX:/ { print $4, $6 }'
+}
+
+printf "%-7s %6s %5s %-9s %8s %10s\n" "ring" "slots" "segs" "indirect" "Mpps" "Gbit/s"
+for ring in split packed; do
+    for size in 256 1024; do
+        for segs in $SEGS; do
+            for indirect in off on; do
+                opts="--ring-size $size --segs $segs"
+                [ "$ring" = packed ] && opts="$opts --packed"
+                [ "$indirect" = on ] && opts="$opts --indirect"
+                read -r mpps gbits <<< "$(run_one "$opts")"
+                printf "%-7s %6s %5s %-9s %8s %10s\n" "$ring" "$size" "$segs" \
+                       "$indirect" "${mpps:--}" "${gbits:--}"
+            done
+        done
+    done
+done
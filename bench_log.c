@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "vhost_log.h"
+
+// CPU cost of a log statement to the thread that makes it. Each thread logs
+// the line the server used to print for every SET_VRING_NUM, over and over:
+// with printf() into a redirected stdout, as the server did before, through
+// the ring-buffer logger, and through the logger with the statement's level
+// filtered out. Threads log in batches that fit a logger ring and pause
+// between batches so that the flusher keeps up, like a server between
+// bursts of requests; only the batches are timed. Log output goes to a file
+// (default /tmp/vhost-bench-log.out, removed afterwards); the table goes to
+// the terminal.
+
+#define DEFAULT_OUTPUT  "/tmp/vhost-bench-log.out"
+#define MAX_THREADS     64
+#define BATCH           512
+#define BATCH_PAUSE_NS  10000000
+
+typedef enum BenchMode {
+    MODE_PRINTF,
+    MODE_VLOG,
+    MODE_FILTERED,
+} BenchMode;
+
+static const char *const mode_names[] = {
+    [MODE_PRINTF] = "printf",
+    [MODE_VLOG] = "vlog",
+    [MODE_FILTERED] = "filtered",
+};
+
+typedef struct BenchThread {
+    pthread_t thread;
+    BenchMode mode;
+    uint64_t messages;
+    double seconds;
+} BenchThread;
+
+static pthread_barrier_t start_barrier;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of the calling thread, so that a flusher running on the same
+// CPU is not charged to the threads that log
+static double thread_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void log_batch(BenchMode mode, unsigned n) {
+    switch (mode) {
+        case MODE_PRINTF:
+            for (unsigned i = 0; i < n; i++) {
+                printf("SET_VRING_NUM: index=%u num=%u\n", i & 15, 256);
+            }
+            break;
+        case MODE_VLOG:
+            for (unsigned i = 0; i < n; i++) {
+                VLOG_INFO("SET_VRING_NUM: index=%u num=%u", i & 15, 256);
+            }
+            break;
+        case MODE_FILTERED:
+            for (unsigned i = 0; i < n; i++) {
+                VLOG_DEBUG("SET_VRING_NUM: index=%u num=%u", i & 15, 256);
+            }
+            break;
+    }
+}
+
+static void *log_thread(void *arg) {
+    BenchThread *bt = arg;
+    struct timespec pause = { 0, BATCH_PAUSE_NS };
+
+    pthread_barrier_wait(&start_barrier);
+    bt->seconds = 0;
+    for (uint64_t done = 0; done < bt->messages; done += BATCH) {
+        unsigned n = bt->messages - done < BATCH ? bt->messages - done : BATCH;
+        double start = thread_seconds();
+
+        log_batch(bt->mode, n);
+        bt->seconds += thread_seconds() - start;
+        nanosleep(&pause, NULL);
+    }
+    if (bt->mode == MODE_PRINTF) {
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// Run nthreads loggers; returns the mean time a statement took its caller
+// and, in *flush_ms, how long the logger took to write out the rest.
+static double run_one(BenchMode mode, unsigned nthreads, uint64_t messages,
+                      double *flush_ms) {
+    BenchThread threads[MAX_THREADS];
+    double busy = 0, start;
+
+    if (mode != MODE_PRINTF) {
+        vhost_log_start();
+    }
+    pthread_barrier_init(&start_barrier, NULL, nthreads);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i].mode = mode;
+        threads[i].messages = messages;
+        pthread_create(&threads[i].thread, NULL, log_thread, &threads[i]);
+    }
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        busy += threads[i].seconds;
+    }
+    pthread_barrier_destroy(&start_barrier);
+
+    start = now_seconds();
+    if (mode != MODE_PRINTF) {
+        vhost_log_stop();
+    }
+    *flush_ms = (now_seconds() - start) * 1e3;
+    return busy * 1e9 / (messages * nthreads);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("  -n, --messages N       messages per thread and run (default 100000)\n");
+    printf("  -t, --threads N        logging threads, may be repeated (default 1, 4)\n");
+    printf("  -o, --output FILE      where the log lines go (default %s)\n", DEFAULT_OUTPUT);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "messages", required_argument, NULL, 'n' },
+        { "threads",  required_argument, NULL, 't' },
+        { "output",   required_argument, NULL, 'o' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned thread_counts[8] = { 1, 4 };
+    unsigned nthread_counts = 0;
+    uint64_t messages = 100000;
+    const char *output = DEFAULT_OUTPUT;
+    FILE *report;
+    int fd, opt;
+
+    while ((opt = getopt_long(argc, argv, "n:t:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                messages = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                if (nthread_counts < 8) {
+                    thread_counts[nthread_counts++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (nthread_counts == 0) {
+        nthread_counts = 2;
+    }
+    for (unsigned i = 0; i < nthread_counts; i++) {
+        if (thread_counts[i] < 1 || thread_counts[i] > MAX_THREADS) {
+            fprintf(stderr, "Thread count must be 1-%d\n", MAX_THREADS);
+            return 1;
+        }
+    }
+    if (messages == 0) {
+        fprintf(stderr, "Message count must be positive\n");
+        return 1;
+    }
+
+    // Log lines, including the logger's drop notices, go to the file
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (fd < 0 || !report) {
+        perror(output);
+        return 1;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    fprintf(report, "%-10s %8s %12s %10s %10s %12s\n", "mode", "threads", "messages",
+            "ns/msg", "flush ms", "dropped");
+    for (unsigned i = 0; i < nthread_counts; i++) {
+        for (BenchMode mode = MODE_PRINTF; mode <= MODE_FILTERED; mode++) {
+            double flush_ms, ns;
+            uint64_t before = vhost_log_dropped();
+
+            ns = run_one(mode, thread_counts[i], messages, &flush_ms);
+            fprintf(report, "%-10s %8u %12lu %10.1f %10.1f %12lu\n", mode_names[mode],
+                    thread_counts[i], messages * thread_counts[i], ns, flush_ms,
+                    vhost_log_dropped() - before);
+        }
+    }
+
+    if (strcmp(output, DEFAULT_OUTPUT) == 0) {
+        unlink(output);
+    }
+    fclose(report);
+    return 0;
+}
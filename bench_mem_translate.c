@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vhost_mem.h"
+
+// Guest-physical to host-virtual translation cost per descriptor. Three
+// lookups are compared over the same address streams:
+//   linear  scan of the region table (what chain_add() used to do)
+//   sorted  binary search of the sorted index (vhost_mem_gpa_to_hva)
+//   cached  last-hit cache in front of the index (vhost_mem_gpa_to_iov)
+// The "ring" pattern keeps a ring's worth of buffers in one region before
+// moving on, like a queue whose buffers the guest allocated together; the
+// "random" pattern picks a region at random for every descriptor.
+
+#define REGION_SIZE     (2ULL << 20)
+#define BUF_SIZE        1536
+#define RING_SIZE       256
+#define NADDRS          (1 << 16)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *linear_gpa_to_hva(const VhostMem *mem, uint64_t gpa, uint64_t len) {
+    for (uint32_t i = 0; i < mem->nregions; i++) {
+        const VhostMemRegion *reg = &mem->regions[i];
+        if (gpa >= reg->guest_phys_addr &&
+            gpa - reg->guest_phys_addr < reg->size &&
+            len <= reg->size - (gpa - reg->guest_phys_addr)) {
+            return reg->host_addr + (gpa - reg->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+// Regions are contiguous in guest physical space but added in shuffled
+// order, so the table is not already sorted.
+static int setup_regions(VhostMem *mem, unsigned nregions, int fd) {
+    unsigned order[VHOST_MEM_MAX_REGIONS];
+
+    for (unsigned i = 0; i < nregions; i++) {
+        order[i] = i;
+    }
+    for (unsigned i = nregions; i > 1; i--) {
+        unsigned j = rand() % i, tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+    memset(mem, 0, sizeof(*mem));
+    for (unsigned i = 0; i < nregions; i++) {
+        uint64_t gpa = order[i] * REGION_SIZE;
+        if (vhost_mem_add_region(mem, gpa, REGION_SIZE, 0x7f0000000000ULL + gpa,
+                                 0, fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void fill_addrs(uint64_t *addrs, unsigned nregions, int random_regions) {
+    unsigned region = 0;
+
+    for (unsigned i = 0; i < NADDRS; i++) {
+        uint64_t slot = rand() % (REGION_SIZE / BUF_SIZE);
+
+        if (random_regions) {
+            region = rand() % nregions;
+        } else if (i % RING_SIZE == 0) {
+            region = rand() % nregions;
+        }
+        addrs[i] = region * REGION_SIZE + slot * BUF_SIZE;
+    }
+}
+
+// Every method must agree, and a buffer straddling two regions must come
+// back as two spans.
+static int verify(const VhostMem *mem, const uint64_t *addrs, unsigned nregions) {
+    VhostMemCache cache = { 0 };
+    struct iovec iov[2];
+
+    for (unsigned i = 0; i < NADDRS; i++) {
+        void *hva = linear_gpa_to_hva(mem, addrs[i], BUF_SIZE);
+        if (!hva || hva != vhost_mem_gpa_to_hva(mem, addrs[i], BUF_SIZE) ||
+            vhost_mem_gpa_to_iov(mem, &cache, addrs[i], BUF_SIZE, iov, 2) != 1 ||
+            iov[0].iov_base != hva || iov[0].iov_len != BUF_SIZE) {
+            fprintf(stderr, "Translation mismatch at gpa 0x%lx\n", addrs[i]);
+            return -1;
+        }
+    }
+    if (nregions > 1 &&
+        (vhost_mem_gpa_to_iov(mem, &cache, REGION_SIZE - 100, BUF_SIZE, iov, 2) != 2 ||
+         iov[0].iov_len != 100 || iov[1].iov_len != BUF_SIZE - 100 ||
+         vhost_mem_gpa_to_hva(mem, REGION_SIZE - 100, BUF_SIZE) != NULL)) {
+        fprintf(stderr, "Buffer spanning two regions not split into spans\n");
+        return -1;
+    }
+    return 0;
+}
+
+typedef enum { METHOD_LINEAR, METHOD_SORTED, METHOD_CACHED } Method;
+
+static double run_one(const VhostMem *mem, const uint64_t *addrs, Method method,
+                      uint64_t lookups) {
+    VhostMemCache cache = { 0 };
+    uintptr_t sum = 0;
+    double start = now_seconds();
+
+    for (uint64_t i = 0; i < lookups; i++) {
+        uint64_t gpa = addrs[i & (NADDRS - 1)];
+        struct iovec iov;
+
+        switch (method) {
+            case METHOD_LINEAR:
+                sum += (uintptr_t)linear_gpa_to_hva(mem, gpa, BUF_SIZE);
+                break;
+            case METHOD_SORTED:
+                sum += (uintptr_t)vhost_mem_gpa_to_hva(mem, gpa, BUF_SIZE);
+                break;
+            case METHOD_CACHED:
+                vhost_mem_gpa_to_iov(mem, &cache, gpa, BUF_SIZE, &iov, 1);
+                sum += (uintptr_t)iov.iov_base;
+                break;
+        }
+    }
+    // Keep the lookups from being optimised away.
+    __asm__ __volatile__("" : : "r"(sum));
+    return (now_seconds() - start) * 1e9 / lookups;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("  -n, --lookups N        lookups per run (default 20000000)\n");
+    printf("  -r, --regions N        region count, may be repeated (default 1, 8, 64)\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "lookups", required_argument, NULL, 'n' },
+        { "regions", required_argument, NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const char *const method_names[] = { "linear", "sorted", "cached" };
+    unsigned region_counts[8] = { 1, 8, 64 };
+    unsigned ncounts = 0;
+    uint64_t lookups = 20000000;
+    uint64_t *addrs;
+    VhostMem mem;
+    int fd, opt;
+
+    while ((opt = getopt_long(argc, argv, "n:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                lookups = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                if (ncounts < 8) {
+                    region_counts[ncounts++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (ncounts == 0) {
+        ncounts = 3;
+    }
+    for (unsigned i = 0; i < ncounts; i++) {
+        if (region_counts[i] < 1 || region_counts[i] > VHOST_MEM_MAX_REGIONS) {
+            fprintf(stderr, "Region count must be 1-%d\n", VHOST_MEM_MAX_REGIONS);
+            return 1;
+        }
+    }
+    if (lookups == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Every region maps the same memfd; only the addresses matter here.
+    fd = memfd_create("bench-guest-mem", MFD_CLOEXEC);
+    addrs = malloc(NADDRS * sizeof(*addrs));
+    if (fd < 0 || ftruncate(fd, REGION_SIZE) < 0 || !addrs) {
+        perror("memfd");
+        return 1;
+    }
+    srand(1);
+
+    printf("%-8s %8s %8s %10s\n", "pattern", "regions", "method", "ns/lookup");
+    for (unsigned i = 0; i < ncounts; i++) {
+        if (setup_regions(&mem, region_counts[i], fd) < 0) {
+            return 1;
+        }
+        for (int random_regions = 0; random_regions <= 1; random_regions++) {
+            fill_addrs(addrs, region_counts[i], random_regions);
+            if (verify(&mem, addrs, region_counts[i]) < 0) {
+                return 1;
+            }
+            for (Method m = METHOD_LINEAR; m <= METHOD_CACHED; m++) {
+                printf("%-8s %8u %8s %10.2f\n", random_regions ? "random" : "ring",
+                       region_counts[i], method_names[m],
+                       run_one(&mem, addrs, m, lookups));
+            }
+        }
+        vhost_mem_unmap(&mem);
+    }
+
+    free(addrs);
+    close(fd);
+    return 0;
+}
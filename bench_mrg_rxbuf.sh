@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Loopback throughput of simple_vhost_server with and without mergeable RX
+# buffers (VIRTIO_NET_F_MRG_RXBUF), at 1500 and 9000 byte MTUs. Without the
+# feature every RX buffer must hold a whole frame; with it the client posts
+# small buffers and large frames span several of them.
+#
+# Usage: ./bench_mrg_rxbuf.sh [DURATION] [MTUS...]
+#   DURATION  seconds per run (default 2)
+#   MTUS      MTUs to test (default 1500 9000)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+DURATION="${1:-2}"
+shift
+MTUS="${*:-1500 9000}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+run_one() {
+    local frame_size="$1" flags="$2"
+    local client_out server_pid
+
+    rm -f "$SOCKET_PATH"
+    ./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+    server_pid=$!
+    for i in {1..50}; do
+        [ -S "$SOCKET_PATH" ] && break
+        sleep 0.1
+    done
+
+    client_out=$(./vhost_user_client --traffic --pkt-size "$frame_size" $flags \
+                 --duration "$DURATION" "$SOCKET_PATH" 2>&1)
+    kill -INT "$server_pid"
+    wait "$server_pid"
+
+    # RX: N packets, X Mpps, Y Gbit/s
+    rx=$(echo "$client_out" | awk '/^RX:/ { print $4, $6 }')
+    # RX buffers: N bytes each, XKB per ring, Y per frame
+    bufs=$(echo "$client_out" | awk '/^RX buffers:/ { sub(/KB$/, "", $6); print $6, $9 }')
+    # Drops: N (sent but not received back), ...
+    drops=$(echo "$client_out" | awk '/^Drops:/ { print $2 }')
+    echo "$rx $bufs $drops"
+}
+
+printf "%-6s %-10s %10s %10s %12s %11s %12s\n" \
+       "MTU" "mrg_rxbuf" "RX Mpps" "RX Gbit/s" "RX ring KB" "bufs/frame" "drops"
+for mtu in $MTUS; do
+    # Ethernet header on top of the MTU
+    frame_size=$((mtu + 14))
+    for mode in off on; do
+        flags=$([ "$mode" = on ] && echo --mrg-rxbuf)
+        read -r mpps gbps ring_kb per_frame drops <<< "$(run_one "$frame_size" "$flags")"
+        printf "%-6s %-10s %10s %10s %12s %11s %12s\n" "$mtu" "$mode" \
+               "${mpps:--}" "${gbps:--}" "${ring_kb:--}" "${per_frame:--}" "${drops:--}"
+    done
+done
+
+rm -f "$SOCKET_PATH" "$LOG_FILE"
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Latency and backend CPU use versus packet rate for the worker wake-up
+# modes of simple_vhost_server: sleeping on kick eventfds, adaptive
+# busy-polling, and pure polling.
+#
+# Usage: ./bench_poll_modes.sh [DURATION] [RATES...]
+#   DURATION  seconds per run (default 2)
+#   RATES     frames per second, 0 for unpaced (default 10000 100000 1000000 0)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+DURATION="${1:-2}"
+shift
+RATES="${*:-10000 100000 1000000 0}"
+
+# name:--poll-us value
+MODES="eventfd:0 adaptive-50us:50 adaptive-500us:500 poll:-1"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+run_one() {
+    local poll_us="$1" rate="$2"
+    local client_out server_pid
+
+    rm -f "$SOCKET_PATH"
+    ./simple_vhost_server --poll-us "$poll_us" "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+    server_pid=$!
+    for i in {1..50}; do
+        [ -S "$SOCKET_PATH" ] && break
+        sleep 0.1
+    done
+
+    client_out=$(./vhost_user_client --traffic --rate "$rate" --duration "$DURATION" \
+                 "$SOCKET_PATH" 2>&1)
+    kill -INT "$server_pid"
+    wait "$server_pid"
+
+    # TX: N packets, X Mpps, ...
+    mpps=$(echo "$client_out" | awk '/^TX:/ { print $4 }')
+    # Latency: avg Xus, p50 <Yus, p99 <Zus, max Wus (N frames)
+    lat=$(echo "$client_out" | awk '/^Latency:/ { gsub(/[^0-9.]/, " "); print $1, $3, $5 }')
+    # Queue pair 0 worker: N TX packets, Xs CPU (...), N wakeups
+    cpu=$(awk '/^Queue pair 0 worker:/ { gsub(/s$/, "", $8); print $8, $(NF - 1) }' "$LOG_FILE")
+    echo "$mpps $lat $cpu"
+}
+
+printf "%-15s %10s %8s %9s %9s %9s %8s %10s\n" \
+       "mode" "rate" "Mpps" "avg(us)" "p50(us)" "p99(us)" "CPU%" "wakeups"
+for mode in $MODES; do
+    name="${mode%%:*}"
+    poll_us="${mode#*:}"
+    for rate in $RATES; do
+        read -r mpps avg p50 p99 cpu wakeups <<< "$(run_one "$poll_us" "$rate")"
+        cpu_pct=$(awk -v c="${cpu:-0}" -v d="$DURATION" 'BEGIN { printf "%.1f", 100 * c / d }')
+        printf "%-15s %10s %8s %9s %9s %9s %8s %10s\n" "$name" \
+               "$([ "$rate" = 0 ] && echo max || echo "$rate")" \
+               "${mpps:--}" "${avg:--}" "${p50:--}" "${p99:--}" "$cpu_pct" "${wakeups:--}"
+    done
+done
+
+rm -f "$SOCKET_PATH" "$LOG_FILE"
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "vhost_pool.h"
+
+// Allocation rate of packet buffers. Each thread takes a burst of buffers,
+// writes a header into each, and gives them back, over and over: with
+// malloc() and free() one buffer at a time, from the pool through a cache
+// of its own, and from the pool's shared ring alone, the path every thread
+// would take without caches. One operation is a buffer taken and given back.
+
+#define MAX_THREADS     64
+#define MAX_BURST       VHOST_POOL_BULK
+
+typedef enum BenchMode {
+    MODE_MALLOC,
+    MODE_POOL,
+    MODE_RING,
+} BenchMode;
+
+static const char *const mode_names[] = {
+    [MODE_MALLOC] = "malloc",
+    [MODE_POOL] = "pool",
+    [MODE_RING] = "pool-ring",
+};
+
+typedef struct BenchThread {
+    pthread_t thread;
+    BenchMode mode;
+    VhostPool *pool;
+    uint64_t ops;
+    unsigned burst;
+    size_t size;
+    int failed;
+} BenchThread;
+
+static pthread_barrier_t start_barrier;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *pool_thread(void *arg) {
+    BenchThread *bt = arg;
+    VhostPoolCache cache = { 0 };
+    VhostPoolCache *c = bt->mode == MODE_POOL ? &cache : NULL;
+    void *bufs[MAX_BURST];
+
+    pthread_barrier_wait(&start_barrier);
+    for (uint64_t done = 0; done < bt->ops; done += bt->burst) {
+        if (bt->mode == MODE_MALLOC) {
+            for (unsigned i = 0; i < bt->burst; i++) {
+                bufs[i] = malloc(bt->size);
+            }
+        } else if (vhost_pool_alloc_bulk(bt->pool, c, bufs, bt->burst) != bt->burst) {
+            bt->failed = 1;
+            break;
+        }
+        for (unsigned i = 0; i < bt->burst; i++) {
+            if (!bufs[i]) {
+                bt->failed = 1;
+                return NULL;
+            }
+            memset(bufs[i], (int)i, 16);
+        }
+        __asm__ volatile("" : : "r"(bufs) : "memory");
+        if (bt->mode == MODE_MALLOC) {
+            for (unsigned i = 0; i < bt->burst; i++) {
+                free(bufs[i]);
+            }
+        } else {
+            vhost_pool_free_bulk(bt->pool, c, bufs, bt->burst);
+        }
+    }
+    if (c) {
+        vhost_pool_cache_flush(bt->pool, c);
+    }
+    return NULL;
+}
+
+// Run nthreads threads of ops operations each; returns millions of
+// operations per second over all threads, or -1 if the pool ran dry.
+static double run_one(BenchMode mode, VhostPool *pool, unsigned nthreads, uint64_t ops,
+                      unsigned burst, size_t size) {
+    BenchThread threads[MAX_THREADS];
+    double start, elapsed;
+    int failed = 0;
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i] = (BenchThread){ .mode = mode, .pool = pool, .ops = ops,
+                                    .burst = burst, .size = size };
+        pthread_create(&threads[i].thread, NULL, pool_thread, &threads[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    start = now_seconds();
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        failed |= threads[i].failed;
+    }
+    elapsed = now_seconds() - start;
+    pthread_barrier_destroy(&start_barrier);
+    if (failed || vhost_pool_ring_count(pool) != pool->nbufs) {
+        return -1;
+    }
+    return ops * nthreads / elapsed / 1e6;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("  -n, --ops N            buffers each thread takes and gives back (default 10000000)\n");
+    printf("  -t, --threads N        threads, may be repeated (default 1, 4, 16)\n");
+    printf("  -b, --burst N          buffers taken at once, 1-%d (default 32)\n", MAX_BURST);
+    printf("  -s, --size BYTES       buffer size (default 2048)\n");
+    printf("  -H, --hugepages        back the pool with huge pages if there are any\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "ops",       required_argument, NULL, 'n' },
+        { "threads",   required_argument, NULL, 't' },
+        { "burst",     required_argument, NULL, 'b' },
+        { "size",      required_argument, NULL, 's' },
+        { "hugepages", no_argument,       NULL, 'H' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned thread_counts[8] = { 1, 4, 16 };
+    unsigned nthread_counts = 0, burst = 32;
+    uint64_t ops = 10000000;
+    size_t size = 2048;
+    int flags = 0, opt;
+
+    while ((opt = getopt_long(argc, argv, "n:t:b:s:Hh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                if (nthread_counts < 8) {
+                    thread_counts[nthread_counts++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 'b':
+                burst = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                flags |= VHOST_POOL_F_HUGEPAGES;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (nthread_counts == 0) {
+        nthread_counts = 3;
+    }
+    for (unsigned i = 0; i < nthread_counts; i++) {
+        if (thread_counts[i] < 1 || thread_counts[i] > MAX_THREADS) {
+            fprintf(stderr, "Thread count must be 1-%d\n", MAX_THREADS);
+            return 1;
+        }
+    }
+    if (burst < 1 || burst > MAX_BURST || ops == 0 || size < 16 || size > (1 << 20)) {
+        fprintf(stderr, "Invalid burst, operation count or size\n");
+        return 1;
+    }
+
+    printf("%-10s %8s %8s %12s %10s\n", "mode", "threads", "burst", "ops", "Mops/s");
+    for (unsigned i = 0; i < nthread_counts; i++) {
+        unsigned nthreads = thread_counts[i];
+        VhostPool pool;
+
+        // Enough for every cache to fill up while a burst is out
+        if (vhost_pool_init(&pool, nthreads * (VHOST_POOL_CACHE_SIZE + burst), size, flags) < 0) {
+            return 1;
+        }
+        for (BenchMode mode = MODE_MALLOC; mode <= MODE_RING; mode++) {
+            double mops = run_one(mode, &pool, nthreads, ops, burst, size);
+
+            if (mops < 0) {
+                fprintf(stderr, "%s: pool ran dry or lost buffers\n", mode_names[mode]);
+                return 1;
+            }
+            printf("%-10s %8u %8u %12lu %10.1f\n", mode_names[mode], nthreads, burst,
+                   ops * nthreads, mops);
+        }
+        if (i == 0) {
+            printf("(pool on %s pages)\n", pool.hugepages ? "huge" : "normal");
+        }
+        vhost_pool_destroy(&pool);
+    }
+    return 0;
+}
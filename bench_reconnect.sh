@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Data-plane recovery across backend restarts. The client runs traffic with
+# an inflight area (--reconnect) while the server is killed with SIGKILL and
+# started again, CYCLES times per ring layout. For each restart it reports
+# how long the control connection was down and how long after the reconnect
+# frames completed again.
+#
+# Usage: ./bench_reconnect.sh [CYCLES] [GAP_MS]
+#   CYCLES  restarts per ring layout (default 5)
+#   GAP_MS  time the backend stays down, in milliseconds (default 0)
+
+SOCKET_PATH="/tmp/vhost-user-bench-sock"
+LOG_FILE="/tmp/vhost-user-bench.log"
+CLIENT_LOG="/tmp/vhost-user-bench-client.log"
+CYCLES="${1:-5}"
+GAP_MS="${2:-0}"
+
+make simple_vhost_server vhost_user_client > /dev/null || exit 1
+
+SERVER_PID=
+trap 'kill -INT $SERVER_PID 2>/dev/null; rm -f "$SOCKET_PATH" "$LOG_FILE" "$CLIENT_LOG"' EXIT
+
+start_server() {
+    ./simple_vhost_server "$SOCKET_PATH" >> "$LOG_FILE" 2>&1 &
+    SERVER_PID=$!
+}
+
+printf "%-7s %6s %12s %12s %12s\n" "ring" "cycle" "down ms" "resume ms" "total ms"
+for ring in split packed; do
+    opts="--traffic --reconnect --duration $((CYCLES + 1))"
+    [ "$ring" = packed ] && opts="$opts --packed"
+
+    rm -f "$SOCKET_PATH"
+    start_server
+    for i in {1..50}; do
+        [ -S "$SOCKET_PATH" ] && break
+        sleep 0.1
+    done
+    ./vhost_user_client $opts "$SOCKET_PATH" > "$CLIENT_LOG" 2>&1 &
+    CLIENT_PID=$!
+    for ((c = 0; c < CYCLES; c++)); do
+        sleep 1
+        kill -9 "$SERVER_PID"
+        wait "$SERVER_PID" 2>/dev/null
+        sleep "$(awk "BEGIN { print $GAP_MS / 1000 }")"
+        start_server
+    done
+    if ! wait "$CLIENT_PID"; then
+        echo "$ring: client failed" >&2
+        tail -5 "$CLIENT_LOG" >&2
+    fi
+
+    # Reconnected after X ms, traffic resumed Y ms after reconnecting
+    awk -v ring="$ring" '/^Reconnected after/ {
+            down = $3 + 0; resume = $6 + 0
+            printf "%-7s %6d %12.1f %12.1f %12.1f\n", ring, ++n, down, resume, down + resume
+        }' "$CLIENT_LOG"
+    kill -INT "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+done
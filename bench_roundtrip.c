@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "vhost_user.h"
+
+// Control-plane round-trip latency of a vhost-user backend. One connection
+// stays open and each request type is sent over and over, one at a time:
+// the clock starts before the request is written and stops when its reply
+// has been read. Requests that have no reply of their own are only timed
+// when the backend offers REPLY_ACK, with the need-reply flag set. Only
+// requests that leave the device as they found it are used, so the same
+// message can be repeated millions of times.
+
+#define DEFAULT_SOCKET      "/tmp/vhost-user-bench-sock"
+#define MAX_TYPES           VHOST_USER_MAX
+
+typedef struct BenchResult {
+    VhostUserRequest request;
+    uint64_t count;
+    double seconds;
+    uint32_t p50_ns;
+    uint32_t p99_ns;
+    uint32_t p999_ns;
+    uint32_t max_ns;
+} BenchResult;
+
+typedef struct BenchConn {
+    int sock;
+    VhostUserReader rd;
+} BenchConn;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Start the backend on path with its output discarded and wait until it
+// accepts connections.
+static pid_t spawn_server(const char *server, const char *path, int *sock) {
+    pid_t pid;
+
+    unlink(path);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, path, NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) {
+        *sock = connect_to(path);
+        if (*sock >= 0) {
+            return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "%s did not come up on %s\n", server, path);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// Send one request and read its reply into reply.
+static int round_trip(BenchConn *conn, VhostUserMsg *msg, VhostUserMsg *reply) {
+    int fds[VHOST_USER_MAX_FDS];
+    size_t nfds;
+    int ret;
+
+    if (vhost_user_send(conn->sock, (const VhostUserHdr *)msg, &msg->payload,
+                        NULL, 0) < 0) {
+        return -1;
+    }
+    while ((ret = vhost_user_next(&conn->rd, reply, sizeof(*reply), fds, &nfds)) == 0) {
+        ssize_t n = vhost_user_recv(conn->sock, &conn->rd, 0);
+
+        if (n <= 0) {
+            fprintf(stderr, "Backend closed the connection\n");
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    if (reply->request != msg->request || !(reply->flags & VHOST_USER_REPLY_MASK)) {
+        fprintf(stderr, "Unexpected reply %u to %s\n", (uint32_t)reply->request,
+                vhost_user_request_name(msg->request));
+        return -1;
+    }
+    return 0;
+}
+
+// The message repeated for request: a no-op on the device as set up by
+// main(), with need-reply set unless the request is answered anyway.
+static void build_request(VhostUserMsg *msg, VhostUserRequest request,
+                          uint64_t features, uint64_t protocol_features) {
+    memset(msg, 0, sizeof(*msg));
+    msg->request = request;
+    msg->flags = VHOST_USER_VERSION;
+    if (!vhost_user_request_has_reply(request)) {
+        msg->flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+    switch (request) {
+        case VHOST_USER_SET_FEATURES:
+            msg->size = sizeof(msg->payload.u64);
+            msg->payload.u64 = features;
+            break;
+        case VHOST_USER_SET_PROTOCOL_FEATURES:
+            msg->size = sizeof(msg->payload.u64);
+            msg->payload.u64 = protocol_features;
+            break;
+        case VHOST_USER_SET_VRING_NUM:
+            msg->size = sizeof(msg->payload.state);
+            msg->payload.state.num = 256;
+            break;
+        case VHOST_USER_SET_VRING_BASE:
+        case VHOST_USER_GET_VRING_BASE:
+            msg->size = sizeof(msg->payload.state);
+            break;
+        case VHOST_USER_SET_VRING_ENABLE:
+            msg->size = sizeof(msg->payload.state);
+            msg->payload.state.num = 1;
+            break;
+        case VHOST_USER_SET_VRING_ADDR:
+            // Never used: the ring has no kick fd, so it is not started.
+            msg->size = sizeof(msg->payload.addr);
+            msg->payload.addr.desc_user_addr = 0x10000;
+            msg->payload.addr.avail_user_addr = 0x11000;
+            msg->payload.addr.used_user_addr = 0x12000;
+            break;
+        case VHOST_USER_SET_VRING_CALL:
+            msg->size = sizeof(msg->payload.u64);
+            msg->payload.u64 = VHOST_USER_VRING_NOFD_MASK;
+            break;
+        default:
+            break;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint64_t n, double p) {
+    return sorted[(uint64_t)((n - 1) * p)];
+}
+
+static int run_one(BenchConn *conn, VhostUserRequest request, uint64_t features,
+                   uint64_t protocol_features, uint64_t count, uint64_t warmup,
+                   uint32_t *samples, BenchResult *res) {
+    VhostUserMsg msg, reply;
+    uint64_t start;
+
+    build_request(&msg, request, features, protocol_features);
+    for (uint64_t i = 0; i < warmup; i++) {
+        if (round_trip(conn, &msg, &reply) < 0) {
+            return -1;
+        }
+    }
+    start = now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t t0 = now_ns(), t;
+
+        if (round_trip(conn, &msg, &reply) < 0) {
+            return -1;
+        }
+        t = now_ns() - t0;
+        samples[i] = t > UINT32_MAX ? UINT32_MAX : t;
+        if (!vhost_user_request_has_reply(request) && reply.payload.u64 != 0) {
+            fprintf(stderr, "%s failed with status %lu\n",
+                    vhost_user_request_name(request), reply.payload.u64);
+            return -1;
+        }
+    }
+    res->request = request;
+    res->count = count;
+    res->seconds = (now_ns() - start) / 1e9;
+    qsort(samples, count, sizeof(*samples), cmp_u32);
+    res->p50_ns = percentile(samples, count, 0.50);
+    res->p99_ns = percentile(samples, count, 0.99);
+    res->p999_ns = percentile(samples, count, 0.999);
+    res->max_ns = samples[count - 1];
+    return 0;
+}
+
+static int write_json(const char *path, const char *socket_path,
+                      const BenchResult *res, unsigned nres) {
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"socket\": \"%s\",\n  \"results\": [\n", socket_path);
+    for (unsigned i = 0; i < nres; i++) {
+        fprintf(f, "    {\"request\": \"%s\", \"count\": %lu, \"requests_per_sec\": %.0f, "
+                "\"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u}%s\n",
+                vhost_user_request_name(res[i].request), res[i].count,
+                res[i].count / res[i].seconds, res[i].p50_ns, res[i].p99_ns,
+                res[i].p999_ns, res[i].max_ns, i + 1 < nres ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+    return 0;
+}
+
+static VhostUserRequest parse_request(const char *name) {
+    for (uint32_t r = 1; r < VHOST_USER_MAX; r++) {
+        if (strcasecmp(name, vhost_user_request_name(r)) == 0) {
+            return r;
+        }
+    }
+    return VHOST_USER_NONE;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [SOCKET_PATH]\n", prog);
+    printf("  -n, --count N          timed requests per type (default 1000000)\n");
+    printf("  -w, --warmup N         untimed requests per type first (default 10000)\n");
+    printf("  -r, --request NAME     request type, may be repeated (default all)\n");
+    printf("  -j, --json FILE        also write the results as JSON, - for stdout\n");
+    printf("  -S, --server PATH      start this backend on SOCKET_PATH and stop it after\n");
+    printf("SOCKET_PATH defaults to %s\n", DEFAULT_SOCKET);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "count",   required_argument, NULL, 'n' },
+        { "warmup",  required_argument, NULL, 'w' },
+        { "request", required_argument, NULL, 'r' },
+        { "json",    required_argument, NULL, 'j' },
+        { "server",  required_argument, NULL, 'S' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    // Every request this benchmark knows how to repeat harmlessly.
+    static const VhostUserRequest all_requests[] = {
+        VHOST_USER_GET_FEATURES, VHOST_USER_GET_PROTOCOL_FEATURES,
+        VHOST_USER_GET_QUEUE_NUM, VHOST_USER_GET_VRING_BASE,
+        VHOST_USER_SET_OWNER, VHOST_USER_SET_FEATURES,
+        VHOST_USER_SET_PROTOCOL_FEATURES, VHOST_USER_SET_VRING_NUM,
+        VHOST_USER_SET_VRING_BASE, VHOST_USER_SET_VRING_ADDR,
+        VHOST_USER_SET_VRING_ENABLE, VHOST_USER_SET_VRING_CALL,
+    };
+    const unsigned nall = sizeof(all_requests) / sizeof(all_requests[0]);
+    const char *socket_path = DEFAULT_SOCKET;
+    const char *json_path = NULL;
+    const char *server = NULL;
+    VhostUserRequest requests[MAX_TYPES];
+    BenchResult results[MAX_TYPES];
+    unsigned nrequests = 0, nresults = 0;
+    uint64_t count = 1000000, warmup = 10000;
+    uint64_t features, protocol_features = 0;
+    VhostUserMsg msg, reply;
+    uint32_t *samples;
+    BenchConn conn;
+    pid_t server_pid = -1;
+    int opt, ret = 1;
+
+    while ((opt = getopt_long(argc, argv, "n:w:r:j:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                count = strtoull(optarg, NULL, 0);
+                break;
+            case 'w':
+                warmup = strtoull(optarg, NULL, 0);
+                break;
+            case 'r': {
+                VhostUserRequest r = parse_request(optarg);
+                int known = 0;
+
+                for (unsigned i = 0; i < nall; i++) {
+                    known |= all_requests[i] == r;
+                }
+                if (!known) {
+                    fprintf(stderr, "Cannot benchmark request %s\n", optarg);
+                    return 1;
+                }
+                if (nrequests < MAX_TYPES) {
+                    requests[nrequests++] = r;
+                }
+                break;
+            }
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'S':
+                server = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        socket_path = argv[optind];
+    }
+    if (count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nrequests == 0) {
+        memcpy(requests, all_requests, sizeof(all_requests));
+        nrequests = nall;
+    }
+    samples = malloc(count * sizeof(*samples));
+    if (!samples) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (server) {
+        server_pid = spawn_server(server, socket_path, &conn.sock);
+        if (server_pid < 0) {
+            free(samples);
+            return 1;
+        }
+    } else if ((conn.sock = connect_to(socket_path)) < 0) {
+        perror(socket_path);
+        free(samples);
+        return 1;
+    }
+    vhost_user_reader_init(&conn.rd);
+
+    // Negotiate once; the SET_ requests then repeat what was agreed.
+    build_request(&msg, VHOST_USER_GET_FEATURES, 0, 0);
+    if (round_trip(&conn, &msg, &reply) < 0) {
+        goto out;
+    }
+    features = reply.payload.u64 & ((1ULL << VIRTIO_F_VERSION_1) |
+                                    (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        build_request(&msg, VHOST_USER_GET_PROTOCOL_FEATURES, 0, 0);
+        if (round_trip(&conn, &msg, &reply) < 0) {
+            goto out;
+        }
+        protocol_features = reply.payload.u64 & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+        build_request(&msg, VHOST_USER_SET_PROTOCOL_FEATURES, 0, protocol_features);
+        // Enabling REPLY_ACK applies to the request itself.
+        if (protocol_features && round_trip(&conn, &msg, &reply) < 0) {
+            goto out;
+        }
+    }
+
+    printf("%-22s %10s %12s %9s %9s %9s %9s\n", "request", "count", "req/s",
+           "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (unsigned i = 0; i < nrequests; i++) {
+        BenchResult *res = &results[nresults];
+
+        if (!vhost_user_request_has_reply(requests[i]) && !protocol_features) {
+            printf("%-22s skipped: backend does not offer REPLY_ACK\n",
+                   vhost_user_request_name(requests[i]));
+            continue;
+        }
+        if (run_one(&conn, requests[i], features, protocol_features, count, warmup,
+                    samples, res) < 0) {
+            goto out;
+        }
+        printf("%-22s %10lu %12.0f %9u %9u %9u %9u\n",
+               vhost_user_request_name(res->request), res->count,
+               res->count / res->seconds, res->p50_ns, res->p99_ns, res->p999_ns,
+               res->max_ns);
+        fflush(stdout);
+        nresults++;
+    }
+    ret = json_path && write_json(json_path, socket_path, results, nresults) < 0;
+
+out:
+    close(conn.sock);
+    free(samples);
+    if (server_pid > 0) {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+        unlink(socket_path);
+    }
+    return ret;
+}
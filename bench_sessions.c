@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "vhost_user.h"
+
+// How the backend's control plane scales with the number of sessions.
+// Load threads share the sessions of each concurrency level between them.
+// First every session connects and completes one GET_FEATURES round
+// trip: the time until all of them have done so gives the connection setup
+// rate. Then each session keeps a fixed number of GET_FEATURES requests in
+// flight, sending a new one for every reply, and the replies counted over
+// the run give the aggregate request rate. The least and most served
+// sessions show whether some are starved as the count grows.
+
+#define DEFAULT_SOCKET      "/tmp/vhost-user-bench-sock"
+#define MAX_LEVELS          16
+#define MAX_DEPTH           64
+#define EPOLL_BATCH         256
+
+typedef struct BenchSession {
+    int sock;
+    VhostUserReader rd;
+    uint64_t replies;
+} BenchSession;
+
+typedef struct LoadThread {
+    pthread_t tid;
+    BenchSession *sessions;
+    unsigned nsessions;
+    int epfd;
+    uint64_t setup_start;
+    uint64_t setup_end;
+    uint64_t load_start;
+    uint64_t load_end;
+    uint64_t replies;
+    int failed;
+} LoadThread;
+
+typedef struct LevelResult {
+    unsigned sessions;
+    double setup_seconds;
+    double seconds;
+    uint64_t replies;
+    uint64_t min_replies;
+    uint64_t max_replies;
+} LevelResult;
+
+static const char *socket_path = DEFAULT_SOCKET;
+static unsigned depth = 1;
+static double duration = 2.0;
+static pthread_barrier_t phase_barrier;
+static uint8_t request_wire[MAX_DEPTH * sizeof(VhostUserHdr)];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Start the backend on path with its output discarded and wait until it
+// accepts connections.
+static pid_t spawn_server(const char *server, const char *path) {
+    pid_t pid;
+
+    unlink(path);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, path, NULL);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) {
+        int sock = connect_to(path);
+
+        if (sock >= 0) {
+            close(sock);
+            return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "%s did not come up on %s\n", server, path);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// Write n GET_FEATURES requests in one go.
+static int send_requests(BenchSession *s, unsigned n) {
+    size_t len = n * sizeof(VhostUserHdr), off = 0;
+
+    while (off < len) {
+        ssize_t ret = send(s->sock, request_wire + off, len - off, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+// Read what the session has and count the complete replies in it.
+static int read_replies(BenchSession *s) {
+    int fds[VHOST_USER_MAX_FDS];
+    VhostUserMsg reply;
+    size_t nfds;
+    int got = 0, ret;
+    ssize_t n = vhost_user_recv(s->sock, &s->rd, MSG_DONTWAIT);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        fprintf(stderr, "Backend closed a session\n");
+        return -1;
+    }
+    while ((ret = vhost_user_next(&s->rd, &reply, sizeof(reply), fds, &nfds)) > 0) {
+        if (reply.request != VHOST_USER_GET_FEATURES) {
+            fprintf(stderr, "Unexpected reply %u\n", (uint32_t)reply.request);
+            return -1;
+        }
+        got++;
+    }
+    return ret < 0 ? -1 : got;
+}
+
+static int thread_connect(LoadThread *t) {
+    struct epoll_event events[EPOLL_BATCH];
+    unsigned pending = t->nsessions;
+
+    for (unsigned i = 0; i < t->nsessions; i++) {
+        BenchSession *s = &t->sessions[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+
+        s->sock = connect_to(socket_path);
+        if (s->sock < 0) {
+            perror("connect");
+            return -1;
+        }
+        vhost_user_reader_init(&s->rd);
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, s->sock, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        if (send_requests(s, 1) < 0) {
+            return -1;
+        }
+    }
+    while (pending > 0) {
+        int n = epoll_wait(t->epfd, events, EPOLL_BATCH, 5000);
+
+        if (n <= 0) {
+            fprintf(stderr, "Timed out waiting for %u sessions\n", pending);
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            int got = read_replies(events[i].data.ptr);
+
+            if (got < 0) {
+                return -1;
+            }
+            pending -= got;
+        }
+    }
+    return 0;
+}
+
+static int thread_load(LoadThread *t) {
+    struct epoll_event events[EPOLL_BATCH];
+    uint64_t deadline = now_ns() + (uint64_t)(duration * 1e9);
+
+    for (unsigned i = 0; i < t->nsessions; i++) {
+        if (send_requests(&t->sessions[i], depth) < 0) {
+            return -1;
+        }
+    }
+    while (now_ns() < deadline) {
+        int n = epoll_wait(t->epfd, events, EPOLL_BATCH, 10);
+
+        for (int i = 0; i < n; i++) {
+            BenchSession *s = events[i].data.ptr;
+            int got = read_replies(s);
+
+            if (got < 0) {
+                return -1;
+            }
+            s->replies += got;
+            t->replies += got;
+            if (got > 0 && send_requests(s, got) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// The phases are separated by barriers. Each thread times its own part; a
+// phase lasts from the first thread starting it to the last one finishing.
+// A failed thread still waits at every barrier to keep the others going.
+static void *load_thread(void *arg) {
+    LoadThread *t = arg;
+
+    pthread_barrier_wait(&phase_barrier);
+    t->setup_start = now_ns();
+    t->failed = thread_connect(t) < 0;
+    t->setup_end = now_ns();
+    pthread_barrier_wait(&phase_barrier);
+    t->load_start = now_ns();
+    if (!t->failed) {
+        t->failed = thread_load(t) < 0;
+    }
+    t->load_end = now_ns();
+    return NULL;
+}
+
+static int run_level(unsigned nsessions, unsigned nthreads, LevelResult *res) {
+    BenchSession *sessions = calloc(nsessions, sizeof(*sessions));
+    LoadThread *threads = calloc(nthreads, sizeof(*threads));
+    unsigned next = 0;
+    uint64_t setup_start = UINT64_MAX, setup_end = 0;
+    uint64_t load_start = UINT64_MAX, load_end = 0;
+    int failed = 0;
+
+    if (!sessions || !threads) {
+        perror("calloc");
+        free(sessions);
+        free(threads);
+        return -1;
+    }
+    if (nthreads > nsessions) {
+        nthreads = nsessions;
+    }
+    pthread_barrier_init(&phase_barrier, NULL, nthreads);
+    for (unsigned i = 0; i < nthreads; i++) {
+        LoadThread *t = &threads[i];
+
+        t->sessions = &sessions[next];
+        t->nsessions = nsessions / nthreads + (i < nsessions % nthreads);
+        next += t->nsessions;
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        for (unsigned j = 0; j < t->nsessions; j++) {
+            t->sessions[j].sock = -1;
+        }
+        pthread_create(&t->tid, NULL, load_thread, t);
+    }
+
+
+    res->sessions = nsessions;
+    res->replies = 0;
+    res->min_replies = UINT64_MAX;
+    res->max_replies = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        LoadThread *t = &threads[i];
+
+        pthread_join(t->tid, NULL);
+        failed |= t->failed;
+        res->replies += t->replies;
+        setup_start = t->setup_start < setup_start ? t->setup_start : setup_start;
+        setup_end = t->setup_end > setup_end ? t->setup_end : setup_end;
+        load_start = t->load_start < load_start ? t->load_start : load_start;
+        load_end = t->load_end > load_end ? t->load_end : load_end;
+        close(t->epfd);
+    }
+    res->setup_seconds = (setup_end - setup_start) / 1e9;
+    res->seconds = (load_end - load_start) / 1e9;
+    for (unsigned i = 0; i < nsessions; i++) {
+        if (sessions[i].replies < res->min_replies) {
+            res->min_replies = sessions[i].replies;
+        }
+        if (sessions[i].replies > res->max_replies) {
+            res->max_replies = sessions[i].replies;
+        }
+        if (sessions[i].sock >= 0) {
+            close(sessions[i].sock);
+        }
+    }
+    pthread_barrier_destroy(&phase_barrier);
+    free(sessions);
+    free(threads);
+    return failed ? -1 : 0;
+}
+
+static int write_json(const char *path, unsigned nthreads, const LevelResult *res,
+                      unsigned nres) {
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"socket\": \"%s\",\n  \"threads\": %u,\n  \"depth\": %u,\n"
+            "  \"levels\": [\n", socket_path, nthreads, depth);
+    for (unsigned i = 0; i < nres; i++) {
+        fprintf(f, "    {\"sessions\": %u, \"setup_seconds\": %.6f, "
+                "\"connections_per_sec\": %.0f, \"requests_per_sec\": %.0f, "
+                "\"min_session_replies\": %lu, \"max_session_replies\": %lu}%s\n",
+                res[i].sessions, res[i].setup_seconds,
+                res[i].sessions / res[i].setup_seconds, res[i].replies / res[i].seconds,
+                res[i].min_replies, res[i].max_replies, i + 1 < nres ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+    return 0;
+}
+
+// Every session is a descriptor here and one more in the backend.
+static void raise_fd_limit(unsigned nsessions) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nsessions + 64) {
+        rl.rlim_cur = rl.rlim_max < nsessions + 64 ? rl.rlim_max : nsessions + 64;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [SOCKET_PATH]\n", prog);
+    printf("  -s, --sessions N       concurrent sessions, may be repeated\n");
+    printf("                         (default 1 4 16 64 256 1024 4096)\n");
+    printf("  -t, --threads N        load generator threads (default: online CPUs)\n");
+    printf("  -p, --depth N          requests in flight per session, 1-%d (default 1)\n",
+           MAX_DEPTH);
+    printf("  -d, --duration SECS    load phase per level (default 2)\n");
+    printf("  -j, --json FILE        also write the results as JSON, - for stdout\n");
+    printf("  -S, --server PATH      start this backend on SOCKET_PATH and stop it after\n");
+    printf("SOCKET_PATH defaults to %s\n", DEFAULT_SOCKET);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "sessions", required_argument, NULL, 's' },
+        { "threads",  required_argument, NULL, 't' },
+        { "depth",    required_argument, NULL, 'p' },
+        { "duration", required_argument, NULL, 'd' },
+        { "json",     required_argument, NULL, 'j' },
+        { "server",   required_argument, NULL, 'S' },
+        { "help",     no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned levels[MAX_LEVELS] = { 1, 4, 16, 64, 256, 1024, 4096 };
+    unsigned nlevels = 0, max_sessions = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = ncpus > 0 ? ncpus : 1;
+    const char *json_path = NULL;
+    const char *server = NULL;
+    LevelResult results[MAX_LEVELS];
+    unsigned nresults = 0;
+    pid_t server_pid = -1;
+    int opt, ret = 0;
+
+    while ((opt = getopt_long(argc, argv, "s:t:p:d:j:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                if (nlevels < MAX_LEVELS) {
+                    levels[nlevels++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 't':
+                nthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'S':
+                server = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        socket_path = argv[optind];
+    }
+    if (nlevels == 0) {
+        nlevels = 7;
+    }
+    if (nthreads == 0 || depth == 0 || depth > MAX_DEPTH || duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (unsigned i = 0; i < nlevels; i++) {
+        if (levels[i] == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (levels[i] > max_sessions) {
+            max_sessions = levels[i];
+        }
+    }
+    raise_fd_limit(max_sessions);
+    for (unsigned i = 0; i < MAX_DEPTH; i++) {
+        VhostUserHdr hdr = { VHOST_USER_GET_FEATURES, VHOST_USER_VERSION, 0 };
+
+        memcpy(request_wire + i * sizeof(hdr), &hdr, sizeof(hdr));
+    }
+
+    if (server) {
+        server_pid = spawn_server(server, socket_path);
+        if (server_pid < 0) {
+            return 1;
+        }
+    }
+
+    printf("%-9s %-8s %10s %12s %12s %12s %12s\n", "sessions", "threads",
+           "setup ms", "conn/s", "req/s", "min/session", "max/session");
+    for (unsigned i = 0; i < nlevels; i++) {
+        LevelResult *res = &results[nresults];
+
+        if (run_level(levels[i], nthreads, res) < 0) {
+            fprintf(stderr, "Level with %u sessions failed\n", levels[i]);
+            ret = 1;
+            break;
+        }
+        printf("%-9u %-8u %10.3f %12.0f %12.0f %12lu %12lu\n", res->sessions,
+               nthreads < res->sessions ? nthreads : res->sessions,
+               res->setup_seconds * 1e3, res->sessions / res->setup_seconds,
+               res->replies / res->seconds, res->min_replies, res->max_replies);
+        fflush(stdout);
+        nresults++;
+    }
+    if (json_path && write_json(json_path, nthreads, results, nresults) < 0) {
+        ret = 1;
+    }
+
+    if (server_pid > 0) {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+        unlink(socket_path);
+    }
+    return ret;
+}
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vhost_mem.h"
+#include "virtqueue.h"
+
+// Split vs packed virtqueue throughput, measured in-process: a driver
+// thread posts TX frames and reclaims them, a device thread pops and
+// returns them, one at a time (burst 1) or in bursts. Both sides poll; the
+// guest memory is a memfd mapped twice, once per side, like a frontend and
+// backend in separate processes.
+
+#define VIRTIO_NET_HDR_SIZE 12
+#define GUEST_MEM_SIZE      (64ULL << 20)
+#define SPIN_BEFORE_YIELD   64
+
+typedef struct BenchRing {
+    int packed;
+    uint16_t num;
+    unsigned burst;
+    uint32_t buf_size;
+    uint64_t packets;
+    int driver_cpu;
+    int device_cpu;
+    VqDriver drv;
+    Virtqueue vq;
+    uint8_t *guest;             // driver's view of guest memory
+    uint64_t bufs_gpa;
+} BenchRing;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Cannot pin to CPU %d\n", cpu);
+    }
+}
+
+static void *driver_thread(void *arg) {
+    BenchRing *br = arg;
+    uint64_t sent = 0, completed = 0;
+    unsigned idle = 0;
+
+    pin_to_cpu(br->driver_cpu);
+    while (completed < br->packets) {
+        int progress = 0;
+
+        while (vq_driver_get_used(&br->drv, NULL) >= 0) {
+            completed++;
+            progress = 1;
+        }
+        while (sent < br->packets && br->drv.num_free > 0) {
+            VringDesc seg = {
+                .addr = br->bufs_gpa + (uint64_t)br->drv.free_head * br->buf_size,
+                .len = br->buf_size,
+            };
+            vq_driver_add(&br->drv, &seg, 1);
+            sent++;
+            progress = 1;
+        }
+        vq_driver_publish(&br->drv);
+        if (!progress && ++idle % SPIN_BEFORE_YIELD == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *device_thread(void *arg) {
+    BenchRing *br = arg;
+    static __thread VqChain chains[VQ_BURST_MAX];
+    uint64_t done = 0;
+    unsigned idle = 0;
+
+    pin_to_cpu(br->device_cpu);
+    while (done < br->packets) {
+        int ret;
+
+        if (br->burst == 1) {
+            ret = vq_pop(&br->vq, &chains[0]);
+            if (ret > 0) {
+                vq_push(&br->vq, &chains[0], 0);
+            }
+        } else {
+            ret = vq_dequeue_burst(&br->vq, chains, br->burst);
+            vq_enqueue_burst(&br->vq, chains, NULL, ret > 0 ? ret : 0);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Malformed chain\n");
+            exit(1);
+        }
+        if (ret == 0) {
+            if (++idle % SPIN_BEFORE_YIELD == 0) {
+                sched_yield();
+            }
+            continue;
+        }
+        done += ret;
+    }
+    return NULL;
+}
+
+static double run_one(BenchRing *br, const VhostMem *mem) {
+    pthread_t drv_tid, dev_tid;
+    size_t ring_bytes = br->packed ? vring_packed_size(br->num)
+                                   : vring_split_size(br->num);
+    uint64_t ring_uva = (uint64_t)(uintptr_t)br->guest;
+    double start, secs;
+
+    br->bufs_gpa = (ring_bytes + 4095) & ~4095ULL;
+    if (br->bufs_gpa + (uint64_t)br->num * br->buf_size > GUEST_MEM_SIZE ||
+        vq_driver_init(&br->drv, br->num, br->packed, br->guest) < 0) {
+        fprintf(stderr, "Ring does not fit in guest memory\n");
+        exit(1);
+    }
+
+    memset(&br->vq, 0, sizeof(br->vq));
+    br->vq.num = br->num;
+    br->vq.packed = br->packed;
+    br->vq.call_fd = -1;
+    if (br->packed) {
+        vq_map(&br->vq, mem, ring_uva, ring_uva + vring_packed_driver_offset(br->num),
+               ring_uva + vring_packed_device_offset(br->num));
+        vq_set_base(&br->vq, 1U << VRING_PACKED_WRAP_SHIFT);
+    } else {
+        vq_map(&br->vq, mem, ring_uva, ring_uva + vring_avail_offset(br->num),
+               ring_uva + vring_used_offset(br->num));
+        vq_set_base(&br->vq, 0);
+    }
+
+    start = now_seconds();
+    pthread_create(&dev_tid, NULL, device_thread, br);
+    pthread_create(&drv_tid, NULL, driver_thread, br);
+    pthread_join(drv_tid, NULL);
+    pthread_join(dev_tid, NULL);
+    secs = now_seconds() - start;
+
+    vq_driver_cleanup(&br->drv);
+    return secs;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("  -n, --packets N        packets per run (default 10000000)\n");
+    printf("  -q, --ring-size N      ring size, may be repeated (default 256, 1024)\n");
+    printf("  -b, --burst N          device burst size, may be repeated (default 1, 8, 32, 64)\n");
+    printf("  -s, --pkt-size BYTES   frame size (default 64)\n");
+    printf("  -d, --driver-cpu CPU   pin the driver thread\n");
+    printf("  -D, --device-cpu CPU   pin the device thread\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "packets",    required_argument, NULL, 'n' },
+        { "ring-size",  required_argument, NULL, 'q' },
+        { "burst",      required_argument, NULL, 'b' },
+        { "pkt-size",   required_argument, NULL, 's' },
+        { "driver-cpu", required_argument, NULL, 'd' },
+        { "device-cpu", required_argument, NULL, 'D' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    uint16_t ring_sizes[8] = { 256, 1024 };
+    unsigned nring_sizes = 0;
+    unsigned bursts[8] = { 1, 8, 32, 64 };
+    unsigned nbursts = 0;
+    uint64_t packets = 10000000;
+    uint32_t pkt_size = 64;
+    int driver_cpu = -1, device_cpu = -1;
+    VhostMem mem;
+    uint8_t *guest;
+    int memfd, opt;
+
+    while ((opt = getopt_long(argc, argv, "n:q:b:s:d:D:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                packets = strtoull(optarg, NULL, 0);
+                break;
+            case 'q':
+                if (nring_sizes < 8) {
+                    ring_sizes[nring_sizes++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 'b':
+                if (nbursts < 8) {
+                    bursts[nbursts++] = strtoul(optarg, NULL, 0);
+                }
+                break;
+            case 's':
+                pkt_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                driver_cpu = atoi(optarg);
+                break;
+            case 'D':
+                device_cpu = atoi(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (nring_sizes == 0) {
+        nring_sizes = 2;
+    }
+    if (nbursts == 0) {
+        nbursts = 4;
+    }
+    for (unsigned i = 0; i < nbursts; i++) {
+        if (bursts[i] < 1 || bursts[i] > VQ_BURST_MAX) {
+            fprintf(stderr, "Burst size must be 1-%d\n", VQ_BURST_MAX);
+            return 1;
+        }
+    }
+
+    memfd = memfd_create("bench-guest-mem", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, GUEST_MEM_SIZE) < 0) {
+        perror("memfd");
+        return 1;
+    }
+    guest = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (guest == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(&mem, 0, sizeof(mem));
+    if (vhost_mem_add_region(&mem, 0, GUEST_MEM_SIZE, (uint64_t)(uintptr_t)guest,
+                             0, memfd) < 0) {
+        return 1;
+    }
+
+    printf("%-8s %6s %6s %12s %10s %10s\n", "layout", "ring", "burst", "packets",
+           "Mpps", "ns/pkt");
+    for (unsigned i = 0; i < nring_sizes; i++) {
+        for (int packed = 0; packed <= 1; packed++) {
+            for (unsigned b = 0; b < nbursts; b++) {
+                BenchRing br;
+                double secs;
+
+                memset(&br, 0, sizeof(br));
+                br.packed = packed;
+                br.num = ring_sizes[i];
+                br.burst = bursts[b];
+                br.buf_size = VIRTIO_NET_HDR_SIZE + pkt_size;
+                br.packets = packets;
+                br.driver_cpu = driver_cpu;
+                br.device_cpu = device_cpu;
+                br.guest = guest;
+                secs = run_one(&br, &mem);
+                printf("%-8s %6u %6u %12lu %10.2f %10.1f\n", packed ? "packed" : "split",
+                       br.num, br.burst, packets, packets / secs / 1e6,
+                       secs * 1e9 / packets);
+            }
+        }
+    }
+
+    vhost_mem_unmap(&mem);
+    munmap(guest, GUEST_MEM_SIZE);
+    close(memfd);
+    return 0;
+}
@@ -53,7 +53,7 @@ build_tests() {
     make all
     
     if [ ! -f "test_vhost_user_qemu" ]; then
-        gcc -Wall -Wextra -std=c99 -O2 -o test_vhost_user_qemu test_vhost_user_qemu.c
+        gcc -Wall -Wextra -std=c99 -O2 -pthread -o test_vhost_user_qemu test_vhost_user_qemu.c libvhostuser-lite.a
     fi
     
     log_info "Build completed"
@@ -83,15 +83,8 @@ run_performance_tests() {
     
     sleep 3
     
-    log_info "Testing connection latency..."
-    time ./vhost_user_client /tmp/vhost-user-test-sock
-    
-    log_info "Testing multiple rapid connections..."
-    for i in {1..5}; do
-        echo "Connection attempt $i:"
-        time ./vhost_user_client /tmp/vhost-user-test-sock
-        sleep 1
-    done
+    log_info "Measuring control-plane round trips..."
+    ./bench_roundtrip -n 100000 -j bench_roundtrip.json /tmp/vhost-user-test-sock
     
     # Stop QEMU server
     ./start_qemu_vhost_server.sh stop
@@ -105,12 +98,8 @@ run_stress_tests() {
     
     sleep 3
     
-    log_info "Running 10 concurrent client connections..."
-    for i in {1..10}; do
-        ./vhost_user_client /tmp/vhost-user-test-sock &
-    done
-    
-    wait
+    log_info "Driving 10 to 1000 concurrent sessions..."
+    ./bench_sessions -s 10 -s 100 -s 1000 -d 1 /tmp/vhost-user-test-sock
     
     # Stop QEMU server
     ./start_qemu_vhost_server.sh stop
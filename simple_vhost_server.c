@@ -6,196 +6,2504 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <signal.h>
-#include <sys/wait.h>
-
-#define VHOST_USER_PROTOCOL_F_MQ            0
-#define VHOST_USER_PROTOCOL_F_LOG_SHMFD     1
-#define VHOST_USER_PROTOCOL_F_RARP          2
-#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
-
-typedef enum VhostUserRequest {
-    VHOST_USER_NONE = 0,
-    VHOST_USER_GET_FEATURES = 1,
-    VHOST_USER_SET_FEATURES = 2,
-    VHOST_USER_SET_OWNER = 3,
-    VHOST_USER_RESET_OWNER = 4,
-    VHOST_USER_SET_MEM_TABLE = 5,
-    VHOST_USER_SET_LOG_BASE = 6,
-    VHOST_USER_SET_LOG_FD = 7,
-    VHOST_USER_SET_VRING_NUM = 8,
-    VHOST_USER_SET_VRING_ADDR = 9,
-    VHOST_USER_SET_VRING_BASE = 10,
-    VHOST_USER_GET_VRING_BASE = 11,
-    VHOST_USER_SET_VRING_KICK = 12,
-    VHOST_USER_SET_VRING_CALL = 13,
-    VHOST_USER_SET_VRING_ERR = 14,
-    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
-    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
-    VHOST_USER_MAX
-} VhostUserRequest;
-
-typedef struct VhostUserMsg {
-    VhostUserRequest request;
-    uint32_t flags;
-    uint32_t size;
-    union {
-        uint64_t u64;
-        struct {
-            uint32_t index;
-            uint32_t num;
-        } state;
-    } payload;
-} __attribute__((packed)) VhostUserMsg;
+#include <getopt.h>
+#include <sched.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+
+#include "vhost_log.h"
+#include "vhost_mem.h"
+#include "vhost_pool.h"
+#include "vhost_stats.h"
+#include "vhost_user.h"
+#include "virtio_net.h"
+#include "virtqueue.h"
+
+// Checksums and TSO sends from the driver are finished here, see
+// tx_frames(); receivers get segments, so there is no GUEST_TSO.
+#define SERVER_FEATURES ((1ULL << VIRTIO_NET_F_CSUM) | \
+                         (1ULL << VIRTIO_NET_F_GUEST_CSUM) | \
+                         (1ULL << VIRTIO_NET_F_HOST_TSO4) | \
+                         (1ULL << VIRTIO_NET_F_HOST_TSO6) | \
+                         (1ULL << VIRTIO_NET_F_MRG_RXBUF) | \
+                         (1ULL << VHOST_F_LOG_ALL) | \
+                         (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+                         (1ULL << VIRTIO_RING_F_EVENT_IDX) | \
+                         (1ULL << VHOST_USER_F_PROTOCOL_FEATURES) | \
+                         (1ULL << VIRTIO_F_VERSION_1) | \
+                         (1ULL << VIRTIO_F_RING_PACKED))
+
+// virtio-net queue layout: vrings 2n and 2n + 1 are the RX (to the guest)
+// and TX queues of queue pair n.
+#define VHOST_MAX_QUEUE_PAIRS   8
+#define VHOST_MAX_VRINGS        (2 * VHOST_MAX_QUEUE_PAIRS)
+#define VHOST_BURST             32
+// TX bursts a worker handles per hold of its queue pair lock. The control
+// thread takes the lock too, and a guest that keeps TX full would
+// otherwise hold off SET_VRING_*, GET_VRING_BASE and the like for good.
+#define VHOST_LOCK_BURSTS       16
+
+// With --pool-bufs, frames that find a loopback RX ring out of buffers wait
+// in buffers from rx_pool, copied out of the TX chain, until the driver
+// posts more; frames behind them queue up too, so none overtakes another.
+// Up to VHOST_STAGE_MAX frames per queue pair wait, and a frame is dropped
+// as it is without the pool if it does not fit or the pool runs dry. Frames
+// that wait are copied twice, so a driver that cannot keep its RX ring
+// filled loses fewer frames but gets them more slowly.
+#define VHOST_STAGE_MAX         256
+#define VHOST_STAGE_DATA        2048    // frame bytes a pool buffer holds
+
+typedef struct StagedFrame {
+    struct StagedFrame *next;
+    struct iovec iov;           // the whole frame, in data
+    uint8_t needs_csum;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint8_t data[];
+} StagedFrame;
+
+typedef struct VhostVring {
+    Virtqueue vq;
+    uint64_t desc_uva;
+    uint64_t avail_uva;
+    uint64_t used_uva;
+    uint64_t log_guest_addr;
+    int log_used;               // VHOST_VRING_F_LOG was set
+    int addr_set;
+    int kick_fd;
+    int started;
+    int enabled;
+    int broken;
+    int mergeable;              // RX: VIRTIO_NET_F_MRG_RXBUF negotiated
+    int guest_csum;             // RX: VIRTIO_NET_F_GUEST_CSUM negotiated
+    // Owned by the queue pair's worker (vhost_stat_add()); the stats
+    // socket reads them while it runs.
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
+    uint64_t calls;             // call eventfd writes
+    struct timespec start_time;
+} VhostVring;
+
+struct VhostDev;
+
+// Each queue pair is served by its own worker thread.
+typedef struct VhostQueuePair {
+    struct VhostDev *dev;
+    unsigned index;
+    pthread_mutex_t lock;       // held by the worker while it touches rings
+    int lock_waiters;           // control thread requests waiting for lock
+    pthread_t worker;
+    int worker_running;
+    int wake_fd;
+    int stop;
+    int cpu;                    // -1 when not pinned
+    uint64_t worker_cpu_ns;
+    uint64_t wakeups;           // times the worker slept on its eventfds
+    // Owned by the worker: its cache of rx_pool buffers, which lives on its
+    // stack, and the frames staged in them
+    VhostPoolCache *cache;
+    StagedFrame *staged_head;
+    StagedFrame *staged_tail;
+    unsigned nstaged;
+    uint64_t staged;            // frames that waited for RX buffers
+} VhostQueuePair;
+
+typedef struct VhostDev {
+    uint64_t features;
+    uint64_t protocol_features;
+    VhostMem mem;
+    VhostLog log;               // dirty page bitmap from SET_LOG_BASE
+    VhostInflightArea inflight; // from GET/SET_INFLIGHT_FD, one VqInflight per vring
+    int reply_fd;               // fd the reply to the current request carries
+    VhostVring vrings[VHOST_MAX_VRINGS];
+    VhostQueuePair qps[VHOST_MAX_QUEUE_PAIRS];
+    struct SwitchPort *port;    // switch mode: the port it is attached to
+} VhostDev;
 
 static volatile int running = 1;
 
-static void signal_handler(int sig) {
-    (void)sig;
-    running = 0;
+// CPUs the queue pair workers are pinned to, handed out round-robin.
+static int worker_cpus[CPU_SETSIZE];
+static unsigned nworker_cpus;
+static unsigned next_worker_cpu;
+
+// How long a worker keeps polling its rings after the last packet before
+// it re-enables kicks and sleeps: 0 sleeps right away, negative never does.
+static int64_t worker_poll_ns;
+
+// Buffers for staged frames, shared by all workers; nbufs is 0 when
+// staging is disabled.
+static VhostPool rx_pool;
+static uint32_t rx_pool_bufs;
+static int rx_pool_flags;
+
+// VHOST_MEM_F_* for the guest memory of every device.
+static int mem_map_flags;
+
+// Each socket the server listens on is a port. With one port every
+// frontend that connects gets its TX frames looped back. With two or more
+// the server is a switch: each port serves one frontend at a time, and the
+// workers forward TX frames to the RX queues of the other ports. A frame is
+// copied once, from the sender's guest memory straight into the receiver's.
+#define VSWITCH_MAX_PORTS       16
+#define VSWITCH_FDB_SIZE        4096    // MAC table slots, a power of two
+#define VSWITCH_FDB_PROBE       8
+
+typedef struct SwitchPort {
+    unsigned index;
+    const char *path;
+    int listen_sock;
+    int map_to;                 // --map destination, -1 if none
+    // Serialise deliveries into an RX queue of the attached device, which
+    // come from the workers of every other port, with each other and with
+    // the control plane. Taken after queue pair locks, never before.
+    pthread_mutex_t rx_lock[VHOST_MAX_QUEUE_PAIRS];
+    VhostDev *dev;              // NULL when idle; changed with all rx_locks held
+} SwitchPort;
+
+typedef struct VSwitch {
+    unsigned nports;
+    int enabled;                // two or more ports
+    int use_map;                // forward by --map instead of by MAC
+    SwitchPort ports[VSWITCH_MAX_PORTS];
+    // Learned MACs, each slot (mac << 16) | (port + 1) or 0 when free, so
+    // that workers look up and learn with plain atomic loads and stores.
+    uint64_t fdb[VSWITCH_FDB_SIZE];
+} VSwitch;
+
+static VSwitch vswitch;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void close_fds(int *fds, size_t nfds) {
+    for (size_t i = 0; i < nfds; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+static int set_mem_table(VhostMem *mem, const VhostUserMsg *msg,
+                         int *fds, size_t nfds) {
+    VhostUserMemory table;
+
+    // The payload sits at a 4-byte offset; work on an aligned copy.
+    memcpy(&table, &msg->payload.memory, sizeof(table));
+    if (msg->size < offsetof(VhostUserMemory, regions) ||
+        table.nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        msg->size < offsetof(VhostUserMemory, regions) +
+                    table.nregions * sizeof(VhostUserMemoryRegion) ||
+        table.nregions != nfds) {
+        VLOG_ERR("SET_MEM_TABLE: malformed table (%u regions, %zu fds)",
+                 table.nregions, nfds);
+        return -1;
+    }
+
+    vhost_mem_unmap(mem);
+    for (uint32_t i = 0; i < table.nregions; i++) {
+        const VhostUserMemoryRegion *reg = &table.regions[i];
+        if (vhost_mem_add_region(mem, reg->guest_phys_addr, reg->memory_size,
+                                 reg->userspace_addr, reg->mmap_offset,
+                                 fds[i]) < 0) {
+            vhost_mem_unmap(mem);
+            return -1;
+        }
+        VLOG_DEBUG("  region %u: gpa=0x%lx size=0x%lx uva=0x%lx -> %p (%luKB pages)", i,
+                   reg->guest_phys_addr, reg->memory_size, reg->userspace_addr,
+                   (void *)mem->regions[i].host_addr, mem->regions[i].page_size >> 10);
+    }
+    return 0;
+}
+
+static double elapsed_seconds(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void dev_init(VhostDev *dev) {
+    memset(dev, 0, sizeof(*dev));
+    dev->mem.map_flags = mem_map_flags;
+    dev->reply_fd = -1;
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        dev->vrings[i].kick_fd = -1;
+        dev->vrings[i].vq.call_fd = -1;
+    }
+    for (unsigned i = 0; i < VHOST_MAX_QUEUE_PAIRS; i++) {
+        VhostQueuePair *qp = &dev->qps[i];
+        qp->dev = dev;
+        qp->index = i;
+        qp->wake_fd = -1;
+        qp->cpu = -1;
+        pthread_mutex_init(&qp->lock, NULL);
+    }
+}
+
+static VhostQueuePair *vring_qp(VhostDev *dev, unsigned index) {
+    return &dev->qps[index / 2];
+}
+
+static void port_lock_rx(SwitchPort *port) {
+    for (unsigned i = 0; i < VHOST_MAX_QUEUE_PAIRS; i++) {
+        pthread_mutex_lock(&port->rx_lock[i]);
+    }
+}
+
+static void port_unlock_rx(SwitchPort *port) {
+    for (unsigned i = VHOST_MAX_QUEUE_PAIRS; i-- > 0;) {
+        pthread_mutex_unlock(&port->rx_lock[i]);
+    }
+}
+
+// The control thread's side of qp->lock. A busy worker drops the lock
+// after VHOST_LOCK_BURSTS and would take it straight back; lock_waiters
+// tells it to let the request in first.
+static void qp_lock_wait(VhostQueuePair *qp) {
+    __atomic_add_fetch(&qp->lock_waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&qp->lock);
+    __atomic_sub_fetch(&qp->lock_waiters, 1, __ATOMIC_RELAXED);
+}
+
+// Control-plane changes to a queue pair. In switch mode other ports'
+// workers write to its RX queue, so their deliveries are held off too.
+static void qp_lock(VhostQueuePair *qp) {
+    qp_lock_wait(qp);
+    if (qp->dev->port) {
+        pthread_mutex_lock(&qp->dev->port->rx_lock[qp->index]);
+    }
+}
+
+static void qp_unlock(VhostQueuePair *qp) {
+    if (qp->dev->port) {
+        pthread_mutex_unlock(&qp->dev->port->rx_lock[qp->index]);
+    }
+    pthread_mutex_unlock(&qp->lock);
+}
+
+// Device-wide changes (features, memory table) must not race any worker.
+static void dev_lock_all(VhostDev *dev) {
+    for (unsigned i = 0; i < VHOST_MAX_QUEUE_PAIRS; i++) {
+        qp_lock_wait(&dev->qps[i]);
+    }
+    if (dev->port) {
+        port_lock_rx(dev->port);
+    }
+}
+
+static void dev_unlock_all(VhostDev *dev) {
+    if (dev->port) {
+        port_unlock_rx(dev->port);
+    }
+    for (unsigned i = VHOST_MAX_QUEUE_PAIRS; i-- > 0;) {
+        pthread_mutex_unlock(&dev->qps[i].lock);
+    }
+}
+
+static void qp_wake_worker(VhostQueuePair *qp) {
+    uint64_t one = 1;
+    if (write(qp->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        VLOG_ERR("write wake eventfd: %s", strerror(errno));
+    }
+}
+
+// A frame on its way from a TX chain to RX buffers: head holds the packet
+// headers rewritten for a TSO segment, if it is one, and len more bytes
+// follow from iov, the TX chain's driver buffers or a staged copy of the
+// frame, starting offset bytes in. The receiver gets a
+// virtio-net header of our own in front. A checksum still to be finished
+// spans csum_start to the end of the frame.
+typedef struct RxFrame {
+    const struct iovec *iov;
+    unsigned niov;
+    uint32_t offset;
+    uint32_t len;
+    uint16_t head_len;
+    uint8_t needs_csum;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint8_t head[NET_GSO_HDR_MAX];
+} RxFrame;
+
+// Bytes a frame takes in RX buffers, virtio-net header included.
+static uint32_t rx_frame_len(const RxFrame *f) {
+    return VIRTIO_NET_HDR_SIZE + f->head_len + f->len;
+}
+
+// The frames TX chain c carries, from TSO segment *seg on, into at most max
+// entries of out: the frame as it is, or each segment of a TSO send. *seg
+// is left at the segment to continue from, 0 once the chain is done.
+// Returns the number of frames, 0 if c holds nothing that can be delivered.
+static unsigned tx_frames(const VqChain *c, uint32_t *seg, RxFrame *out, unsigned max) {
+    uint32_t len = c->out_len - VIRTIO_NET_HDR_SIZE;
+    VirtioNetHdr vh;
+    NetGso g;
+    unsigned n;
+
+    iov_read(c->iov, c->nout, 0, &vh, sizeof(vh));
+    if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+        out->iov = c->iov;
+        out->niov = c->nout;
+        out->offset = VIRTIO_NET_HDR_SIZE;
+        out->len = len;
+        out->head_len = 0;
+        out->needs_csum = !!(vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        out->csum_start = vh.csum_start;
+        out->csum_offset = vh.csum_offset;
+        if (out->needs_csum && (uint32_t)vh.csum_start + vh.csum_offset + 2 > len) {
+            return 0;
+        }
+        return 1;
+    }
+
+    // Segments are cut straight from the TX buffers; only their headers are
+    // built here.
+    if (net_gso_init(&g, &vh, c->iov, c->nout, VIRTIO_NET_HDR_SIZE, len) < 0) {
+        return 0;
+    }
+    for (n = 0; n < max && *seg < g.nsegs; n++, (*seg)++) {
+        RxFrame *f = &out[n];
+
+        f->iov = c->iov;
+        f->niov = c->nout;
+        f->offset = VIRTIO_NET_HDR_SIZE + g.hdr_len + *seg * g.mss;
+        f->len = net_gso_seg_len(&g, *seg);
+        f->head_len = g.hdr_len;
+        f->needs_csum = 1;
+        f->csum_start = g.l4_off;
+        f->csum_offset = NET_TCP_CSUM_OFF;
+        net_gso_segment(&g, *seg, f->head);
+    }
+    if (*seg == g.nsegs) {
+        *seg = 0;
+    }
+    return n;
+}
+
+// Copy frame f into the RX buffers dst behind a virtio-net header for the
+// receiver, and finish its checksum unless the receiver negotiated
+// VIRTIO_NET_F_GUEST_CSUM and does that itself. The data was just copied,
+// so the checksum reads it from cache. Returns the bytes written.
+static uint32_t rx_frame_copy(const VhostVring *rx, const struct iovec *dst,
+                              unsigned ndst, const RxFrame *f, uint16_t num_buffers) {
+    VirtioNetHdr vh = { .num_buffers = num_buffers };
+    uint32_t len = rx_frame_len(f);
+
+    if (f->needs_csum && rx->guest_csum) {
+        vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh.csum_start = f->csum_start;
+        vh.csum_offset = f->csum_offset;
+    }
+    iov_write(dst, ndst, 0, &vh, sizeof(vh));
+    iov_write(dst, ndst, VIRTIO_NET_HDR_SIZE, f->head, f->head_len);
+    iov_copy_at(dst, ndst, VIRTIO_NET_HDR_SIZE + f->head_len,
+                f->iov, f->niov, f->offset, f->len);
+    if (f->needs_csum && !rx->guest_csum) {
+        net_csum_complete(dst, ndst, VIRTIO_NET_HDR_SIZE, len - VIRTIO_NET_HDR_SIZE,
+                          f->csum_start, f->csum_offset);
+    }
+    return len;
+}
+
+// With VIRTIO_NET_F_MRG_RXBUF a frame larger than one RX chain spreads over
+// as many chains as it needs, and num_buffers in the first chain's header
+// tells the driver how many used entries make up the frame. Chains taken
+// for a frame that does not fit in what the ring has left are given back.
+static unsigned rx_deliver_mergeable(VhostVring *rx, const RxFrame *const *frames,
+                                     unsigned n, unsigned *taken) {
+    VqChain chains[VQ_BURST_MAX];
+    uint32_t lens[VQ_BURST_MAX];
+    unsigned nchains = 0, delivered = 0, i = 0;
+    uint64_t bytes = 0;
+
+    while (i < n && !rx->broken) {
+        const RxFrame *frame = frames[i];
+        uint32_t frame_len = rx_frame_len(frame);
+        struct iovec dst[VQ_MAX_SEGS];
+        unsigned first = nchains, ndst = 0;
+        uint32_t room = 0, left = frame_len;
+        int ret = 1;
+
+        while (room < frame_len && nchains < VQ_BURST_MAX &&
+               (ret = vq_pop(&rx->vq, &chains[nchains])) > 0) {
+            const VqChain *c = &chains[nchains++];
+
+            if (ndst + c->nin > VQ_MAX_SEGS) {
+                break;
+            }
+            memcpy(&dst[ndst], c->iov + c->nout, c->nin * sizeof(dst[0]));
+            ndst += c->nin;
+            room += c->in_len;
+        }
+        if (ret < 0) {
+            VLOG_ERR("Malformed RX descriptor chain, stopping vring");
+            rx->broken = 1;
+            for (unsigned k = first; k < nchains; k++) {
+                lens[k] = 0;
+            }
+            break;
+        }
+        if (room < frame_len) {
+            vq_unpop(&rx->vq, &chains[first], nchains - first);
+            if (nchains == VQ_BURST_MAX && first > 0) {
+                // Out of room in chains[]: flush and retry the frame.
+                vq_enqueue_burst(&rx->vq, chains, lens, first);
+                nchains = 0;
+                continue;
+            }
+            nchains = first;
+            if (ret == 0 && taken) {
+                break;
+            }
+            i++;
+            continue;
+        }
+
+        rx_frame_copy(rx, dst, ndst, frame, nchains - first);
+        for (unsigned k = first; k < nchains; k++) {
+            lens[k] = chains[k].in_len < left ? chains[k].in_len : left;
+            left -= lens[k];
+        }
+        bytes += frame_len - VIRTIO_NET_HDR_SIZE;
+        delivered++;
+        i++;
+    }
+    vq_enqueue_burst(&rx->vq, chains, lens, nchains);
+    if (taken) {
+        *taken = rx->broken ? n : i;
+        n = *taken;
+    }
+    vhost_stat_add(&rx->packets, delivered);
+    vhost_stat_add(&rx->bytes, bytes);
+    vhost_stat_add(&rx->drops, n - delivered);
+    return delivered;
+}
+
+// Hand a burst of frames to the RX queue. Frames that find an RX buffer
+// too small are dropped. So are those that find the ring out of buffers,
+// unless taken is given: then the burst stops at the first of them, and
+// *taken tells how many frames were delivered or dropped. Returns the
+// number delivered.
+static unsigned rx_deliver_burst(VhostVring *rx, const RxFrame *const *frames,
+                                 unsigned n, unsigned *taken) {
+    VqChain chains[VHOST_BURST];
+    uint32_t lens[VHOST_BURST];
+    unsigned delivered = 0;
+    uint64_t bytes = 0;
+    int got;
+
+    if (rx->mergeable) {
+        return rx_deliver_mergeable(rx, frames, n, taken);
+    }
+    got = vq_dequeue_burst(&rx->vq, chains, n);
+    if (got < 0) {
+        VLOG_ERR("Malformed RX descriptor chain, stopping vring");
+        rx->broken = 1;
+        vhost_stat_add(&rx->drops, n);
+        if (taken) {
+            *taken = n;
+        }
+        return 0;
+    }
+    if (taken) {
+        *taken = got;
+        n = got;
+    }
+    for (int i = 0; i < got; i++) {
+        const struct iovec *in = chains[i].iov + chains[i].nout;
+
+        if (chains[i].in_len < rx_frame_len(frames[i])) {
+            // Without mergeable buffers the frame must fit in one chain.
+            lens[i] = 0;
+            continue;
+        }
+        lens[i] = rx_frame_copy(rx, in, chains[i].nin, frames[i], 1);
+        bytes += lens[i] - VIRTIO_NET_HDR_SIZE;
+        delivered++;
+    }
+    vq_enqueue_burst(&rx->vq, chains, lens, got);
+    vhost_stat_add(&rx->packets, delivered);
+    vhost_stat_add(&rx->bytes, bytes);
+    vhost_stat_add(&rx->drops, n - delivered);
+    return delivered;
+}
+
+// Signal the driver that vr has new used chains, if it wants to know.
+static void vring_notify(VhostVring *vr) {
+    if (vq_notify(&vr->vq)) {
+        vhost_stat_add(&vr->calls, 1);
+    }
+}
+
+// Copy frames out of their TX chains into rx_pool buffers, behind those
+// already staged. Frames that cannot be staged are dropped.
+static void qp_stage(VhostQueuePair *qp, VhostVring *rx, const RxFrame *const *frames,
+                     unsigned n) {
+    uint64_t drops = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        const RxFrame *f = frames[i];
+        uint32_t len = f->head_len + f->len;
+        StagedFrame *s;
+
+        if (len > VHOST_STAGE_DATA || qp->nstaged == VHOST_STAGE_MAX ||
+            !(s = vhost_pool_alloc(&rx_pool, qp->cache))) {
+            drops++;
+            continue;
+        }
+        memcpy(s->data, f->head, f->head_len);
+        iov_read(f->iov, f->niov, f->offset, s->data + f->head_len, f->len);
+        s->iov.iov_base = s->data;
+        s->iov.iov_len = len;
+        s->needs_csum = f->needs_csum;
+        s->csum_start = f->csum_start;
+        s->csum_offset = f->csum_offset;
+        s->next = NULL;
+        if (qp->staged_tail) {
+            qp->staged_tail->next = s;
+        } else {
+            qp->staged_head = s;
+        }
+        qp->staged_tail = s;
+        qp->nstaged++;
+        qp->staged++;
+    }
+    vhost_stat_add(&rx->drops, drops);
+}
+
+// Deliver staged frames, oldest first, until they or the RX ring's buffers
+// run out. Returns the number delivered.
+static unsigned qp_unstage(VhostQueuePair *qp, VhostVring *rx) {
+    unsigned delivered = 0;
+
+    while (qp->staged_head) {
+        RxFrame pool[VHOST_BURST];
+        const RxFrame *frames[VHOST_BURST];
+        void *bufs[VHOST_BURST];
+        StagedFrame *s = qp->staged_head;
+        unsigned n, taken;
+
+        for (n = 0; s && n < VHOST_BURST; n++, s = s->next) {
+            RxFrame *f = &pool[n];
+
+            f->iov = &s->iov;
+            f->niov = 1;
+            f->offset = 0;
+            f->len = s->iov.iov_len;
+            f->head_len = 0;
+            f->needs_csum = s->needs_csum;
+            f->csum_start = s->csum_start;
+            f->csum_offset = s->csum_offset;
+            frames[n] = f;
+            bufs[n] = s;
+        }
+        delivered += rx_deliver_burst(rx, frames, n, &taken);
+        qp->staged_head = taken < n ? bufs[taken] : s;
+        if (!qp->staged_head) {
+            qp->staged_tail = NULL;
+        }
+        qp->nstaged -= taken;
+        vhost_pool_free_bulk(&rx_pool, qp->cache, bufs, taken);
+        if (taken < n) {
+            break;
+        }
+    }
+    return delivered;
+}
+
+// Drop the staged frames, when there is no RX ring to deliver them to.
+static void qp_drop_staged(VhostQueuePair *qp, VhostVring *rx) {
+    vhost_stat_add(&rx->drops, qp->nstaged);
+    while (qp->staged_head) {
+        StagedFrame *s = qp->staged_head;
+
+        qp->staged_head = s->next;
+        vhost_pool_free(&rx_pool, qp->cache, s);
+    }
+    qp->staged_tail = NULL;
+    qp->nstaged = 0;
+}
+
+// Deliver a burst of TX frames behind the staged ones, and stage those the
+// RX ring has no buffers for. Returns the number delivered.
+static unsigned qp_deliver(VhostQueuePair *qp, VhostVring *rx, const RxFrame *const *frames,
+                           unsigned n) {
+    unsigned delivered = 0, taken = 0;
+
+    if (rx_pool.nbufs == 0) {
+        return rx_deliver_burst(rx, frames, n, NULL);
+    }
+    if (qp->staged_head) {
+        delivered = qp_unstage(qp, rx);
+    }
+    if (!qp->staged_head) {
+        delivered += rx_deliver_burst(rx, frames, n, &taken);
+    }
+    qp_stage(qp, rx, frames + taken, n - taken);
+    return delivered;
+}
+
+// Guest-to-host packets are looped back to the RX queue of the same pair
+// if the frontend started and enabled it, and consumed otherwise. A
+// disabled TX queue is still drained, but its frames are discarded.
+// Chains move in bursts of up to VHOST_BURST; a TSO send is cut into
+// segments on the way, and chains that hold no valid frame count as
+// drops. Staged frames go to RX first. At most VHOST_LOCK_BURSTS bursts
+// are taken per call. Returns the number of TX chains completed plus the
+// number of staged frames delivered before them.
+static int process_tx(VhostQueuePair *qp, VhostVring *vr, VhostVring *rx) {
+    VqChain chains[VHOST_BURST];
+    RxFrame pool[VHOST_BURST];
+    const RxFrame *frames[VHOST_BURST];
+    int n = 0, done = 0, delivered = 0, unstaged = 0;
+    int loopback = vr->enabled && rx->started && rx->enabled;
+
+    for (unsigned i = 0; i < VHOST_BURST; i++) {
+        frames[i] = &pool[i];
+    }
+    if (qp->staged_head) {
+        if (loopback && !rx->broken) {
+            unstaged = qp_unstage(qp, rx);
+            delivered = unstaged;
+        } else {
+            qp_drop_staged(qp, rx);
+        }
+    }
+    for (unsigned burst = 0; burst < VHOST_LOCK_BURSTS &&
+         (n = vq_dequeue_burst(&vr->vq, chains, VHOST_BURST)) > 0; burst++) {
+        unsigned nframes = 0;
+        uint64_t bytes = 0, drops = 0;
+
+        for (int i = 0; i < n; i++) {
+            uint32_t seg = 0;
+
+            bytes += chains[i].out_len > VIRTIO_NET_HDR_SIZE ?
+                     chains[i].out_len - VIRTIO_NET_HDR_SIZE : 0;
+            if (!loopback || chains[i].out_len <= VIRTIO_NET_HDR_SIZE) {
+                continue;
+            }
+            do {
+                unsigned got;
+
+                if (nframes == VHOST_BURST) {
+                    if (!rx->broken) {
+                        delivered += qp_deliver(qp, rx, frames, nframes);
+                    }
+                    nframes = 0;
+                }
+                got = tx_frames(&chains[i], &seg, &pool[nframes], VHOST_BURST - nframes);
+                if (got == 0) {
+                    drops++;
+                    break;
+                }
+                nframes += got;
+            } while (seg);
+        }
+        vhost_stat_add(&vr->packets, n);
+        vhost_stat_add(&vr->bytes, bytes);
+        vhost_stat_add(&vr->drops, drops);
+        if (nframes > 0 && !rx->broken) {
+            delivered += qp_deliver(qp, rx, frames, nframes);
+        }
+        vq_enqueue_burst(&vr->vq, chains, NULL, n);
+        done += n;
+    }
+    if (n < 0) {
+        VLOG_ERR("Malformed descriptor chain, stopping vring");
+        vr->broken = 1;
+    }
+    if (done) {
+        vring_notify(vr);
+    }
+    if (delivered) {
+        vring_notify(rx);
+    }
+    return done + unstaged;
+}
+
+static uint64_t mac_to_u64(const uint8_t *mac) {
+    uint64_t v = 0;
+
+    for (int i = 0; i < 6; i++) {
+        v = v << 8 | mac[i];
+    }
+    return v;
+}
+
+static unsigned fdb_hash(uint64_t mac) {
+    return (mac * 0x9e3779b97f4a7c15ULL) >> 52 & (VSWITCH_FDB_SIZE - 1);
+}
+
+// Port that learned mac, or -1.
+static int fdb_lookup(uint64_t mac) {
+    unsigned h = fdb_hash(mac);
+
+    for (unsigned i = 0; i < VSWITCH_FDB_PROBE; i++) {
+        uint64_t e = __atomic_load_n(&vswitch.fdb[(h + i) & (VSWITCH_FDB_SIZE - 1)],
+                                     __ATOMIC_RELAXED);
+        if (e == 0) {
+            return -1;
+        }
+        if (e >> 16 == mac) {
+            return (int)(e & 0xffff) - 1;
+        }
+    }
+    return -1;
+}
+
+// Record that mac was seen on port. Entries are only written when they
+// change, so the table stays in every CPU's cache while traffic flows. If
+// all the slots mac may use are taken, the first one is reused.
+static void fdb_learn(uint64_t mac, unsigned port) {
+    uint64_t entry = mac << 16 | (port + 1);
+    unsigned h = fdb_hash(mac);
+
+    for (unsigned i = 0; i < VSWITCH_FDB_PROBE; i++) {
+        uint64_t *slot = &vswitch.fdb[(h + i) & (VSWITCH_FDB_SIZE - 1)];
+        uint64_t e = __atomic_load_n(slot, __ATOMIC_RELAXED);
+
+        if (e == entry) {
+            return;
+        }
+        if (e >> 16 == mac) {
+            __atomic_store_n(slot, entry, __ATOMIC_RELAXED);
+            return;
+        }
+        if (e == 0 && __atomic_compare_exchange_n(slot, &e, entry, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+    __atomic_store_n(&vswitch.fdb[h], entry, __ATOMIC_RELAXED);
+}
+
+// Drop what port has learned, once its frontend is gone.
+static void fdb_forget_port(unsigned port) {
+    for (unsigned i = 0; i < VSWITCH_FDB_SIZE; i++) {
+        uint64_t e = __atomic_load_n(&vswitch.fdb[i], __ATOMIC_RELAXED);
+
+        if (e != 0 && (e & 0xffff) == port + 1) {
+            __atomic_compare_exchange_n(&vswitch.fdb[i], &e, 0, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Deliver frames to the RX queue pair q of the frontend on port, or to
+// queue pair 0 if it does not run as many. Returns -1 if the port has no
+// frontend or no RX queue ready for them.
+static int switch_deliver(SwitchPort *port, unsigned q, const RxFrame *const *frames,
+                          unsigned n) {
+    for (unsigned dq = q;; dq = 0) {
+        VhostVring *rx;
+        int delivered = -1;
+
+        pthread_mutex_lock(&port->rx_lock[dq]);
+        rx = port->dev ? &port->dev->vrings[2 * dq] : NULL;
+        if (rx && rx->started && rx->enabled && !rx->broken) {
+            delivered = rx_deliver_burst(rx, frames, n, NULL);
+            if (delivered > 0) {
+                vring_notify(rx);
+            }
+        }
+        pthread_mutex_unlock(&port->rx_lock[dq]);
+        if (delivered >= 0 || dq == 0) {
+            return delivered;
+        }
+    }
+}
+
+
+// Hand what switch_tx() collected for each port to that port and start
+// over. Returns the unicast frames dropped for want of a receiver;
+// flooding to a port without a frontend loses nothing.
+static uint64_t switch_flush(unsigned q, const RxFrame *(*frames)[VHOST_BURST],
+                             unsigned *nframes, unsigned *nunicast) {
+    uint64_t drops = 0;
+
+    for (unsigned p = 0; p < vswitch.nports; p++) {
+        if (nframes[p] > 0 &&
+            switch_deliver(&vswitch.ports[p], q, frames[p], nframes[p]) < 0) {
+            drops += nunicast[p];
+        }
+        nframes[p] = 0;
+        nunicast[p] = 0;
+    }
+    return drops;
+}
+
+// Switch mode counterpart of process_tx(): each frame goes to the port its
+// destination MAC was learned on, to every other port if the destination is
+// unknown or a group address, or, with --map, to the port mapped to the
+// sender. Frames with nowhere to go count as drops of the TX queue.
+static int switch_tx(VhostVring *vr, SwitchPort *self, unsigned q) {
+    VqChain chains[VHOST_BURST];
+    RxFrame pool[VHOST_BURST];
+    const RxFrame *frames[VSWITCH_MAX_PORTS][VHOST_BURST];
+    unsigned nframes[VSWITCH_MAX_PORTS] = { 0 };
+    unsigned nunicast[VSWITCH_MAX_PORTS] = { 0 };
+    int n = 0, done = 0;
+
+    for (unsigned burst = 0; burst < VHOST_LOCK_BURSTS &&
+         (n = vq_dequeue_burst(&vr->vq, chains, VHOST_BURST)) > 0; burst++) {
+        unsigned npool = 0;
+        uint64_t bytes = 0, drops = 0;
+
+        for (int i = 0; i < n; i++) {
+            uint8_t eth[12];
+            uint32_t seg = 0;
+            int to, flood = 0;
+
+            bytes += chains[i].out_len > VIRTIO_NET_HDR_SIZE ?
+                     chains[i].out_len - VIRTIO_NET_HDR_SIZE : 0;
+            if (!vr->enabled) {
+                continue;
+            }
+            if (iov_read(chains[i].iov, chains[i].nout, VIRTIO_NET_HDR_SIZE,
+                         eth, sizeof(eth)) < sizeof(eth)) {
+                drops++;
+                continue;
+            }
+            if (vswitch.use_map) {
+                to = self->map_to;
+            } else {
+                if (!(eth[6] & 1)) {
+                    fdb_learn(mac_to_u64(eth + 6), self->index);
+                }
+                to = eth[0] & 1 ? -1 : fdb_lookup(mac_to_u64(eth));
+                flood = to < 0;
+            }
+            if (!flood && (to < 0 || to == (int)self->index)) {
+                drops++;
+                continue;
+            }
+            do {
+                unsigned got;
+
+                if (npool == VHOST_BURST) {
+                    drops += switch_flush(q, frames, nframes, nunicast);
+                    npool = 0;
+                }
+                got = tx_frames(&chains[i], &seg, &pool[npool], VHOST_BURST - npool);
+                if (got == 0) {
+                    drops++;
+                    break;
+                }
+                for (unsigned k = npool; k < npool + got; k++) {
+                    if (!flood) {
+                        frames[to][nframes[to]++] = &pool[k];
+                        nunicast[to]++;
+                        continue;
+                    }
+                    for (unsigned p = 0; p < vswitch.nports; p++) {
+                        if (p != self->index) {
+                            frames[p][nframes[p]++] = &pool[k];
+                        }
+                    }
+                }
+                npool += got;
+            } while (seg);
+        }
+        drops += switch_flush(q, frames, nframes, nunicast);
+        vhost_stat_add(&vr->packets, n);
+        vhost_stat_add(&vr->bytes, bytes);
+        vhost_stat_add(&vr->drops, drops);
+        vq_enqueue_burst(&vr->vq, chains, NULL, n);
+        done += n;
+    }
+    if (n < 0) {
+        VLOG_ERR("Malformed descriptor chain, stopping vring");
+        vr->broken = 1;
+    }
+    if (done) {
+        vring_notify(vr);
+    }
+    return done;
+}
+
+// Set whether the driver should kick the pair's started rings. Returns 1
+// if enabling kicks raced with a chain being made available on TX, or on
+// RX while frames wait for its buffers.
+static int qp_set_kicks(VhostQueuePair *qp, VhostVring *rx, VhostVring *tx, int enable) {
+    int pending = 0;
+
+    for (VhostVring *vr = rx; vr <= tx; vr++) {
+        if (!vr->started || vr->broken) {
+            continue;
+        }
+        if (enable) {
+            pending |= vq_enable_kicks(&vr->vq) && (vr == tx || qp->staged_head);
+        } else {
+            vq_disable_kicks(&vr->vq);
+        }
+    }
+    return pending;
+}
+
+// Process TX until it runs dry, keep polling for worker_poll_ns with kicks
+// disabled, then re-enable kicks and sleep on the kick eventfds. The lock
+// is dropped every VHOST_LOCK_BURSTS bursts, for long enough to let a
+// waiting request through.
+static void *vring_worker(void *arg) {
+    VhostQueuePair *qp = arg;
+    VhostDev *dev = qp->dev;
+    VhostVring *tx = &dev->vrings[2 * qp->index + 1];
+    // In switch mode the RX queue belongs to the other ports' workers
+    VhostVring *rx = dev->port ? tx : &dev->vrings[2 * qp->index];
+    struct pollfd pfds[3];
+    struct timespec cpu;
+    VhostPoolCache cache = { 0 };
+    uint64_t idle_since = 0;
+    int polling = 0;
+
+    qp->cache = &cache;
+    while (!__atomic_load_n(&qp->stop, __ATOMIC_ACQUIRE)) {
+        int nfds = 0, work = 0, pending = 0;
+        uint64_t val;
+
+        pthread_mutex_lock(&qp->lock);
+        if (tx->started && !tx->broken) {
+            work = dev->port ? switch_tx(tx, dev->port, qp->index) : process_tx(qp, tx, rx);
+        }
+        pthread_mutex_unlock(&qp->lock);
+        if (work) {
+            while (__atomic_load_n(&qp->lock_waiters, __ATOMIC_RELAXED)) {
+                sched_yield();
+            }
+            idle_since = 0;
+            continue;
+        }
+
+        if (worker_poll_ns != 0) {
+            uint64_t now = now_ns();
+
+            if (idle_since == 0) {
+                idle_since = now;
+            }
+            if (worker_poll_ns < 0 || now - idle_since < (uint64_t)worker_poll_ns) {
+                if (!polling) {
+                    pthread_mutex_lock(&qp->lock);
+                    qp_set_kicks(qp, rx, tx, 0);
+                    pthread_mutex_unlock(&qp->lock);
+                    polling = 1;
+                }
+                cpu_relax();
+                continue;
+            }
+        }
+
+        pfds[nfds].fd = qp->wake_fd;
+        pfds[nfds++].events = POLLIN;
+        pthread_mutex_lock(&qp->lock);
+        // Even without polling: with VIRTIO_RING_F_EVENT_IDX avail_event
+        // has to catch up with the ring before every sleep.
+        pending = qp_set_kicks(qp, rx, tx, 1);
+        polling = 0;
+        for (VhostVring *vr = rx; vr <= tx; vr++) {
+            if (vr->started && !vr->broken && vr->kick_fd >= 0) {
+                pfds[nfds].fd = vr->kick_fd;
+                pfds[nfds++].events = POLLIN;
+            }
+        }
+        pthread_mutex_unlock(&qp->lock);
+        if (pending) {
+            continue;
+        }
+
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VLOG_ERR("poll: %s", strerror(errno));
+            break;
+        }
+        vhost_stat_add(&qp->wakeups, 1);
+        idle_since = 0;
+        if (read(qp->wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+            VLOG_ERR("read wake eventfd: %s", strerror(errno));
+        }
+
+        // Kick fds may have been replaced while we slept, so only drain the
+        // ones currently installed (they are non-blocking, see SET_VRING_KICK).
+        // No kicks are needed until the rings run dry again.
+        pthread_mutex_lock(&qp->lock);
+        qp_set_kicks(qp, rx, tx, 0);
+        for (VhostVring *vr = rx; vr <= tx; vr++) {
+            if (vr->started && vr->kick_fd >= 0 &&
+                read(vr->kick_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+                VLOG_ERR("read kick eventfd: %s", strerror(errno));
+            }
+        }
+        pthread_mutex_unlock(&qp->lock);
+    }
+
+    qp_drop_staged(qp, rx);
+    vhost_pool_cache_flush(&rx_pool, &cache);
+    qp->cache = NULL;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    qp->worker_cpu_ns = cpu.tv_sec * 1000000000ULL + cpu.tv_nsec;
+    return NULL;
+}
+
+static int qp_start_worker(VhostQueuePair *qp) {
+    if (qp->worker_running) {
+        qp_wake_worker(qp);
+        return 0;
+    }
+    // Created on first use: most sessions never start a ring, and every fd
+    // counts when thousands of them are connected.
+    if (qp->wake_fd < 0) {
+        qp->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (qp->wake_fd < 0) {
+            VLOG_ERR("eventfd: %s", strerror(errno));
+            return -1;
+        }
+    }
+    qp->stop = 0;
+    if (pthread_create(&qp->worker, NULL, vring_worker, qp) != 0) {
+        VLOG_ERR("Failed to create vring worker");
+        return -1;
+    }
+    qp->worker_running = 1;
+    if (nworker_cpus > 0) {
+        cpu_set_t set;
+
+        qp->cpu = worker_cpus[next_worker_cpu++ % nworker_cpus];
+        CPU_ZERO(&set);
+        CPU_SET(qp->cpu, &set);
+        if (pthread_setaffinity_np(qp->worker, sizeof(set), &set) != 0) {
+            VLOG_WARN("Cannot pin queue pair %u to CPU %d", qp->index, qp->cpu);
+            qp->cpu = -1;
+        }
+    }
+    VLOG_INFO("Queue pair %u worker started (CPU %d)", qp->index, qp->cpu);
+    return 0;
+}
+
+static void qp_stop_worker(VhostQueuePair *qp) {
+    if (!qp->worker_running) {
+        return;
+    }
+    __atomic_store_n(&qp->stop, 1, __ATOMIC_RELEASE);
+    qp_wake_worker(qp);
+    pthread_join(qp->worker, NULL);
+    qp->worker_running = 0;
+}
+
+static int vring_map(VhostDev *dev, VhostVring *vr) {
+    return vq_map(&vr->vq, &dev->mem, vr->desc_uva, vr->avail_uva, vr->used_uva);
+}
+
+// Attach the dirty log to a ring while VHOST_F_LOG_ALL is negotiated and
+// a log is mapped. Ring writes are logged only if the frontend asked for
+// it with VHOST_VRING_F_LOG.
+static void vring_set_log(VhostDev *dev, VhostVring *vr) {
+    Virtqueue *vq = &vr->vq;
+
+    vq->log = (dev->features & (1ULL << VHOST_F_LOG_ALL)) && dev->log.bitmap ?
+              &dev->log : NULL;
+    vq->log_cache.n = 0;
+    vq->log_ring = 0;
+    if (vq->log && vr->log_used) {
+        // Packed rings write used descriptors back into the descriptor
+        // ring; log_guest_addr only names the split used ring.
+        vq->log_ring_gpa = vq->packed ? vhost_mem_uva_to_gpa(&dev->mem, vr->desc_uva)
+                                      : vr->log_guest_addr;
+        vq->log_ring = vq->log_ring_gpa != (uint64_t)-1;
+    }
+}
+
+static void dev_set_log(VhostDev *dev) {
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        vring_set_log(dev, &dev->vrings[i]);
+    }
+}
+
+// Attach the ring's slot of the inflight area, if the frontend set one up
+// and it covers the ring. Returns 1 if the ring resumes where a previous
+// backend left it.
+static int vring_set_inflight(VhostDev *dev, VhostVring *vr, unsigned index) {
+    size_t slot = vq_inflight_size();
+
+    if (!dev->inflight.addr || (index + 1) * slot > dev->inflight.size) {
+        return vq_inflight_attach(&vr->vq, NULL);
+    }
+    return vq_inflight_attach(&vr->vq, (VqInflight *)(dev->inflight.addr + index * slot));
+}
+
+// Called with every queue pair lock held.
+static int dev_any_started(const VhostDev *dev) {
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        if (dev->vrings[i].started) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Replace the inflight area, with every queue pair lock held and no ring
+// started. Stopped rings may still point into the old mapping; they let go
+// of it without clearing their slot, which the new area may share, and
+// attach again when they start.
+static int dev_set_inflight(VhostDev *dev, const char *request) {
+    if (dev_any_started(dev)) {
+        VLOG_ERR("%s: rings are running", request);
+        return -1;
+    }
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        dev->vrings[i].vq.inflight = NULL;
+    }
+    return 0;
+}
+
+static void vring_stop(VhostDev *dev, VhostVring *vr, unsigned index) {
+    double secs;
+
+    if (!vr->started) {
+        return;
+    }
+    vr->started = 0;
+    secs = elapsed_seconds(&vr->start_time);
+    VLOG_INFO("vring %u (%s) stopped: %lu packets, %lu bytes, %lu drops in %.3fs (%.3f Mpps)",
+              index, vr->vq.packed ? "packed" : "split", vr->packets, vr->bytes,
+              vr->drops, secs, secs > 0 ? vr->packets / secs / 1e6 : 0.0);
+    // The worker may be sleeping on this fd; qp_wake_worker() makes it
+    // rebuild its poll set.
+    if (vr->kick_fd >= 0) {
+        close(vr->kick_fd);
+        vr->kick_fd = -1;
+    }
+    if (vr->vq.call_fd >= 0) {
+        close(vr->vq.call_fd);
+        vr->vq.call_fd = -1;
+    }
+    if (vring_qp(dev, index)->worker_running) {
+        qp_wake_worker(vring_qp(dev, index));
+    }
+}
+
+static int vring_start(VhostDev *dev, VhostVring *vr, unsigned index) {
+    if (!vr->addr_set || dev->mem.nregions == 0 || vring_map(dev, vr) < 0) {
+        VLOG_ERR("Cannot start vring: rings not set up");
+        return -1;
+    }
+    // A packed base is a descriptor index. It was checked against the ring
+    // size when it was set, but SET_VRING_NUM may have shrunk the ring since
+    // and SET_FEATURES may have turned a split base into a packed one.
+    if (vr->vq.packed && vr->vq.last_avail_idx >= vr->vq.num) {
+        VLOG_ERR("Cannot start vring %u: base %u is outside a ring of %u",
+                 index, vr->vq.last_avail_idx, vr->vq.num);
+        return -1;
+    }
+    vr->started = 1;
+    vr->broken = 0;
+    // Without VHOST_USER_F_PROTOCOL_FEATURES there is no SET_VRING_ENABLE
+    // and rings run as soon as they are started.
+    if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        vr->enabled = 1;
+    }
+    vr->mergeable = !!(dev->features & (1ULL << VIRTIO_NET_F_MRG_RXBUF));
+    vr->guest_csum = !!(dev->features & (1ULL << VIRTIO_NET_F_GUEST_CSUM));
+    vr->vq.indirect = !!(dev->features & (1ULL << VIRTIO_RING_F_INDIRECT_DESC));
+    vr->vq.event_idx = !!(dev->features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+    vr->vq.signalled_valid = 0;
+    vring_set_log(dev, vr);
+    if (vring_set_inflight(dev, vr, index)) {
+        VLOG_INFO("vring %u (%s) resumed at %u from the inflight area", index,
+                  vr->vq.packed ? "packed" : "split", vq_get_base(&vr->vq));
+    }
+    vr->packets = 0;
+    vr->bytes = 0;
+    vr->drops = 0;
+    vr->calls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &vr->start_time);
+    return qp_start_worker(vring_qp(dev, index));
+}
+
+static void dev_cleanup(VhostDev *dev) {
+    for (unsigned i = 0; i < VHOST_MAX_QUEUE_PAIRS; i++) {
+        VhostQueuePair *qp = &dev->qps[i];
+        uint64_t packets = dev->vrings[2 * i + 1].packets;
+
+        qp_stop_worker(qp);
+        vring_stop(dev, &dev->vrings[2 * i], 2 * i);
+        vring_stop(dev, &dev->vrings[2 * i + 1], 2 * i + 1);
+        if (qp->worker_cpu_ns > 0) {
+            VLOG_INFO("Queue pair %u worker: %lu TX packets, %.3fs CPU (%.3f Mpps per core), %lu wakeups, %lu staged",
+                      i, packets, qp->worker_cpu_ns / 1e9,
+                      packets / (qp->worker_cpu_ns / 1e9) / 1e6, qp->wakeups, qp->staged);
+        }
+        if (qp->wake_fd >= 0) {
+            close(qp->wake_fd);
+        }
+        pthread_mutex_destroy(&qp->lock);
+    }
+    vhost_mem_unmap(&dev->mem);
+    vhost_log_unmap(&dev->log);
+    // The rings are left attached: the frontend keeps the area so that the
+    // next backend can pick them up.
+    vhost_inflight_unmap(&dev->inflight);
+    if (dev->reply_fd >= 0) {
+        close(dev->reply_fd);
+    }
+}
+
+// Resolve the vring a SET_VRING_KICK/CALL message refers to and take
+// ownership of the fd that came with it.
+static VhostVring *vring_fd_msg(VhostDev *dev, const VhostUserMsg *msg,
+                                int *fds, size_t nfds, int *fd) {
+    unsigned index = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+
+    *fd = -1;
+    if (index >= VHOST_MAX_VRINGS) {
+        VLOG_ERR("Invalid vring index %u", index);
+        return NULL;
+    }
+    if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+        if (nfds != 1) {
+            VLOG_ERR("Expected one fd, got %zu", nfds);
+            return NULL;
+        }
+        *fd = fds[0];
+        fds[0] = -1;
+    }
+    return &dev->vrings[index];
+}
+
+// Request handlers, one per request type, dispatched through
+// request_handlers[]. Each logs what it was asked to do and returns -1 to
+// report a failed status to the frontend.
+static int handle_get_features(void *opaque, const VhostUserMsg *msg,
+                               int *fds, size_t nfds, VhostUserMsg *reply) {
+    (void)opaque; (void)msg; (void)fds; (void)nfds;
+    reply->payload.u64 = SERVER_FEATURES;
+    VLOG_DEBUG("Sending GET_FEATURES reply: 0x%lx", reply->payload.u64);
+    return 0;
+}
+
+static int handle_get_protocol_features(void *opaque, const VhostUserMsg *msg,
+                                        int *fds, size_t nfds, VhostUserMsg *reply) {
+    (void)opaque; (void)msg; (void)fds; (void)nfds;
+    reply->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                         (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) |
+                         (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+                         (1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD);
+    VLOG_DEBUG("Sending GET_PROTOCOL_FEATURES reply: 0x%lx", reply->payload.u64);
+    return 0;
+}
+
+static int handle_set_features(void *opaque, const VhostUserMsg *msg,
+                               int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+
+    (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_FEATURES: 0x%lx", msg->payload.u64);
+    if (msg->payload.u64 & ~(uint64_t)SERVER_FEATURES) {
+        VLOG_ERR("SET_FEATURES: unsupported bits 0x%lx",
+                 msg->payload.u64 & ~(uint64_t)SERVER_FEATURES);
+        return -1;
+    }
+    dev_lock_all(dev);
+    // A running ring cannot switch between the split and packed layouts.
+    // VHOST_F_LOG_ALL, on the other hand, is toggled under running rings
+    // for live migration.
+    if (((dev->features ^ msg->payload.u64) & (1ULL << VIRTIO_F_RING_PACKED)) &&
+        dev_any_started(dev)) {
+        dev_unlock_all(dev);
+        VLOG_ERR("SET_FEATURES: cannot change VIRTIO_F_RING_PACKED while rings are running");
+        return -1;
+    }
+    dev->features = msg->payload.u64;
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        dev->vrings[i].vq.packed =
+            !!(dev->features & (1ULL << VIRTIO_F_RING_PACKED));
+    }
+    // VHOST_F_LOG_ALL toggles logging on running rings.
+    dev_set_log(dev);
+    dev_unlock_all(dev);
+    return 0;
+}
+
+static int handle_set_protocol_features(void *opaque, const VhostUserMsg *msg,
+                                        int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+
+    (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_PROTOCOL_FEATURES: 0x%lx", msg->payload.u64);
+    dev->protocol_features = msg->payload.u64;
+    return 0;
+}
+
+static int handle_get_queue_num(void *opaque, const VhostUserMsg *msg,
+                                int *fds, size_t nfds, VhostUserMsg *reply) {
+    (void)opaque; (void)msg; (void)fds; (void)nfds;
+    reply->payload.u64 = VHOST_MAX_QUEUE_PAIRS;
+    VLOG_DEBUG("Sending GET_QUEUE_NUM reply: %lu", reply->payload.u64);
+    return 0;
+}
+
+static int handle_set_owner(void *opaque, const VhostUserMsg *msg,
+                            int *fds, size_t nfds, VhostUserMsg *reply) {
+    (void)opaque; (void)msg; (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_OWNER");
+    return 0;
+}
+
+static int handle_set_mem_table(void *opaque, const VhostUserMsg *msg,
+                                int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    int ret;
+
+    (void)reply;
+    VLOG_DEBUG("SET_MEM_TABLE: %u regions", msg->payload.memory.nregions);
+    dev_lock_all(dev);
+    ret = set_mem_table(&dev->mem, msg, fds, nfds);
+    // Running rings must follow the new mapping.
+    for (int i = 0; i < VHOST_MAX_VRINGS; i++) {
+        if (dev->vrings[i].started && vring_map(dev, &dev->vrings[i]) < 0) {
+            dev->vrings[i].broken = 1;
+        }
+    }
+    dev_set_log(dev);
+    dev_unlock_all(dev);
+    return ret;
+}
+
+static int handle_set_vring_num(void *opaque, const VhostUserMsg *msg,
+                                int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+
+    (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_VRING_NUM: index=%u num=%u",
+               msg->payload.state.index, msg->payload.state.num);
+    if (msg->payload.state.index >= VHOST_MAX_VRINGS ||
+        msg->payload.state.num == 0 ||
+        msg->payload.state.num > VQ_MAX_RING_SIZE) {
+        VLOG_ERR("SET_VRING_NUM: invalid request");
+        return -1;
+    }
+    qp = vring_qp(dev, msg->payload.state.index);
+    qp_lock(qp);
+    // The worker masks ring indices with num, and the rings were only
+    // checked against the guest memory for the size they started with.
+    if (dev->vrings[msg->payload.state.index].started) {
+        qp_unlock(qp);
+        VLOG_ERR("SET_VRING_NUM: vring %u is running", msg->payload.state.index);
+        return -1;
+    }
+    dev->vrings[msg->payload.state.index].vq.num = msg->payload.state.num;
+    qp_unlock(qp);
+    return 0;
+}
+
+static int handle_set_vring_addr(void *opaque, const VhostUserMsg *msg,
+                                 int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostUserVringAddr addr;
+    VhostQueuePair *qp;
+    VhostVring *vr;
+
+    (void)fds; (void)nfds; (void)reply;
+    memcpy(&addr, &msg->payload.addr, sizeof(addr));
+    VLOG_DEBUG("SET_VRING_ADDR: index=%u desc=0x%lx avail=0x%lx used=0x%lx",
+               addr.index, addr.desc_user_addr, addr.avail_user_addr,
+               addr.used_user_addr);
+    if (addr.index >= VHOST_MAX_VRINGS) {
+        VLOG_ERR("SET_VRING_ADDR: invalid index");
+        return -1;
+    }
+    qp = vring_qp(dev, addr.index);
+    qp_lock(qp);
+    vr = &dev->vrings[addr.index];
+    vr->desc_uva = addr.desc_user_addr;
+    vr->avail_uva = addr.avail_user_addr;
+    vr->used_uva = addr.used_user_addr;
+    vr->log_guest_addr = addr.log_guest_addr;
+    vr->log_used = !!(addr.flags & (1U << VHOST_VRING_F_LOG));
+    vr->addr_set = 1;
+    qp_unlock(qp);
+    return 0;
+}
+
+static int handle_set_vring_base(void *opaque, const VhostUserMsg *msg,
+                                 int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+    Virtqueue *vq;
+
+    (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_VRING_BASE: index=%u base=%u",
+               msg->payload.state.index, msg->payload.state.num);
+    if (msg->payload.state.index >= VHOST_MAX_VRINGS) {
+        VLOG_ERR("SET_VRING_BASE: invalid index");
+        return -1;
+    }
+    qp = vring_qp(dev, msg->payload.state.index);
+    qp_lock(qp);
+    vq = &dev->vrings[msg->payload.state.index].vq;
+    if (vq->packed && vq->num &&
+        (msg->payload.state.num & ((1U << VRING_PACKED_WRAP_SHIFT) - 1)) >= vq->num) {
+        qp_unlock(qp);
+        VLOG_ERR("SET_VRING_BASE: base %u is outside a packed ring of %u",
+                 msg->payload.state.num, vq->num);
+        return -1;
+    }
+    vq_set_base(vq, msg->payload.state.num);
+    qp_unlock(qp);
+    return 0;
+}
+
+static int handle_get_vring_base(void *opaque, const VhostUserMsg *msg,
+                                 int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+    VhostVring *vr;
+
+    (void)fds; (void)nfds;
+    VLOG_DEBUG("GET_VRING_BASE: index=%u", msg->payload.state.index);
+    reply->payload.state.index = msg->payload.state.index;
+    if (msg->payload.state.index >= VHOST_MAX_VRINGS) {
+        VLOG_ERR("GET_VRING_BASE: invalid index");
+        return -1;
+    }
+    qp = vring_qp(dev, msg->payload.state.index);
+    qp_lock(qp);
+    vr = &dev->vrings[msg->payload.state.index];
+    vring_stop(dev, vr, msg->payload.state.index);
+    vq_inflight_detach(&vr->vq);
+    reply->payload.state.num = vq_get_base(&vr->vq);
+    qp_unlock(qp);
+    return 0;
 }
 
-static void handle_client(int client_sock) {
-    VhostUserMsg msg, reply;
-    
-    printf("Client connected\n");
-    
-    while (running) {
-        ssize_t ret = recv(client_sock, &msg, sizeof(msg), 0);
-        if (ret != sizeof(msg)) {
-            if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("recv");
+static int handle_set_vring_enable(void *opaque, const VhostUserMsg *msg,
+                                   int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+
+    (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("SET_VRING_ENABLE: index=%u enable=%u",
+               msg->payload.state.index, msg->payload.state.num);
+    if (msg->payload.state.index >= VHOST_MAX_VRINGS) {
+        VLOG_ERR("SET_VRING_ENABLE: invalid index");
+        return -1;
+    }
+    qp = vring_qp(dev, msg->payload.state.index);
+    qp_lock(qp);
+    dev->vrings[msg->payload.state.index].enabled = !!msg->payload.state.num;
+    qp_unlock(qp);
+    if (qp->worker_running) {
+        qp_wake_worker(qp);
+    }
+    return 0;
+}
+
+static int handle_set_vring_kick(void *opaque, const VhostUserMsg *msg,
+                                 int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+    VhostVring *vr;
+    int fd, ret = 0;
+
+    (void)reply;
+    VLOG_DEBUG("SET_VRING_KICK: 0x%lx", msg->payload.u64);
+    vr = vring_fd_msg(dev, msg, fds, nfds, &fd);
+    if (!vr) {
+        return -1;
+    }
+    if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        VLOG_ERR("fcntl kick fd: %s", strerror(errno));
+    }
+    qp = vring_qp(dev, vr - dev->vrings);
+    qp_lock(qp);
+    if (vr->kick_fd >= 0) {
+        close(vr->kick_fd);
+    }
+    vr->kick_fd = fd;
+    if (vring_start(dev, vr, vr - dev->vrings) < 0) {
+        vr->broken = 1;
+        ret = -1;
+    }
+    qp_unlock(qp);
+    return ret;
+}
+
+static int handle_set_vring_call(void *opaque, const VhostUserMsg *msg,
+                                 int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostQueuePair *qp;
+    VhostVring *vr;
+    int fd;
+
+    (void)reply;
+    VLOG_DEBUG("SET_VRING_CALL: 0x%lx", msg->payload.u64);
+    vr = vring_fd_msg(dev, msg, fds, nfds, &fd);
+    if (!vr) {
+        return -1;
+    }
+    qp = vring_qp(dev, vr - dev->vrings);
+    qp_lock(qp);
+    if (vr->vq.call_fd >= 0) {
+        close(vr->vq.call_fd);
+    }
+    vr->vq.call_fd = fd;
+    qp_unlock(qp);
+    return 0;
+}
+
+static int handle_set_log_base(void *opaque, const VhostUserMsg *msg,
+                               int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostUserLog log;
+    int ret;
+
+    (void)reply;
+    memcpy(&log, &msg->payload.log, sizeof(log));
+    VLOG_DEBUG("SET_LOG_BASE: size=0x%lx offset=0x%lx", log.mmap_size,
+               log.mmap_offset);
+    if (nfds != 1) {
+        VLOG_ERR("SET_LOG_BASE: malformed request (%zu fds)", nfds);
+        return -1;
+    }
+    dev_lock_all(dev);
+    ret = vhost_log_map(&dev->log, log.mmap_size, log.mmap_offset, fds[0]);
+    dev_set_log(dev);
+    dev_unlock_all(dev);
+    return ret;
+}
+
+// A new area for num_queues vrings, handed to the frontend with the reply.
+// Each ring attaches its slot when it starts.
+static int handle_get_inflight_fd(void *opaque, const VhostUserMsg *msg,
+                                  int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostUserInflight req;
+    int fd, ret;
+
+    (void)fds; (void)nfds;
+    memcpy(&req, &msg->payload.inflight, sizeof(req));
+    VLOG_DEBUG("GET_INFLIGHT_FD: num_queues=%u queue_size=%u", req.num_queues,
+               req.queue_size);
+    if (req.num_queues == 0 || req.num_queues > VHOST_MAX_VRINGS ||
+        req.queue_size == 0 || req.queue_size > VQ_MAX_RING_SIZE) {
+        VLOG_ERR("GET_INFLIGHT_FD: invalid geometry");
+        return -1;
+    }
+    dev_lock_all(dev);
+    ret = dev_set_inflight(dev, "GET_INFLIGHT_FD");
+    if (ret == 0) {
+        ret = vhost_inflight_create(&dev->inflight, req.num_queues * vq_inflight_size(), &fd);
+    }
+    dev_unlock_all(dev);
+    if (ret < 0) {
+        return -1;
+    }
+    req.mmap_size = dev->inflight.size;
+    req.mmap_offset = 0;
+    reply->size = sizeof(req);
+    memcpy(&reply->payload.inflight, &req, sizeof(req));
+    if (dev->reply_fd >= 0) {
+        close(dev->reply_fd);
+    }
+    dev->reply_fd = fd;
+    return 0;
+}
+
+static int handle_set_inflight_fd(void *opaque, const VhostUserMsg *msg,
+                                  int *fds, size_t nfds, VhostUserMsg *reply) {
+    VhostDev *dev = opaque;
+    VhostUserInflight inf;
+    int ret;
+
+    (void)reply;
+    memcpy(&inf, &msg->payload.inflight, sizeof(inf));
+    VLOG_DEBUG("SET_INFLIGHT_FD: size=0x%lx offset=0x%lx num_queues=%u queue_size=%u",
+               inf.mmap_size, inf.mmap_offset, inf.num_queues, inf.queue_size);
+    if (nfds != 1) {
+        VLOG_ERR("SET_INFLIGHT_FD: malformed request (%zu fds)", nfds);
+        return -1;
+    }
+    if (inf.num_queues == 0 || inf.num_queues > VHOST_MAX_VRINGS ||
+        inf.queue_size == 0 || inf.queue_size > VQ_MAX_RING_SIZE) {
+        VLOG_ERR("SET_INFLIGHT_FD: invalid geometry");
+        return -1;
+    }
+    dev_lock_all(dev);
+    ret = dev_set_inflight(dev, "SET_INFLIGHT_FD");
+    if (ret == 0) {
+        ret = vhost_inflight_map(&dev->inflight, inf.mmap_size, inf.mmap_offset, fds[0]);
+    }
+    dev_unlock_all(dev);
+    return ret;
+}
+
+// SET_LOG_FD only signals a full log buffer, which a shared bitmap never
+// is, and we never report vring errors; the caller drops the fd.
+static int handle_ignored(void *opaque, const VhostUserMsg *msg,
+                          int *fds, size_t nfds, VhostUserMsg *reply) {
+    (void)opaque; (void)fds; (void)nfds; (void)reply;
+    VLOG_DEBUG("%s: 0x%lx", vhost_user_request_name(msg->request), msg->payload.u64);
+    return 0;
+}
+
+#define STATE_SIZE  sizeof(((VhostUserMsg *)0)->payload.state)
+#define U64_SIZE    sizeof(uint64_t)
+
+static const VhostUserHandler request_handlers[VHOST_USER_MAX] = {
+    [VHOST_USER_GET_FEATURES]          = { handle_get_features, 0 },
+    [VHOST_USER_SET_FEATURES]          = { handle_set_features, U64_SIZE },
+    [VHOST_USER_SET_OWNER]             = { handle_set_owner, 0 },
+    [VHOST_USER_SET_MEM_TABLE]         = { handle_set_mem_table, offsetof(VhostUserMemory, regions) },
+    [VHOST_USER_SET_LOG_BASE]          = { handle_set_log_base, sizeof(VhostUserLog) },
+    [VHOST_USER_SET_LOG_FD]            = { handle_ignored, 0 },
+    [VHOST_USER_SET_VRING_NUM]         = { handle_set_vring_num, STATE_SIZE },
+    [VHOST_USER_SET_VRING_ADDR]        = { handle_set_vring_addr, sizeof(VhostUserVringAddr) },
+    [VHOST_USER_SET_VRING_BASE]        = { handle_set_vring_base, STATE_SIZE },
+    [VHOST_USER_GET_VRING_BASE]        = { handle_get_vring_base, STATE_SIZE },
+    [VHOST_USER_SET_VRING_KICK]        = { handle_set_vring_kick, U64_SIZE },
+    [VHOST_USER_SET_VRING_CALL]        = { handle_set_vring_call, U64_SIZE },
+    [VHOST_USER_SET_VRING_ERR]         = { handle_ignored, U64_SIZE },
+    [VHOST_USER_GET_PROTOCOL_FEATURES] = { handle_get_protocol_features, 0 },
+    [VHOST_USER_SET_PROTOCOL_FEATURES] = { handle_set_protocol_features, U64_SIZE },
+    [VHOST_USER_GET_QUEUE_NUM]         = { handle_get_queue_num, 0 },
+    [VHOST_USER_SET_VRING_ENABLE]      = { handle_set_vring_enable, STATE_SIZE },
+    [VHOST_USER_GET_INFLIGHT_FD]       = { handle_get_inflight_fd, sizeof(VhostUserInflight) },
+    [VHOST_USER_SET_INFLIGHT_FD]       = { handle_set_inflight_fd, sizeof(VhostUserInflight) },
+};
+
+// Control plane: a single epoll loop multiplexes the listening socket and
+// every session. Sockets are non-blocking; each session reads into its own
+// buffer and handles the messages that are complete, so several requests
+// can arrive in one read and one request in several. A session that used
+// up its budget with messages still buffered goes on the backlog, which
+// the loop drains before it waits again. Data planes keep their own
+// worker threads.
+#define MAX_EPOLL_EVENTS        64
+#define SESSION_MSG_BUDGET      32      // messages per wakeup, for fairness
+#define SESSION_TX_BUF_SIZE     4096
+
+typedef struct Session {
+    uint64_t id;                // accept order, for the stats socket
+    int sock;
+    int want_out;               // EPOLLOUT armed
+    VhostDev dev;
+    VhostUserReader rd;
+    VhostUserMsg msg;           // message being handled
+    int fds[VHOST_USER_MAX_FDS];
+    uint8_t tx_buf[SESSION_TX_BUF_SIZE];    // replies not yet taken by the peer
+    size_t tx_len;
+    int tx_fd;                  // -1, or an fd to pass with the reply at tx_fd_off
+    size_t tx_fd_off;
+    size_t tx_fd_len;
+    uint64_t messages;
+    struct timespec accept_time;
+    uint64_t first_reply_ns;    // 0 until the first reply went out
+    int backlogged;
+    struct Session *prev;
+    struct Session *next;
+    struct Session *backlog_next;
+} Session;
+
+// Per request type, over all sessions; slot VHOST_USER_MAX collects
+// unknown requests. Only the control loop touches these.
+typedef struct RequestStats {
+    uint64_t count;
+    uint64_t failed;
+    VhostHist latency_ns;       // time spent handling the request
+} RequestStats;
+
+typedef struct Server {
+    int stats_sock;             // -1 without --stats
+    int epfd;
+    int accept_paused;          // out of fds, waiting for a session to close
+    Session *sessions;
+    Session *backlog;           // sessions with messages left in their buffer
+    unsigned nsessions;
+    unsigned peak_sessions;
+    uint64_t accepted;
+    struct timespec start_time;
+    VhostHist first_reply_ns;   // accept to first reply, per session
+    RequestStats requests[VHOST_USER_MAX + 1];
+} Server;
+
+static uint64_t elapsed_ns(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL +
+           (now.tv_nsec - since->tv_nsec);
+}
+
+static void latency_report(const VhostHist *h) {
+    if (h->count == 0) {
+        return;
+    }
+    VLOG_INFO("Accept-to-first-reply latency over %lu sessions: "
+              "min %.1fus avg %.1fus max %.1fus p50 %.1fus p99 %.1fus",
+              h->count, h->min / 1e3, (double)h->sum / 1e3 / h->count, h->max / 1e3,
+              vhost_hist_percentile(h, 50) / 1e3, vhost_hist_percentile(h, 99) / 1e3);
+}
+
+static int session_update_events(Server *srv, Session *s) {
+    struct epoll_event ev;
+    int want_out = s->tx_len > 0;
+
+    if (want_out == s->want_out) {
+        return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, s->sock, &ev) < 0) {
+        VLOG_ERR("epoll_ctl session: %s", strerror(errno));
+        return -1;
+    }
+    s->want_out = want_out;
+    return 0;
+}
+
+// Send the reply that carries s->tx_fd, and nothing else: the frontend
+// hands descriptors to the message that ends the read they came with.
+static ssize_t session_send_fd(Session *s, const uint8_t *buf, size_t len) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    memset(control, 0, sizeof(control));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &s->tx_fd, sizeof(int));
+    ret = sendmsg(s->sock, &mh, MSG_NOSIGNAL);
+    if (ret > 0) {
+        close(s->tx_fd);
+        s->tx_fd = -1;
+    }
+    return ret;
+}
+
+static int session_flush(Server *srv, Session *s) {
+    size_t off = 0;
+
+    while (off < s->tx_len) {
+        ssize_t ret;
+
+        if (s->tx_fd >= 0 && off == s->tx_fd_off) {
+            ret = session_send_fd(s, s->tx_buf + off, s->tx_fd_len);
+        } else {
+            size_t end = s->tx_fd >= 0 && s->tx_fd_off > off ? s->tx_fd_off : s->tx_len;
+
+            ret = send(s->sock, s->tx_buf + off, end - off, MSG_NOSIGNAL);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            VLOG_ERR("send: %s", strerror(errno));
+            return -1;
+        }
+        off += ret;
+    }
+    if (off > 0 && s->first_reply_ns == 0) {
+        s->first_reply_ns = elapsed_ns(&s->accept_time);
+        vhost_hist_record(&srv->first_reply_ns, s->first_reply_ns);
+    }
+    memmove(s->tx_buf, s->tx_buf + off, s->tx_len - off);
+    s->tx_len -= off;
+    if (s->tx_fd >= 0) {
+        s->tx_fd_off -= off;
+    }
+    return session_update_events(srv, s);
+}
+
+// Queue a reply, with the fd its handler left in dev.reply_fd if any;
+// session_read() flushes everything a pass produced at once.
+static int session_reply(Session *s, const VhostUserMsg *reply) {
+    size_t len = vhost_user_msg_len(reply);
+
+    if (s->tx_len + len > sizeof(s->tx_buf) ||
+        (s->dev.reply_fd >= 0 && s->tx_fd >= 0)) {
+        VLOG_WARN("Client is not reading replies, dropping it");
+        return -1;
+    }
+    if (s->dev.reply_fd >= 0) {
+        s->tx_fd = s->dev.reply_fd;
+        s->tx_fd_off = s->tx_len;
+        s->tx_fd_len = len;
+        s->dev.reply_fd = -1;
+    }
+    memcpy(s->tx_buf + s->tx_len, reply, len);
+    s->tx_len += len;
+    return 0;
+}
+
+// Handle the messages already buffered, reading from the socket only when
+// none is complete. Returns -1 when the session must be closed.
+static int session_read(Server *srv, Session *s) {
+    unsigned handled = 0;
+
+    while (handled < SESSION_MSG_BUDGET) {
+        VhostUserMsg reply;
+        RequestStats *rs;
+        uint64_t start;
+        size_t nfds;
+        int has_reply, failed;
+        int ret = vhost_user_next(&s->rd, &s->msg, sizeof(s->msg), s->fds, &nfds);
+
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            ssize_t n = vhost_user_recv(s->sock, &s->rd, MSG_DONTWAIT);
+
+            if (n == 0) {
+                return -1;
+            }
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                VLOG_ERR("recvmsg: %s", strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        start = now_ns();
+        failed = vhost_user_dispatch(request_handlers, &s->dev, &s->msg, s->fds,
+                                     nfds, &reply) < 0;
+        rs = &srv->requests[(uint32_t)s->msg.request < VHOST_USER_MAX ?
+                            s->msg.request : VHOST_USER_MAX];
+        rs->count++;
+        rs->failed += failed;
+        vhost_hist_record(&rs->latency_ns, now_ns() - start);
+        // A SET_PROTOCOL_FEATURES that enables REPLY_ACK applies to itself.
+        has_reply = vhost_user_need_reply(&s->msg, s->dev.protocol_features);
+        // Mappings hold their own reference, so no received fd outlives
+        // the message it came with.
+        close_fds(s->fds, nfds);
+        s->messages++;
+        handled++;
+        if (has_reply && session_reply(s, &reply) < 0) {
+            return -1;
+        }
+    }
+    if (handled == SESSION_MSG_BUDGET && !s->backlogged) {
+        s->backlogged = 1;
+        s->backlog_next = srv->backlog;
+        srv->backlog = s;
+    }
+    return s->tx_len > 0 ? session_flush(srv, s) : 0;
+}
+
+// Poll the listening sockets, or stop while the server is out of fds.
+static int server_set_accepting(Server *srv, int on) {
+    int ret = 0;
+
+    for (unsigned i = 0; i < vswitch.nports; i++) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = on ? EPOLLIN : 0;
+        ev.data.ptr = &vswitch.ports[i];
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, vswitch.ports[i].listen_sock, &ev) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void session_close(Server *srv, Session *s) {
+    SwitchPort *port = s->dev.port;
+
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        srv->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    srv->nsessions--;
+    if (s->backlogged) {
+        Session **link = &srv->backlog;
+
+        while (*link != s) {
+            link = &(*link)->backlog_next;
+        }
+        *link = s->backlog_next;
+    }
+
+    vhost_user_reader_reset(&s->rd);
+    if (port) {
+        // Other ports' workers must be done with the rings before they go.
+        port_lock_rx(port);
+        port->dev = NULL;
+        port_unlock_rx(port);
+    }
+    dev_cleanup(&s->dev);
+    if (port) {
+        fdb_forget_port(port->index);
+    }
+    if (s->tx_fd >= 0) {
+        close(s->tx_fd);
+    }
+    close(s->sock);
+    VLOG_INFO("Client disconnected after %lu messages (first reply %.1fus, %u sessions)",
+              s->messages, s->first_reply_ns / 1e3, srv->nsessions);
+    free(s);
+
+    if (srv->accept_paused && server_set_accepting(srv, 1) == 0) {
+        srv->accept_paused = 0;
+    }
+}
+
+static void session_event(Server *srv, Session *s, uint32_t events) {
+    if ((events & EPOLLOUT) && session_flush(srv, s) < 0) {
+        session_close(srv, s);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && session_read(srv, s) < 0) {
+        session_close(srv, s);
+    }
+}
+
+static void server_accept(Server *srv, SwitchPort *port) {
+    for (;;) {
+        struct epoll_event ev;
+        Session *s;
+        int sock = accept4(port->listen_sock, NULL, NULL,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // The pending connection stays queued; stop polling the
+                // listener until a session goes away.
+                VLOG_WARN("accept4: %s, pausing accepts at %u sessions",
+                          strerror(errno), srv->nsessions);
+                if (server_set_accepting(srv, 0) == 0) {
+                    srv->accept_paused = 1;
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                VLOG_ERR("accept4: %s", strerror(errno));
+            }
+            return;
+        }
+        if (vswitch.enabled && port->dev) {
+            VLOG_WARN("Port %u (%s) already has a frontend, refusing connection",
+                      port->index, port->path);
+            close(sock);
+            continue;
+        }
+
+        s = calloc(1, sizeof(*s));
+        if (!s) {
+            VLOG_ERR("Out of memory for session");
+            close(sock);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &s->accept_time);
+        s->id = srv->accepted;
+        s->sock = sock;
+        s->tx_fd = -1;
+        vhost_user_reader_init(&s->rd);
+        dev_init(&s->dev);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            VLOG_ERR("epoll_ctl add session: %s", strerror(errno));
+            dev_cleanup(&s->dev);
+            close(sock);
+            free(s);
+            continue;
+        }
+
+        s->next = srv->sessions;
+        if (srv->sessions) {
+            srv->sessions->prev = s;
+        }
+        srv->sessions = s;
+        srv->nsessions++;
+        srv->accepted++;
+        if (srv->nsessions > srv->peak_sessions) {
+            srv->peak_sessions = srv->nsessions;
+        }
+        if (vswitch.enabled) {
+            // No ring is running yet, so no worker can see the port change.
+            s->dev.port = port;
+            port_lock_rx(port);
+            port->dev = &s->dev;
+            port_unlock_rx(port);
+            VLOG_INFO("Client connected to port %u (%s)", port->index, port->path);
+        } else {
+            VLOG_INFO("Client connected (%u sessions)", srv->nsessions);
+        }
+    }
+}
+
+// --stats: every connection to the stats socket gets one JSON snapshot and
+// is closed, e.g. "socat - UNIX-CONNECT:PATH". The control loop writes it,
+// so request stats are read by the thread that updates them and vring
+// counters with relaxed loads: nothing stops while a snapshot is taken.
+#define STATS_SEND_TIMEOUT_MS   100
+
+static void stats_write(const Server *srv, FILE *f) {
+    const char *sep = "";
+
+    fprintf(f, "{\n  \"uptime_ns\": %lu,\n", elapsed_ns(&srv->start_time));
+    fprintf(f, "  \"sessions\": {\"active\": %u, \"accepted\": %lu, \"peak\": %u},\n",
+            srv->nsessions, srv->accepted, srv->peak_sessions);
+    fprintf(f, "  \"first_reply_ns\": ");
+    vhost_hist_json(f, &srv->first_reply_ns);
+    fprintf(f, ",\n  \"requests\": {");
+    for (uint32_t r = 0; r <= VHOST_USER_MAX; r++) {
+        const RequestStats *rs = &srv->requests[r];
+
+        if (rs->count == 0) {
+            continue;
+        }
+        fprintf(f, "%s\n    \"%s\": {\"count\": %lu, \"failed\": %lu, \"latency_ns\": ",
+                sep, vhost_user_request_name(r), rs->count, rs->failed);
+        vhost_hist_json(f, &rs->latency_ns);
+        fprintf(f, "}");
+        sep = ",";
+    }
+    fprintf(f, "\n  },\n  \"vrings\": [");
+    sep = "";
+    for (const Session *s = srv->sessions; s; s = s->next) {
+        for (unsigned i = 0; i < VHOST_MAX_VRINGS; i++) {
+            const VhostVring *vr = &s->dev.vrings[i];
+
+            if (!vr->started) {
+                continue;
+            }
+            fprintf(f, "%s\n    {\"session\": %lu, \"port\": %d, \"vring\": %u, "
+                    "\"queue\": \"%s\", \"enabled\": %d, \"broken\": %d, "
+                    "\"packets\": %lu, \"bytes\": %lu, \"drops\": %lu, \"calls\": %lu, "
+                    "\"wakeups\": %lu}",
+                    sep, s->id, s->dev.port ? (int)s->dev.port->index : -1, i,
+                    i % 2 ? "tx" : "rx", vr->enabled, vr->broken,
+                    vhost_stat_read(&vr->packets), vhost_stat_read(&vr->bytes),
+                    vhost_stat_read(&vr->drops), vhost_stat_read(&vr->calls),
+                    vhost_stat_read(&s->dev.qps[i / 2].wakeups));
+            sep = ",";
+        }
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static void stats_serve(Server *srv) {
+    for (;;) {
+        struct timeval tv = { 0, STATS_SEND_TIMEOUT_MS * 1000 };
+        char *buf = NULL;
+        size_t len = 0, off = 0;
+        FILE *f;
+        int sock = accept4(srv->stats_sock, NULL, NULL, SOCK_CLOEXEC);
+
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                VLOG_ERR("accept4 stats: %s", strerror(errno));
+            }
+            return;
+        }
+        // A reader that stalls only costs the loop the send timeout.
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        f = open_memstream(&buf, &len);
+        if (f) {
+            stats_write(srv, f);
+            fclose(f);
+            while (off < len) {
+                ssize_t ret = send(sock, buf + off, len - off, MSG_NOSIGNAL);
+
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    break;
+                }
+                off += ret;
+            }
+        }
+        free(buf);
+        close(sock);
+    }
+}
+
+// A non-blocking listening socket at path, replacing any stale one.
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) {
+        VLOG_ERR("socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        VLOG_ERR("bind: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    if (listen(sock, SOMAXCONN) < 0) {
+        VLOG_ERR("listen: %s", strerror(errno));
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    return sock;
+}
+
+// Parse a CPU list such as "0,2,4-7" into worker_cpus.
+static int parse_cpu_list(const char *list) {
+    const char *p = list;
+
+    nworker_cpus = 0;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && nworker_cpus < CPU_SETSIZE; cpu++) {
+            worker_cpus[nworker_cpus++] = cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        p = end;
+    }
+    return nworker_cpus > 0 ? 0 : -1;
+}
+
+// Parse --map "A:B[,A:B...]": frames sent on port A go to port B.
+static int parse_port_map(const char *list) {
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        unsigned long from = strtoul(p, &end, 10), to;
+
+        if (end == p || *end != ':' || from >= vswitch.nports) {
+            return -1;
+        }
+        p = end + 1;
+        to = strtoul(p, &end, 10);
+        if (end == p || to >= vswitch.nports || to == from) {
+            return -1;
+        }
+        vswitch.ports[from].map_to = to;
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        p = end;
+    }
+    vswitch.use_map = 1;
+    return 0;
+}
+
+static void close_listeners(void) {
+    for (unsigned i = 0; i < vswitch.nports; i++) {
+        if (vswitch.ports[i].listen_sock >= 0) {
+            close(vswitch.ports[i].listen_sock);
+            unlink(vswitch.ports[i].path);
+        }
+    }
+}
+
+// The port whose listening socket an epoll event is for, or NULL.
+static SwitchPort *listener_port(const void *ptr) {
+    for (unsigned i = 0; i < vswitch.nports; i++) {
+        if (ptr == &vswitch.ports[i]) {
+            return &vswitch.ports[i];
         }
-        
-        printf("Received request: %d (flags=0x%x, size=%d)\n", 
-               msg.request, msg.flags, msg.size);
-        
-        // Prepare reply
-        memset(&reply, 0, sizeof(reply));
-        reply.request = msg.request;
-        reply.flags = 1;
-        reply.size = 8;
-        
-        switch (msg.request) {
-            case VHOST_USER_GET_FEATURES:
-                // Return realistic virtio-net features
-                reply.payload.u64 = 0x100002000000ULL; // VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_VERSION_1
-                printf("Sending GET_FEATURES reply: 0x%lx\n", reply.payload.u64);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [SOCKET_PATH...]\n", prog);
+    printf("With two or more sockets, switch frames between the frontends on them.\n");
+    printf("  -c, --cpus LIST        pin queue pair workers to these CPUs, e.g. 2,4-7\n");
+    printf("  -p, --poll-us USEC     keep polling rings for USEC after the last packet\n");
+    printf("                         before sleeping on kicks (default 0, -1: never sleep)\n");
+    printf("  -s, --stats PATH       serve a JSON snapshot of the counters and latency\n");
+    printf("                         histograms to every connection on PATH\n");
+    printf("  -m, --map LIST         switch by port number instead of learning MACs:\n");
+    printf("                         A:B[,A:B...] sends frames from port A to port B\n");
+    printf("  -b, --pool-bufs N      loopback: instead of dropping frames while an RX\n");
+    printf("                         ring has no buffers, keep up to %u per queue pair\n",
+           VHOST_STAGE_MAX);
+    printf("                         in a pool of N buffers (default 0: drop them)\n");
+    printf("  -H, --hugepages        back the pool with huge pages if there are any\n");
+    printf("  -P, --populate         prefault guest memory when mapping it (MAP_POPULATE)\n");
+    printf("  -v, --verbose          also log every request received and reply sent\n");
+    printf("  -h, --help             show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "cpus",    required_argument, NULL, 'c' },
+        { "poll-us", required_argument, NULL, 'p' },
+        { "stats",   required_argument, NULL, 's' },
+        { "map",     required_argument, NULL, 'm' },
+        { "pool-bufs", required_argument, NULL, 'b' },
+        { "hugepages", no_argument,     NULL, 'H' },
+        { "populate", no_argument,      NULL, 'P' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *socket_path = "/tmp/vhost-user-test-sock";
+    const char *stats_path = NULL;
+    const char *port_map = NULL;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct epoll_event ev;
+    static Server srv;
+    int opt;
+    
+    while ((opt = getopt_long(argc, argv, "c:p:s:m:b:HPvh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                if (parse_cpu_list(optarg) < 0) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    return 1;
+                }
                 break;
-                
-            case VHOST_USER_GET_PROTOCOL_FEATURES:
-                // Return supported protocol features
-                reply.payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
-                                   (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
-                printf("Sending GET_PROTOCOL_FEATURES reply: 0x%lx\n", reply.payload.u64);
+            case 'p':
+                worker_poll_ns = strtoll(optarg, NULL, 0);
+                worker_poll_ns = worker_poll_ns < 0 ? -1 : worker_poll_ns * 1000;
                 break;
-                
-            case VHOST_USER_SET_FEATURES:
-                reply.size = 0;
-                printf("SET_FEATURES: 0x%lx\n", msg.payload.u64);
+            case 's':
+                stats_path = optarg;
                 break;
-                
-            case VHOST_USER_SET_PROTOCOL_FEATURES:
-                reply.size = 0;
-                printf("SET_PROTOCOL_FEATURES: 0x%lx\n", msg.payload.u64);
+            case 'm':
+                port_map = optarg;
                 break;
-                
-            case VHOST_USER_SET_OWNER:
-                reply.size = 0;
-                printf("SET_OWNER\n");
+            case 'b':
+                rx_pool_bufs = strtoul(optarg, NULL, 0);
                 break;
-                
-            default:
-                reply.payload.u64 = 0;
-                printf("Unhandled request: %d\n", msg.request);
+            case 'H':
+                rx_pool_flags |= VHOST_POOL_F_HUGEPAGES;
                 break;
-        }
-        
-        if (send(client_sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
-            perror("send");
-            break;
+            case 'P':
+                mem_map_flags |= VHOST_MEM_F_POPULATE;
+                break;
+            case 'v':
+                vhost_log_level = VHOST_LOG_DEBUG;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
         }
     }
-    
-    printf("Client disconnected\n");
-}
+    if (argc - optind > VSWITCH_MAX_PORTS) {
+        fprintf(stderr, "At most %d sockets\n", VSWITCH_MAX_PORTS);
+        return 1;
+    }
+    do {
+        SwitchPort *port = &vswitch.ports[vswitch.nports];
 
-int main(int argc, char *argv[]) {
-    const char *socket_path = "/tmp/vhost-user-test-sock";
-    int server_sock, client_sock;
-    struct sockaddr_un addr;
-    
-    if (argc > 1) {
-        socket_path = argv[1];
+        port->index = vswitch.nports++;
+        port->path = optind < argc ? argv[optind] : socket_path;
+        port->listen_sock = -1;
+        port->map_to = -1;
+        for (unsigned i = 0; i < VHOST_MAX_QUEUE_PAIRS; i++) {
+            pthread_mutex_init(&port->rx_lock[i], NULL);
+        }
+    } while (++optind < argc);
+    vswitch.enabled = vswitch.nports > 1;
+    if (port_map && (!vswitch.enabled || parse_port_map(port_map) < 0)) {
+        fprintf(stderr, "Invalid port map: %s\n", port_map);
+        return 1;
+    }
+    // The switch delivers straight into the other ports' rings and has
+    // nothing to stage.
+    if (!vswitch.enabled && rx_pool_bufs > 0 &&
+        vhost_pool_init(&rx_pool, rx_pool_bufs, sizeof(StagedFrame) + VHOST_STAGE_DATA,
+                        rx_pool_flags) < 0) {
+        return 1;
     }
     
-    // Set up signal handlers
+    // Set up signal handlers; epoll_wait() returns EINTR so the loop exits
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
-    // Remove existing socket
-    unlink(socket_path);
+    memset(&srv, 0, sizeof(srv));
+    clock_gettime(CLOCK_MONOTONIC, &srv.start_time);
+    srv.stats_sock = -1;
     
-    // Create server socket
-    server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("socket");
-        return 1;
+    // Create server sockets
+    for (unsigned i = 0; i < vswitch.nports; i++) {
+        vswitch.ports[i].listen_sock = listen_unix(vswitch.ports[i].path);
+        if (vswitch.ports[i].listen_sock < 0) {
+            close_listeners();
+            return 1;
+        }
     }
-    
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
-    
-    if (bind(server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(server_sock);
-        return 1;
+    if (stats_path) {
+        srv.stats_sock = listen_unix(stats_path);
+        if (srv.stats_sock < 0) {
+            close_listeners();
+            return 1;
+        }
     }
     
-    if (listen(server_sock, 5) < 0) {
-        perror("listen");
-        close(server_sock);
-        unlink(socket_path);
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    // Listeners are told apart by their SwitchPort, sessions by their Session
+    for (unsigned i = 0; i < vswitch.nports; i++) {
+        ev.data.ptr = &vswitch.ports[i];
+        if (srv.epfd < 0 ||
+            epoll_ctl(srv.epfd, EPOLL_CTL_ADD, vswitch.ports[i].listen_sock, &ev) < 0) {
+            VLOG_ERR("epoll: %s", strerror(errno));
+            close_listeners();
+            return 1;
+        }
+    }
+    ev.data.ptr = &srv.stats_sock;
+    if (srv.stats_sock >= 0 && epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.stats_sock, &ev) < 0) {
+        VLOG_ERR("epoll stats: %s", strerror(errno));
+        close_listeners();
         return 1;
     }
     
-    printf("Simple vhost-user server listening on: %s\n", socket_path);
-    printf("PID: %d\n", getpid());
+    // From here on, workers and the control loop only queue their messages
+    vhost_log_start();
+    if (vswitch.enabled) {
+        VLOG_INFO("Simple vhost-user switch with %u ports, forwarding by %s",
+                  vswitch.nports, vswitch.use_map ? "port map" : "MAC learning");
+        for (unsigned i = 0; i < vswitch.nports; i++) {
+            VLOG_INFO("Port %u listening on: %s", i, vswitch.ports[i].path);
+        }
+    } else {
+        VLOG_INFO("Simple vhost-user server listening on: %s", vswitch.ports[0].path);
+    }
+    if (rx_pool.nbufs > 0) {
+        VLOG_INFO("RX staging pool: %u buffers of %u bytes on %s pages",
+                  rx_pool.nbufs, rx_pool.buf_size, rx_pool.hugepages ? "huge" : "normal");
+    }
+    VLOG_INFO("PID: %d", getpid());
     
     while (running) {
-        client_sock = accept(server_sock, NULL, NULL);
-        if (client_sock < 0) {
+        int n = epoll_wait(srv.epfd, events, MAX_EPOLL_EVENTS, srv.backlog ? 0 : -1);
+        if (n < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            perror("accept");
+            VLOG_ERR("epoll_wait: %s", strerror(errno));
             break;
         }
-        
-        // Fork to handle multiple clients concurrently
-        pid_t child = fork();
-        if (child == 0) {
-            // Child process handles the client
-            close(server_sock);
-            handle_client(client_sock);
-            close(client_sock);
-            exit(0);
-        } else if (child > 0) {
-            // Parent process continues accepting
-            close(client_sock);
-        } else {
-            perror("fork");
-            close(client_sock);
+        for (int i = 0; i < n; i++) {
+            SwitchPort *port = listener_port(events[i].data.ptr);
+
+            if (port) {
+                server_accept(&srv, port);
+            } else if (events[i].data.ptr == &srv.stats_sock) {
+                stats_serve(&srv);
+            } else {
+                session_event(&srv, events[i].data.ptr, events[i].events);
+            }
         }
+        // Sessions taken off the backlog go back on it if they hit their
+        // budget again.
+        Session *s = srv.backlog;
+        srv.backlog = NULL;
+        while (s) {
+            Session *next = s->backlog_next;
+
+            s->backlogged = 0;
+            if (session_read(&srv, s) < 0) {
+                session_close(&srv, s);
+            }
+            s = next;
+        }
+    }
+    
+    while (srv.sessions) {
+        session_close(&srv, srv.sessions);
     }
+    VLOG_INFO("Sessions: %lu accepted, %u peak concurrent",
+              srv.accepted, srv.peak_sessions);
+    latency_report(&srv.first_reply_ns);
     
-    close(server_sock);
-    unlink(socket_path);
-    printf("Server shutting down\n");
+    close(srv.epfd);
+    close_listeners();
+    if (srv.stats_sock >= 0) {
+        close(srv.stats_sock);
+        unlink(stats_path);
+    }
+    if (rx_pool.nbufs > 0 && vhost_pool_ring_count(&rx_pool) != rx_pool.nbufs) {
+        VLOG_WARN("RX staging pool: %u buffers not returned",
+                  rx_pool.nbufs - vhost_pool_ring_count(&rx_pool));
+    }
+    vhost_pool_destroy(&rx_pool);
+    VLOG_INFO("Server shutting down");
+    vhost_log_stop();
     
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #!/bin/bash
 
 SOCKET_PATH="/tmp/vhost-user-test-sock"
+STATS_PATH="/tmp/vhost-user-test-stats"
 PID_FILE="/tmp/simple-vhost-server.pid"
 LOG_FILE="/tmp/simple-vhost-server.log"
 
@@ -17,7 +18,7 @@ cleanup() {
         fi
         rm -f "$PID_FILE"
     fi
-    rm -f "$SOCKET_PATH"
+    rm -f "$SOCKET_PATH" "$STATS_PATH"
     rm -f "$LOG_FILE"
 }
 
@@ -28,11 +29,11 @@ start_server() {
     
     # Build the server if it doesn't exist
     if [ ! -f "simple_vhost_server" ]; then
-        gcc -Wall -Wextra -std=c99 -O2 -o simple_vhost_server simple_vhost_server.c
+        make simple_vhost_server
     fi
     
     # Start the server in background
-    ./simple_vhost_server "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
+    ./simple_vhost_server --verbose --stats "$STATS_PATH" "$SOCKET_PATH" > "$LOG_FILE" 2>&1 &
     SERVER_PID=$!
     
     echo $SERVER_PID > "$PID_FILE"
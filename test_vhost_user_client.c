@@ -6,49 +6,18 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <pthread.h>
 #include <assert.h>
 
-#define VHOST_USER_PROTOCOL_F_MQ            0
-#define VHOST_USER_PROTOCOL_F_LOG_SHMFD     1
-#define VHOST_USER_PROTOCOL_F_RARP          2
-#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
-
-typedef enum VhostUserRequest {
-    VHOST_USER_NONE = 0,
-    VHOST_USER_GET_FEATURES = 1,
-    VHOST_USER_SET_FEATURES = 2,
-    VHOST_USER_SET_OWNER = 3,
-    VHOST_USER_RESET_OWNER = 4,
-    VHOST_USER_SET_MEM_TABLE = 5,
-    VHOST_USER_SET_LOG_BASE = 6,
-    VHOST_USER_SET_LOG_FD = 7,
-    VHOST_USER_SET_VRING_NUM = 8,
-    VHOST_USER_SET_VRING_ADDR = 9,
-    VHOST_USER_SET_VRING_BASE = 10,
-    VHOST_USER_GET_VRING_BASE = 11,
-    VHOST_USER_SET_VRING_KICK = 12,
-    VHOST_USER_SET_VRING_CALL = 13,
-    VHOST_USER_SET_VRING_ERR = 14,
-    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
-    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
-    VHOST_USER_MAX
-} VhostUserRequest;
-
-typedef struct VhostUserMsg {
-    VhostUserRequest request;
-    uint32_t flags;
-    uint32_t size;
-    union {
-        uint64_t u64;
-        struct {
-            uint32_t index;
-            uint32_t num;
-        } state;
-    } payload;
-} __attribute__((packed)) VhostUserMsg;
+#include "vhost_log.h"
+#include "vhost_pool.h"
+#include "vhost_user.h"
+#include "vhost_stats.h"
+#include "virtio_net.h"
+#include "virtqueue.h"
 
 static int test_count = 0;
 static int test_passed = 0;
@@ -113,9 +82,15 @@ static void* mock_server_thread(void *arg) {
         return NULL;
     }
     
+    // Each request is a header followed by exactly msg.size payload bytes.
     while (1) {
-        ssize_t ret = recv(client_sock, &msg, sizeof(msg), 0);
-        if (ret != sizeof(msg)) {
+        size_t hdr_size = sizeof(VhostUserHdr);
+        ssize_t ret = recv(client_sock, &msg, hdr_size, MSG_WAITALL);
+        if (ret != (ssize_t)hdr_size || msg.size > sizeof(msg.payload)) {
+            break;
+        }
+        if (msg.size > 0 &&
+            recv(client_sock, &msg.payload, msg.size, MSG_WAITALL) != (ssize_t)msg.size) {
             break;
         }
         
@@ -136,7 +111,8 @@ static void* mock_server_thread(void *arg) {
                 break;
         }
         
-        if (send(client_sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        if (send(client_sock, &reply, vhost_user_msg_len(&reply), 0) !=
+            (ssize_t)vhost_user_msg_len(&reply)) {
             break;
         }
     }
@@ -175,7 +151,11 @@ static int test_client_connection() {
 static int test_message_structure() {
     VhostUserMsg msg;
     
-    TEST_ASSERT(sizeof(VhostUserMsg) == 20, "VhostUserMsg structure size is correct (20 bytes)");
+    TEST_ASSERT(sizeof(VhostUserHdr) == 12, "VhostUserHdr structure size is correct (12 bytes)");
+    TEST_ASSERT(offsetof(VhostUserMsg, payload) == sizeof(VhostUserHdr),
+                "VhostUserMsg payload follows the header");
+    TEST_ASSERT(sizeof(VhostUserMsg) == sizeof(VhostUserHdr) + sizeof(VhostUserMemory),
+                "VhostUserMsg holds the largest payload (memory table)");
     
     memset(&msg, 0, sizeof(msg));
     msg.request = VHOST_USER_GET_FEATURES;
@@ -201,6 +181,431 @@ static int test_enum_values() {
     return 1;
 }
 
+static int test_handler_calls;
+
+static int test_handler(void *dev, const VhostUserMsg *msg, int *fds,
+                        size_t nfds, VhostUserMsg *reply) {
+    (void)fds; (void)nfds;
+    test_handler_calls++;
+    reply->payload.u64 = msg->payload.u64 + *(uint64_t *)dev;
+    return msg->payload.u64 == 0 ? -1 : 0;
+}
+
+static int test_dispatch() {
+    static const VhostUserHandler table[VHOST_USER_MAX] = {
+        [VHOST_USER_SET_FEATURES] = { test_handler, sizeof(uint64_t) },
+    };
+    uint64_t dev = 1;
+    VhostUserMsg msg, reply;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_FEATURES;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = sizeof(uint64_t);
+    msg.payload.u64 = 41;
+    vhost_user_dispatch(table, &dev, &msg, NULL, 0, &reply);
+    TEST_ASSERT(test_handler_calls == 1 && reply.payload.u64 == 42,
+                "Dispatcher runs the handler for the request");
+    TEST_ASSERT(reply.request == VHOST_USER_SET_FEATURES && reply.size == 8 &&
+                reply.flags == (VHOST_USER_VERSION | VHOST_USER_REPLY_MASK),
+                "Dispatcher builds the reply header");
+    
+    msg.payload.u64 = 0;
+    vhost_user_dispatch(table, &dev, &msg, NULL, 0, &reply);
+    TEST_ASSERT(reply.payload.u64 == 1, "Handler failure becomes a failed status");
+    
+    msg.size = 4;
+    vhost_user_dispatch(table, &dev, &msg, NULL, 0, &reply);
+    TEST_ASSERT(test_handler_calls == 2 && reply.payload.u64 == 1,
+                "Short payload is rejected without calling the handler");
+    
+    msg.request = VHOST_USER_SET_OWNER;
+    vhost_user_dispatch(table, &dev, &msg, NULL, 0, &reply);
+    TEST_ASSERT(reply.payload.u64 == 1, "Request without a handler is rejected");
+    msg.request = (VhostUserRequest)1000;
+    vhost_user_dispatch(table, &dev, &msg, NULL, 0, &reply);
+    TEST_ASSERT(reply.payload.u64 == 1, "Request outside the table is rejected");
+    
+    msg.request = VHOST_USER_SET_FEATURES;
+    TEST_ASSERT(!vhost_user_need_reply(&msg, 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK),
+                "No reply without need-reply");
+    msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+    TEST_ASSERT(!vhost_user_need_reply(&msg, 0), "No reply without REPLY_ACK");
+    TEST_ASSERT(vhost_user_need_reply(&msg, 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK),
+                "Need-reply is honoured with REPLY_ACK");
+    msg.request = VHOST_USER_GET_FEATURES;
+    msg.flags = VHOST_USER_VERSION;
+    TEST_ASSERT(vhost_user_need_reply(&msg, 0), "GET_FEATURES is always answered");
+    
+    return 1;
+}
+
+static int test_histogram() {
+    static VhostHist h;
+    int contiguous = 1;
+    
+    for (uint64_t v = 0; v < 4096; v++) {
+        unsigned i = vhost_hist_index(v);
+        contiguous &= vhost_hist_bucket_low(i) <= v &&
+                      (i + 1 == VHOST_HIST_BUCKETS || v < vhost_hist_bucket_low(i + 1));
+    }
+    TEST_ASSERT(contiguous, "Histogram buckets cover every value in order");
+    TEST_ASSERT(vhost_hist_index(UINT64_MAX) == VHOST_HIST_BUCKETS - 1,
+                "Largest value falls into the last bucket");
+    
+    memset(&h, 0, sizeof(h));
+    for (uint64_t v = 1; v <= 1000; v++) {
+        vhost_hist_record(&h, v * 1000);
+    }
+    TEST_ASSERT(h.count == 1000 && h.min == 1000 && h.max == 1000000,
+                "Histogram tracks count, min and max");
+    TEST_ASSERT(vhost_hist_percentile(&h, 50) >= 500000 &&
+                vhost_hist_percentile(&h, 50) < 500000 * 1.125,
+                "Median is within one bucket (12.5%)");
+    TEST_ASSERT(vhost_hist_percentile(&h, 100) == 1000000, "p100 is the maximum");
+    
+    return 1;
+}
+
+static void *log_thread(void *arg) {
+    VLOG_INFO("from thread %d", *(int *)arg);
+    return NULL;
+}
+
+static int test_logger() {
+    char expected[1024], out[1024], *line;
+    const char *name = "SET_VRING_NUM";
+    const char *thread_line = "from thread 7\n";
+    int saved, id = 7;
+    pthread_t thread;
+    FILE *tmp = tmpfile();
+    size_t len;
+    
+    snprintf(expected, sizeof(expected),
+             "%s: index=%u num=%-5d|\n0x%lx %zu %5.2f %c 100%% %p\n"
+             "[%8s] [%.3s] [%*d]\nshown\n",
+             name, 3, -12, 0xdeadbeefUL, (size_t)42, 3.14159, 'x',
+             (void *)&id, "abc", "truncate", 4, 9);
+    
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    vhost_log_start();
+    VLOG_INFO("%s: index=%u num=%-5d|", name, 3, -12);
+    VLOG_INFO("0x%lx %zu %5.2f %c 100%% %p", 0xdeadbeefUL, (size_t)42, 3.14159,
+              'x', (void *)&id);
+    // '*' widths are formatted by the caller
+    VLOG_INFO("[%8s] [%.3s] [%*d]", "abc", "truncate", 4, 9);
+    pthread_create(&thread, NULL, log_thread, &id);
+    pthread_join(thread, NULL);
+    VLOG_DEBUG("hidden at the default level");
+    vhost_log_level = VHOST_LOG_DEBUG;
+    VLOG_DEBUG("shown");
+    vhost_log_level = VHOST_LOG_INFO;
+    vhost_log_stop();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    
+    rewind(tmp);
+    len = fread(out, 1, sizeof(out) - 1, tmp);
+    out[len] = '\0';
+    fclose(tmp);
+    // Only the lines of one thread keep their order
+    line = strstr(out, thread_line);
+    TEST_ASSERT(line != NULL, "Messages of other threads are written");
+    if (line) {
+        memmove(line, line + strlen(thread_line), strlen(line + strlen(thread_line)) + 1);
+    }
+    TEST_ASSERT(strcmp(out, expected) == 0, "Flusher formats queued messages like printf");
+    TEST_ASSERT(vhost_log_dropped() == 0, "No message dropped");
+    
+    return 1;
+}
+
+// RFC 1071 one 16-bit big-endian word at a time, for comparison.
+static uint16_t reference_csum(const uint8_t *buf, size_t len) {
+    uint32_t sum = 0;
+    
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += buf[i] << 8 | buf[i + 1];
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+// net_csum_fold() result as it would sit in a packet, read big-endian.
+static uint16_t stored_csum(uint32_t sum) {
+    uint16_t csum = net_csum_fold(sum);
+    const uint8_t *b = (const uint8_t *)&csum;
+    
+    return b[0] << 8 | b[1];
+}
+
+// Ethernet, IPv4 and TCP headers and payload_len bytes, with the TCP
+// checksum field holding the pseudo-header sum as a driver leaves it.
+static size_t build_tcp_frame(uint8_t *frame, size_t payload_len) {
+    uint8_t *ip = frame + 14, *tcp = ip + 20;
+    uint16_t ip_len = 40 + payload_len, csum;
+    
+    memset(frame, 0, 54);
+    frame[12] = 0x08;
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len & 0xff;
+    ip[4] = 0x12;
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, (const uint8_t[]){ 192, 168, 0, 1, 192, 168, 0, 2 }, 8);
+    csum = net_csum_fold(net_csum(ip, 20, 0));
+    memcpy(ip + 10, &csum, sizeof(csum));
+    tcp[4] = 0x10;                      // sequence number 0x10000000
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x19;                     // FIN, PSH, ACK
+    for (size_t i = 0; i < payload_len; i++) {
+        tcp[20 + i] = (uint8_t)(i * 7 + 3);
+    }
+    csum = ~net_csum_fold(net_pseudo_sum(ip, 0, 6, 20 + payload_len));
+    memcpy(tcp + NET_TCP_CSUM_OFF, &csum, sizeof(csum));
+    return 54 + payload_len;
+}
+
+static int test_checksum() {
+    static uint8_t buf[4096 + 64], frame[54 + 4000], seg[1600];
+    static const size_t lens[] = { 0, 1, 2, 3, 15, 31, 63, 64, 65, 127, 1500, 1514, 4095 };
+    NetCsumImpl saved = net_csum_selected();
+    int kernels_ok = 1, tested = 0, iov_ok = 1, segs_ok = 1;
+    struct iovec iov[4];
+    VirtioNetHdr vh = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = 54,
+        .gso_size = 1448,
+        .csum_start = 34,
+        .csum_offset = NET_TCP_CSUM_OFF,
+    };
+    NetGso g;
+    size_t len;
+    uint32_t off = 0;
+    
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 131 + (i >> 8));
+    }
+    for (NetCsumImpl impl = NET_CSUM_SCALAR; impl < NET_CSUM_IMPLS; impl++) {
+        if (net_csum_select(impl) < 0) {
+            continue;
+        }
+        tested++;
+        for (size_t a = 0; a < 8; a++) {
+            for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+                kernels_ok &= stored_csum(net_csum(buf + a, lens[l], 0)) ==
+                              reference_csum(buf + a, lens[l]);
+            }
+        }
+        // Sums of adjacent even-length ranges add up
+        kernels_ok &= net_csum_fold(net_csum_add(net_csum(buf, 1000, 0),
+                                                 net_csum(buf + 1000, 3001, 0))) ==
+                      net_csum_fold(net_csum(buf, 4001, 0));
+    }
+    net_csum_select(saved);
+    TEST_ASSERT(tested >= 1 && kernels_ok,
+                "Every supported checksum kernel matches RFC 1071 at any length and alignment");
+    
+    // Odd-sized pieces: later pieces start at odd offsets of the stream
+    iov[0] = (struct iovec){ buf, 7 };
+    iov[1] = (struct iovec){ buf + 7, 1 };
+    iov[2] = (struct iovec){ buf + 8, 1001 };
+    iov[3] = (struct iovec){ buf + 1009, 3000 };
+    for (size_t start = 0; start < 12; start++) {
+        iov_ok &= stored_csum(net_csum_iov(iov, 4, start, 4009 - start, 0)) ==
+                  reference_csum(buf + start, 4009 - start);
+    }
+    TEST_ASSERT(iov_ok, "Checksum over a scatter list matches the contiguous checksum");
+    
+    len = build_tcp_frame(frame, 1000);
+    iov[0] = (struct iovec){ frame, 41 };
+    iov[1] = (struct iovec){ frame + 41, len - 41 };
+    TEST_ASSERT(net_l4_csum_ok(frame, len) == 0 &&
+                net_csum_complete(iov, 2, 0, len, 34, NET_TCP_CSUM_OFF) == 0 &&
+                net_l4_csum_ok(frame, len) == 1,
+                "Partial TCP checksum is completed across buffers");
+    TEST_ASSERT(net_csum_complete(iov, 2, 0, 40, 34, NET_TCP_CSUM_OFF) < 0,
+                "Checksum field outside the frame is rejected");
+    
+    len = build_tcp_frame(frame, 4000);
+    iov[0] = (struct iovec){ frame, 20 };
+    iov[1] = (struct iovec){ frame + 20, len - 20 };
+    TEST_ASSERT(net_gso_init(&g, &vh, iov, 2, 0, len) == 0 && g.nsegs == 3 &&
+                g.hdr_len == 54 && g.payload_len == 4000,
+                "TSO send of 4000 bytes is cut into three segments");
+    for (uint32_t i = 0; i < g.nsegs; i++) {
+        uint32_t plen = net_gso_seg_len(&g, i), seq;
+        struct iovec sv = { seg, 54 + plen };
+        const uint8_t *ip = seg + 14, *tcp = ip + 20;
+        
+        net_gso_segment(&g, i, seg);
+        memcpy(seg + 54, frame + 54 + off, plen);
+        segs_ok &= net_csum_complete(&sv, 1, 0, 54 + plen, 34, NET_TCP_CSUM_OFF) == 0 &&
+                   net_l4_csum_ok(seg, 54 + plen) == 1 &&
+                   reference_csum(ip, 20) == 0;
+        seq = (uint32_t)tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7];
+        segs_ok &= (uint32_t)(ip[2] << 8 | ip[3]) == 40 + plen && seq == 0x10000000 + off &&
+                   (uint32_t)(ip[4] << 8 | ip[5]) == 0x1200 + i;
+        // FIN and PSH only on the last segment
+        segs_ok &= (tcp[13] & 0x09) == (i + 1 == g.nsegs ? 0x09 : 0);
+        off += plen;
+    }
+    TEST_ASSERT(segs_ok && off == 4000,
+                "Segments carry correct lengths, sequence numbers, flags and checksums");
+    vh.gso_type = VIRTIO_NET_HDR_GSO_UDP;
+    TEST_ASSERT(net_gso_init(&g, &vh, iov, 2, 0, len) < 0, "UDP fragmentation is not offered");
+    
+    return 1;
+}
+
+static int test_event_idx() {
+    TEST_ASSERT(vring_need_event(10, 11, 10) && vring_need_event(10, 20, 5) &&
+                !vring_need_event(10, 10, 5) && !vring_need_event(10, 20, 11),
+                "Event index triggers only when the index moves past it");
+    TEST_ASSERT(vring_need_event(65535, 3, 65530) && !vring_need_event(2, 65535, 65530) &&
+                vring_need_event(0, 1, 65535),
+                "Event index comparison survives 16-bit wraparound");
+    TEST_ASSERT(!vring_need_event(5, 9, 9), "No event without progress");
+    
+    return 1;
+}
+
+#define POOL_THREADS    4
+#define POOL_ROUNDS     20000
+
+typedef struct PoolThread {
+    VhostPool *pool;
+    uintptr_t id;
+    int ok;
+} PoolThread;
+
+// Take bursts, stamp them, and check that nobody else got them before
+// giving them back.
+static void *pool_thread(void *arg) {
+    PoolThread *pt = arg;
+    VhostPoolCache cache = { 0 };
+    void *bufs[48];
+
+    pt->ok = 1;
+    for (unsigned r = 0; r < POOL_ROUNDS; r++) {
+        unsigned n = 1 + r % 48;
+        unsigned got = vhost_pool_alloc_bulk(pt->pool, r % 7 ? &cache : NULL, bufs, n);
+
+        for (unsigned i = 0; i < got; i++) {
+            *(uintptr_t *)bufs[i] = pt->id << 32 | (r * 48 + i);
+        }
+        for (unsigned i = 0; i < got; i++) {
+            pt->ok &= *(uintptr_t *)bufs[i] == (pt->id << 32 | (r * 48 + i));
+        }
+        vhost_pool_free_bulk(pt->pool, r % 5 ? &cache : NULL, bufs, got);
+    }
+    vhost_pool_cache_flush(pt->pool, &cache);
+    return NULL;
+}
+
+static int test_pool() {
+    static void *bufs[1024];
+    VhostPoolCache cache = { 0 };
+    PoolThread threads[POOL_THREADS];
+    pthread_t tids[POOL_THREADS];
+    VhostPool pool;
+    unsigned got, total = 0;
+    int distinct = 1, threads_ok = 1;
+    
+    TEST_ASSERT(vhost_pool_init(&pool, 1000, 100, VHOST_POOL_F_HUGEPAGES) == 0 &&
+                pool.buf_size == 128 && vhost_pool_ring_count(&pool) == 1000,
+                "Pool starts with every buffer in the ring, sizes rounded to cache lines");
+    
+    got = vhost_pool_alloc_bulk(&pool, &cache, bufs, 10);
+    TEST_ASSERT(got == 10 && cache.len == VHOST_POOL_BULK &&
+                vhost_pool_ring_count(&pool) == 1000 - 10 - VHOST_POOL_BULK,
+                "Cache refills a bulk beyond what was asked");
+    for (unsigned i = 0; i < got; i++) {
+        uint8_t *b = bufs[i];
+        
+        distinct &= b >= pool.mem && b + pool.buf_size <= pool.mem + pool.mem_size &&
+                    (b - pool.mem) % pool.buf_size == 0;
+        for (unsigned j = 0; j < i; j++) {
+            distinct &= bufs[j] != bufs[i];
+        }
+    }
+    TEST_ASSERT(distinct, "Buffers are distinct and lie on buffer boundaries");
+    vhost_pool_free_bulk(&pool, &cache, bufs, got);
+    vhost_pool_cache_flush(&pool, &cache);
+    TEST_ASSERT(cache.len == 0 && vhost_pool_ring_count(&pool) == 1000,
+                "Flushing a cache returns its buffers to the ring");
+    
+    while ((got = vhost_pool_alloc_bulk(&pool, &cache, bufs + total, 100)) > 0) {
+        total += got;
+    }
+    TEST_ASSERT(total == 1000 && vhost_pool_alloc(&pool, &cache) == NULL,
+                "Pool hands out every buffer once and then runs dry");
+    vhost_pool_free_bulk(&pool, NULL, bufs, 500);
+    vhost_pool_free_bulk(&pool, &cache, bufs + 500, 500);
+    TEST_ASSERT(cache.len <= VHOST_POOL_CACHE_SIZE &&
+                cache.len + vhost_pool_ring_count(&pool) == 1000,
+                "Full cache spills to the ring");
+    vhost_pool_cache_flush(&pool, &cache);
+    
+    for (unsigned i = 0; i < POOL_THREADS; i++) {
+        threads[i] = (PoolThread){ .pool = &pool, .id = i + 1 };
+        pthread_create(&tids[i], NULL, pool_thread, &threads[i]);
+    }
+    for (unsigned i = 0; i < POOL_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+        threads_ok &= threads[i].ok;
+    }
+    TEST_ASSERT(threads_ok && vhost_pool_ring_count(&pool) == 1000,
+                "Threads share the ring without losing or doubling buffers");
+    vhost_pool_destroy(&pool);
+    
+    return 1;
+}
+
+// A restarted backend must not take a ring position or a burst from the
+// inflight area, which the frontend can write, that lies outside the ring.
+static int test_inflight_corrupt() {
+    static VringPackedDesc ring[8], zero[8];
+    static VqInflight inf;
+    Virtqueue vq = { .num = 8, .packed = 1 };
+    uint16_t wrap = 1 << VRING_PACKED_WRAP_SHIFT;
+    
+    vq.pdesc = ring;
+    vq_set_base(&vq, 3 | wrap);
+    inf = (VqInflight){ .version = VQ_INFLIGHT_VERSION, .num = 8, .used_base = 5 | wrap,
+                        .batch_base = 5 | wrap, .batch_len = 1 };
+    inf.batch[0] = (VqInflightUsed){ .id = 1, .ndescs = 0xffff };
+    TEST_ASSERT(vq_inflight_attach(&vq, &inf) == 0 && vq_get_base(&vq) == (3 | wrap) &&
+                memcmp(ring, zero, sizeof(ring)) == 0,
+                "Burst with an oversized descriptor count is not replayed");
+    TEST_ASSERT(inf.version == VQ_INFLIGHT_VERSION && inf.batch_len == 0 &&
+                inf.used_base == (3 | wrap), "Corrupt slot is claimed again from SET_VRING_BASE");
+    
+    inf.batch_len = 1;
+    inf.batch[0].ndescs = 0;
+    TEST_ASSERT(vq_inflight_attach(&vq, &inf) == 0 && vq_get_base(&vq) == (3 | wrap),
+                "Burst with a zero descriptor count is not replayed");
+    
+    inf.used_base = 8 | wrap;
+    TEST_ASSERT(vq_inflight_attach(&vq, &inf) == 0 && vq_get_base(&vq) == (3 | wrap),
+                "Used position beyond the ring is not resumed from");
+    
+    inf.used_base = 6;
+    TEST_ASSERT(vq_inflight_attach(&vq, &inf) == 1 && vq_get_base(&vq) == 6,
+                "Valid slot is resumed from");
+    
+    return 1;
+}
+
 static int test_invalid_socket() {
     const char *invalid_socket = "/nonexistent/path/socket";
     int status;
@@ -243,6 +648,33 @@ int main() {
     test_enum_values();
     printf("\n");
     
+    printf("Testing request dispatcher...\n");
+    test_dispatch();
+    printf("\n");
+    
+    printf("Testing latency histogram...\n");
+    test_histogram();
+    
+    printf("Testing asynchronous logger...\n");
+    test_logger();
+    printf("\n");
+    
+    printf("Testing event index suppression...\n");
+    test_event_idx();
+    printf("\n");
+    
+    printf("Testing inflight area validation...\n");
+    test_inflight_corrupt();
+    printf("\n");
+    
+    printf("Testing packet buffer pool...\n");
+    test_pool();
+    printf("\n");
+    
+    printf("Testing checksum and segmentation offloads...\n");
+    test_checksum();
+    printf("\n");
+    
     printf("Testing client with invalid socket...\n");
     TEST_ASSERT(test_invalid_socket(), "Client fails gracefully with invalid socket path");
     printf("\n");
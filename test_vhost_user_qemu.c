@@ -7,51 +7,21 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
-#define VHOST_USER_PROTOCOL_F_MQ            0
-#define VHOST_USER_PROTOCOL_F_LOG_SHMFD     1
-#define VHOST_USER_PROTOCOL_F_RARP          2
-#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
-
-typedef enum VhostUserRequest {
-    VHOST_USER_NONE = 0,
-    VHOST_USER_GET_FEATURES = 1,
-    VHOST_USER_SET_FEATURES = 2,
-    VHOST_USER_SET_OWNER = 3,
-    VHOST_USER_RESET_OWNER = 4,
-    VHOST_USER_SET_MEM_TABLE = 5,
-    VHOST_USER_SET_LOG_BASE = 6,
-    VHOST_USER_SET_LOG_FD = 7,
-    VHOST_USER_SET_VRING_NUM = 8,
-    VHOST_USER_SET_VRING_ADDR = 9,
-    VHOST_USER_SET_VRING_BASE = 10,
-    VHOST_USER_GET_VRING_BASE = 11,
-    VHOST_USER_SET_VRING_KICK = 12,
-    VHOST_USER_SET_VRING_CALL = 13,
-    VHOST_USER_SET_VRING_ERR = 14,
-    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
-    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
-    VHOST_USER_MAX
-} VhostUserRequest;
-
-typedef struct VhostUserMsg {
-    VhostUserRequest request;
-    uint32_t flags;
-    uint32_t size;
-    union {
-        uint64_t u64;
-        struct {
-            uint32_t index;
-            uint32_t num;
-        } state;
-    } payload;
-} __attribute__((packed)) VhostUserMsg;
+#include "vhost_user.h"
+
+// Every reply the backend sends is a header plus a u64.
+#define REPLY_LEN ((ssize_t)(sizeof(VhostUserHdr) + sizeof(uint64_t)))
 
 static int test_count = 0;
 static int test_passed = 0;
@@ -69,6 +39,14 @@ static int test_failed = 0;
 } while(0)
 
 #define QEMU_SOCKET_PATH "/tmp/vhost-user-test-sock"
+#define STATS_SOCKET_PATH "/tmp/vhost-user-test-stats"
+#define SWITCH_PORT0_PATH "/tmp/vhost-user-test-port0"
+#define SWITCH_PORT1_PATH "/tmp/vhost-user-test-port1"
+#define RESTART_SOCKET_PATH "/tmp/vhost-user-test-restart"
+#define POOL_SOCKET_PATH "/tmp/vhost-user-test-pool"
+#define POOL_LOG_PATH "/tmp/vhost-user-test-pool.log"
+#define HUGEPAGE_SOCKET_PATH "/tmp/vhost-user-test-hugepages"
+#define HUGEPAGE_LOG_PATH "/tmp/vhost-user-test-hugepages.log"
 #define QEMU_STARTUP_SCRIPT "./start_qemu_vhost_server.sh"
 #define SIMPLE_STARTUP_SCRIPT "./start_simple_server.sh"
 #define MAX_WAIT_TIME 30
@@ -184,13 +162,13 @@ static int test_vhost_user_protocol_with_qemu() {
     msg.flags = 1;
     msg.size = 0;
     
-    if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+    if (send(sock, &msg, vhost_user_msg_len(&msg), 0) != (ssize_t)vhost_user_msg_len(&msg)) {
         perror("send GET_FEATURES");
         close(sock);
         return 0;
     }
     
-    if (recv(sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+    if (recv(sock, &reply, REPLY_LEN, 0) != REPLY_LEN) {
         perror("recv GET_FEATURES reply");
         close(sock);
         return 0;
@@ -205,13 +183,13 @@ static int test_vhost_user_protocol_with_qemu() {
     msg.flags = 1;
     msg.size = 0;
     
-    if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+    if (send(sock, &msg, vhost_user_msg_len(&msg), 0) != (ssize_t)vhost_user_msg_len(&msg)) {
         perror("send GET_PROTOCOL_FEATURES");
         close(sock);
         return 0;
     }
     
-    if (recv(sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+    if (recv(sock, &reply, REPLY_LEN, 0) != REPLY_LEN) {
         perror("recv GET_PROTOCOL_FEATURES reply");
         close(sock);
         return 0;
@@ -246,6 +224,676 @@ static int test_client_with_qemu() {
     return 0;
 }
 
+static int test_client_mem_table() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for memory table test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // Share 16MB of memfd-backed guest memory split into 4 regions
+        execl("./vhost_user_client", "vhost_user_client",
+              "--mem-size", "16", "--mem-regions", "4", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_split_ring_datapath() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for datapath test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // The client checks that every packet comes back through the used
+        // ring and that GET_VRING_BASE matches the number sent
+        execl("./vhost_user_client", "vhost_user_client", "--mem-size", "16",
+              "--tx-packets", "100000", "--ring-size", "256", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_packed_ring_datapath() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for packed ring test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // A ring size that is not a power of two exercises the wrap counter
+        execl("./vhost_user_client", "vhost_user_client", "--mem-size", "16",
+              "--packed", "--tx-packets", "100000", "--ring-size", "250",
+              QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_traffic_generator() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for traffic test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        execl("./vhost_user_client", "vhost_user_client", "--traffic", "--imix",
+              "--duration", "1", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_paced_traffic() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for paced traffic test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // Paced frames carry timestamps; the client reports round-trip latency
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--rate", "20000", "--duration", "1", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_multiqueue_traffic() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for multi-queue test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // Negotiates MQ, checks GET_QUEUE_NUM and enables every vring
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--queues", "4", "--duration", "1", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_mergeable_rx_traffic() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for mergeable RX test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // Jumbo frames only come back if the backend spreads them over
+        // several 1536 byte RX buffers
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--mrg-rxbuf", "--pkt-size", "9014", "--duration", "1",
+              QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_offload_traffic() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for offload test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // 64KB TCP sends with partial checksums; the client fails if any
+        // segment comes back with a wrong checksum
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--tso", "--pkt-size", "65549", "--duration", "1",
+              QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_event_idx_traffic() {
+    static const char *const runs[][8] = {
+        { "--traffic", "--event-idx", "--duration", "1", NULL },
+        { "--traffic", "--event-idx", "--packed", "--duration", "1", NULL },
+        // Waits on the call eventfd whenever the ring is full
+        { "--mem-size", "64", "--tx-packets", "20000", "--event-idx", "--packed", NULL },
+    };
+    
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for event index test\n");
+        return 0;
+    }
+    
+    for (unsigned r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        const char *argv[10] = { "vhost_user_client" };
+        int status, argc = 1;
+        pid_t pid;
+        
+        for (unsigned i = 0; runs[r][i]; i++) {
+            argv[argc++] = runs[r][i];
+        }
+        argv[argc] = QEMU_SOCKET_PATH;
+        pid = fork();
+        if (pid == 0) {
+            execv("./vhost_user_client", (char *const *)argv);
+            exit(1);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || WEXITSTATUS(status) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int test_indirect_traffic() {
+    static const char *const runs[][10] = {
+        { "--traffic", "--segs", "4", "--duration", "1", NULL },
+        { "--traffic", "--segs", "4", "--indirect", "--duration", "1", NULL },
+        { "--traffic", "--segs", "8", "--indirect", "--packed", "--duration", "1", NULL },
+        // Multi-segment TSO sends through indirect tables
+        { "--traffic", "--segs", "8", "--indirect", "--tso", "--pkt-size", "65549",
+          "--duration", "1", NULL },
+    };
+    
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for indirect descriptor test\n");
+        return 0;
+    }
+    
+    for (unsigned r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        const char *argv[12] = { "vhost_user_client" };
+        int status, argc = 1;
+        pid_t pid;
+        
+        for (unsigned i = 0; runs[r][i]; i++) {
+            argv[argc++] = runs[r][i];
+        }
+        argv[argc] = QEMU_SOCKET_PATH;
+        pid = fork();
+        if (pid == 0) {
+            execv("./vhost_user_client", (char *const *)argv);
+            exit(1);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || WEXITSTATUS(status) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int test_dirty_log_traffic() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for dirty log test\n");
+        return 0;
+    }
+    
+    int status;
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        // The client fails unless the backend marked pages in the log
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--dirty-log", "--packed", "--duration", "1", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+        return WEXITSTATUS(status) == 0;
+    }
+    
+    return 0;
+}
+
+static int test_reply_ack() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for REPLY_ACK test\n");
+        return 0;
+    }
+    
+    int sock;
+    int ok = 1;
+    struct sockaddr_un addr;
+    VhostUserMsg msgs[4], reply;
+    uint8_t wire[sizeof(msgs)];
+    size_t len = 0;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 0;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, QEMU_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return 0;
+    }
+    
+    // Pipeline four requests in one write: enable REPLY_ACK, SET_OWNER
+    // without the need-reply flag, an invalid SET_VRING_NUM with it, and
+    // GET_FEATURES. Only the last two may be answered, in order.
+    memset(msgs, 0, sizeof(msgs));
+    msgs[0].request = VHOST_USER_SET_PROTOCOL_FEATURES;
+    msgs[0].flags = 1;
+    msgs[0].size = sizeof(msgs[0].payload.u64);
+    msgs[0].payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK;
+    msgs[1].request = VHOST_USER_SET_OWNER;
+    msgs[1].flags = 1;
+    msgs[2].request = VHOST_USER_SET_VRING_NUM;
+    msgs[2].flags = 1 | VHOST_USER_NEED_REPLY_MASK;
+    msgs[2].size = sizeof(msgs[2].payload.state);
+    msgs[2].payload.state.index = 200;
+    msgs[2].payload.state.num = 256;
+    msgs[3].request = VHOST_USER_GET_FEATURES;
+    msgs[3].flags = 1;
+    
+    for (int i = 0; i < 4; i++) {
+        memcpy(wire + len, &msgs[i], vhost_user_msg_len(&msgs[i]));
+        len += vhost_user_msg_len(&msgs[i]);
+    }
+    if (send(sock, wire, len, 0) != (ssize_t)len) {
+        perror("send");
+        close(sock);
+        return 0;
+    }
+    
+    if (recv(sock, &reply, REPLY_LEN, MSG_WAITALL) != REPLY_LEN ||
+        reply.request != VHOST_USER_SET_VRING_NUM || reply.payload.u64 == 0) {
+        printf("Expected a failed status for SET_VRING_NUM, got request %d status 0x%lx\n",
+               reply.request, reply.payload.u64);
+        ok = 0;
+    }
+    if (recv(sock, &reply, REPLY_LEN, MSG_WAITALL) != REPLY_LEN ||
+        reply.request != VHOST_USER_GET_FEATURES || reply.payload.u64 == 0) {
+        printf("Expected the GET_FEATURES reply, got request %d\n", reply.request);
+        ok = 0;
+    }
+    
+    close(sock);
+    return ok;
+}
+
+static int send_with_fd(int sock, const VhostUserMsg *msg, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = vhost_user_msg_len(msg) };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &mh, 0) == (ssize_t)vhost_user_msg_len(msg) ? 0 : -1;
+}
+
+static int test_pipelined_fds() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for fd passing test\n");
+        return 0;
+    }
+    
+    // vring 1 gets no fd, vrings 2 and 0 one each. A descriptor handed to
+    // the wrong message leaves a SET_VRING_CALL without its fd, which the
+    // server reports with a non-zero status.
+    static const unsigned index[3] = { 1, 2, 0 };
+    int sock, efd, ok = 1;
+    struct sockaddr_un addr;
+    VhostUserMsg msg, reply;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (sock < 0 || efd < 0) {
+        perror("socket/eventfd");
+        return 0;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, QEMU_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        close(efd);
+        return 0;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_PROTOCOL_FEATURES;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK;
+    ok = send_with_fd(sock, &msg, -1) == 0;
+    
+    // All three go out before any status is read.
+    for (int i = 0; i < 3 && ok; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.request = VHOST_USER_SET_VRING_CALL;
+        msg.flags = 1 | VHOST_USER_NEED_REPLY_MASK;
+        msg.size = sizeof(msg.payload.u64);
+        msg.payload.u64 = index[i] | (index[i] == 1 ? VHOST_USER_VRING_NOFD_MASK : 0);
+        ok = send_with_fd(sock, &msg, index[i] == 1 ? -1 : efd) == 0;
+    }
+    for (int i = 0; i < 3 && ok; i++) {
+        if (recv(sock, &reply, REPLY_LEN, MSG_WAITALL) != REPLY_LEN ||
+            reply.request != VHOST_USER_SET_VRING_CALL || reply.payload.u64 != 0) {
+            printf("SET_VRING_CALL for vring %u failed (status 0x%lx)\n",
+                   index[i], reply.payload.u64);
+            ok = 0;
+        }
+    }
+    
+    close(efd);
+    close(sock);
+    return ok;
+}
+
+// Send msg, which asks for an ack, and return its status, or -1 if no
+// ack came back.
+static long send_acked(int sock, VhostUserMsg *msg, int fd) {
+    VhostUserMsg reply;
+    
+    msg->flags = 1 | VHOST_USER_NEED_REPLY_MASK;
+    if (send_with_fd(sock, msg, fd) < 0 ||
+        recv(sock, &reply, REPLY_LEN, MSG_WAITALL) != REPLY_LEN ||
+        reply.request != msg->request) {
+        return -1;
+    }
+    return (long)reply.payload.u64;
+}
+
+static int test_resize_running_ring() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for ring resize test\n");
+        return 0;
+    }
+    
+    // Start TX vring 1 on a small split ring in a memfd, then ask for a
+    // bigger ring while it runs. The worker would index the new size into
+    // rings mapped for the old one, so the server must refuse; once
+    // GET_VRING_BASE has stopped the ring, the same request goes through.
+    const size_t mem_size = 64 * 1024;
+    int sock, memfd, efd, ok = 1;
+    struct sockaddr_un addr;
+    VhostUserMsg msg, reply;
+    uint8_t *mem;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memfd = memfd_create("resize-test", MFD_CLOEXEC);
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (sock < 0 || memfd < 0 || efd < 0 || ftruncate(memfd, mem_size) < 0) {
+        perror("socket/memfd/eventfd");
+        return 0;
+    }
+    mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, QEMU_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        ok = 0;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_PROTOCOL_FEATURES;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK;
+    ok = ok && send_acked(sock, &msg, -1) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_FEATURES;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    ok = ok && send_acked(sock, &msg, -1) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_MEM_TABLE;
+    msg.size = offsetof(VhostUserMemory, regions) + sizeof(VhostUserMemoryRegion);
+    msg.payload.memory.nregions = 1;
+    msg.payload.memory.regions[0].memory_size = mem_size;
+    msg.payload.memory.regions[0].userspace_addr = (uintptr_t)mem;
+    ok = ok && send_acked(sock, &msg, memfd) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_NUM;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = 1;
+    msg.payload.state.num = 256;
+    ok = ok && send_acked(sock, &msg, -1) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_ADDR;
+    msg.size = sizeof(msg.payload.addr);
+    msg.payload.addr.index = 1;
+    msg.payload.addr.desc_user_addr = (uintptr_t)mem;
+    msg.payload.addr.avail_user_addr = (uintptr_t)mem + 4096;
+    msg.payload.addr.used_user_addr = (uintptr_t)mem + 8192;
+    ok = ok && send_acked(sock, &msg, -1) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_BASE;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = 1;
+    ok = ok && send_acked(sock, &msg, -1) == 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_KICK;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = 1;
+    ok = ok && send_acked(sock, &msg, efd) == 0;
+    if (!ok) {
+        printf("Could not start vring 1\n");
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_NUM;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = 1;
+    msg.payload.state.num = 1024;
+    if (ok && send_acked(sock, &msg, -1) <= 0) {
+        printf("SET_VRING_NUM on a running vring was not refused\n");
+        ok = 0;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_GET_VRING_BASE;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = 1;
+    if (ok && (send_with_fd(sock, &msg, -1) < 0 ||
+               recv(sock, &reply, REPLY_LEN, MSG_WAITALL) != REPLY_LEN)) {
+        printf("GET_VRING_BASE failed\n");
+        ok = 0;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_NUM;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = 1;
+    msg.payload.state.num = 1024;
+    if (ok && send_acked(sock, &msg, -1) != 0) {
+        printf("SET_VRING_NUM on a stopped vring failed\n");
+        ok = 0;
+    }
+    
+    munmap(mem, mem_size);
+    close(memfd);
+    close(efd);
+    close(sock);
+    return ok;
+}
+
+static int test_pipelined_bringup() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for bring-up test\n");
+        return 0;
+    }
+    
+    const char *modes[] = { "--lockstep", NULL };
+    
+    // The same setup must work with every request acked in turn and with
+    // the whole sequence pipelined behind a handful of acks.
+    for (int i = 0; i < 2; i++) {
+        int status;
+        pid_t pid = fork();
+        
+        if (pid == 0) {
+            execl("./vhost_user_client", "vhost_user_client", "--mem-size", "4",
+                  "--queues", "2", "--traffic", "--duration", "1",
+                  QEMU_SOCKET_PATH, modes[i], NULL);
+            exit(1);
+        } else if (pid > 0) {
+            waitpid(pid, &status, 0);
+            if (WEXITSTATUS(status) != 0) {
+                return 0;
+            }
+        } else {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Read one snapshot from the simple server's stats socket.
+static ssize_t read_stats(char *buf, size_t cap) {
+    struct sockaddr_un addr;
+    size_t len = 0;
+    ssize_t n;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, STATS_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    while (len < cap - 1 && (n = recv(sock, buf + len, cap - 1 - len, 0)) > 0) {
+        len += n;
+    }
+    buf[len] = '\0';
+    close(sock);
+    return len;
+}
+
+static unsigned long stats_value(const char *stats, const char *after, const char *key) {
+    const char *p = strstr(stats, after);
+    
+    p = p ? strstr(p, key) : NULL;
+    return p ? strtoul(p + strlen(key), NULL, 10) : 0;
+}
+
+static int test_stats_socket() {
+    static char before[1 << 16], during[1 << 16];
+    int status, ok;
+    pid_t pid;
+    
+    if (read_stats(before, sizeof(before)) <= 0) {
+        printf("Stats socket not available (QEMU backend?)\n");
+        return 0;
+    }
+    
+    pid = fork();
+    if (pid == 0) {
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--duration", "2", QEMU_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (pid < 0) {
+        return 0;
+    }
+    
+    // Counters must move while traffic runs, without stopping it.
+    usleep(1000000);
+    ok = read_stats(during, sizeof(during)) > 0;
+    waitpid(pid, &status, 0);
+    if (!ok || WEXITSTATUS(status) != 0) {
+        return 0;
+    }
+    
+    printf("SET_MEM_TABLE: %lu before, %lu during; TX packets during: %lu\n",
+           stats_value(before, "\"SET_MEM_TABLE\"", "\"count\": "),
+           stats_value(during, "\"SET_MEM_TABLE\"", "\"count\": "),
+           stats_value(during, "\"queue\": \"tx\"", "\"packets\": "));
+    return stats_value(during, "\"SET_MEM_TABLE\"", "\"count\": ") >
+           stats_value(before, "\"SET_MEM_TABLE\"", "\"count\": ") &&
+           stats_value(during, "\"SET_MEM_TABLE\"", "\"p99\": ") > 0 &&
+           stats_value(during, "\"queue\": \"tx\"", "\"packets\": ") > 0;
+}
+
 static int test_multiple_connections() {
     if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
         printf("QEMU socket not available for multiple connection test\n");
@@ -276,7 +924,7 @@ static int test_multiple_connections() {
             msg.flags = 1;
             msg.size = 0;
             
-            send(sock, &msg, sizeof(msg), 0);
+            send(sock, &msg, vhost_user_msg_len(&msg), 0);
             close(sock);
         } else {
             printf("Connection %d failed\n", i + 1);
@@ -289,6 +937,324 @@ static int test_multiple_connections() {
     return successful_connections >= 2;
 }
 
+static int test_concurrent_sessions() {
+    if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
+        printf("Server socket not available for concurrent session test\n");
+        return 0;
+    }
+    
+    enum { NUM_SESSIONS = 256, SPLIT_AT = 5 };
+    int socks[NUM_SESSIONS];
+    int ok = 1, answered = 0;
+    struct sockaddr_un addr;
+    VhostUserMsg msg, reply;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, QEMU_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_GET_FEATURES;
+    msg.flags = 1;
+    msg.size = 0;
+    
+    // Keep every session open at once and send each request in two pieces,
+    // so the server has to interleave partially received frames.
+    for (int i = 0; i < NUM_SESSIONS; i++) {
+        socks[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socks[i] < 0 ||
+            connect(socks[i], (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            send(socks[i], &msg, SPLIT_AT, 0) != SPLIT_AT) {
+            printf("Session %d could not be opened\n", i);
+            ok = 0;
+        }
+    }
+    usleep(10000);
+    for (int i = 0; i < NUM_SESSIONS; i++) {
+        if (socks[i] >= 0 &&
+            send(socks[i], (char *)&msg + SPLIT_AT, vhost_user_msg_len(&msg) - SPLIT_AT, 0) !=
+            (ssize_t)(vhost_user_msg_len(&msg) - SPLIT_AT)) {
+            ok = 0;
+        }
+    }
+    for (int i = 0; i < NUM_SESSIONS; i++) {
+        if (socks[i] < 0) {
+            continue;
+        }
+        if (recv(socks[i], &reply, REPLY_LEN, MSG_WAITALL) == REPLY_LEN &&
+            reply.request == VHOST_USER_GET_FEATURES && reply.payload.u64 != 0) {
+            answered++;
+        }
+        close(socks[i]);
+    }
+    
+    printf("%d of %d concurrent sessions answered\n", answered, NUM_SESSIONS);
+    return ok && answered == NUM_SESSIONS;
+}
+
+static pid_t spawn_switch_client(const char *socket_path, const char *src_mac,
+                                 const char *dst_mac) {
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        execl("./vhost_user_client", "vhost_user_client", "--traffic",
+              "--duration", "1", "--src-mac", src_mac, "--dst-mac", dst_mac,
+              socket_path, NULL);
+        exit(1);
+    }
+    return pid;
+}
+
+// Runs a server of its own with two ports. The client exits non-zero if no
+// frame came back to it, which a switch only does with a peer on the
+// other port.
+static int test_switch_mode() {
+    int status0 = -1, status1 = -1, status_alone = -1;
+    pid_t server, client0, client1;
+    
+    unlink(SWITCH_PORT0_PATH);
+    unlink(SWITCH_PORT1_PATH);
+    server = fork();
+    if (server == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        
+        dup2(fd, STDOUT_FILENO);
+        execl("./simple_vhost_server", "simple_vhost_server",
+              SWITCH_PORT0_PATH, SWITCH_PORT1_PATH, NULL);
+        exit(1);
+    } else if (server < 0) {
+        return 0;
+    }
+    if (!wait_for_socket(SWITCH_PORT0_PATH, 5) || !wait_for_socket(SWITCH_PORT1_PATH, 5)) {
+        printf("Switch sockets did not appear\n");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return 0;
+    }
+    
+    client0 = spawn_switch_client(SWITCH_PORT0_PATH, "02:00:00:00:00:01", "02:00:00:00:00:02");
+    client1 = spawn_switch_client(SWITCH_PORT1_PATH, "02:00:00:00:00:02", "02:00:00:00:00:01");
+    if (client0 > 0) {
+        waitpid(client0, &status0, 0);
+    }
+    if (client1 > 0) {
+        waitpid(client1, &status1, 0);
+    }
+    
+    // Alone on the switch: nothing is looped back.
+    client0 = spawn_switch_client(SWITCH_PORT0_PATH, "02:00:00:00:00:01", "02:00:00:00:00:02");
+    if (client0 > 0) {
+        waitpid(client0, &status_alone, 0);
+    }
+    
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    printf("Port 0 client exit %d, port 1 client exit %d, lone client exit %d\n",
+           WEXITSTATUS(status0), WEXITSTATUS(status1), WEXITSTATUS(status_alone));
+    return WIFEXITED(status0) && WEXITSTATUS(status0) == 0 &&
+           WIFEXITED(status1) && WEXITSTATUS(status1) == 0 &&
+           WIFEXITED(status_alone) && WEXITSTATUS(status_alone) != 0;
+}
+
+static pid_t spawn_restart_server(void) {
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        
+        dup2(fd, STDOUT_FILENO);
+        execl("./simple_vhost_server", "simple_vhost_server", RESTART_SOCKET_PATH, NULL);
+        exit(1);
+    }
+    return pid;
+}
+
+// Runs a server of its own and kills it in the middle of the traffic. The
+// client exits non-zero unless it reconnects to the restarted server and
+// frames complete again.
+static int test_backend_restart() {
+    static const char *const runs[][8] = {
+        { "--traffic", "--reconnect", "--duration", "3", NULL },
+        { "--traffic", "--reconnect", "--packed", "--duration", "3", NULL },
+    };
+    
+    for (unsigned r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        const char *argv[10] = { "vhost_user_client" };
+        int status = -1, argc = 1;
+        pid_t server, client;
+        
+        unlink(RESTART_SOCKET_PATH);
+        server = spawn_restart_server();
+        if (server < 0 || !wait_for_socket(RESTART_SOCKET_PATH, 5)) {
+            printf("Restart test socket did not appear\n");
+            if (server > 0) {
+                kill(server, SIGTERM);
+                waitpid(server, NULL, 0);
+            }
+            return 0;
+        }
+        for (unsigned i = 0; runs[r][i]; i++) {
+            argv[argc++] = runs[r][i];
+        }
+        argv[argc] = RESTART_SOCKET_PATH;
+        client = fork();
+        if (client == 0) {
+            execv("./vhost_user_client", (char *const *)argv);
+            exit(1);
+        }
+        
+        sleep(1);
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+        server = spawn_restart_server();
+        if (client > 0) {
+            waitpid(client, &status, 0);
+        }
+        if (server > 0) {
+            kill(server, SIGTERM);
+            waitpid(server, NULL, 0);
+        }
+        printf("Client exit %d across a backend restart (%s)\n", WEXITSTATUS(status),
+               r == 0 ? "split" : "packed");
+        if (client < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Runs a server of its own that stages frames in a buffer pool while the
+// client's RX ring is empty, and checks from its log that the workers gave
+// every buffer back through their caches before it exited.
+static int test_rx_staging_pool() {
+    static const char *const runs[][8] = {
+        { "--traffic", "--duration", "1", NULL },
+        { "--traffic", "--packed", "--mrg-rxbuf", "--pkt-size", "1500", "--duration", "1", NULL },
+    };
+    char log[8192];
+    const char *line;
+    unsigned long staged = 0;
+    int ok = 1, fd;
+    ssize_t len;
+    pid_t server;
+    
+    unlink(POOL_SOCKET_PATH);
+    server = fork();
+    if (server == 0) {
+        fd = open(POOL_LOG_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, STDOUT_FILENO);
+        execl("./simple_vhost_server", "simple_vhost_server", "--pool-bufs", "1024",
+              POOL_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (server < 0) {
+        return 0;
+    }
+    if (!wait_for_socket(POOL_SOCKET_PATH, 5)) {
+        printf("Pool test socket did not appear\n");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return 0;
+    }
+    for (unsigned r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        const char *argv[10] = { "vhost_user_client" };
+        int status = -1, argc = 1;
+        pid_t client;
+        
+        for (unsigned i = 0; runs[r][i]; i++) {
+            argv[argc++] = runs[r][i];
+        }
+        argv[argc] = POOL_SOCKET_PATH;
+        client = fork();
+        if (client == 0) {
+            fd = open("/dev/null", O_WRONLY);
+            dup2(fd, STDOUT_FILENO);
+            execv("./vhost_user_client", (char *const *)argv);
+            exit(1);
+        }
+        if (client > 0) {
+            waitpid(client, &status, 0);
+        }
+        ok &= client > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    
+    fd = open(POOL_LOG_PATH, O_RDONLY);
+    len = fd >= 0 ? read(fd, log, sizeof(log) - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(POOL_LOG_PATH);
+    if (len <= 0) {
+        return 0;
+    }
+    log[len] = '\0';
+    for (line = strstr(log, "wakeups, "); line; line = strstr(line + 1, "wakeups, ")) {
+        staged += strtoul(line + strlen("wakeups, "), NULL, 10);
+    }
+    printf("%lu frames staged\n", staged);
+    return ok && strstr(log, "RX staging pool: 1024 buffers") && strstr(log, " staged\n") &&
+           !strstr(log, "not returned");
+}
+
+// Runs a server of its own that prefaults guest memory, and a client that
+// asks for huge pages. Without huge pages on this system the client falls
+// back to 4KB pages; either way traffic has to flow.
+static int test_hugepage_memory() {
+    char out[8192];
+    const char *line;
+    int status = -1, fd;
+    ssize_t len;
+    pid_t server, client;
+    
+    unlink(HUGEPAGE_SOCKET_PATH);
+    server = fork();
+    if (server == 0) {
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        execl("./simple_vhost_server", "simple_vhost_server", "--populate",
+              HUGEPAGE_SOCKET_PATH, NULL);
+        exit(1);
+    } else if (server < 0) {
+        return 0;
+    }
+    if (!wait_for_socket(HUGEPAGE_SOCKET_PATH, 5)) {
+        printf("Huge page test socket did not appear\n");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return 0;
+    }
+    client = fork();
+    if (client == 0) {
+        fd = open(HUGEPAGE_LOG_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, STDOUT_FILENO);
+        execl("./vhost_user_client", "vhost_user_client", "--hugepages", "--mem-regions", "2",
+              "--traffic", "--duration", "1", HUGEPAGE_SOCKET_PATH, NULL);
+        exit(1);
+    }
+    if (client > 0) {
+        waitpid(client, &status, 0);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    
+    fd = open(HUGEPAGE_LOG_PATH, O_RDONLY);
+    len = fd >= 0 ? read(fd, out, sizeof(out) - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(HUGEPAGE_LOG_PATH);
+    if (len <= 0) {
+        return 0;
+    }
+    out[len] = '\0';
+    line = strstr(out, "Guest memory: ");
+    if (line) {
+        printf("%.*s\n", (int)strcspn(line, "\n"), line);
+    }
+    return client > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 && line != NULL;
+}
+
 static int test_socket_permissions() {
     if (!wait_for_socket(QEMU_SOCKET_PATH, MAX_WAIT_TIME)) {
         return 0;
@@ -337,10 +1303,94 @@ int main() {
     TEST_ASSERT(test_client_with_qemu(), "vhost_user_client successfully communicates with QEMU");
     printf("\n");
     
+    printf("Testing SET_MEM_TABLE with memfd regions...\n");
+    TEST_ASSERT(test_client_mem_table(), "Server maps memfd regions passed with SET_MEM_TABLE");
+    printf("\n");
+    
+    printf("Testing split virtqueue datapath...\n");
+    TEST_ASSERT(test_split_ring_datapath(), "Backend consumes TX packets and publishes used entries");
+    printf("\n");
+    
+    printf("Testing packed virtqueue datapath...\n");
+    TEST_ASSERT(test_packed_ring_datapath(), "Backend negotiates VIRTIO_F_RING_PACKED and runs a packed ring");
+    printf("\n");
+    
+    printf("Testing frontend traffic generator...\n");
+    TEST_ASSERT(test_traffic_generator(), "Traffic generator drives TX and RX vrings through the backend");
+    printf("\n");
+    
+    printf("Testing paced traffic...\n");
+    TEST_ASSERT(test_paced_traffic(), "Traffic generator paces frames and measures latency");
+    printf("\n");
+    
+    printf("Testing multi-queue traffic...\n");
+    TEST_ASSERT(test_multiqueue_traffic(), "Traffic runs on four queue pairs with per-pair workers");
+    printf("\n");
+    
+    printf("Testing mergeable RX buffers...\n");
+    TEST_ASSERT(test_mergeable_rx_traffic(), "Backend spreads jumbo frames over mergeable RX buffers");
+    printf("\n");
+    
+    printf("Testing checksum and TSO offload...\n");
+    TEST_ASSERT(test_offload_traffic(), "Backend segments TSO sends and completes their checksums");
+    printf("\n");
+    
+    printf("Testing event index notification suppression...\n");
+    TEST_ASSERT(test_event_idx_traffic(), "Both sides honour used_event and avail_event");
+    printf("\n");
+    
+    printf("Testing indirect descriptors...\n");
+    TEST_ASSERT(test_indirect_traffic(), "Backend walks multi-segment chains and indirect tables");
+    printf("\n");
+    
+    printf("Testing dirty page logging...\n");
+    TEST_ASSERT(test_dirty_log_traffic(), "Backend marks written pages in the shared dirty log");
+    printf("\n");
+    
+    printf("Testing REPLY_ACK semantics...\n");
+    TEST_ASSERT(test_reply_ack(), "Server acks only requests that ask for it, in order");
+    printf("\n");
+    
+    printf("Testing descriptors on back-to-back messages...\n");
+    TEST_ASSERT(test_pipelined_fds(), "Server hands each pipelined message its own descriptors");
+    printf("\n");
+    
+    printf("Testing SET_VRING_NUM on a running vring...\n");
+    TEST_ASSERT(test_resize_running_ring(), "Server refuses to resize a running vring and resizes it once stopped");
+    printf("\n");
+    
+    printf("Testing pipelined device bring-up...\n");
+    TEST_ASSERT(test_pipelined_bringup(), "Client brings up the device pipelined and in lockstep");
+    printf("\n");
+    
+    printf("Testing the stats socket...\n");
+    TEST_ASSERT(test_stats_socket(), "Server reports request latency and vring counters during traffic");
+    printf("\n");
+    
     printf("Testing multiple connections...\n");
     TEST_ASSERT(test_multiple_connections(), "Multiple connections to QEMU work correctly");
     printf("\n");
     
+    printf("Testing concurrent sessions...\n");
+    TEST_ASSERT(test_concurrent_sessions(), "Server multiplexes concurrent sessions with partial frames");
+    printf("\n");
+    
+    printf("Testing switch mode...\n");
+    TEST_ASSERT(test_switch_mode(), "Server switches frames between two ports by learned MAC");
+    printf("\n");
+    
+    printf("Testing backend restart with an inflight area...\n");
+    TEST_ASSERT(test_backend_restart(), "Client resumes traffic on a restarted backend via INFLIGHT_SHMFD");
+    printf("\n");
+    
+    printf("Testing RX staging in the buffer pool...\n");
+    TEST_ASSERT(test_rx_staging_pool(), "Server stages frames for empty RX rings in pool buffers");
+    printf("\n");
+    
+    printf("Testing huge page guest memory...\n");
+    TEST_ASSERT(test_hugepage_memory(), "Client backs guest memory with huge pages or 4KB pages, server prefaults it");
+    printf("\n");
+    
     // Cleanup
     printf("Cleaning up QEMU server...\n");
     stop_qemu_server();
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "vhost_log.h"
+
+// How long the flusher sleeps once every ring is empty
+#define FLUSH_INTERVAL_NS       2000000
+#define FLUSH_BUF_SIZE          65536
+#define REC_ALIGN               16
+#define SPEC_MAX                32
+
+// A record in a ring: this header, then the message's arguments packed by
+// log_pack() or, for formats log_pack() cannot handle, the formatted text.
+// A padding record fills the end of the ring when the next record does not
+// fit there.
+typedef struct LogRec {
+    uint32_t len;               // whole record, a multiple of REC_ALIGN
+    uint8_t level;
+    uint8_t kind;
+    uint16_t data_len;
+    const char *fmt;
+} LogRec;
+
+enum {
+    REC_ARGS,
+    REC_TEXT,
+    REC_PAD,
+};
+
+// Single-producer, single-consumer ring of records: the thread holding
+// in_use advances head, the flusher advances tail. A thread that exits
+// hands its ring, and whatever is still queued in it, to the next thread
+// that starts logging.
+typedef struct LogRing {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    int in_use;
+    struct LogRing *next;
+    uint8_t data[VHOST_LOG_RING_SIZE] __attribute__((aligned(REC_ALIGN)));
+} LogRing;
+
+typedef struct LogBuf {
+    int fd;
+    size_t len;
+    char data[FLUSH_BUF_SIZE];
+} LogBuf;
+
+// One conversion of a format string
+typedef enum LogLength {
+    LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T,
+} LogLength;
+
+typedef struct LogSpec {
+    size_t len;                 // from '%' to the conversion character
+    LogLength length;
+    char conv;
+} LogSpec;
+
+int vhost_log_level = VHOST_LOG_INFO;
+
+static LogRing *rings;
+static __thread LogRing *thread_ring;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static pthread_t flusher;
+static int flusher_running;
+static int flusher_stop;
+static uint64_t dropped_reported;
+static LogBuf out_buf = { .fd = STDOUT_FILENO };
+static LogBuf err_buf = { .fd = STDERR_FILENO };
+
+static void ring_release(void *opaque) {
+    LogRing *r = opaque;
+
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static LogRing *ring_get(void) {
+    LogRing *r;
+
+    if (thread_ring) {
+        return thread_ring;
+    }
+    pthread_once(&ring_key_once, ring_key_create);
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!r) {
+        r = aligned_alloc(64, sizeof(*r));
+        if (!r) {
+            return NULL;
+        }
+        memset(r, 0, offsetof(LogRing, data));
+        r->in_use = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(ring_key, r);
+    thread_ring = r;
+    return r;
+}
+
+// Parse the conversion whose '%' is at p. Returns the character after it,
+// or NULL for what cannot be deferred: '*' widths, long double, wide
+// characters, %n and anything unknown.
+static const char *spec_parse(const char *p, LogSpec *spec) {
+    const char *start = p++;
+
+    p += strspn(p, "-+ #0'");
+    p += strspn(p, "0123456789");
+    if (*p == '.') {
+        p++;
+        p += strspn(p, "0123456789");
+    }
+    spec->length = LEN_NONE;
+    switch (*p) {
+        case 'h':
+            spec->length = p[1] == 'h' ? LEN_HH : LEN_H;
+            p += spec->length == LEN_HH ? 2 : 1;
+            break;
+        case 'l':
+            spec->length = p[1] == 'l' ? LEN_LL : LEN_L;
+            p += spec->length == LEN_LL ? 2 : 1;
+            break;
+        case 'z':
+            spec->length = LEN_Z;
+            p++;
+            break;
+        case 'j':
+            spec->length = LEN_J;
+            p++;
+            break;
+        case 't':
+            spec->length = LEN_T;
+            p++;
+            break;
+    }
+    spec->conv = *p;
+    if (!*p || !strchr("diouxXcspfFeEgGaA%", *p) ||
+        (spec->length == LEN_L && (*p == 'c' || *p == 's'))) {
+        return NULL;
+    }
+    spec->len = p + 1 - start;
+    return spec->len < SPEC_MAX ? p + 1 : NULL;
+}
+
+static int spec_is_int(char conv) {
+    return strchr("diouxXc", conv) != NULL;
+}
+
+static int spec_is_double(char conv) {
+    return strchr("fFeEgGaA", conv) != NULL;
+}
+
+// How log_pack() fetches each argument
+enum {
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR,
+};
+
+enum {
+    SITE_NEW,
+    SITE_PARSING,
+    SITE_PACK,                  // arguments are copied, the flusher formats
+    SITE_FORMAT,                // formatted by the thread that logs
+};
+
+static int site_parse(VhostLogSite *site, const char *fmt) {
+    static const uint8_t int_args[] = {
+        [LEN_NONE] = ARG_INT, [LEN_HH] = ARG_INT, [LEN_H] = ARG_INT,
+        [LEN_L] = ARG_LONG, [LEN_LL] = ARG_LLONG, [LEN_Z] = ARG_SIZE,
+        [LEN_J] = ARG_INTMAX, [LEN_T] = ARG_PTRDIFF,
+    };
+    LogSpec spec;
+
+    site->nargs = 0;
+    for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        p = spec_parse(p, &spec);
+        if (!p || site->nargs == VHOST_LOG_MAX_ARGS) {
+            return SITE_FORMAT;
+        }
+        if (spec.conv == '%') {
+            continue;
+        }
+        site->args[site->nargs++] = spec_is_int(spec.conv) ? int_args[spec.length] :
+                                    spec_is_double(spec.conv) ? ARG_DOUBLE :
+                                    spec.conv == 'p' ? ARG_PTR : ARG_STR;
+    }
+    return SITE_PACK;
+}
+
+// Copy the arguments into buf: 8 bytes per number or pointer, and for
+// strings a 4-byte length and the characters, padded to 8 bytes. Strings
+// are truncated to what fits. Returns the bytes used.
+static size_t log_pack(uint8_t *buf, size_t cap, const VhostLogSite *site,
+                       va_list ap) {
+    size_t off = 0;
+
+    for (unsigned i = 0; i < site->nargs; i++) {
+        union { int64_t i; double d; void *p; } v = { 0 };
+        const char *s;
+        uint32_t n;
+
+        switch (site->args[i]) {
+            case ARG_INT:     v.i = va_arg(ap, int); break;
+            case ARG_LONG:    v.i = va_arg(ap, long); break;
+            case ARG_LLONG:   v.i = va_arg(ap, long long); break;
+            case ARG_SIZE:    v.i = va_arg(ap, size_t); break;
+            case ARG_INTMAX:  v.i = va_arg(ap, intmax_t); break;
+            case ARG_PTRDIFF: v.i = va_arg(ap, ptrdiff_t); break;
+            case ARG_DOUBLE:  v.d = va_arg(ap, double); break;
+            case ARG_PTR:     v.p = va_arg(ap, void *); break;
+            case ARG_STR:
+                // VHOST_LOG_MAX_ARGS numbers fit, so there is room for
+                // the length of every string
+                s = va_arg(ap, const char *);
+                if (!s) {
+                    s = "(null)";
+                }
+                n = strnlen(s, cap - off - 4 - 8 * (site->nargs - i - 1));
+                memcpy(buf + off, &n, 4);
+                memcpy(buf + off + 4, s, n);
+                off += (4 + n + 7) & ~7U;
+                continue;
+        }
+        memcpy(buf + off, &v, 8);
+        off += 8;
+    }
+    return off;
+}
+
+// Format a REC_ARGS record into line, the flusher's side of log_pack().
+static size_t log_unpack(char *line, size_t cap, const char *fmt,
+                         const uint8_t *data) {
+    size_t len = 0, off = 0;
+    const char *p = fmt;
+    LogSpec spec;
+
+    while (*p && len < cap - 1) {
+        const char *pct = strchr(p, '%');
+        size_t lit = pct ? (size_t)(pct - p) : strlen(p);
+        char sp[SPEC_MAX];
+        int n;
+
+        if (lit > cap - 1 - len) {
+            lit = cap - 1 - len;
+        }
+        memcpy(line + len, p, lit);
+        len += lit;
+        if (!pct) {
+            break;
+        }
+        p = spec_parse(pct, &spec);
+        if (spec.conv == '%') {
+            line[len++] = '%';
+            continue;
+        }
+        memcpy(sp, pct, spec.len);
+        sp[spec.len] = '\0';
+        if (spec_is_int(spec.conv)) {
+            int64_t v;
+
+            memcpy(&v, data + off, 8);
+            switch (spec.length) {
+                case LEN_L:  n = snprintf(line + len, cap - len, sp, (long)v); break;
+                case LEN_LL: n = snprintf(line + len, cap - len, sp, (long long)v); break;
+                case LEN_Z:  n = snprintf(line + len, cap - len, sp, (size_t)v); break;
+                case LEN_J:  n = snprintf(line + len, cap - len, sp, (intmax_t)v); break;
+                case LEN_T:  n = snprintf(line + len, cap - len, sp, (ptrdiff_t)v); break;
+                default:     n = snprintf(line + len, cap - len, sp, (int)v); break;
+            }
+            off += 8;
+        } else if (spec_is_double(spec.conv)) {
+            double v;
+
+            memcpy(&v, data + off, 8);
+            n = snprintf(line + len, cap - len, sp, v);
+            off += 8;
+        } else if (spec.conv == 'p') {
+            void *v;
+
+            memcpy(&v, data + off, sizeof(v));
+            n = snprintf(line + len, cap - len, sp, v);
+            off += 8;
+        } else {
+            char s[VHOST_LOG_LINE_MAX];
+            uint32_t slen;
+
+            memcpy(&slen, data + off, 4);
+            memcpy(s, data + off + 4, slen);
+            s[slen] = '\0';
+            n = snprintf(line + len, cap - len, sp, s);
+            off += (4 + slen + 7) & ~7U;
+        }
+        if (n > 0) {
+            len += (size_t)n < cap - len ? (size_t)n : cap - 1 - len;
+        }
+    }
+    return len;
+}
+
+static void log_sync(VhostLogLevel level, const char *fmt, va_list ap) {
+    FILE *f = level <= VHOST_LOG_WARN ? stderr : stdout;
+
+    flockfile(f);
+    vfprintf(f, fmt, ap);
+    putc_unlocked('\n', f);
+    funlockfile(f);
+}
+
+static void log_queue(VhostLogSite *site, VhostLogLevel level,
+                      const char *fmt, va_list ap) {
+    uint8_t data[VHOST_LOG_LINE_MAX] __attribute__((aligned(8)));
+    LogRing *r = NULL;
+    uint64_t head, pos, pad = 0;
+    LogRec rec;
+    int n;
+
+    if (__atomic_load_n(&flusher_running, __ATOMIC_ACQUIRE)) {
+        r = ring_get();
+    }
+    if (!r) {
+        log_sync(level, fmt, ap);
+        return;
+    }
+
+    if (site->state == SITE_PACK) {
+        n = log_pack(data, sizeof(data), site, ap);
+        rec.kind = REC_ARGS;
+    } else {
+        n = vsnprintf((char *)data, sizeof(data), fmt, ap);
+        n = n < 0 ? 0 : (size_t)n < sizeof(data) ? n : (int)sizeof(data) - 1;
+        rec.kind = REC_TEXT;
+    }
+    rec.level = level;
+    rec.data_len = n;
+    rec.fmt = fmt;
+    rec.len = (sizeof(rec) + n + REC_ALIGN - 1) & ~(REC_ALIGN - 1);
+
+    head = r->head;
+    pos = head % VHOST_LOG_RING_SIZE;
+    if (VHOST_LOG_RING_SIZE - pos < rec.len) {
+        pad = VHOST_LOG_RING_SIZE - pos;
+    }
+    if (head + pad + rec.len - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >
+        VHOST_LOG_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (pad) {
+        LogRec fill = { .len = pad, .kind = REC_PAD };
+
+        memcpy(r->data + pos, &fill, sizeof(fill));
+        pos = 0;
+    }
+    memcpy(r->data + pos, &rec, sizeof(rec));
+    memcpy(r->data + pos + sizeof(rec), data, n);
+    __atomic_store_n(&r->head, head + pad + rec.len, __ATOMIC_RELEASE);
+}
+
+void vhost_log_at(VhostLogSite *site, VhostLogLevel level, const char *fmt, ...) {
+    VhostLogSite local;
+    int state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+    va_list ap;
+
+    // One thread fills in the site; others parse for themselves meanwhile
+    if (state == SITE_NEW &&
+        __atomic_compare_exchange_n(&site->state, &state, SITE_PARSING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&site->state, site_parse(site, fmt), __ATOMIC_RELEASE);
+    } else if (state == SITE_NEW || state == SITE_PARSING) {
+        local.state = site_parse(&local, fmt);
+        site = &local;
+    }
+    va_start(ap, fmt);
+    log_queue(site, level, fmt, ap);
+    va_end(ap);
+}
+
+void vhost_log(VhostLogLevel level, const char *fmt, ...) {
+    VhostLogSite site;
+    va_list ap;
+
+    site.state = site_parse(&site, fmt);
+    va_start(ap, fmt);
+    log_queue(&site, level, fmt, ap);
+    va_end(ap);
+}
+
+static void buf_flush(LogBuf *b) {
+    size_t off = 0;
+
+    while (off < b->len) {
+        ssize_t n = write(b->fd, b->data + off, b->len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;              // nowhere left to report it
+        }
+        off += n;
+    }
+    b->len = 0;
+}
+
+static void buf_append(LogBuf *b, const char *text, size_t len) {
+    if (b->len + len + 1 > sizeof(b->data)) {
+        buf_flush(b);
+    }
+    memcpy(b->data + b->len, text, len);
+    b->len += len;
+    b->data[b->len++] = '\n';
+}
+
+uint64_t vhost_log_dropped(void) {
+    uint64_t dropped = 0;
+
+    for (LogRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+// Format and write out everything queued so far. Returns the number of
+// messages written.
+static uint64_t drain(void) {
+    char line[VHOST_LOG_LINE_MAX];
+    uint64_t written = 0;
+    uint64_t dropped;
+
+    for (LogRing *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = r->tail;
+
+        while (tail != head) {
+            const uint8_t *p = r->data + tail % VHOST_LOG_RING_SIZE;
+            LogRec rec;
+
+            memcpy(&rec, p, sizeof(rec));
+            if (rec.kind != REC_PAD) {
+                LogBuf *b = rec.level <= VHOST_LOG_WARN ? &err_buf : &out_buf;
+
+                if (rec.kind == REC_TEXT) {
+                    buf_append(b, (const char *)p + sizeof(rec), rec.data_len);
+                } else {
+                    buf_append(b, line, log_unpack(line, sizeof(line), rec.fmt,
+                                                   p + sizeof(rec)));
+                }
+                written++;
+            }
+            tail += rec.len;
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    dropped = vhost_log_dropped();
+    if (dropped != dropped_reported) {
+        int len = snprintf(line, sizeof(line), "log: %lu messages dropped",
+                           dropped - dropped_reported);
+
+        buf_append(&err_buf, line, len);
+        dropped_reported = dropped;
+    }
+    buf_flush(&out_buf);
+    buf_flush(&err_buf);
+    return written;
+}
+
+static void *flusher_main(void *arg) {
+    struct timespec idle = { 0, FLUSH_INTERVAL_NS };
+
+    (void)arg;
+    while (!__atomic_load_n(&flusher_stop, __ATOMIC_ACQUIRE)) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int vhost_log_start(void) {
+    if (flusher_running) {
+        return 0;
+    }
+    // Whatever stdio still buffers was logged before anything queued now
+    fflush(NULL);
+    flusher_stop = 0;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        fprintf(stderr, "Cannot start log flusher, logging synchronously\n");
+        return -1;
+    }
+    __atomic_store_n(&flusher_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void vhost_log_stop(void) {
+    if (!flusher_running) {
+        return;
+    }
+    __atomic_store_n(&flusher_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&flusher_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    drain();
+}
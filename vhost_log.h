@@ -0,0 +1,83 @@
+#ifndef VHOST_LOG_H
+#define VHOST_LOG_H
+
+#include <stdint.h>
+
+// Leveled logging that stays off the hot path. Each thread copies the
+// format string pointer and the arguments of its messages into a ring of
+// its own; a background flusher formats and writes them out. Logging takes
+// no lock and makes no system call, and formatting leaves the thread that
+// logs. The format must therefore outlive the flusher, which every string
+// literal does; %s arguments are copied. Errors and warnings go
+// to stderr, everything else to stdout. Messages of one thread keep their
+// order; lines of different threads may interleave differently than they
+// were logged. Until vhost_log_start() is called, and after
+// vhost_log_stop(), messages are written synchronously with stdio.
+
+typedef enum VhostLogLevel {
+    VHOST_LOG_ERR = 0,
+    VHOST_LOG_WARN,
+    VHOST_LOG_INFO,
+    VHOST_LOG_DEBUG,
+} VhostLogLevel;
+
+// Most verbose level compiled in; calls above it are removed by the
+// compiler, e.g. -DVHOST_LOG_LEVEL=VHOST_LOG_INFO drops every VLOG_DEBUG.
+#ifndef VHOST_LOG_LEVEL
+#define VHOST_LOG_LEVEL VHOST_LOG_DEBUG
+#endif
+
+// Most verbose level written at run time, VHOST_LOG_INFO by default.
+extern int vhost_log_level;
+
+// Argument types of one log statement, worked out from its format the
+// first time it runs so that later calls only copy the arguments.
+#define VHOST_LOG_MAX_ARGS      16
+
+typedef struct VhostLogSite {
+    int state;
+    uint8_t nargs;
+    uint8_t args[VHOST_LOG_MAX_ARGS];
+} VhostLogSite;
+
+#define VLOG(level, ...)                                                    \
+    do {                                                                    \
+        if ((level) <= VHOST_LOG_LEVEL && (int)(level) <= vhost_log_level) { \
+            static VhostLogSite vlog_site_;                                 \
+            vhost_log_at(&vlog_site_, (level), __VA_ARGS__);                \
+        }                                                                   \
+    } while (0)
+
+#define VLOG_ERR(...)   VLOG(VHOST_LOG_ERR, __VA_ARGS__)
+#define VLOG_WARN(...)  VLOG(VHOST_LOG_WARN, __VA_ARGS__)
+#define VLOG_INFO(...)  VLOG(VHOST_LOG_INFO, __VA_ARGS__)
+#define VLOG_DEBUG(...) VLOG(VHOST_LOG_DEBUG, __VA_ARGS__)
+
+// Messages longer than this are truncated.
+#define VHOST_LOG_LINE_MAX      256
+// Bytes of messages a thread can have waiting for the flusher, about 2000
+// typical messages; messages that do not fit are dropped and counted.
+#define VHOST_LOG_RING_SIZE     65536
+
+// Queue one message. Use the VLOG_* macros so that filtered messages cost
+// a compare and their arguments are never evaluated. Formats with '*'
+// widths, long double, wide characters or more than VHOST_LOG_MAX_ARGS
+// arguments are formatted right away.
+void vhost_log(VhostLogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// vhost_log() for a statement that always passes the same fmt with site.
+void vhost_log_at(VhostLogSite *site, VhostLogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Start the flusher thread. Returns -1 if it cannot be created, in which
+// case logging stays synchronous.
+int vhost_log_start(void);
+
+// Write out everything queued and stop the flusher.
+void vhost_log_stop(void);
+
+// Messages dropped so far because a thread's ring was full.
+uint64_t vhost_log_dropped(void);
+
+#endif
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+
+#include "vhost_mem.h"
+
+#define HUGETLBFS_MAGIC 0x958458f6
+
+// Page size of the memory behind fd: the huge page size for a file on
+// hugetlbfs, the base page size otherwise.
+static uint64_t fd_page_size(int fd) {
+    struct statfs fs;
+
+    if (fstatfs(fd, &fs) == 0 && (uint32_t)fs.f_type == HUGETLBFS_MAGIC) {
+        return fs.f_bsize;
+    }
+    return sysconf(_SC_PAGESIZE);
+}
+
+int vhost_mem_add_region(VhostMem *mem, uint64_t guest_phys_addr,
+                         uint64_t size, uint64_t userspace_addr,
+                         uint64_t mmap_offset, int fd) {
+    VhostMemRegion *reg;
+    uint64_t page_size, mmap_size;
+    uint32_t pos;
+    void *addr;
+
+    if (mem->nregions >= VHOST_MEM_MAX_REGIONS) {
+        fprintf(stderr, "vhost_mem: too many regions\n");
+        return -1;
+    }
+    if (size == 0 || guest_phys_addr + size < guest_phys_addr) {
+        fprintf(stderr, "vhost_mem: invalid region size 0x%lx\n", size);
+        return -1;
+    }
+    // Keep the index sorted by guest physical address; lookups rely on
+    // regions not overlapping.
+    for (pos = 0; pos < mem->nregions; pos++) {
+        const VhostMemRegion *other = &mem->regions[mem->by_gpa[pos]];
+
+        if (guest_phys_addr < other->guest_phys_addr + other->size &&
+            other->guest_phys_addr < guest_phys_addr + size) {
+            fprintf(stderr, "vhost_mem: region at 0x%lx overlaps another\n",
+                    guest_phys_addr);
+            return -1;
+        }
+        if (guest_phys_addr < other->guest_phys_addr) {
+            break;
+        }
+    }
+
+    // Map from offset 0 so mmap_offset does not need to be page aligned.
+    // Huge page mappings must also end on a page boundary to be unmapped.
+    page_size = fd_page_size(fd);
+    mmap_size = (size + mmap_offset + page_size - 1) & ~(page_size - 1);
+    addr = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | (mem->map_flags & VHOST_MEM_F_POPULATE ? MAP_POPULATE : 0),
+                fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap guest region");
+        return -1;
+    }
+
+    memmove(&mem->sorted_gpa[pos + 1], &mem->sorted_gpa[pos],
+            (mem->nregions - pos) * sizeof(mem->sorted_gpa[0]));
+    memmove(&mem->by_gpa[pos + 1], &mem->by_gpa[pos], mem->nregions - pos);
+    mem->sorted_gpa[pos] = guest_phys_addr;
+    mem->by_gpa[pos] = mem->nregions;
+    reg = &mem->regions[mem->nregions++];
+    reg->guest_phys_addr = guest_phys_addr;
+    reg->size = size;
+    reg->userspace_addr = userspace_addr;
+    reg->mmap_addr = addr;
+    reg->mmap_size = mmap_size;
+    reg->page_size = page_size;
+    reg->host_addr = (uint8_t *)addr + mmap_offset;
+    mem->generation++;
+    return 0;
+}
+
+void vhost_mem_unmap(VhostMem *mem) {
+    uint32_t generation = mem->generation;
+    int map_flags = mem->map_flags;
+
+    for (uint32_t i = 0; i < mem->nregions; i++) {
+        munmap(mem->regions[i].mmap_addr, mem->regions[i].mmap_size);
+    }
+    memset(mem, 0, sizeof(*mem));
+    // Caches filled from the old table must not match the new one.
+    mem->generation = generation + 1;
+    mem->map_flags = map_flags;
+}
+
+// Binary search of the sorted index for the last region starting at or
+// below gpa. The loop has a fixed trip count for a given table and no
+// data-dependent branch, so random lookups do not pay for mispredictions.
+// Returns the region's slot, or -1.
+static int vhost_mem_find(const VhostMem *mem, uint64_t gpa) {
+    const uint64_t *base = mem->sorted_gpa;
+    uint32_t n = mem->nregions;
+    const VhostMemRegion *reg;
+
+    if (n == 0) {
+        return -1;
+    }
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base = base[half] <= gpa ? base + half : base;
+        n -= half;
+    }
+    reg = &mem->regions[mem->by_gpa[base - mem->sorted_gpa]];
+    if (gpa - reg->guest_phys_addr >= reg->size) {
+        return -1;
+    }
+    return mem->by_gpa[base - mem->sorted_gpa];
+}
+
+void *vhost_mem_gpa_to_hva(const VhostMem *mem, uint64_t gpa, uint64_t len) {
+    int i = vhost_mem_find(mem, gpa);
+    const VhostMemRegion *reg;
+
+    if (i < 0) {
+        return NULL;
+    }
+    reg = &mem->regions[i];
+    if (len > reg->size - (gpa - reg->guest_phys_addr)) {
+        return NULL;
+    }
+    return reg->host_addr + (gpa - reg->guest_phys_addr);
+}
+
+int vhost_mem_translate(const VhostMem *mem, VhostMemCache *cache, uint64_t gpa,
+                        uint64_t len, struct iovec *iov, unsigned max) {
+    unsigned n = 0;
+
+    if (gpa + len < gpa) {
+        return -1;
+    }
+    // A zero-length buffer still has to point into guest memory.
+    do {
+        const VhostMemRegion *reg;
+        uint64_t off, chunk;
+        uint8_t *hva;
+        int i = vhost_mem_find(mem, gpa);
+
+        if (i < 0) {
+            return -1;
+        }
+        reg = &mem->regions[i];
+        if (cache) {
+            cache->generation = mem->generation;
+            cache->region = i;
+        }
+
+        off = gpa - reg->guest_phys_addr;
+        chunk = reg->size - off < len ? reg->size - off : len;
+        hva = reg->host_addr + off;
+        if (n > 0 && (uint8_t *)iov[n - 1].iov_base + iov[n - 1].iov_len == hva) {
+            iov[n - 1].iov_len += chunk;
+        } else {
+            if (n >= max) {
+                return -1;
+            }
+            iov[n].iov_base = hva;
+            iov[n].iov_len = chunk;
+            n++;
+        }
+        gpa += chunk;
+        len -= chunk;
+    } while (len > 0);
+    return n;
+}
+
+uint64_t vhost_mem_uva_to_gpa(const VhostMem *mem, uint64_t uva) {
+    for (uint32_t i = 0; i < mem->nregions; i++) {
+        const VhostMemRegion *reg = &mem->regions[i];
+        if (uva >= reg->userspace_addr && uva - reg->userspace_addr < reg->size) {
+            return reg->guest_phys_addr + (uva - reg->userspace_addr);
+        }
+    }
+    return (uint64_t)-1;
+}
+
+void *vhost_mem_uva_to_hva(const VhostMem *mem, uint64_t uva, uint64_t len) {
+    for (uint32_t i = 0; i < mem->nregions; i++) {
+        const VhostMemRegion *reg = &mem->regions[i];
+        if (uva >= reg->userspace_addr &&
+            uva - reg->userspace_addr < reg->size &&
+            len <= reg->size - (uva - reg->userspace_addr)) {
+            return reg->host_addr + (uva - reg->userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+int vhost_log_map(VhostLog *log, uint64_t mmap_size, uint64_t mmap_offset, int fd) {
+    void *addr;
+
+    if (mmap_size == 0 || mmap_offset + mmap_size < mmap_offset) {
+        fprintf(stderr, "vhost_log: invalid log size 0x%lx\n", mmap_size);
+        return -1;
+    }
+    addr = mmap(NULL, mmap_size + mmap_offset, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap dirty log");
+        return -1;
+    }
+    vhost_log_unmap(log);
+    log->mmap_addr = addr;
+    log->mmap_size = mmap_size + mmap_offset;
+    log->bitmap = (uint8_t *)addr + mmap_offset;
+    log->size = mmap_size;
+    return 0;
+}
+
+void vhost_log_unmap(VhostLog *log) {
+    if (log->mmap_addr) {
+        munmap(log->mmap_addr, log->mmap_size);
+    }
+    memset(log, 0, sizeof(*log));
+}
+
+void vhost_log_write(VhostLog *log, VhostLogCache *cache, uint64_t gpa, uint64_t len) {
+    uint64_t page, last;
+
+    if (len == 0) {
+        return;
+    }
+    page = gpa >> VHOST_LOG_PAGE_SHIFT;
+    last = (gpa + len - 1) >> VHOST_LOG_PAGE_SHIFT;
+    for (; page <= last && page / 8 < log->size; page++) {
+        uint64_t word = page / 64;
+        unsigned i;
+
+        // Search from the newest entry: consecutive writes usually hit it.
+        for (i = cache->n; i > 0 && cache->entries[i - 1].word != word; i--) {
+        }
+        if (i == 0) {
+            if (cache->n == VHOST_LOG_CACHE_SIZE) {
+                vhost_log_flush(log, cache);
+            }
+            i = ++cache->n;
+            cache->entries[i - 1].word = word;
+            cache->entries[i - 1].mask = 0;
+        }
+        cache->entries[i - 1].mask |= 1ULL << (page % 64);
+    }
+}
+
+void vhost_log_flush(VhostLog *log, VhostLogCache *cache) {
+    // Order the logged writes before the bits that announce them.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (unsigned i = 0; i < cache->n; i++) {
+        uint64_t word = cache->entries[i].word, mask = cache->entries[i].mask;
+        uint8_t *p = log->bitmap + word * 8;
+
+        if (((uintptr_t)p & 7) == 0 && word * 8 + 8 <= log->size) {
+            __atomic_fetch_or((uint64_t *)p, mask, __ATOMIC_RELAXED);
+            continue;
+        }
+        // Unaligned or partial last word: fall back to bytes.
+        for (unsigned b = 0; b < 8 && word * 8 + b < log->size; b++) {
+            uint8_t bits = mask >> (8 * b);
+            if (bits) {
+                __atomic_fetch_or(&p[b], bits, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    cache->n = 0;
+}
+
+int vhost_inflight_map(VhostInflightArea *area, uint64_t mmap_size,
+                       uint64_t mmap_offset, int fd) {
+    void *addr;
+
+    if (mmap_size == 0 || mmap_offset + mmap_size < mmap_offset) {
+        fprintf(stderr, "vhost_inflight: invalid area size 0x%lx\n", mmap_size);
+        return -1;
+    }
+    addr = mmap(NULL, mmap_size + mmap_offset, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap inflight area");
+        return -1;
+    }
+    vhost_inflight_unmap(area);
+    area->mmap_addr = addr;
+    area->mmap_size = mmap_size + mmap_offset;
+    area->addr = (uint8_t *)addr + mmap_offset;
+    area->size = mmap_size;
+    return 0;
+}
+
+int vhost_inflight_create(VhostInflightArea *area, uint64_t size, int *fd) {
+    int memfd = memfd_create("vhost-inflight", MFD_CLOEXEC);
+
+    if (memfd < 0) {
+        perror("memfd_create inflight area");
+        return -1;
+    }
+    // A new memfd reads as zeros, which is an area no queue has used yet.
+    if (ftruncate(memfd, (off_t)size) < 0) {
+        perror("ftruncate inflight area");
+        close(memfd);
+        return -1;
+    }
+    if (vhost_inflight_map(area, size, 0, memfd) < 0) {
+        close(memfd);
+        return -1;
+    }
+    *fd = memfd;
+    return 0;
+}
+
+void vhost_inflight_unmap(VhostInflightArea *area) {
+    if (area->mmap_addr) {
+        munmap(area->mmap_addr, area->mmap_size);
+    }
+    memset(area, 0, sizeof(*area));
+}
@@ -0,0 +1,148 @@
+#ifndef VHOST_MEM_H
+#define VHOST_MEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// SET_MEM_TABLE carries at most 8 regions; the table itself can hold more.
+#define VHOST_MEM_MAX_REGIONS 64
+
+// One guest memory region mapped into the backend's address space.
+typedef struct VhostMemRegion {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t userspace_addr;    // frontend virtual address of guest_phys_addr
+    void *mmap_addr;            // start of our mapping (covers mmap_offset too)
+    uint64_t mmap_size;
+    uint64_t page_size;         // of the memory behind fd, e.g. 2MB on hugetlbfs
+    uint8_t *host_addr;         // backend virtual address of guest_phys_addr
+} VhostMemRegion;
+
+// Prefault regions when they are mapped (MAP_POPULATE), so the data path
+// never takes a page fault on guest memory. With huge pages this is cheap:
+// 64MB of guest memory is 32 faults.
+#define VHOST_MEM_F_POPULATE    1
+
+typedef struct VhostMem {
+    uint32_t nregions;
+    uint32_t generation;        // bumped whenever the table changes
+    int map_flags;              // VHOST_MEM_F_*, kept across vhost_mem_unmap()
+    VhostMemRegion regions[VHOST_MEM_MAX_REGIONS];
+    // Sorted index: region start addresses in ascending order, and the
+    // region slot each one belongs to.
+    uint64_t sorted_gpa[VHOST_MEM_MAX_REGIONS];
+    uint8_t by_gpa[VHOST_MEM_MAX_REGIONS];
+} VhostMem;
+
+// Last region a queue's lookups hit. Descriptors of one queue tend to come
+// from the same region, so most translations never search the table. Zero
+// initialisation gives an empty cache.
+typedef struct VhostMemCache {
+    uint32_t generation;
+    uint32_t region;
+} VhostMemCache;
+
+// Map a region shared by the frontend. The fd is only needed for the
+// duration of the call; the caller still owns it. A region on hugetlbfs,
+// such as a MFD_HUGETLB memfd, is mapped with huge pages, which is how the
+// kernel maps such files; page_size records which it was.
+int vhost_mem_add_region(VhostMem *mem, uint64_t guest_phys_addr,
+                         uint64_t size, uint64_t userspace_addr,
+                         uint64_t mmap_offset, int fd);
+
+// Unmap every region and reset the table.
+void vhost_mem_unmap(VhostMem *mem);
+
+// Translate a guest physical / frontend virtual address range to a pointer
+// in our address space. Returns NULL unless [addr, addr + len) lies inside
+// a single region. Guest physical lookups binary-search the sorted index.
+void *vhost_mem_gpa_to_hva(const VhostMem *mem, uint64_t gpa, uint64_t len);
+void *vhost_mem_uva_to_hva(const VhostMem *mem, uint64_t uva, uint64_t len);
+
+// Guest physical address of a frontend virtual address, or -1 if unmapped.
+uint64_t vhost_mem_uva_to_gpa(const VhostMem *mem, uint64_t uva);
+
+// Slow path of vhost_mem_gpa_to_iov(): searches the index and may split
+// the range.
+int vhost_mem_translate(const VhostMem *mem, VhostMemCache *cache, uint64_t gpa,
+                        uint64_t len, struct iovec *iov, unsigned max);
+
+// Translate [gpa, gpa + len) into at most max contiguous host spans, one per
+// region it crosses (spans that happen to be adjacent in our address space
+// are merged). Returns the number of spans, or -1 if part of the range is
+// not mapped or needs more than max spans. cache may be NULL.
+static inline int vhost_mem_gpa_to_iov(const VhostMem *mem, VhostMemCache *cache,
+                                       uint64_t gpa, uint64_t len,
+                                       struct iovec *iov, unsigned max) {
+    if (cache && cache->generation == mem->generation && max > 0) {
+        const VhostMemRegion *reg = &mem->regions[cache->region];
+        uint64_t off = gpa - reg->guest_phys_addr;
+
+        // off wraps around when gpa is below the region.
+        if (off < reg->size && len <= reg->size - off) {
+            iov->iov_base = reg->host_addr + off;
+            iov->iov_len = len;
+            return 1;
+        }
+    }
+    return vhost_mem_translate(mem, cache, gpa, len, iov, max);
+}
+
+// Dirty page log shared with the frontend for live migration
+// (SET_LOG_BASE): bit n of the bitmap marks guest page n as written.
+#define VHOST_LOG_PAGE_SHIFT    12
+#define VHOST_LOG_CACHE_SIZE    32
+
+typedef struct VhostLog {
+    uint8_t *bitmap;
+    uint64_t size;              // bytes of bitmap
+    void *mmap_addr;
+    uint64_t mmap_size;
+} VhostLog;
+
+// Pages a queue dirtied since the last flush, coalesced into 64-page words
+// so a burst costs one atomic OR per word rather than one per write.
+typedef struct VhostLogCache {
+    unsigned n;
+    struct {
+        uint64_t word;          // index of a 64-bit word of the bitmap
+        uint64_t mask;
+    } entries[VHOST_LOG_CACHE_SIZE];
+} VhostLogCache;
+
+// Map the log the frontend passed with SET_LOG_BASE. The fd is only needed
+// for the duration of the call.
+int vhost_log_map(VhostLog *log, uint64_t mmap_size, uint64_t mmap_offset, int fd);
+void vhost_log_unmap(VhostLog *log);
+
+// Record that [gpa, gpa + len) was written. Pages beyond the bitmap are
+// ignored. Flushes the cache to the bitmap when it fills up.
+void vhost_log_write(VhostLog *log, VhostLogCache *cache, uint64_t gpa, uint64_t len);
+
+// Set every cached bit in the shared bitmap. Call after the writes being
+// logged are visible, so the frontend never clears a bit before the page
+// it covers holds the new data.
+void vhost_log_flush(VhostLog *log, VhostLogCache *cache);
+
+// Inflight tracking area shared with the frontend (GET_INFLIGHT_FD /
+// SET_INFLIGHT_FD). The frontend keeps it across backend restarts, so a new
+// backend finds in it where the old one stopped.
+typedef struct VhostInflightArea {
+    uint8_t *addr;
+    uint64_t size;
+    void *mmap_addr;
+    uint64_t mmap_size;
+} VhostInflightArea;
+
+// Create a zeroed area of size bytes in a new memfd and map it. The fd is
+// returned in *fd for the GET_INFLIGHT_FD reply; the caller closes it.
+int vhost_inflight_create(VhostInflightArea *area, uint64_t size, int *fd);
+
+// Map the area the frontend passed with SET_INFLIGHT_FD. The fd is only
+// needed for the duration of the call.
+int vhost_inflight_map(VhostInflightArea *area, uint64_t mmap_size,
+                       uint64_t mmap_offset, int fd);
+void vhost_inflight_unmap(VhostInflightArea *area);
+
+#endif
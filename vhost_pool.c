@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "vhost_log.h"
+#include "vhost_pool.h"
+
+#define VHOST_POOL_SPINS    128     // pauses before yielding the CPU
+
+static inline void pool_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Publish [head, next) on one side of the ring. Threads that claimed slots
+// before us publish first, so the other side never sees a slot that is
+// still being written or read. One of them may have been preempted in
+// between, and with more threads than CPUs it only gets to finish if we
+// give up ours.
+static void ring_publish(VhostPoolHeadTail *ht, uint32_t head, uint32_t next) {
+    for (unsigned spins = 0; __atomic_load_n(&ht->tail, __ATOMIC_RELAXED) != head; spins++) {
+        if (spins < VHOST_POOL_SPINS) {
+            pool_relax();
+        } else {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&ht->tail, next, __ATOMIC_RELEASE);
+}
+
+// Take up to n buffers out of the ring.
+static unsigned ring_dequeue(VhostPool *pool, void **bufs, unsigned n) {
+    uint32_t head = __atomic_load_n(&pool->cons.head, __ATOMIC_ACQUIRE), next, avail;
+
+    do {
+        avail = __atomic_load_n(&pool->prod.tail, __ATOMIC_ACQUIRE) - head;
+        if (n > avail) {
+            n = avail;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&pool->cons.head, &head, next, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    for (unsigned i = 0; i < n; i++) {
+        bufs[i] = pool->ring[(head + i) & pool->mask];
+    }
+    ring_publish(&pool->cons, head, next);
+    return n;
+}
+
+// Put n buffers into the ring. It has a slot for every buffer of the pool,
+// so there is always room for buffers that came from it.
+static void ring_enqueue(VhostPool *pool, void *const *bufs, unsigned n) {
+    uint32_t head = __atomic_load_n(&pool->prod.head, __ATOMIC_ACQUIRE), next;
+
+    if (n == 0) {
+        return;
+    }
+    do {
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&pool->prod.head, &head, next, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    for (unsigned i = 0; i < n; i++) {
+        pool->ring[(head + i) & pool->mask] = bufs[i];
+    }
+    ring_publish(&pool->prod, head, next);
+}
+
+int vhost_pool_init(VhostPool *pool, uint32_t nbufs, uint32_t buf_size, int flags) {
+    uint32_t slots = 1;
+    void *mem = MAP_FAILED;
+
+    memset(pool, 0, sizeof(*pool));
+    if (nbufs == 0 || nbufs > (1U << 30) || buf_size == 0 ||
+        buf_size > UINT32_MAX - VHOST_POOL_ALIGN) {
+        VLOG_ERR("vhost_pool: invalid geometry (%u buffers of %u bytes)", nbufs, buf_size);
+        return -1;
+    }
+    pool->buf_size = (buf_size + VHOST_POOL_ALIGN - 1) & ~(uint32_t)(VHOST_POOL_ALIGN - 1);
+    pool->mem_size = (size_t)nbufs * pool->buf_size;
+    if (flags & VHOST_POOL_F_HUGEPAGES) {
+        size_t size = (pool->mem_size + VHOST_POOL_HUGEPAGE - 1) & ~(VHOST_POOL_HUGEPAGE - 1);
+
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (mem != MAP_FAILED) {
+            pool->mem_size = size;
+            pool->hugepages = 1;
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, pool->mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            VLOG_ERR("vhost_pool: mmap %zu bytes: %s", pool->mem_size, strerror(errno));
+            return -1;
+        }
+        if (flags & VHOST_POOL_F_HUGEPAGES) {
+            madvise(mem, pool->mem_size, MADV_HUGEPAGE);
+        }
+    }
+    while (slots < nbufs) {
+        slots <<= 1;
+    }
+    pool->ring = calloc(slots, sizeof(*pool->ring));
+    if (!pool->ring) {
+        VLOG_ERR("vhost_pool: out of memory for %u ring slots", slots);
+        munmap(mem, pool->mem_size);
+        return -1;
+    }
+    pool->mem = mem;
+    pool->mask = slots - 1;
+    pool->nbufs = nbufs;
+    for (uint32_t i = 0; i < nbufs; i++) {
+        pool->ring[i] = pool->mem + (size_t)i * pool->buf_size;
+    }
+    pool->prod.head = pool->prod.tail = nbufs;
+    return 0;
+}
+
+void vhost_pool_destroy(VhostPool *pool) {
+    if (pool->mem) {
+        munmap(pool->mem, pool->mem_size);
+    }
+    free(pool->ring);
+    memset(pool, 0, sizeof(*pool));
+}
+
+unsigned vhost_pool_alloc_bulk(VhostPool *pool, VhostPoolCache *cache,
+                               void **bufs, unsigned n) {
+    unsigned got;
+
+    if (!cache || n > VHOST_POOL_CACHE_SIZE - VHOST_POOL_BULK) {
+        return ring_dequeue(pool, bufs, n);
+    }
+    if (cache->len < n) {
+        // Refill with a bulk on top of what is missing.
+        cache->len += ring_dequeue(pool, cache->bufs + cache->len,
+                                   n - cache->len + VHOST_POOL_BULK);
+    }
+    got = cache->len < n ? cache->len : n;
+    // The buffers freed last are the likeliest to be in cache.
+    for (unsigned i = 0; i < got; i++) {
+        bufs[i] = cache->bufs[--cache->len];
+    }
+    return got;
+}
+
+void vhost_pool_free_bulk(VhostPool *pool, VhostPoolCache *cache,
+                          void *const *bufs, unsigned n) {
+    if (!cache || n > VHOST_POOL_CACHE_SIZE - VHOST_POOL_BULK) {
+        ring_enqueue(pool, bufs, n);
+        return;
+    }
+    if (cache->len + n > VHOST_POOL_CACHE_SIZE) {
+        // Spill the oldest buffers, leaving a bulk of room after this free.
+        unsigned spill = cache->len + n - (VHOST_POOL_CACHE_SIZE - VHOST_POOL_BULK);
+
+        ring_enqueue(pool, cache->bufs, spill);
+        cache->len -= spill;
+        memmove(cache->bufs, cache->bufs + spill, cache->len * sizeof(cache->bufs[0]));
+    }
+    memcpy(cache->bufs + cache->len, bufs, n * sizeof(bufs[0]));
+    cache->len += n;
+}
+
+void vhost_pool_cache_flush(VhostPool *pool, VhostPoolCache *cache) {
+    ring_enqueue(pool, cache->bufs, cache->len);
+    cache->len = 0;
+}
+
+uint32_t vhost_pool_ring_count(const VhostPool *pool) {
+    return __atomic_load_n(&pool->prod.tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&pool->cons.tail, __ATOMIC_ACQUIRE);
+}
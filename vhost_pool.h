@@ -0,0 +1,92 @@
+#ifndef VHOST_POOL_H
+#define VHOST_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Fixed-size packet buffers for the data path. Every buffer is carved out
+// of one mapping made up front, on huge pages when the system has them, so
+// taking and returning buffers never calls into libc or the kernel. Free
+// buffers wait in a ring of pointers shared by all threads, which takes and
+// gives back runs of buffers without a lock: a thread claims a range of
+// slots with a compare-and-swap on the ring's head and publishes it by
+// moving the tail once the threads ahead of it are done. Each worker keeps
+// a cache of its own in front of the ring and only goes to the ring
+// VHOST_POOL_BULK buffers at a time. A buffer may be freed by another
+// thread than the one that took it, but only into the pool it came from.
+
+#define VHOST_POOL_CACHE_SIZE   256     // buffers a cache holds at most
+#define VHOST_POOL_BULK         64      // buffers a cache moves to or from the ring at once
+#define VHOST_POOL_ALIGN        64      // buffer sizes are rounded up to cache lines
+#define VHOST_POOL_HUGEPAGE     (2UL << 20)
+
+#define VHOST_POOL_F_HUGEPAGES  1       // back the buffers with MAP_HUGETLB pages if possible
+
+// One side of the ring: slots up to head are claimed, up to tail done.
+typedef struct VhostPoolHeadTail {
+    uint32_t head;
+    uint32_t tail;
+} __attribute__((aligned(64))) VhostPoolHeadTail;
+
+typedef struct VhostPool {
+    VhostPoolHeadTail prod;     // frees fill slots
+    VhostPoolHeadTail cons;     // allocations empty them
+    void **ring;                // mask + 1 slots, a power of two >= nbufs
+    uint32_t mask;
+    uint32_t nbufs;
+    uint32_t buf_size;
+    int hugepages;              // the buffers sit on MAP_HUGETLB pages
+    uint8_t *mem;
+    size_t mem_size;
+} VhostPool;
+
+// Buffers owned by one thread. Zero initialisation gives an empty cache.
+typedef struct VhostPoolCache {
+    unsigned len;
+    void *bufs[VHOST_POOL_CACHE_SIZE];
+} VhostPoolCache;
+
+// Map nbufs buffers of at least buf_size bytes and put them all in the
+// ring. Without huge pages the mapping is made of normal pages, with
+// transparent huge pages requested. Returns -1 if it cannot be mapped.
+int vhost_pool_init(VhostPool *pool, uint32_t nbufs, uint32_t buf_size, int flags);
+
+// Unmap the buffers. Every cache must have been flushed and no buffer may
+// be in use any more.
+void vhost_pool_destroy(VhostPool *pool);
+
+// Take up to n buffers into bufs, from cache if it has them. Returns how
+// many were taken, fewer than n only when the pool runs dry. cache may be
+// NULL to take straight from the ring.
+unsigned vhost_pool_alloc_bulk(VhostPool *pool, VhostPoolCache *cache,
+                               void **bufs, unsigned n);
+
+// Give n buffers back into cache, spilling its oldest buffers to the ring
+// when it fills up. cache may be NULL to give them straight to the ring.
+void vhost_pool_free_bulk(VhostPool *pool, VhostPoolCache *cache,
+                          void *const *bufs, unsigned n);
+
+static inline void *vhost_pool_alloc(VhostPool *pool, VhostPoolCache *cache) {
+    void *buf;
+
+    if (cache && cache->len > 0) {
+        return cache->bufs[--cache->len];
+    }
+    return vhost_pool_alloc_bulk(pool, cache, &buf, 1) ? buf : NULL;
+}
+
+static inline void vhost_pool_free(VhostPool *pool, VhostPoolCache *cache, void *buf) {
+    if (cache && cache->len < VHOST_POOL_CACHE_SIZE) {
+        cache->bufs[cache->len++] = buf;
+        return;
+    }
+    vhost_pool_free_bulk(pool, cache, &buf, 1);
+}
+
+// Return everything in cache to the ring, e.g. when its thread exits.
+void vhost_pool_cache_flush(VhostPool *pool, VhostPoolCache *cache);
+
+// Buffers in the ring, not counting those in caches or in use.
+uint32_t vhost_pool_ring_count(const VhostPool *pool);
+
+#endif
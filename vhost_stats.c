@@ -0,0 +1,50 @@
+#include "vhost_stats.h"
+
+uint64_t vhost_hist_bucket_low(unsigned i) {
+    unsigned shift;
+
+    if (i < VHOST_HIST_SUB) {
+        return i;
+    }
+    shift = i / VHOST_HIST_SUB - 1;
+    return (uint64_t)(VHOST_HIST_SUB + i % VHOST_HIST_SUB) << shift;
+}
+
+uint64_t vhost_hist_percentile(const VhostHist *h, double pct) {
+    uint64_t target = (uint64_t)(h->count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    if (target == 0) {
+        target = 1;
+    }
+    for (unsigned i = 0; i < VHOST_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t high = i + 1 < VHOST_HIST_BUCKETS ?
+                            vhost_hist_bucket_low(i + 1) - 1 : UINT64_MAX;
+
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+void vhost_hist_json(FILE *f, const VhostHist *h) {
+    const char *sep = "";
+
+    fprintf(f, "{\"count\": %lu, \"min\": %lu, \"max\": %lu, \"mean\": %.1f, "
+            "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"buckets\": [",
+            h->count, h->min, h->max, h->count ? (double)h->sum / h->count : 0.0,
+            vhost_hist_percentile(h, 50), vhost_hist_percentile(h, 90),
+            vhost_hist_percentile(h, 99), vhost_hist_percentile(h, 99.9));
+    for (unsigned i = 0; i < VHOST_HIST_BUCKETS; i++) {
+        if (h->buckets[i]) {
+            fprintf(f, "%s[%lu, %lu]", sep, vhost_hist_bucket_low(i), h->buckets[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "]}");
+}
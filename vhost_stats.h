@@ -0,0 +1,68 @@
+#ifndef VHOST_STATS_H
+#define VHOST_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Counters written by one thread and read by others while it runs. The
+// writer owns the counter, so a relaxed load and store is enough: readers
+// never see a torn value and the writer pays no more than a plain add.
+static inline void vhost_stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t vhost_stat_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Log-linear histogram in the style of HdrHistogram. Values below
+// VHOST_HIST_SUB get a bucket each; above that every power of two is split
+// into VHOST_HIST_SUB buckets, so a bucket's width is at most 1/8 of its
+// values and any uint64_t fits. One thread records into and reads a
+// histogram.
+#define VHOST_HIST_SUB_BITS     3
+#define VHOST_HIST_SUB          (1U << VHOST_HIST_SUB_BITS)
+#define VHOST_HIST_BUCKETS      ((64 - VHOST_HIST_SUB_BITS + 1) * VHOST_HIST_SUB)
+
+typedef struct VhostHist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[VHOST_HIST_BUCKETS];
+} VhostHist;
+
+static inline unsigned vhost_hist_index(uint64_t v) {
+    unsigned shift;
+
+    if (v < VHOST_HIST_SUB) {
+        return v;
+    }
+    shift = 63 - __builtin_clzll(v) - VHOST_HIST_SUB_BITS;
+    return (shift + 1) * VHOST_HIST_SUB + ((v >> shift) & (VHOST_HIST_SUB - 1));
+}
+
+static inline void vhost_hist_record(VhostHist *h, uint64_t v) {
+    h->buckets[vhost_hist_index(v)]++;
+    if (h->count == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->sum += v;
+}
+
+// Smallest value that falls into bucket i.
+uint64_t vhost_hist_bucket_low(unsigned i);
+
+// Highest value of the bucket holding the pct-th percentile (0-100),
+// capped at the largest value recorded; 0 for an empty histogram.
+uint64_t vhost_hist_percentile(const VhostHist *h, double pct);
+
+// Write h as a JSON object: count, min, max, mean, p50, p90, p99, p99.9
+// and the non-empty buckets as [lowest value, count] pairs.
+void vhost_hist_json(FILE *f, const VhostHist *h);
+
+#endif
@@ -0,0 +1,83 @@
+#include "vhost_log.h"
+#include "vhost_user.h"
+
+static const char *const request_names[VHOST_USER_MAX] = {
+    [VHOST_USER_NONE] = "NONE",
+    [VHOST_USER_GET_FEATURES] = "GET_FEATURES",
+    [VHOST_USER_SET_FEATURES] = "SET_FEATURES",
+    [VHOST_USER_SET_OWNER] = "SET_OWNER",
+    [VHOST_USER_RESET_OWNER] = "RESET_OWNER",
+    [VHOST_USER_SET_MEM_TABLE] = "SET_MEM_TABLE",
+    [VHOST_USER_SET_LOG_BASE] = "SET_LOG_BASE",
+    [VHOST_USER_SET_LOG_FD] = "SET_LOG_FD",
+    [VHOST_USER_SET_VRING_NUM] = "SET_VRING_NUM",
+    [VHOST_USER_SET_VRING_ADDR] = "SET_VRING_ADDR",
+    [VHOST_USER_SET_VRING_BASE] = "SET_VRING_BASE",
+    [VHOST_USER_GET_VRING_BASE] = "GET_VRING_BASE",
+    [VHOST_USER_SET_VRING_KICK] = "SET_VRING_KICK",
+    [VHOST_USER_SET_VRING_CALL] = "SET_VRING_CALL",
+    [VHOST_USER_SET_VRING_ERR] = "SET_VRING_ERR",
+    [VHOST_USER_GET_PROTOCOL_FEATURES] = "GET_PROTOCOL_FEATURES",
+    [VHOST_USER_SET_PROTOCOL_FEATURES] = "SET_PROTOCOL_FEATURES",
+    [VHOST_USER_GET_QUEUE_NUM] = "GET_QUEUE_NUM",
+    [VHOST_USER_SET_VRING_ENABLE] = "SET_VRING_ENABLE",
+    [VHOST_USER_GET_INFLIGHT_FD] = "GET_INFLIGHT_FD",
+    [VHOST_USER_SET_INFLIGHT_FD] = "SET_INFLIGHT_FD",
+};
+
+const char *vhost_user_request_name(uint32_t request) {
+    return request < VHOST_USER_MAX && request_names[request] ? request_names[request]
+                                                              : "UNKNOWN";
+}
+
+int vhost_user_request_has_reply(uint32_t request) {
+    switch (request) {
+        case VHOST_USER_GET_FEATURES:
+        case VHOST_USER_GET_PROTOCOL_FEATURES:
+        case VHOST_USER_GET_QUEUE_NUM:
+        case VHOST_USER_GET_VRING_BASE:
+        case VHOST_USER_SET_LOG_BASE:
+        case VHOST_USER_GET_INFLIGHT_FD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int vhost_user_need_reply(const VhostUserMsg *msg, uint64_t protocol_features) {
+    return vhost_user_request_has_reply(msg->request) ||
+           ((protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK)) &&
+            (msg->flags & VHOST_USER_NEED_REPLY_MASK));
+}
+
+int vhost_user_dispatch(const VhostUserHandler *table, void *dev,
+                        const VhostUserMsg *msg, int *fds, size_t nfds,
+                        VhostUserMsg *reply) {
+    const VhostUserHandler *h = NULL;
+
+    // Only the header and the u64 go out, so that is all we initialise.
+    reply->request = msg->request;
+    reply->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    reply->size = sizeof(reply->payload.u64);
+    reply->payload.u64 = 0;
+
+    if ((uint32_t)msg->request < VHOST_USER_MAX) {
+        h = &table[msg->request];
+    }
+    if (!h || !h->fn) {
+        VLOG_ERR("Unhandled request: %u", (uint32_t)msg->request);
+        reply->payload.u64 = 1;
+        return -1;
+    }
+    if (msg->size < h->min_size) {
+        VLOG_ERR("%s: short payload (%u bytes)",
+                 vhost_user_request_name(msg->request), msg->size);
+        reply->payload.u64 = 1;
+        return -1;
+    }
+    if (h->fn(dev, msg, fds, nfds, reply) < 0) {
+        reply->payload.u64 = 1;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,159 @@
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vhost_user_codec.h"
+
+// Protocol definitions shared by the frontend, the backend and the tests,
+// built into libvhostuser-lite.a together with the codec and the request
+// dispatcher.
+
+#define VHOST_USER_PROTOCOL_F_MQ            0
+#define VHOST_USER_PROTOCOL_F_LOG_SHMFD     1
+#define VHOST_USER_PROTOCOL_F_RARP          2
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
+#define VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD 12
+
+#define VIRTIO_NET_F_CSUM                   0
+#define VIRTIO_NET_F_GUEST_CSUM             1
+#define VIRTIO_NET_F_HOST_TSO4              11
+#define VIRTIO_NET_F_HOST_TSO6              12
+#define VIRTIO_NET_F_MRG_RXBUF              15
+#define VHOST_F_LOG_ALL                     26
+#define VIRTIO_RING_F_INDIRECT_DESC         28
+#define VIRTIO_RING_F_EVENT_IDX             29
+#define VHOST_USER_F_PROTOCOL_FEATURES      30
+#define VIRTIO_F_VERSION_1                  32
+#define VIRTIO_F_RING_PACKED                34
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_INFLIGHT_FD = 31,
+    VHOST_USER_SET_INFLIGHT_FD = 32,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+#define VHOST_MEMORY_MAX_NREGIONS 8
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserVringAddr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} VhostUserVringAddr;
+
+// SET_VRING_ADDR flag: log writes to the used ring at log_guest_addr.
+#define VHOST_VRING_F_LOG           0
+
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
+// GET_INFLIGHT_FD asks for an area covering num_queues vrings of up to
+// queue_size entries; the reply describes the fd that comes with it, which
+// SET_INFLIGHT_FD hands back, e.g. to a restarted backend.
+typedef struct VhostUserInflight {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+    uint16_t num_queues;
+    uint16_t queue_size;
+} __attribute__((packed)) VhostUserInflight;
+
+// A VhostUserHdr followed by the largest payload any request carries. Only
+// vhost_user_msg_len() bytes of it go on the wire.
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        struct {
+            uint32_t index;
+            uint32_t num;
+        } state;
+        VhostUserVringAddr addr;
+        VhostUserMemory memory;
+        VhostUserLog log;
+        VhostUserInflight inflight;
+    } payload;
+} __attribute__((packed)) VhostUserMsg;
+
+// Header flags: protocol version, "this is a reply" and, with REPLY_ACK,
+// "acknowledge this request"
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_REPLY_MASK       (1U << 2)
+#define VHOST_USER_NEED_REPLY_MASK  (1U << 3)
+
+// SET_VRING_KICK/CALL/ERR payload: vring index plus a "no fd" flag
+#define VHOST_USER_VRING_IDX_MASK   0xff
+#define VHOST_USER_VRING_NOFD_MASK  (1ULL << 8)
+
+// Name of a request for logs, "UNKNOWN" outside the enum.
+const char *vhost_user_request_name(uint32_t request);
+
+// Requests whose reply carries data are always answered.
+int vhost_user_request_has_reply(uint32_t request);
+
+// Whether the backend answers msg: requests without a reply of their own
+// get a u64 status only when REPLY_ACK is among protocol_features and the
+// frontend set the need-reply flag.
+int vhost_user_need_reply(const VhostUserMsg *msg, uint64_t protocol_features);
+
+// Backend handler for one request type. reply arrives as a u64 reply with
+// status 0; a handler fills in the data its request returns, or returns -1
+// to report a failed status. Descriptors it takes out of fds must be set
+// to -1; the caller closes the rest.
+typedef int (*VhostUserHandlerFn)(void *dev, const VhostUserMsg *msg,
+                                  int *fds, size_t nfds, VhostUserMsg *reply);
+
+typedef struct VhostUserHandler {
+    VhostUserHandlerFn fn;
+    uint32_t min_size;          // shortest payload the handler accepts
+} VhostUserHandler;
+
+// Run the handler table[msg->request] and build the reply in reply. A
+// request without a handler, or with a payload shorter than its min_size,
+// is rejected with a failed status. The table has VHOST_USER_MAX entries;
+// use vhost_user_need_reply() to decide whether the reply is sent. Returns
+// -1 if the request failed or was rejected, 0 otherwise.
+int vhost_user_dispatch(const VhostUserHandler *table, void *dev,
+                        const VhostUserMsg *msg, int *fds, size_t nfds,
+                        VhostUserMsg *reply);
+
+#endif
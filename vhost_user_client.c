@@ -1,58 +1,143 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
-#define VHOST_USER_PROTOCOL_F_MQ            0
-#define VHOST_USER_PROTOCOL_F_LOG_SHMFD     1
-#define VHOST_USER_PROTOCOL_F_RARP          2
-#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
-
-typedef enum VhostUserRequest {
-    VHOST_USER_NONE = 0,
-    VHOST_USER_GET_FEATURES = 1,
-    VHOST_USER_SET_FEATURES = 2,
-    VHOST_USER_SET_OWNER = 3,
-    VHOST_USER_RESET_OWNER = 4,
-    VHOST_USER_SET_MEM_TABLE = 5,
-    VHOST_USER_SET_LOG_BASE = 6,
-    VHOST_USER_SET_LOG_FD = 7,
-    VHOST_USER_SET_VRING_NUM = 8,
-    VHOST_USER_SET_VRING_ADDR = 9,
-    VHOST_USER_SET_VRING_BASE = 10,
-    VHOST_USER_GET_VRING_BASE = 11,
-    VHOST_USER_SET_VRING_KICK = 12,
-    VHOST_USER_SET_VRING_CALL = 13,
-    VHOST_USER_SET_VRING_ERR = 14,
-    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
-    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
-    VHOST_USER_MAX
-} VhostUserRequest;
-
-typedef struct VhostUserMsg {
+#include "vhost_user.h"
+#include "virtio_net.h"
+#include "virtqueue.h"
+
+// Control connection to the backend. Requests are written back to back;
+// the replies they produce come back in order and vhost_wait() collects
+// them. Only requests with a reply of their own, or an ack asked for with
+// REPLY_ACK's need-reply flag, produce one. In lockstep mode every request
+// waits for its reply before the next is sent.
+#define MAX_PENDING_REPLIES     64
+
+typedef struct PendingReply {
     VhostUserRequest request;
-    uint32_t flags;
-    uint32_t size;
-    union {
-        uint64_t u64;
-        struct {
-            uint32_t index;
-            uint32_t num;
-        } state;
-    } payload;
-} __attribute__((packed)) VhostUserMsg;
+    VhostUserMsg *reply;        // NULL: the reply is a status, 0 on success
+} PendingReply;
 
-static int connect_to_server(const char *socket_path) {
+typedef struct VhostConn {
+    const char *path;
     int sock;
+    VhostUserReader rd;
+    int reply_ack;              // VHOST_USER_PROTOCOL_F_REPLY_ACK negotiated
+    int lockstep;
+    PendingReply pending[MAX_PENDING_REPLIES];
+    unsigned npending;
+    uint64_t requests;
+    uint64_t round_trips;       // times we blocked for replies
+    uint64_t connect_ns;
+    int bringup_done;
+    // What the device was set up with, for replaying it after --reconnect
+    uint64_t features;
+    uint64_t protocol_features;
+    int inflight_fd;            // area from GET_INFLIGHT_FD, -1 if none
+    VhostUserInflight inflight;
+} VhostConn;
+
+// Guest memory owned by the client acting as frontend.
+typedef struct GuestRegion {
+    uint64_t guest_phys_addr;
+    uint64_t size;
+    uint64_t page_size;         // 4KB, or the huge page size with MFD_HUGETLB
+    uint8_t *addr;
+    int fd;
+} GuestRegion;
+
+typedef struct GuestMemory {
+    uint32_t nregions;
+    GuestRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    uint32_t alloc_region;      // bump allocator position
+    uint64_t alloc_off;
+} GuestMemory;
+
+// Dirty page bitmap shared with the backend, one bit per 4KB guest page.
+#define LOG_PAGE_SIZE       4096
+
+typedef struct DirtyLog {
+    uint8_t *bitmap;
+    uint64_t size;
+    int fd;
+} DirtyLog;
+
+#define MRG_RX_BUF_SIZE     1536        // RX buffer size with --mrg-rxbuf
+#define VHOST_NET_RX_QUEUE  0
+#define VHOST_NET_TX_QUEUE  1
+#define MAX_QUEUE_PAIRS     8
+#define MAX_FRAME_SIZE      1518
+#define ETH_HDR_SIZE        14
+// --tso frames: Ethernet, IPv4 and TCP headers, 1460 byte segments
+#define TCP_HDRS_SIZE       54
+#define TSO_MSS             1460
+#define TSO_SEG_MAX         (TCP_HDRS_SIZE + TSO_MSS)
+#define TSO_FRAME_MAX       (ETH_HDR_SIZE + 65535)
+#define LATENCY_BUCKETS     32
+
+typedef struct TrafficConfig {
+    uint16_t ring_size;
+    int packed;
+    uint32_t pkt_size;
+    int imix;
+    double duration;
+    unsigned queues;            // queue pairs in --traffic mode
+    double rate;                // packets per second over all pairs, 0: unlimited
+    int enable_rings;           // rings start disabled (protocol features)
+    int mrg_rxbuf;              // negotiate VIRTIO_NET_F_MRG_RXBUF
+    int dirty_log;              // have the backend log the pages it writes
+    int event_idx;              // negotiate VIRTIO_RING_F_EVENT_IDX
+    int tso;                    // TCP frames with checksum and segmentation offload
+    unsigned segs;              // descriptors per TX frame
+    int indirect;               // put them in indirect tables (VIRTIO_RING_F_INDIRECT_DESC)
+    int reconnect;              // survive backend restarts (INFLIGHT_SHMFD)
+} TrafficConfig;
+
+// Simple IMIX: 7 x 64, 4 x 570 and 1 x 1518 byte frames, interleaved.
+static const uint16_t imix_sizes[] = {
+    64, 570, 64, 64, 570, 64, 1518, 64, 570, 64, 64, 570
+};
+#define IMIX_LEN (sizeof(imix_sizes) / sizeof(imix_sizes[0]))
+
+// One vring driven by the client, with a fixed buffer per descriptor slot.
+typedef struct ClientVring {
+    unsigned index;
+    VqDriver drv;
+    uint8_t *ring;
+    uint64_t ring_gpa;
+    uint8_t *bufs;
+    uint64_t bufs_gpa;
+    uint32_t buf_size;
+    uint8_t *tables;            // TX with --indirect: a table per slot
+    uint64_t tables_gpa;
+    int kick_fd;
+    int call_fd;
+    uint64_t kicks;             // kick eventfd writes
+    uint64_t calls;             // call eventfd writes by the backend
+} ClientVring;
+
+// Returns -1 with errno set, quietly: --reconnect retries until a
+// backend listens again.
+static int unix_connect(const char *socket_path) {
+    int sock, err;
     struct sockaddr_un addr;
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock < 0) {
-        perror("socket");
         return -1;
     }
 
@@ -61,96 +146,1644 @@ static int connect_to_server(const char *socket_path) {
     strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
 
     if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect");
+        err = errno;
         close(sock);
+        errno = err;
         return -1;
     }
 
     return sock;
 }
 
-static int send_message(int sock, VhostUserMsg *msg) {
-    ssize_t ret = send(sock, msg, sizeof(*msg), 0);
-    if (ret != sizeof(*msg)) {
-        perror("send");
+static int connect_to_server(const char *socket_path) {
+    int sock = unix_connect(socket_path);
+
+    if (sock < 0) {
+        perror("connect");
+    }
+    return sock;
+}
+
+// Read the next reply, from what is already buffered if possible.
+static int recv_message(VhostConn *conn, VhostUserMsg *msg) {
+    int fds[VHOST_USER_MAX_FDS];
+    size_t nfds;
+    int ret;
+
+    while ((ret = vhost_user_next(&conn->rd, msg, sizeof(*msg), fds, &nfds)) == 0) {
+        ssize_t n = vhost_user_recv(conn->sock, &conn->rd, 0);
+
+        if (n <= 0) {
+            if (n < 0) {
+                perror("recv");
+            } else {
+                printf("Connection closed by server\n");
+            }
+            return -1;
+        }
+    }
+    // Only the GET_INFLIGHT_FD reply carries a descriptor we keep.
+    if (ret > 0 && msg->request == VHOST_USER_GET_INFLIGHT_FD && nfds > 0) {
+        if (conn->inflight_fd >= 0) {
+            close(conn->inflight_fd);
+        }
+        conn->inflight_fd = fds[0];
+        fds[0] = -1;
+    }
+    for (size_t i = 0; i < nfds; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static void guest_memory_free(GuestMemory *gm) {
+    for (uint32_t i = 0; i < gm->nregions; i++) {
+        munmap(gm->regions[i].addr, gm->regions[i].size);
+        close(gm->regions[i].fd);
+    }
+    gm->nregions = 0;
+}
+
+// Create and map a memfd of at least size bytes, whole pages of it, for
+// one region. Returns -1 with errno set, having printed nothing.
+static int guest_region_create(GuestRegion *reg, uint64_t size, unsigned flags) {
+    struct stat st;
+    int fd = memfd_create("vhost-guest-mem", MFD_CLOEXEC | flags), err;
+
+    if (fd < 0) {
+        return -1;
+    }
+    // hugetlbfs reports its page size as the block size.
+    if (fstat(fd, &st) == 0) {
+        reg->page_size = st.st_blksize;
+        size = (size + reg->page_size - 1) & ~(reg->page_size - 1);
+        // Huge pages are reserved here, so a shortage shows now rather
+        // than as SIGBUS on first touch.
+        if (ftruncate(fd, size) == 0) {
+            reg->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (reg->addr != MAP_FAILED) {
+                reg->fd = fd;
+                reg->size = size;
+                return 0;
+            }
+        }
+    }
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+// Back the guest with memfds so the server can map them directly. With
+// hugepages they are MFD_HUGETLB memfds, and regions are rounded up to
+// whole huge pages; if the system cannot provide them, all of guest memory
+// falls back to 4KB pages.
+static int guest_memory_init(GuestMemory *gm, uint64_t total_size,
+                             uint32_t nregions, int hugepages) {
+    uint64_t region_size = total_size / nregions, gpa = 0;
+
+    memset(gm, 0, sizeof(*gm));
+    for (uint32_t i = 0; i < nregions; i++) {
+        GuestRegion *reg = &gm->regions[i];
+
+        if (hugepages && guest_region_create(reg, region_size, MFD_HUGETLB) < 0) {
+            printf("Huge pages unavailable for guest memory (%s), using 4KB pages\n",
+                   strerror(errno));
+            guest_memory_free(gm);
+            return guest_memory_init(gm, total_size, nregions, 0);
+        }
+        if (!hugepages && guest_region_create(reg, region_size, 0) < 0) {
+            perror("guest memory");
+            guest_memory_free(gm);
+            return -1;
+        }
+        reg->guest_phys_addr = gpa;
+        gpa += reg->size;
+        gm->nregions++;
+    }
+    printf("Guest memory: %luMB in %u region(s) on %luKB pages\n", gpa >> 20,
+           gm->nregions, gm->regions[0].page_size >> 10);
+    return 0;
+}
+
+// Carve size bytes out of guest memory; allocations never span regions.
+static uint8_t *guest_alloc(GuestMemory *gm, uint64_t size, uint64_t align,
+                            uint64_t *gpa) {
+    while (gm->alloc_region < gm->nregions) {
+        GuestRegion *reg = &gm->regions[gm->alloc_region];
+        uint64_t off = (gm->alloc_off + align - 1) & ~(align - 1);
+        if (off + size <= reg->size) {
+            gm->alloc_off = off + size;
+            *gpa = reg->guest_phys_addr + off;
+            return reg->addr + off;
+        }
+        gm->alloc_region++;
+        gm->alloc_off = 0;
+    }
+    fprintf(stderr, "Out of guest memory (need %lu bytes)\n", size);
+    return NULL;
+}
+
+// A bitmap covering all of guest memory, in its own memfd.
+static int dirty_log_init(DirtyLog *log, const GuestMemory *gm) {
+    const GuestRegion *last = &gm->regions[gm->nregions - 1];
+    uint64_t pages = (last->guest_phys_addr + last->size + LOG_PAGE_SIZE - 1) /
+                     LOG_PAGE_SIZE;
+
+    log->size = (pages + 7) / 8;
+    log->fd = memfd_create("vhost-dirty-log", MFD_CLOEXEC);
+    if (log->fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(log->fd, log->size) < 0) {
+        perror("ftruncate");
+        close(log->fd);
+        return -1;
+    }
+    log->bitmap = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       log->fd, 0);
+    if (log->bitmap == MAP_FAILED) {
+        perror("mmap");
+        close(log->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void dirty_log_free(DirtyLog *log) {
+    if (log->bitmap) {
+        munmap(log->bitmap, log->size);
+        close(log->fd);
+        log->bitmap = NULL;
+    }
+}
+
+static uint64_t dirty_log_count(const DirtyLog *log) {
+    uint64_t pages = 0;
+
+    for (uint64_t i = 0; i < log->size; i++) {
+        pages += __builtin_popcount(log->bitmap[i]);
+    }
+    return pages;
+}
+
+static uint64_t guest_va_to_uva(const uint8_t *va) {
+    return (uint64_t)(uintptr_t)va;
+}
+
+// Collect every outstanding reply. All of them are read even after a
+// failed status so the stream stays in step with the requests.
+static int vhost_wait(VhostConn *conn) {
+    unsigned n = conn->npending;
+    int ret = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+    conn->npending = 0;
+    conn->round_trips++;
+    for (unsigned i = 0; i < n; i++) {
+        const PendingReply *p = &conn->pending[i];
+        VhostUserMsg status;
+        VhostUserMsg *reply = p->reply ? p->reply : &status;
+
+        if (recv_message(conn, reply) < 0) {
+            return -1;
+        }
+        if (reply->request != p->request) {
+            printf("Unexpected reply %d to request %d\n", reply->request, p->request);
+            return -1;
+        }
+        if (!p->reply && reply->payload.u64 != 0) {
+            printf("Request %d failed: status 0x%lx\n", p->request, reply->payload.u64);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// Send a request. Requests with a reply of their own store it in reply,
+// or check it as a status when reply is NULL. ack asks a REPLY_ACK
+// backend to report the status of any other request; lockstep mode asks
+// for every one.
+static int vhost_send(VhostConn *conn, VhostUserMsg *msg, const int *fds,
+                      size_t nfds, VhostUserMsg *reply, int ack) {
+    int has_reply = vhost_user_request_has_reply(msg->request);
+
+    if (!has_reply && conn->reply_ack && (ack || conn->lockstep)) {
+        msg->flags |= VHOST_USER_NEED_REPLY_MASK;
+        has_reply = 1;
+    }
+    if (has_reply && conn->npending == MAX_PENDING_REPLIES && vhost_wait(conn) < 0) {
+        return -1;
+    }
+    if (vhost_user_send(conn->sock, (const VhostUserHdr *)msg, &msg->payload,
+                        fds, nfds) < 0) {
+        return -1;
+    }
+    conn->requests++;
+    if (has_reply) {
+        conn->pending[conn->npending].request = msg->request;
+        conn->pending[conn->npending].reply = reply;
+        conn->npending++;
+    }
+    return conn->lockstep ? vhost_wait(conn) : 0;
+}
+
+static int set_vring_state(VhostConn *conn, VhostUserRequest request,
+                           unsigned index, unsigned num, int ack) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = request;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = index;
+    msg.payload.state.num = num;
+    return vhost_send(conn, &msg, NULL, 0, NULL, ack);
+}
+
+static int set_vring_fd(VhostConn *conn, VhostUserRequest request,
+                        unsigned index, int fd, int ack) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = request;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = index;
+    return vhost_send(conn, &msg, &fd, 1, NULL, ack);
+}
+
+static int get_vring_base(VhostConn *conn, unsigned index, unsigned *base) {
+    VhostUserMsg msg, reply;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_GET_VRING_BASE;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = index;
+    if (vhost_send(conn, &msg, NULL, 0, &reply, 0) < 0 || vhost_wait(conn) < 0) {
+        return -1;
+    }
+    *base = reply.payload.state.num;
+    return 0;
+}
+
+// Reset the call eventfd, counting the writes it collected.
+static void client_vring_ack(ClientVring *cv) {
+    uint64_t val;
+
+    if (read(cv->call_fd, &val, sizeof(val)) == sizeof(val)) {
+        cv->calls += val;
+    } else if (errno != EAGAIN) {
+        perror("read call eventfd");
+    }
+}
+
+static void client_vring_close(ClientVring *cv) {
+    if (cv->kick_fd >= 0) {
+        close(cv->kick_fd);
+    }
+    if (cv->call_fd >= 0) {
+        client_vring_ack(cv);
+        close(cv->call_fd);
+    }
+    cv->kick_fd = cv->call_fd = -1;
+    vq_driver_cleanup(&cv->drv);
+}
+
+// Hand a laid out ring to the backend, to continue from base. The requests
+// are only queued: starting the ring (the kick) and enabling it are acked,
+// and vhost_bringup_done() collects the acks.
+static int client_vring_start(VhostConn *conn, const ClientVring *cv,
+                              const TrafficConfig *cfg, unsigned base) {
+    VhostUserMsg msg;
+    VhostUserVringAddr addr;
+    unsigned index = cv->index;
+    uint16_t num = cfg->ring_size;
+    int packed = cfg->packed;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.index = index;
+    addr.desc_user_addr = guest_va_to_uva(cv->ring);
+    if (cfg->dirty_log) {
+        // The backend finds a packed ring's descriptors itself.
+        addr.flags = 1U << VHOST_VRING_F_LOG;
+        addr.log_guest_addr = cv->ring_gpa + (packed ? 0 : vring_used_offset(num));
+    }
+    if (packed) {
+        addr.avail_user_addr = guest_va_to_uva(cv->ring + vring_packed_driver_offset(num));
+        addr.used_user_addr = guest_va_to_uva(cv->ring + vring_packed_device_offset(num));
+    } else {
+        addr.avail_user_addr = guest_va_to_uva(cv->ring + vring_avail_offset(num));
+        addr.used_user_addr = guest_va_to_uva(cv->ring + vring_used_offset(num));
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_VRING_ADDR;
+    msg.flags = 1;
+    msg.size = sizeof(addr);
+    memcpy(&msg.payload.addr, &addr, sizeof(addr));
+
+    if (set_vring_state(conn, VHOST_USER_SET_VRING_NUM, index, num, 0) < 0 ||
+        vhost_send(conn, &msg, NULL, 0, NULL, 0) < 0 ||
+        set_vring_state(conn, VHOST_USER_SET_VRING_BASE, index, base, 0) < 0 ||
+        set_vring_fd(conn, VHOST_USER_SET_VRING_CALL, index, cv->call_fd, 0) < 0 ||
+        set_vring_fd(conn, VHOST_USER_SET_VRING_KICK, index, cv->kick_fd, 1) < 0 ||
+        (cfg->enable_rings &&
+         set_vring_state(conn, VHOST_USER_SET_VRING_ENABLE, index, 1, 1) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Lay out a ring plus one buffer per slot in guest memory and start it.
+static int client_vring_setup(VhostConn *conn, GuestMemory *gm, ClientVring *cv,
+                              unsigned index, const TrafficConfig *cfg,
+                              uint32_t buf_size) {
+    uint16_t num = cfg->ring_size;
+    int packed = cfg->packed;
+    size_t ring_size = packed ? vring_packed_size(num) : vring_split_size(num);
+
+    memset(cv, 0, sizeof(*cv));
+    cv->index = index;
+    cv->buf_size = buf_size;
+    cv->kick_fd = cv->call_fd = -1;
+    cv->ring = guest_alloc(gm, ring_size, 4096, &cv->ring_gpa);
+    cv->bufs = guest_alloc(gm, (uint64_t)num * buf_size, 64, &cv->bufs_gpa);
+    if (cfg->indirect && index % 2 == VHOST_NET_TX_QUEUE) {
+        cv->tables = guest_alloc(gm, (uint64_t)num * cfg->segs * sizeof(VringDesc), 64,
+                                 &cv->tables_gpa);
+        if (!cv->tables) {
+            return -1;
+        }
+    }
+    if (!cv->ring || !cv->bufs || vq_driver_init(&cv->drv, num, packed, cv->ring) < 0) {
+        return -1;
+    }
+    cv->drv.event_idx = cfg->event_idx;
+
+    cv->kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    cv->call_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (cv->kick_fd < 0 || cv->call_fd < 0) {
+        perror("eventfd");
+        client_vring_close(cv);
+        return -1;
+    }
+    if (client_vring_start(conn, cv, cfg, packed ? 1U << VRING_PACKED_WRAP_SHIFT : 0) < 0) {
+        client_vring_close(cv);
+        return -1;
+    }
+    return 0;
+}
+
+// Where a restarted backend continues the ring: a split ring's used index,
+// or for a packed ring the driver's own used position, which the backend
+// only falls back to when the inflight area does not know better.
+static unsigned client_vring_base(const ClientVring *cv) {
+    if (cv->drv.packed) {
+        return __atomic_load_n(&cv->drv.last_used_idx, __ATOMIC_RELAXED) |
+               (unsigned)__atomic_load_n(&cv->drv.used_wrap_counter, __ATOMIC_RELAXED)
+               << VRING_PACKED_WRAP_SHIFT;
+    }
+    return __atomic_load_n(&cv->drv.used->idx, __ATOMIC_ACQUIRE);
+}
+
+static void client_vring_kick(ClientVring *cv) {
+    uint64_t one = 1;
+    if (write(cv->kick_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write kick eventfd");
+    }
+    cv->kicks++;
+}
+
+// Wait for the backend to signal the call eventfd, unless a chain was used
+// before interrupts were enabled.
+static int client_vring_wait(ClientVring *cv, int timeout_ms) {
+    struct pollfd pfd = { .fd = cv->call_fd, .events = POLLIN };
+
+    if (vq_driver_enable_interrupts(&cv->drv)) {
+        return 0;
+    }
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+    client_vring_ack(cv);
+    return 0;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Round-trip latency of looped-back frames. Bucket i counts samples below
+// 2^(i+1) microseconds (and at least 2^i, except for bucket 0).
+typedef struct LatencyStats {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+static void latency_record(LatencyStats *st, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    unsigned b = 0;
+
+    while (us > 1 && b < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    st->buckets[b]++;
+    st->count++;
+    st->sum_ns += ns;
+    if (ns > st->max_ns) {
+        st->max_ns = ns;
+    }
+}
+
+static void latency_merge(LatencyStats *sum, const LatencyStats *st) {
+    sum->count += st->count;
+    sum->sum_ns += st->sum_ns;
+    if (st->max_ns > sum->max_ns) {
+        sum->max_ns = st->max_ns;
+    }
+    for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+        sum->buckets[b] += st->buckets[b];
+    }
+}
+
+// Upper bound, in microseconds, of the bucket holding the given percentile.
+static uint64_t latency_percentile_us(const LatencyStats *st, double pct) {
+    uint64_t target = (uint64_t)(st->count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += st->buckets[b];
+        if (seen >= target && seen > 0) {
+            return 2ULL << b;
+        }
+    }
+    return 2ULL << (LATENCY_BUCKETS - 1);
+}
+
+// Ethernet header of every frame sent; --dst-mac and --src-mac change the
+// addresses, e.g. to put two clients on either side of a switching backend.
+static uint8_t eth_hdr[14] = {
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x02,     // destination
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x01,     // source
+    0x08, 0x00                              // IPv4
+};
+
+static int parse_mac(const char *str, uint8_t *mac) {
+    unsigned b[6];
+    char end;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2], &b[3], &b[4],
+               &b[5], &end) != 6) {
+        return -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (b[i] > 0xff) {
+            return -1;
+        }
+        mac[i] = b[i];
+    }
+    return 0;
+}
+
+static uint32_t max_frame_size(const TrafficConfig *cfg) {
+    return cfg->imix ? MAX_FRAME_SIZE : cfg->pkt_size;
+}
+
+// Frames the backend makes of each one sent.
+static uint32_t frame_segments(const TrafficConfig *cfg) {
+    if (!cfg->tso || cfg->pkt_size <= TSO_SEG_MAX) {
+        return 1;
+    }
+    return (cfg->pkt_size - TCP_HDRS_SIZE + TSO_MSS - 1) / TSO_MSS;
+}
+
+// With --tso the Ethernet frame is a TCP/IPv4 packet whose checksum the
+// backend finishes, as a guest that negotiated VIRTIO_NET_F_CSUM sends it:
+// the TCP checksum field holds the pseudo-header sum. Frames larger than
+// one segment go out as a single TSO send.
+static void fill_tcp_frame(uint8_t *buf, uint32_t frame_len) {
+    VirtioNetHdr vh = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = frame_len > TSO_SEG_MAX ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_NONE,
+        .hdr_len = TCP_HDRS_SIZE,
+        .gso_size = TSO_MSS,
+        .csum_start = ETH_HDR_SIZE + 20,
+        .csum_offset = NET_TCP_CSUM_OFF,
+    };
+    uint8_t *ip = buf + VIRTIO_NET_HDR_SIZE + ETH_HDR_SIZE, *tcp = ip + 20;
+    uint16_t ip_len = frame_len - ETH_HDR_SIZE, csum;
+
+    memcpy(buf, &vh, sizeof(vh));
+    memset(ip, 0, 40);
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len & 0xff;
+    ip[8] = 64;                                 // TTL
+    ip[9] = 6;                                  // TCP
+    memcpy(ip + 12, (const uint8_t[]){ 10, 0, 0, 1, 10, 0, 0, 2 }, 8);
+    csum = net_csum_fold(net_csum(ip, 20, 0));
+    memcpy(ip + 10, &csum, sizeof(csum));
+    tcp[0] = 0x04;                              // port 1234
+    tcp[1] = 0xd2;
+    tcp[2] = 0x16;                              // port 5678
+    tcp[3] = 0x2e;
+    tcp[12] = 5 << 4;                           // no options
+    tcp[13] = 0x18;                             // ACK, PSH
+    tcp[14] = 0xff;
+    tcp[15] = 0xff;
+    csum = ~net_csum_fold(net_pseudo_sum(ip, 0, 6, ip_len - 20));
+    memcpy(tcp + NET_TCP_CSUM_OFF, &csum, sizeof(csum));
+}
+
+// A virtio-net header followed by an Ethernet frame of the largest size
+// cfg sends.
+static void fill_frame(uint8_t *buf, const TrafficConfig *cfg) {
+    uint32_t frame_len = max_frame_size(cfg);
+
+    memset(buf, 0, VIRTIO_NET_HDR_SIZE);
+    buf += VIRTIO_NET_HDR_SIZE;
+    if (frame_len >= sizeof(eth_hdr)) {
+        memcpy(buf, eth_hdr, sizeof(eth_hdr));
+        memset(buf + sizeof(eth_hdr), 0xa5, frame_len - sizeof(eth_hdr));
+    } else {
+        memset(buf, 0xa5, frame_len);
+    }
+    if (cfg->tso) {
+        fill_tcp_frame(buf - VIRTIO_NET_HDR_SIZE, frame_len);
+    }
+}
+
+// Where frames carry their send time: after the Ethernet header, or after
+// the TCP header with --tso.
+static uint32_t tstamp_offset(const TrafficConfig *cfg) {
+    return cfg->tso ? TCP_HDRS_SIZE : ETH_HDR_SIZE;
+}
+
+// Whether the TX ring has the slots for another frame.
+static int tx_room(const ClientVring *tx, const TrafficConfig *cfg) {
+    return tx->drv.num_free >= (cfg->indirect ? 1 : cfg->segs);
+}
+
+// Queue a TX frame in the next free slot, stamped with tstamp (if non-zero
+// and the frame has room after the Ethernet header). Returns the frame
+// length. With --segs the frame is handed over as the virtio-net header
+// followed by segs - 1 pieces of about equal size, through an indirect
+// table with --indirect; it still lies in the buffer of the head slot.
+static uint32_t tx_add(ClientVring *tx, const TrafficConfig *cfg, uint64_t seq,
+                       uint64_t tstamp) {
+    uint32_t len = cfg->imix ? imix_sizes[seq % IMIX_LEN] : cfg->pkt_size;
+    uint16_t slot = tx->drv.free_head;
+    uint8_t *buf = tx->bufs + (uint64_t)slot * tx->buf_size;
+    uint64_t gpa = tx->bufs_gpa + (uint64_t)slot * tx->buf_size;
+    VringDesc segs[VQ_MAX_SEGS];
+    unsigned nsegs = cfg->segs;
+
+    if (tstamp && len >= tstamp_offset(cfg) + sizeof(tstamp)) {
+        memcpy(buf + VIRTIO_NET_HDR_SIZE + tstamp_offset(cfg), &tstamp, sizeof(tstamp));
+    }
+    if (nsegs == 1) {
+        segs[0] = (VringDesc){ .addr = gpa, .len = VIRTIO_NET_HDR_SIZE + len };
+    } else {
+        uint32_t off = VIRTIO_NET_HDR_SIZE;
+
+        segs[0] = (VringDesc){ .addr = gpa, .len = VIRTIO_NET_HDR_SIZE };
+        for (unsigned i = 1; i < nsegs; i++) {
+            uint32_t end = VIRTIO_NET_HDR_SIZE + (uint64_t)len * i / (nsegs - 1);
+
+            segs[i] = (VringDesc){ .addr = gpa + off, .len = end - off };
+            off = end;
+        }
+    }
+    if (cfg->indirect) {
+        uint64_t table_off = (uint64_t)slot * cfg->segs * sizeof(VringDesc);
+
+        vq_driver_add_indirect(&tx->drv, segs, nsegs, tx->tables + table_off,
+                               tx->tables_gpa + table_off);
+    } else {
+        vq_driver_add(&tx->drv, segs, nsegs);
+    }
+    return len;
+}
+
+// Post every free RX slot as a device-writable buffer.
+static int rx_refill(ClientVring *rx) {
+    int added = 0;
+
+    while (rx->drv.num_free > 0) {
+        VringDesc seg = {
+            .addr = rx->bufs_gpa + (uint64_t)rx->drv.free_head * rx->buf_size,
+            .len = rx->buf_size,
+            .flags = VRING_DESC_F_WRITE,
+        };
+        vq_driver_add(&rx->drv, &seg, 1);
+        added++;
+    }
+    if (added) {
+        vq_driver_publish(&rx->drv);
+        if (vq_driver_needs_kick(&rx->drv)) {
+            client_vring_kick(rx);
+        }
+    }
+    return added;
+}
+
+// Wait for either vring's call eventfd. Interrupts are only enabled for
+// the wait: while frames flow the rings are polled.
+static void wait_for_backend(ClientVring *tx, ClientVring *rx, uint64_t timeout_ns) {
+    struct pollfd pfds[2] = {
+        { .fd = tx->call_fd, .events = POLLIN },
+        { .fd = rx->call_fd, .events = POLLIN },
+    };
+    struct timespec timeout = {
+        .tv_sec = timeout_ns / 1000000000ULL,
+        .tv_nsec = timeout_ns % 1000000000ULL,
+    };
+    int pending = vq_driver_enable_interrupts(&tx->drv);
+
+    pending |= vq_driver_enable_interrupts(&rx->drv);
+    if (!pending && ppoll(pfds, 2, &timeout, NULL) > 0) {
+        if (pfds[0].revents & POLLIN) {
+            client_vring_ack(tx);
+        }
+        if (pfds[1].revents & POLLIN) {
+            client_vring_ack(rx);
+        }
+    }
+    vq_driver_disable_interrupts(&tx->drv);
+    vq_driver_disable_interrupts(&rx->drv);
+}
+
+// Collect the acks of the setup requests queued so far and report how
+// long the device took to come up, counted from connect().
+static int vhost_bringup_done(VhostConn *conn) {
+    if (vhost_wait(conn) < 0) {
+        printf("Device setup failed\n");
+        return -1;
+    }
+    if (!conn->bringup_done) {
+        conn->bringup_done = 1;
+        printf("Bring-up: %.1fus, %lu requests in %lu round trips (%s)\n",
+               (now_ns() - conn->connect_ns) / 1e3, conn->requests,
+               conn->round_trips, conn->lockstep ? "lockstep" : "pipelined");
+    }
+    return 0;
+}
+
+// Push count packets through the TX queue and wait until the backend has
+// returned every one of them.
+static int run_tx_packets(VhostConn *conn, GuestMemory *gm, const TrafficConfig *cfg,
+                          uint64_t count) {
+    ClientVring tx;
+    uint64_t sent = 0, completed = 0;
+    uint32_t buf_size = VIRTIO_NET_HDR_SIZE + max_frame_size(cfg);
+    uint16_t ring_size = cfg->ring_size;
+    unsigned base;
+
+    if (client_vring_setup(conn, gm, &tx, VHOST_NET_TX_QUEUE, cfg, buf_size) < 0) {
+        printf("Failed to set up TX vring\n");
+        return -1;
+    }
+    if (vhost_bringup_done(conn) < 0) {
+        client_vring_close(&tx);
+        return -1;
+    }
+    for (uint32_t i = 0; i < ring_size; i++) {
+        fill_frame(tx.bufs + (uint64_t)i * buf_size, cfg);
+    }
+
+    printf("Sending %lu packets...\n", count);
+    while (completed < count) {
+        int progress = 0, added = 0;
+
+        while (vq_driver_get_used(&tx.drv, NULL) >= 0) {
+            completed++;
+            progress = 1;
+        }
+        while (sent < count && tx_room(&tx, cfg)) {
+            tx_add(&tx, cfg, sent, 0);
+            sent++;
+            added++;
+        }
+        if (added) {
+            vq_driver_publish(&tx.drv);
+            if (vq_driver_needs_kick(&tx.drv)) {
+                client_vring_kick(&tx);
+            }
+            progress = 1;
+        }
+        if (!progress && completed < count && client_vring_wait(&tx, 1000) < 0) {
+            printf("Timed out waiting for the backend (%lu/%lu completed)\n",
+                   completed, count);
+            client_vring_close(&tx);
+            return -1;
+        }
+    }
+
+    if (get_vring_base(conn, VHOST_NET_TX_QUEUE, &base) < 0) {
+        client_vring_close(&tx);
+        return -1;
+    }
+    client_vring_close(&tx);
+    if (cfg->packed) {
+        // Packed rings report the wrap counter in bit 15 of the base.
+        uint64_t pos = count % (2ULL * ring_size);
+        unsigned expected = (pos % ring_size) |
+                            ((pos < ring_size) << VRING_PACKED_WRAP_SHIFT);
+        if (base != expected) {
+            printf("Backend vring base 0x%x does not match %lu sent packets\n",
+                   base, count);
+            return -1;
+        }
+    } else if (base != (uint16_t)count) {
+        printf("Backend vring base %u does not match %lu sent packets\n",
+               base, count);
         return -1;
     }
+    printf("TX: %lu packets completed\n", completed);
     return 0;
 }
 
-static int recv_message(int sock, VhostUserMsg *msg) {
-    ssize_t ret = recv(sock, msg, sizeof(*msg), 0);
-    if (ret != sizeof(*msg)) {
-        if (ret < 0) {
-            perror("recv");
+typedef struct TrafficStats {
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_completed;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_buffers;        // used RX entries, more than rx_packets if merged
+    uint64_t rx_csum_errors;    // --tso: frames whose TCP checksum is wrong
+} TrafficStats;
+
+static void print_rate(const char *label, uint64_t packets, uint64_t bytes,
+                       double secs) {
+    printf("%s: %lu packets, %.3f Mpps, %.3f Gbit/s\n", label, packets,
+           packets / secs / 1e6, bytes * 8 / secs / 1e9);
+}
+
+// One RX/TX queue pair, driven by its own thread in --traffic mode.
+typedef struct TrafficPair {
+    const TrafficConfig *cfg;
+    ClientVring rx;
+    ClientVring tx;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    TrafficStats st;            // published by the pair's thread
+    LatencyStats latency;       // read once the thread is done
+    unsigned rx_merge_left;     // buffers still to come for the current frame
+    pthread_t thread;
+} TrafficPair;
+
+static void traffic_stats_publish(TrafficStats *dst, const TrafficStats *src) {
+    __atomic_store_n(&dst->tx_packets, src->tx_packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->tx_bytes, src->tx_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->tx_completed, src->tx_completed, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->rx_packets, src->rx_packets, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->rx_bytes, src->rx_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->rx_buffers, src->rx_buffers, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->rx_csum_errors, src->rx_csum_errors, __ATOMIC_RELAXED);
+}
+
+static void traffic_stats_add(TrafficStats *sum, const TrafficStats *st) {
+    sum->tx_packets += __atomic_load_n(&st->tx_packets, __ATOMIC_RELAXED);
+    sum->tx_bytes += __atomic_load_n(&st->tx_bytes, __ATOMIC_RELAXED);
+    sum->tx_completed += __atomic_load_n(&st->tx_completed, __ATOMIC_RELAXED);
+    sum->rx_packets += __atomic_load_n(&st->rx_packets, __ATOMIC_RELAXED);
+    sum->rx_bytes += __atomic_load_n(&st->rx_bytes, __ATOMIC_RELAXED);
+    sum->rx_buffers += __atomic_load_n(&st->rx_buffers, __ATOMIC_RELAXED);
+    sum->rx_csum_errors += __atomic_load_n(&st->rx_csum_errors, __ATOMIC_RELAXED);
+}
+
+// With mergeable RX buffers a frame occupies num_buffers consecutive used
+// entries; only the first one carries the virtio-net header.
+static void traffic_collect(TrafficStats *st, TrafficPair *pair, uint64_t now) {
+    uint32_t len;
+    int head;
+
+    while (vq_driver_get_used(&pair->tx.drv, NULL) >= 0) {
+        st->tx_completed++;
+    }
+    while ((head = vq_driver_get_used(&pair->rx.drv, &len)) >= 0) {
+        const uint8_t *buf = pair->rx.bufs + (uint64_t)head * pair->rx.buf_size;
+        const uint8_t *frame = buf + VIRTIO_NET_HDR_SIZE;
+        uint16_t num_buffers;
+        uint64_t tstamp;
+
+        st->rx_buffers++;
+        if (pair->rx_merge_left > 0) {
+            pair->rx_merge_left--;
+            st->rx_bytes += len;
+            continue;
+        }
+        memcpy(&num_buffers, buf + VIRTIO_NET_HDR_NUM_BUFFERS, sizeof(num_buffers));
+        if (pair->cfg->mrg_rxbuf && num_buffers > 1) {
+            pair->rx_merge_left = num_buffers - 1;
+        }
+        st->rx_packets++;
+        st->rx_bytes += len > VIRTIO_NET_HDR_SIZE ? len - VIRTIO_NET_HDR_SIZE : 0;
+        // Without VIRTIO_NET_F_GUEST_CSUM every checksum arrives finished.
+        if (pair->cfg->tso && num_buffers <= 1 &&
+            net_l4_csum_ok(frame, len - VIRTIO_NET_HDR_SIZE) != 1) {
+            st->rx_csum_errors++;
+        }
+        if (len >= VIRTIO_NET_HDR_SIZE + tstamp_offset(pair->cfg) + sizeof(tstamp)) {
+            memcpy(&tstamp, frame + tstamp_offset(pair->cfg), sizeof(tstamp));
+            if (tstamp != 0 && tstamp <= now) {
+                latency_record(&pair->latency, now - tstamp);
+            }
+        }
+    }
+}
+
+// Send frames on TX until pair->end_ns, as fast as the backend takes them
+// or paced to cfg->rate, and receive whatever it loops back on RX. Frames
+// carry their send time so RX can measure the round trip.
+static void *traffic_pair_run(void *arg) {
+    TrafficPair *pair = arg;
+    const TrafficConfig *cfg = pair->cfg;
+    double rate = cfg->rate / cfg->queues;
+    TrafficStats st;
+    uint64_t now, drain_end;
+
+    memset(&st, 0, sizeof(st));
+    vq_driver_disable_interrupts(&pair->tx.drv);
+    vq_driver_disable_interrupts(&pair->rx.drv);
+    rx_refill(&pair->rx);
+    for (now = now_ns(); now < pair->end_ns; now = now_ns()) {
+        TrafficStats prev = st;
+        uint64_t budget = UINT64_MAX, timeout = 1000000;
+        int added = 0;
+
+        traffic_collect(&st, pair, now);
+        if (rate > 0) {
+            uint64_t due = (uint64_t)((now - pair->start_ns) / 1e9 * rate) + 1;
+            budget = due > st.tx_packets ? due - st.tx_packets : 0;
+        }
+        while (budget-- > 0 && tx_room(&pair->tx, cfg)) {
+            st.tx_bytes += tx_add(&pair->tx, cfg, st.tx_packets, now);
+            st.tx_packets++;
+            added++;
+        }
+        if (added) {
+            vq_driver_publish(&pair->tx.drv);
+            if (vq_driver_needs_kick(&pair->tx.drv)) {
+                client_vring_kick(&pair->tx);
+            }
+        }
+        rx_refill(&pair->rx);
+        if (!added && st.tx_completed == prev.tx_completed &&
+            st.rx_packets == prev.rx_packets) {
+            if (rate > 0) {
+                // Sleep until the next frame is due, unless frames come back.
+                uint64_t next = pair->start_ns + (uint64_t)(st.tx_packets / rate * 1e9);
+                timeout = next > now ? next - now : 0;
+                timeout = timeout < 1000000 ? timeout : 1000000;
+            }
+            wait_for_backend(&pair->tx, &pair->rx, timeout);
+        }
+        traffic_stats_publish(&pair->st, &st);
+    }
+
+    // Give frames already in flight a moment to come back.
+    drain_end = now_ns() + 100000000;
+    while (st.tx_completed < st.tx_packets && (now = now_ns()) < drain_end) {
+        traffic_collect(&st, pair, now);
+        rx_refill(&pair->rx);
+        wait_for_backend(&pair->tx, &pair->rx, 1000000);
+    }
+    traffic_stats_publish(&pair->st, &st);
+    return NULL;
+}
+
+static int vhost_reconnect(VhostConn *conn, GuestMemory *gm, TrafficPair *pairs,
+                           unsigned npairs, const TrafficConfig *cfg, double deadline);
+static int vhost_peer_closed(VhostConn *conn, int timeout_ms);
+
+// Act as a full frontend: set up cfg->queues RX/TX queue pairs and drive
+// each from its own thread for cfg->duration seconds. With --reconnect the
+// traffic rides out backend restarts.
+static int run_traffic(VhostConn *conn, GuestMemory *gm, const TrafficConfig *cfg) {
+    TrafficPair pairs[MAX_QUEUE_PAIRS];
+    TrafficStats st, last;
+    LatencyStats latency;
+    uint32_t buf_size = VIRTIO_NET_HDR_SIZE + max_frame_size(cfg);
+    // Without mergeable buffers every RX buffer must hold the largest frame,
+    // which with --tso is a segment: the backend does not offer GUEST_TSO.
+    uint32_t rx_buf_size = cfg->mrg_rxbuf ? MRG_RX_BUF_SIZE :
+                           cfg->tso && buf_size > VIRTIO_NET_HDR_SIZE + TSO_SEG_MAX ?
+                           VIRTIO_NET_HDR_SIZE + TSO_SEG_MAX : buf_size;
+    double start, now, last_report, end;
+    // --reconnect: when the backend went away, when we were set up again
+    // and how many frames had completed by then; resume_at is 0 once
+    // frames complete again.
+    double gone_at = 0, resume_at = 0;
+    uint64_t resume_mark = 0;
+    unsigned q, nready = 0, nrunning = 0, base, reconnects = 0;
+    uint64_t kicks = 0, calls = 0;
+    int ret = 0;
+
+    memset(pairs, 0, sizeof(pairs));
+    for (q = 0; q < cfg->queues; q++) {
+        TrafficPair *pair = &pairs[q];
+
+        pair->cfg = cfg;
+        if (client_vring_setup(conn, gm, &pair->rx, 2 * q + VHOST_NET_RX_QUEUE,
+                               cfg, rx_buf_size) < 0) {
+            printf("Failed to set up RX vring of queue pair %u\n", q);
+            ret = -1;
+            break;
+        }
+        if (client_vring_setup(conn, gm, &pair->tx, 2 * q + VHOST_NET_TX_QUEUE,
+                               cfg, buf_size) < 0) {
+            printf("Failed to set up TX vring of queue pair %u\n", q);
+            client_vring_close(&pair->rx);
+            ret = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < cfg->ring_size; i++) {
+            fill_frame(pair->tx.bufs + (uint64_t)i * buf_size, cfg);
+        }
+        nready++;
+    }
+    if (ret == 0 && vhost_bringup_done(conn) < 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if (cfg->imix) {
+            printf("Generating IMIX traffic on %u queue pair(s) for %.1fs...\n",
+                   nready, cfg->duration);
+        } else if (cfg->tso) {
+            printf("Generating %u byte TCP sends (%u segment(s), checksum offloaded) "
+                   "on %u queue pair(s) for %.1fs...\n",
+                   cfg->pkt_size, frame_segments(cfg), nready, cfg->duration);
         } else {
-            printf("Partial message received: %zd bytes\n", ret);
+            printf("Generating %u byte frames on %u queue pair(s) for %.1fs...\n",
+                   cfg->pkt_size, nready, cfg->duration);
+        }
+        if (cfg->segs > 1 || cfg->indirect) {
+            printf("TX frames in %u descriptor(s)%s\n", cfg->segs,
+                   cfg->indirect ? " of an indirect table" : "");
+        }
+        start = last_report = now_seconds();
+        end = start + cfg->duration;
+        for (q = 0; q < nready; q++) {
+            pairs[q].start_ns = (uint64_t)(start * 1e9);
+            pairs[q].end_ns = (uint64_t)(end * 1e9);
+            if (pthread_create(&pairs[q].thread, NULL, traffic_pair_run, &pairs[q]) != 0) {
+                printf("Failed to start queue pair %u\n", q);
+                ret = -1;
+                break;
+            }
+            nrunning++;
+        }
+
+        memset(&last, 0, sizeof(last));
+        while (ret == 0 && (now = now_seconds()) < end) {
+            // Sleep on the control socket; after a reconnect, check every
+            // 50us for frames to complete.
+            int wait_ms = (int)((end - now < 1.0 ? end - now : 1.0) * 1e3) + 1;
+
+            if (resume_at > 0) {
+                usleep(50);
+                wait_ms = 0;
+            }
+            if (vhost_peer_closed(conn, wait_ms)) {
+                if (!cfg->reconnect) {
+                    printf("Connection closed by server\n");
+                    ret = -1;
+                    break;
+                }
+                gone_at = now_seconds();
+                printf("Backend went away at %.3fs, reconnecting...\n", gone_at - start);
+                if (vhost_reconnect(conn, gm, pairs, nrunning, cfg, end) < 0) {
+                    printf("Reconnect failed\n");
+                    ret = -1;
+                    break;
+                }
+                reconnects++;
+                resume_at = now_seconds();
+                memset(&st, 0, sizeof(st));
+                for (q = 0; q < nrunning; q++) {
+                    traffic_stats_add(&st, &pairs[q].st);
+                }
+                resume_mark = st.tx_completed;
+            }
+            now = now_seconds();
+            memset(&st, 0, sizeof(st));
+            for (q = 0; q < nrunning; q++) {
+                traffic_stats_add(&st, &pairs[q].st);
+            }
+            if (resume_at > 0 && st.tx_completed > resume_mark) {
+                printf("Reconnected after %.1fms, traffic resumed %.1fms after reconnecting\n",
+                       (resume_at - gone_at) * 1e3, (now - resume_at) * 1e3);
+                resume_at = 0;
+            }
+            if (now - last_report >= 0.5) {
+                printf("  %6.1fs  TX %.3f Mpps  RX %.3f Mpps\n", now - start,
+                       (st.tx_packets - last.tx_packets) / (now - last_report) / 1e6,
+                       (st.rx_packets - last.rx_packets) / (now - last_report) / 1e6);
+                last = st;
+                last_report = now;
+            }
+        }
+        for (q = 0; q < nrunning; q++) {
+            pthread_join(pairs[q].thread, NULL);
         }
+        now = now_seconds() - start;
+    }
+
+    memset(&st, 0, sizeof(st));
+    memset(&latency, 0, sizeof(latency));
+    for (q = 0; q < nready; q++) {
+        TrafficPair *pair = &pairs[q];
+
+        get_vring_base(conn, 2 * q + VHOST_NET_TX_QUEUE, &base);
+        get_vring_base(conn, 2 * q + VHOST_NET_RX_QUEUE, &base);
+        client_vring_close(&pair->tx);
+        client_vring_close(&pair->rx);
+        kicks += pair->tx.kicks + pair->rx.kicks;
+        calls += pair->tx.calls + pair->rx.calls;
+        traffic_stats_add(&st, &pair->st);
+        latency_merge(&latency, &pair->latency);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (nrunning > 1) {
+        for (q = 0; q < nrunning; q++) {
+            printf("Queue pair %u: TX %.3f Mpps, RX %.3f Mpps\n", q,
+                   pairs[q].st.tx_packets / now / 1e6,
+                   pairs[q].st.rx_packets / now / 1e6);
+        }
+    }
+    print_rate("TX", st.tx_packets, st.tx_bytes, now);
+    print_rate("RX", st.rx_packets, st.rx_bytes, now);
+    printf("RX buffers: %u bytes each, %.1fKB per ring, %.2f per frame\n",
+           rx_buf_size, (double)rx_buf_size * cfg->ring_size / 1024,
+           st.rx_packets ? (double)st.rx_buffers / st.rx_packets : 0.0);
+    printf("Drops: %lu (sent but not received back), %lu not completed\n",
+           st.tx_completed * frame_segments(cfg) > st.rx_packets ?
+           st.tx_completed * frame_segments(cfg) - st.rx_packets : 0,
+           st.tx_packets - st.tx_completed);
+    if (cfg->tso) {
+        printf("Checksum errors: %lu\n", st.rx_csum_errors);
+    }
+    printf("Notifications: %lu kicks, %lu interrupts (%.0f per million frames sent)\n",
+           kicks, calls, st.tx_packets ? (kicks + calls) * 1e6 / st.tx_packets : 0.0);
+    if (latency.count > 0) {
+        printf("Latency: avg %.1fus, p50 <%luus, p99 <%luus, max %.1fus (%lu frames)\n",
+               latency.sum_ns / 1e3 / latency.count, latency_percentile_us(&latency, 50),
+               latency_percentile_us(&latency, 99), latency.max_ns / 1e3, latency.count);
+    }
+    if (cfg->reconnect) {
+        printf("Reconnects: %u\n", reconnects);
+    }
+    if (st.tx_completed == 0) {
+        printf("Backend did not complete any frame\n");
+        return -1;
+    }
+    if (resume_at > 0) {
+        printf("Traffic did not resume after reconnecting\n");
+        return -1;
+    }
+    if (st.rx_packets == 0) {
+        printf("Backend did not loop back any frame\n");
+        return -1;
+    }
+    if (st.rx_csum_errors > 0) {
+        printf("Backend looped back frames with a wrong checksum\n");
         return -1;
     }
     return 0;
 }
 
+static int set_u64(VhostConn *conn, VhostUserRequest request, uint64_t value,
+                   int ack) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = request;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = value;
+    return vhost_send(conn, &msg, NULL, 0, NULL, ack);
+}
+
+static int set_features(VhostConn *conn, uint64_t features) {
+    printf("Sending SET_FEATURES request: 0x%lx\n", features);
+    return set_u64(conn, VHOST_USER_SET_FEATURES, features, 1);
+}
+
+static int set_protocol_features(VhostConn *conn, uint64_t features) {
+    printf("Sending SET_PROTOCOL_FEATURES request: 0x%lx\n", features);
+    return set_u64(conn, VHOST_USER_SET_PROTOCOL_FEATURES, features, 0);
+}
+
+static int set_owner(VhostConn *conn) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_OWNER;
+    msg.flags = 1;
+    msg.size = 0;
+    return vhost_send(conn, &msg, NULL, 0, NULL, 0);
+}
+
+static int get_queue_num(VhostConn *conn, uint64_t *num) {
+    VhostUserMsg msg, reply;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_GET_QUEUE_NUM;
+    msg.flags = 1;
+    msg.size = 0;
+    if (vhost_send(conn, &msg, NULL, 0, &reply, 0) < 0 || vhost_wait(conn) < 0) {
+        return -1;
+    }
+    *num = reply.payload.u64;
+    printf("Server supports %lu queue pairs\n", *num);
+    return 0;
+}
+
+static int set_mem_table(VhostConn *conn, const GuestMemory *gm) {
+    VhostUserMsg msg;
+    VhostUserMemory table;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+
+    memset(&table, 0, sizeof(table));
+    table.nregions = gm->nregions;
+    for (uint32_t i = 0; i < gm->nregions; i++) {
+        VhostUserMemoryRegion *reg = &table.regions[i];
+        reg->guest_phys_addr = gm->regions[i].guest_phys_addr;
+        reg->memory_size = gm->regions[i].size;
+        reg->userspace_addr = (uint64_t)(uintptr_t)gm->regions[i].addr;
+        reg->mmap_offset = 0;
+        fds[i] = gm->regions[i].fd;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_MEM_TABLE;
+    msg.flags = 1;
+    msg.size = offsetof(VhostUserMemory, regions) +
+               gm->nregions * sizeof(VhostUserMemoryRegion);
+    memcpy(&msg.payload.memory, &table, sizeof(table));
+
+    printf("Sending SET_MEM_TABLE request (%u regions)...\n", gm->nregions);
+    return vhost_send(conn, &msg, fds, gm->nregions, NULL, 1);
+}
+
+static int set_log_base(VhostConn *conn, const DirtyLog *log) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_LOG_BASE;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.log);
+    msg.payload.log.mmap_size = log->size;
+    msg.payload.log.mmap_offset = 0;
+    printf("Sending SET_LOG_BASE request (%lu byte bitmap)...\n", log->size);
+    return vhost_send(conn, &msg, &log->fd, 1, NULL, 0);
+}
+
+static int get_inflight_fd(VhostConn *conn, uint16_t num_queues, uint16_t queue_size) {
+    VhostUserMsg msg, reply;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_GET_INFLIGHT_FD;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.inflight);
+    msg.payload.inflight.num_queues = num_queues;
+    msg.payload.inflight.queue_size = queue_size;
+    printf("Sending GET_INFLIGHT_FD request (%u queues of %u)...\n", num_queues, queue_size);
+    if (vhost_send(conn, &msg, NULL, 0, &reply, 0) < 0 || vhost_wait(conn) < 0) {
+        return -1;
+    }
+    if (reply.size != sizeof(reply.payload.inflight) || conn->inflight_fd < 0) {
+        printf("Backend did not hand out an inflight area\n");
+        return -1;
+    }
+    memcpy(&conn->inflight, &reply.payload.inflight, sizeof(conn->inflight));
+    conn->inflight.num_queues = num_queues;
+    conn->inflight.queue_size = queue_size;
+    return 0;
+}
+
+static int set_inflight_fd(VhostConn *conn) {
+    VhostUserMsg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.request = VHOST_USER_SET_INFLIGHT_FD;
+    msg.flags = 1;
+    msg.size = sizeof(msg.payload.inflight);
+    memcpy(&msg.payload.inflight, &conn->inflight, sizeof(conn->inflight));
+    printf("Sending SET_INFLIGHT_FD request (%lu byte area)...\n", conn->inflight.mmap_size);
+    return vhost_send(conn, &msg, &conn->inflight_fd, 1, NULL, 1);
+}
+
+// Replay the device setup on a new connection. The rings, their eventfds
+// and the inflight area stay with us, so the new backend continues where
+// the old one stopped while the traffic threads keep running.
+static int vhost_replay_setup(VhostConn *conn, GuestMemory *gm, TrafficPair *pairs,
+                              unsigned npairs, const TrafficConfig *cfg) {
+    if (set_protocol_features(conn, conn->protocol_features) < 0 ||
+        set_owner(conn) < 0 ||
+        set_features(conn, conn->features) < 0 ||
+        set_mem_table(conn, gm) < 0 ||
+        set_inflight_fd(conn) < 0) {
+        return -1;
+    }
+    for (unsigned q = 0; q < npairs; q++) {
+        if (client_vring_start(conn, &pairs[q].rx, cfg, client_vring_base(&pairs[q].rx)) < 0 ||
+            client_vring_start(conn, &pairs[q].tx, cfg, client_vring_base(&pairs[q].tx)) < 0) {
+            return -1;
+        }
+    }
+    return vhost_wait(conn);
+}
+
+static void vhost_disconnect(VhostConn *conn) {
+    close(conn->sock);
+    conn->sock = -1;
+    conn->npending = 0;
+    vhost_user_reader_reset(&conn->rd);
+}
+
+// --reconnect: the backend went away. Connect again every millisecond until
+// a new one takes the device setup or deadline passes. A connection can
+// still land on the dying backend's listening socket and break, so a
+// failed replay is retried too.
+static int vhost_reconnect(VhostConn *conn, GuestMemory *gm, TrafficPair *pairs,
+                           unsigned npairs, const TrafficConfig *cfg, double deadline) {
+    vhost_disconnect(conn);
+    for (;;) {
+        conn->sock = unix_connect(conn->path);
+        if (conn->sock >= 0) {
+            if (vhost_replay_setup(conn, gm, pairs, npairs, cfg) == 0) {
+                return 0;
+            }
+            vhost_disconnect(conn);
+        }
+        if (now_seconds() >= deadline) {
+            printf("Backend did not come back\n");
+            return -1;
+        }
+        usleep(1000);
+    }
+}
+
+// Whether the backend closed the control connection. It sends nothing
+// unasked, so anything readable is the end of the stream.
+static int vhost_peer_closed(VhostConn *conn, int timeout_ms) {
+    struct pollfd pfd = { .fd = conn->sock, .events = POLLIN };
+    ssize_t n;
+    char c;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    n = recv(conn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || n == 0 || (errno != EAGAIN && errno != EINTR);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [OPTIONS] [SOCKET_PATH]\n", prog);
+    printf("  -m, --mem-size MB      share MB of memfd-backed guest memory\n");
+    printf("  -H, --hugepages        back guest memory with MFD_HUGETLB memfds, or with\n"
+           "                         4KB pages if there are no huge pages to be had\n");
+    printf("  -r, --mem-regions N    split guest memory into N regions (1-%d)\n",
+           VHOST_MEMORY_MAX_NREGIONS);
+    printf("  -t, --tx-packets N     send N packets through the TX vring (needs -m)\n");
+    printf("  -q, --ring-size N      vring size (default 256)\n");
+    printf("  -s, --pkt-size BYTES   frame size (default 64)\n");
+    printf("  -P, --packed           negotiate VIRTIO_F_RING_PACKED\n");
+    printf("  -M, --mrg-rxbuf        negotiate VIRTIO_NET_F_MRG_RXBUF and post %d byte\n"
+           "                         RX buffers that large frames span\n", MRG_RX_BUF_SIZE);
+    printf("  -E, --event-idx        negotiate VIRTIO_RING_F_EVENT_IDX\n");
+    printf("  -L, --dirty-log        share a dirty page log and negotiate VHOST_F_LOG_ALL\n");
+    printf("  -l, --lockstep         wait for each control request's reply before sending\n"
+           "                         the next instead of pipelining device setup\n");
+    printf("  -T, --traffic          generate TX/RX traffic (64MB memory by default)\n");
+    printf("  -d, --duration SECS    traffic duration (default 5)\n");
+    printf("  -i, --imix             use IMIX frame sizes instead of --pkt-size\n");
+    printf("  -O, --tso              send TCP frames with the checksum left to the backend,\n"
+           "                         as TSO sends of up to %d bytes if --pkt-size exceeds %d\n",
+           TSO_FRAME_MAX, TSO_SEG_MAX);
+    printf("  -g, --segs N           hand each TX frame over in N descriptors (1-%d):\n"
+           "                         the virtio-net header, then N - 1 pieces of the frame\n",
+           VQ_MAX_SEGS);
+    printf("  -I, --indirect         negotiate VIRTIO_RING_F_INDIRECT_DESC and put the\n"
+           "                         descriptors of a TX frame in an indirect table\n");
+    printf("  -C, --reconnect        with --traffic, share an inflight area (INFLIGHT_SHMFD)\n"
+           "                         and reconnect when the backend restarts\n");
+    printf("  -R, --rate PPS         pace --traffic to PPS frames per second\n");
+    printf("  -Q, --queues N         traffic queue pairs, one thread each (1-%d)\n",
+           MAX_QUEUE_PAIRS);
+    printf("  -D, --dst-mac MAC      destination of the frames (default 02:00:00:00:00:02)\n");
+    printf("  -S, --src-mac MAC      source of the frames (default 02:00:00:00:00:01)\n");
+    printf("  -h, --help             show this help\n");
+}
+
 int main(int argc, char *argv[]) {
     const char *socket_path = "/tmp/vhost-user-sock";
-    int sock;
-    VhostUserMsg msg, reply;
+    static const struct option long_options[] = {
+        { "mem-size",    required_argument, NULL, 'm' },
+        { "mem-regions", required_argument, NULL, 'r' },
+        { "hugepages",   no_argument,       NULL, 'H' },
+        { "tx-packets",  required_argument, NULL, 't' },
+        { "ring-size",   required_argument, NULL, 'q' },
+        { "pkt-size",    required_argument, NULL, 's' },
+        { "packed",      no_argument,       NULL, 'P' },
+        { "mrg-rxbuf",   no_argument,       NULL, 'M' },
+        { "dirty-log",   no_argument,       NULL, 'L' },
+        { "event-idx",   no_argument,       NULL, 'E' },
+        { "lockstep",    no_argument,       NULL, 'l' },
+        { "traffic",     no_argument,       NULL, 'T' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "imix",        no_argument,       NULL, 'i' },
+        { "tso",         no_argument,       NULL, 'O' },
+        { "segs",        required_argument, NULL, 'g' },
+        { "indirect",    no_argument,       NULL, 'I' },
+        { "reconnect",   no_argument,       NULL, 'C' },
+        { "queues",      required_argument, NULL, 'Q' },
+        { "rate",        required_argument, NULL, 'R' },
+        { "dst-mac",     required_argument, NULL, 'D' },
+        { "src-mac",     required_argument, NULL, 'S' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    uint64_t mem_size_mb = 0;
+    uint32_t mem_regions = 1;
+    int hugepages = 0;
+    uint64_t tx_packets = 0;
+    uint32_t ring_size = 256;
+    TrafficConfig cfg = { .pkt_size = 64, .duration = 5.0, .queues = 1, .segs = 1 };
+    int traffic = 0;
+    uint64_t server_features, protocol_features;
+    GuestMemory guest_mem = { 0 };
+    DirtyLog dirty_log = { 0 };
+    VhostConn conn = { .sock = -1, .inflight_fd = -1 };
+    int opt;
+    VhostUserMsg msg, features_reply, protocol_reply;
 
-    if (argc > 1) {
-        socket_path = argv[1];
+    while ((opt = getopt_long(argc, argv, "m:r:Ht:q:s:PMLElTd:iOg:ICQ:R:D:S:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                mem_size_mb = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                mem_regions = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                hugepages = 1;
+                break;
+            case 't':
+                tx_packets = strtoull(optarg, NULL, 0);
+                break;
+            case 'q':
+                ring_size = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                cfg.pkt_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                cfg.packed = 1;
+                break;
+            case 'M':
+                cfg.mrg_rxbuf = 1;
+                break;
+            case 'L':
+                cfg.dirty_log = 1;
+                break;
+            case 'E':
+                cfg.event_idx = 1;
+                break;
+            case 'l':
+                conn.lockstep = 1;
+                break;
+            case 'T':
+                traffic = 1;
+                break;
+            case 'd':
+                cfg.duration = strtod(optarg, NULL);
+                break;
+            case 'i':
+                cfg.imix = 1;
+                break;
+            case 'O':
+                cfg.tso = 1;
+                break;
+            case 'g':
+                cfg.segs = strtoul(optarg, NULL, 0);
+                break;
+            case 'I':
+                cfg.indirect = 1;
+                break;
+            case 'C':
+                cfg.reconnect = 1;
+                break;
+            case 'Q':
+                cfg.queues = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                cfg.rate = strtod(optarg, NULL);
+                break;
+            case 'D':
+            case 'S':
+                if (parse_mac(optarg, opt == 'D' ? eth_hdr : eth_hdr + 6) < 0) {
+                    fprintf(stderr, "Invalid MAC address: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (traffic && mem_size_mb == 0) {
+        mem_size_mb = 64;
+    }
+    if (mem_regions < 1 || mem_regions > VHOST_MEMORY_MAX_NREGIONS ||
+        (tx_packets > 0 && mem_size_mb == 0) ||
+        ring_size == 0 || ring_size > VQ_MAX_RING_SIZE ||
+        (!cfg.packed && (ring_size & (ring_size - 1)) != 0) ||
+        cfg.pkt_size == 0 || cfg.duration <= 0 ||
+        (cfg.tso && (cfg.imix || cfg.pkt_size < TCP_HDRS_SIZE + 8 ||
+                     cfg.pkt_size > TSO_FRAME_MAX)) ||
+        // Every piece of a frame holds at least one byte, and without
+        // --indirect a frame must fit the ring.
+        cfg.segs < 1 || cfg.segs > VQ_MAX_SEGS ||
+        cfg.segs - 1 > (cfg.imix ? imix_sizes[0] : cfg.pkt_size) ||
+        (!cfg.indirect && cfg.segs > ring_size) ||
+        // Replaying the setup does not cover the dirty log.
+        (cfg.reconnect && (!traffic || cfg.dirty_log)) ||
+        cfg.queues < 1 || cfg.queues > MAX_QUEUE_PAIRS || cfg.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    cfg.ring_size = ring_size;
+    if (optind < argc) {
+        socket_path = argv[optind];
     }
 
     printf("Connecting to vhost-user server at: %s\n", socket_path);
+    conn.path = socket_path;
 
-    sock = connect_to_server(socket_path);
-    if (sock < 0) {
+    conn.connect_ns = now_ns();
+    conn.sock = connect_to_server(socket_path);
+    if (conn.sock < 0) {
         printf("Failed to connect to server\n");
         return 1;
     }
 
     printf("Connected successfully\n");
 
+    // Both feature queries go out before either reply is read.
     memset(&msg, 0, sizeof(msg));
     msg.request = VHOST_USER_GET_FEATURES;
     msg.flags = 1;
     msg.size = 0;
 
     printf("Sending GET_FEATURES request...\n");
-    if (send_message(sock, &msg) < 0) {
-        close(sock);
+    if (vhost_send(&conn, &msg, NULL, 0, &features_reply, 0) < 0) {
+        close(conn.sock);
         return 1;
     }
 
-    printf("Waiting for reply...\n");
-    if (recv_message(sock, &reply) < 0) {
-        close(sock);
-        return 1;
-    }
-
-    printf("Received reply: request=%d, flags=0x%x, size=%d, features=0x%lx\n",
-           reply.request, reply.flags, reply.size, reply.payload.u64);
-
     memset(&msg, 0, sizeof(msg));
     msg.request = VHOST_USER_GET_PROTOCOL_FEATURES;
     msg.flags = 1;
     msg.size = 0;
 
     printf("Sending GET_PROTOCOL_FEATURES request...\n");
-    if (send_message(sock, &msg) < 0) {
-        close(sock);
+    if (vhost_send(&conn, &msg, NULL, 0, &protocol_reply, 0) < 0) {
+        close(conn.sock);
         return 1;
     }
 
-    printf("Waiting for protocol features reply...\n");
-    if (recv_message(sock, &reply) < 0) {
-        close(sock);
+    printf("Waiting for replies...\n");
+    if (vhost_wait(&conn) < 0) {
+        close(conn.sock);
         return 1;
     }
 
+    printf("Received reply: request=%d, flags=0x%x, size=%d, features=0x%lx\n",
+           features_reply.request, features_reply.flags, features_reply.size,
+           features_reply.payload.u64);
+    server_features = features_reply.payload.u64;
     printf("Received protocol features: request=%d, flags=0x%x, size=%d, features=0x%lx\n",
-           reply.request, reply.flags, reply.size, reply.payload.u64);
+           protocol_reply.request, protocol_reply.flags, protocol_reply.size,
+           protocol_reply.payload.u64);
+    protocol_features = protocol_reply.payload.u64;
+
+    if (mem_size_mb > 0) {
+        uint64_t features = (1ULL << VIRTIO_F_VERSION_1) |
+                            (cfg.packed ? 1ULL << VIRTIO_F_RING_PACKED : 0) |
+                            (cfg.mrg_rxbuf ? 1ULL << VIRTIO_NET_F_MRG_RXBUF : 0) |
+                            (cfg.event_idx ? 1ULL << VIRTIO_RING_F_EVENT_IDX : 0) |
+                            (cfg.indirect ? 1ULL << VIRTIO_RING_F_INDIRECT_DESC : 0) |
+                            (cfg.tso ? (1ULL << VIRTIO_NET_F_CSUM) |
+                                       (1ULL << VIRTIO_NET_F_HOST_TSO4) : 0);
+        uint64_t protocol = protocol_features &
+                            ((1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                             (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+        uint64_t need_protocol = (cfg.dirty_log ? 1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD : 0) |
+                                (cfg.reconnect ? 1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD : 0);
+        uint64_t queue_num = 1;
+
+        if (cfg.queues > 1 || cfg.dirty_log || cfg.reconnect) {
+            features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        }
+        // A migrating frontend would set VHOST_F_LOG_ALL only once the
+        // migration starts; we log from the first packet.
+        if (cfg.dirty_log) {
+            features |= 1ULL << VHOST_F_LOG_ALL;
+        }
+        if ((server_features & features) != features ||
+            (cfg.queues > 1 && !(protocol & (1ULL << VHOST_USER_PROTOCOL_F_MQ))) ||
+            (protocol_features & need_protocol) != need_protocol) {
+            printf("Server lacks required features 0x%lx (protocol 0x%lx)\n",
+                   features & ~server_features, protocol_features);
+            close(conn.sock);
+            return 1;
+        }
+        // With protocol features negotiated, rings start out disabled.
+        features |= server_features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        cfg.enable_rings = !!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+        protocol |= need_protocol;
+        conn.features = features;
+        conn.protocol_features = protocol;
+        // Protocol features go first so that REPLY_ACK covers the rest of
+        // the setup. Only a multiqueue run has to wait for the queue count
+        // before it lays out its rings.
+        if (cfg.enable_rings && set_protocol_features(&conn, protocol) < 0) {
+            close(conn.sock);
+            return 1;
+        }
+        conn.reply_ack = cfg.enable_rings &&
+                         (protocol & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+        if (set_owner(&conn) < 0 ||
+            set_features(&conn, features) < 0 ||
+            (cfg.queues > 1 && get_queue_num(&conn, &queue_num) < 0)) {
+            close(conn.sock);
+            return 1;
+        }
+        if (queue_num < cfg.queues) {
+            printf("Server supports only %lu queue pairs\n", queue_num);
+            close(conn.sock);
+            return 1;
+        }
+        if (guest_memory_init(&guest_mem, mem_size_mb << 20, mem_regions, hugepages) < 0 ||
+            set_mem_table(&conn, &guest_mem) < 0 ||
+            (cfg.reconnect && (get_inflight_fd(&conn, 2 * cfg.queues, cfg.ring_size) < 0 ||
+                               set_inflight_fd(&conn) < 0)) ||
+            (cfg.dirty_log && (dirty_log_init(&dirty_log, &guest_mem) < 0 ||
+                               set_log_base(&conn, &dirty_log) < 0)) ||
+            (tx_packets == 0 && !traffic && vhost_bringup_done(&conn) < 0) ||
+            (tx_packets > 0 && run_tx_packets(&conn, &guest_mem, &cfg, tx_packets) < 0) ||
+            (traffic && run_traffic(&conn, &guest_mem, &cfg) < 0)) {
+            dirty_log_free(&dirty_log);
+            guest_memory_free(&guest_mem);
+            close(conn.sock);
+            return 1;
+        }
+        if (cfg.dirty_log) {
+            uint64_t pages = dirty_log_count(&dirty_log);
+
+            printf("Dirty log: %lu pages marked (%.1fMB)\n", pages,
+                   pages * (double)LOG_PAGE_SIZE / (1 << 20));
+            if (pages == 0 && (tx_packets > 0 || traffic)) {
+                printf("Backend did not log any page\n");
+                dirty_log_free(&dirty_log);
+                guest_memory_free(&guest_mem);
+                close(conn.sock);
+                return 1;
+            }
+        }
+        dirty_log_free(&dirty_log);
+        guest_memory_free(&guest_mem);
+    }
 
-    close(sock);
+    close(conn.sock);
     printf("Client completed successfully\n");
     return 0;
 }
\ No newline at end of file
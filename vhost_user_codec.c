@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "vhost_log.h"
+#include "vhost_user_codec.h"
+
+void vhost_user_reader_init(VhostUserReader *rd) {
+    rd->head = 0;
+    rd->tail = 0;
+    rd->nfdsets = 0;
+}
+
+void vhost_user_reader_reset(VhostUserReader *rd) {
+    for (unsigned i = 0; i < rd->nfdsets; i++) {
+        for (size_t j = 0; j < rd->fdsets[i].nfds; j++) {
+            close(rd->fdsets[i].fds[j]);
+        }
+    }
+    vhost_user_reader_init(rd);
+}
+
+// Move the unconsumed bytes to the front to make room at the end.
+static void reader_compact(VhostUserReader *rd) {
+    if (rd->head == 0) {
+        return;
+    }
+    memmove(rd->buf, rd->buf + rd->head, rd->tail - rd->head);
+    for (unsigned i = 0; i < rd->nfdsets; i++) {
+        rd->fdsets[i].pos -= rd->head;
+    }
+    rd->tail -= rd->head;
+    rd->head = 0;
+}
+
+ssize_t vhost_user_recv(int sock, VhostUserReader *rd, int flags) {
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    reader_compact(rd);
+    if (rd->tail == sizeof(rd->buf)) {
+        VLOG_ERR("vhost_user: receive buffer full");
+        errno = EMSGSIZE;
+        return -1;
+    }
+    iov.iov_base = rd->buf + rd->tail;
+    iov.iov_len = sizeof(rd->buf) - rd->tail;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    do {
+        ret = recvmsg(sock, &mh, flags | MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            VhostUserFdSet *set = &rd->fdsets[rd->nfdsets];
+
+            if (rd->nfdsets == VHOST_USER_FD_SETS || n > VHOST_USER_MAX_FDS) {
+                int received[VHOST_USER_MAX_FDS];
+
+                VLOG_ERR("vhost_user: unexpected descriptors");
+                memcpy(received, CMSG_DATA(cmsg), n * sizeof(int));
+                for (size_t i = 0; i < n; i++) {
+                    close(received[i]);
+                }
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(set->fds, CMSG_DATA(cmsg), n * sizeof(int));
+            set->nfds = n;
+            set->pos = rd->tail + ret - 1;
+            rd->nfdsets++;
+        }
+    }
+    if (mh.msg_flags & MSG_CTRUNC) {
+        VLOG_ERR("vhost_user: ancillary data truncated");
+        errno = EPROTO;
+        return -1;
+    }
+    rd->tail += ret;
+    return ret;
+}
+
+int vhost_user_next(VhostUserReader *rd, void *msg, size_t cap,
+                    int *fds, size_t *nfds) {
+    size_t avail = rd->tail - rd->head, len;
+    VhostUserHdr hdr;
+
+    *nfds = 0;
+    if (avail < sizeof(hdr)) {
+        return 0;
+    }
+    memcpy(&hdr, rd->buf + rd->head, sizeof(hdr));
+    if (hdr.size > cap - sizeof(hdr)) {
+        VLOG_ERR("vhost_user: payload too large: %u bytes", hdr.size);
+        return -1;
+    }
+    len = sizeof(hdr) + hdr.size;
+    if (avail < len) {
+        return 0;
+    }
+
+    memcpy(msg, rd->buf + rd->head, len);
+    // Handlers may read the u64 of a message that carries less.
+    if (hdr.size < sizeof(uint64_t)) {
+        memset((uint8_t *)msg + len, 0, sizeof(uint64_t) - hdr.size);
+    }
+    if (rd->nfdsets > 0 && rd->fdsets[0].pos < rd->head + len) {
+        *nfds = rd->fdsets[0].nfds;
+        memcpy(fds, rd->fdsets[0].fds, *nfds * sizeof(int));
+        rd->nfdsets--;
+        memmove(&rd->fdsets[0], &rd->fdsets[1], rd->nfdsets * sizeof(rd->fdsets[0]));
+    }
+    rd->head += len;
+    if (rd->head == rd->tail) {
+        rd->head = rd->tail = 0;
+    }
+    return 1;
+}
+
+int vhost_user_send(int sock, const VhostUserHdr *hdr, const void *payload,
+                    const int *fds, size_t nfds) {
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+    struct iovec iov[2] = {
+        { .iov_base = (void *)hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = (void *)payload, .iov_len = hdr->size },
+    };
+    struct msghdr mh;
+    size_t left = sizeof(*hdr) + hdr->size;
+
+    if (nfds > VHOST_USER_MAX_FDS) {
+        VLOG_ERR("vhost_user: too many fds: %zu", nfds);
+        return -1;
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = hdr->size > 0 ? 2 : 1;
+    if (nfds > 0) {
+        struct cmsghdr *cmsg;
+
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    while (left > 0) {
+        ssize_t ret = sendmsg(sock, &mh, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            VLOG_ERR("sendmsg: %s", strerror(errno));
+            return -1;
+        }
+        left -= ret;
+        // Skip what went out; the descriptors went with the first byte.
+        while (ret > 0 && (size_t)ret >= mh.msg_iov->iov_len) {
+            ret -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov->iov_base = (uint8_t *)mh.msg_iov->iov_base + ret;
+            mh.msg_iov->iov_len -= ret;
+        }
+        mh.msg_control = NULL;
+        mh.msg_controllen = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef VHOST_USER_CODEC_H
+#define VHOST_USER_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A vhost-user message is a 12-byte header followed by exactly size bytes
+// of payload. File descriptors travel as SCM_RIGHTS ancillary data sent
+// with their message.
+typedef struct VhostUserHdr {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+} __attribute__((packed)) VhostUserHdr;
+
+#define VHOST_USER_MAX_FDS      8
+#define VHOST_USER_RX_BUF_SIZE  4096
+
+// Descriptors received but not yet handed out with their message. pos is
+// the buffer offset of the last byte that arrived with them.
+typedef struct VhostUserFdSet {
+    size_t pos;
+    size_t nfds;
+    int fds[VHOST_USER_MAX_FDS];
+} VhostUserFdSet;
+
+// Receive side of one connection. vhost_user_recv() reads whatever the
+// socket has into buf with a single recvmsg(); vhost_user_next() then
+// takes complete messages out of it, so a run of small requests costs one
+// syscall and a message cut short by the socket is simply finished by the
+// next read. Nothing is allocated after setup.
+//
+// The kernel ends a read right after data that carried descriptors, and a
+// sender passes each message with one sendmsg(), so descriptors belong to
+// the message holding the last byte of the read that returned them. At
+// most two such reads can be outstanding: one finishing a message cut
+// short and one ending in the next message.
+#define VHOST_USER_FD_SETS      2
+
+typedef struct VhostUserReader {
+    uint8_t buf[VHOST_USER_RX_BUF_SIZE];
+    size_t head;                // start of the first unconsumed message
+    size_t tail;                // end of received data
+    VhostUserFdSet fdsets[VHOST_USER_FD_SETS];
+    unsigned nfdsets;
+} VhostUserReader;
+
+void vhost_user_reader_init(VhostUserReader *rd);
+
+// Close descriptors still waiting for their message and drop buffered data.
+void vhost_user_reader_reset(VhostUserReader *rd);
+
+// One recvmsg() into the free space of the buffer. Returns the number of
+// bytes read, 0 at end of stream or -1 with errno set (EAGAIN for an empty
+// non-blocking socket). flags are passed to recvmsg().
+ssize_t vhost_user_recv(int sock, VhostUserReader *rd, int flags);
+
+// Copy the next complete message, header and payload, into msg, which has
+// room for cap bytes (at least a header plus a u64 payload). A payload
+// shorter than 8 bytes is zero-filled to 8. Any descriptors that came with
+// the message are moved to fds, which must hold VHOST_USER_MAX_FDS
+// entries; the caller then owns them. Returns 1 for a message, 0 if more
+// data is needed and -1 for a message that does not fit.
+int vhost_user_next(VhostUserReader *rd, void *msg, size_t cap,
+                    int *fds, size_t *nfds);
+
+// Bytes a message occupies on the wire.
+static inline size_t vhost_user_msg_len(const void *msg) {
+    return sizeof(VhostUserHdr) + ((const VhostUserHdr *)msg)->size;
+}
+
+// Send one message on a blocking socket: the header and hdr->size bytes
+// of payload are gathered from their own buffers and written with
+// sendmsg(), together with nfds descriptors. A short write is completed
+// without resending the descriptors.
+int vhost_user_send(int sock, const VhostUserHdr *hdr, const void *payload,
+                    const int *fds, size_t nfds);
+
+#endif
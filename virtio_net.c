@@ -0,0 +1,413 @@
+#include <string.h>
+
+#include "virtio_net.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define ETH_P_IPV4      0x0800
+#define ETH_P_IPV6      0x86dd
+#define ETH_P_8021Q     0x8100
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define TCP_FLAG_FIN    0x01
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_CWR    0x80
+
+// Kernels return the sum of len bytes as a 64-bit value; any multiple of
+// 2^16 - 1 can be folded away, so carries out of bit 63 are simply added
+// back in.
+typedef uint64_t (*CsumKernel)(const uint8_t *p, size_t len);
+
+static uint64_t add_carry(uint64_t a, uint64_t b) {
+    a += b;
+    return a + (a < b);
+}
+
+// Whatever is left after the wide loops, as one zero-padded word at a time.
+static uint64_t csum_tail(const uint8_t *p, size_t len, uint64_t acc) {
+    while (len > 0) {
+        uint64_t w = 0;
+        size_t n = len < sizeof(w) ? len : sizeof(w);
+
+        memcpy(&w, p, n);
+        acc = add_carry(acc, w);
+        p += n;
+        len -= n;
+    }
+    return acc;
+}
+
+static uint64_t csum_scalar(const uint8_t *p, size_t len) {
+    uint64_t acc = 0, carry = 0;
+
+    // Four independent adds per iteration; carries are counted, not chained.
+    while (len >= 32) {
+        uint64_t w[4];
+
+        memcpy(w, p, sizeof(w));
+        for (int i = 0; i < 4; i++) {
+            acc += w[i];
+            carry += acc < w[i];
+        }
+        p += 32;
+        len -= 32;
+    }
+    return csum_tail(p, len, add_carry(acc, carry));
+}
+
+#ifdef HAVE_X86_KERNELS
+// Both SIMD kernels widen 32-bit words into 64-bit lanes, which cannot
+// overflow before 2^32 iterations, and add the lanes up at the end.
+__attribute__((target("sse4.2")))
+static uint64_t csum_sse42(const uint8_t *p, size_t len) {
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+    uint64_t lanes[4], acc = 0;
+
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+
+        acc0 = _mm_add_epi64(acc0, _mm_cvtepu32_epi64(a));
+        acc1 = _mm_add_epi64(acc1, _mm_cvtepu32_epi64(_mm_srli_si128(a, 8)));
+        acc0 = _mm_add_epi64(acc0, _mm_cvtepu32_epi64(b));
+        acc1 = _mm_add_epi64(acc1, _mm_cvtepu32_epi64(_mm_srli_si128(b, 8)));
+        p += 32;
+        len -= 32;
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc0);
+    _mm_storeu_si128((__m128i *)(lanes + 2), acc1);
+    for (int i = 0; i < 4; i++) {
+        acc = add_carry(acc, lanes[i]);
+    }
+    return csum_tail(p, len, acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const uint8_t *p, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    uint64_t lanes[16], acc = 0;
+
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(b, zero));
+        acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc0);
+    _mm256_storeu_si256((__m256i *)(lanes + 4), acc1);
+    _mm256_storeu_si256((__m256i *)(lanes + 8), acc2);
+    _mm256_storeu_si256((__m256i *)(lanes + 12), acc3);
+    for (int i = 0; i < 16; i++) {
+        acc = add_carry(acc, lanes[i]);
+    }
+    return csum_tail(p, len, acc);
+}
+#endif
+
+static const struct {
+    const char *name;
+    CsumKernel fn;
+} csum_kernels[NET_CSUM_IMPLS] = {
+    [NET_CSUM_SCALAR] = { "scalar", csum_scalar },
+#ifdef HAVE_X86_KERNELS
+    [NET_CSUM_SSE42] = { "sse4.2", csum_sse42 },
+    [NET_CSUM_AVX2] = { "avx2", csum_avx2 },
+#else
+    [NET_CSUM_SSE42] = { "sse4.2", NULL },
+    [NET_CSUM_AVX2] = { "avx2", NULL },
+#endif
+};
+
+// Chosen on first use; every thread picks the same one, so racing is fine.
+static int csum_impl = -1;
+
+static int csum_supported(NetCsumImpl impl) {
+    if (impl >= NET_CSUM_IMPLS || !csum_kernels[impl].fn) {
+        return 0;
+    }
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (impl == NET_CSUM_SSE42) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+    if (impl == NET_CSUM_AVX2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+int net_csum_select(NetCsumImpl impl) {
+    if (!csum_supported(impl)) {
+        return -1;
+    }
+    __atomic_store_n(&csum_impl, impl, __ATOMIC_RELAXED);
+    return 0;
+}
+
+NetCsumImpl net_csum_selected(void) {
+    int impl = __atomic_load_n(&csum_impl, __ATOMIC_RELAXED);
+
+    if (impl < 0) {
+        impl = NET_CSUM_IMPLS;
+        while (--impl > NET_CSUM_SCALAR && !csum_supported(impl)) {
+        }
+        __atomic_store_n(&csum_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+const char *net_csum_impl_name(NetCsumImpl impl) {
+    return impl < NET_CSUM_IMPLS ? csum_kernels[impl].name : "?";
+}
+
+uint32_t net_csum(const void *buf, size_t len, uint32_t sum) {
+    uint64_t acc = csum_kernels[net_csum_selected()].fn(buf, len);
+
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    return net_csum_add(sum, (uint32_t)acc);
+}
+
+// 16-bit sum, not inverted.
+static uint16_t csum_fold16(uint32_t sum) {
+    return (uint16_t)~net_csum_fold(sum);
+}
+
+uint32_t net_csum_iov(const struct iovec *iov, unsigned niov, size_t offset,
+                      size_t len, uint32_t sum) {
+    size_t done = 0;
+
+    for (unsigned i = 0; i < niov && done < len; i++) {
+        size_t n;
+        uint32_t s;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset;
+        if (len - done < n) {
+            n = len - done;
+        }
+        s = net_csum((const uint8_t *)iov[i].iov_base + offset, n, 0);
+        if (done & 1) {
+            // The piece starts on an odd byte of the frame: swap its bytes
+            uint16_t f = csum_fold16(s);
+            s = (uint16_t)(f << 8 | f >> 8);
+        }
+        sum = net_csum_add(sum, s);
+        done += n;
+        offset = 0;
+    }
+    return sum;
+}
+
+static size_t iov_gather(const struct iovec *iov, unsigned niov, size_t offset,
+                         uint8_t *buf, size_t len) {
+    size_t copied = 0;
+
+    for (unsigned i = 0; i < niov && copied < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset;
+        if (len - copied < n) {
+            n = len - copied;
+        }
+        memcpy(buf + copied, (const uint8_t *)iov[i].iov_base + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+static void iov_scatter(const struct iovec *iov, unsigned niov, size_t offset,
+                        const uint8_t *buf, size_t len) {
+    size_t copied = 0;
+
+    for (unsigned i = 0; i < niov && copied < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset;
+        if (len - copied < n) {
+            n = len - copied;
+        }
+        memcpy((uint8_t *)iov[i].iov_base + offset, buf + copied, n);
+        copied += n;
+        offset = 0;
+    }
+}
+
+int net_csum_complete(const struct iovec *iov, unsigned niov, size_t offset,
+                      size_t len, unsigned csum_start, unsigned csum_offset) {
+    uint16_t csum;
+
+    if ((size_t)csum_start + csum_offset + sizeof(csum) > len) {
+        return -1;
+    }
+    csum = net_csum_fold(net_csum_iov(iov, niov, offset + csum_start,
+                                      len - csum_start, 0));
+    iov_scatter(iov, niov, offset + csum_start + csum_offset, (const uint8_t *)&csum,
+                sizeof(csum));
+    return 0;
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+uint32_t net_pseudo_sum(const uint8_t *l3, int ipv6, uint8_t proto, uint32_t l4_len) {
+    uint8_t tail[8] = { 0 };
+
+    if (ipv6) {
+        tail[0] = l4_len >> 24;
+        tail[1] = l4_len >> 16;
+        tail[2] = l4_len >> 8;
+        tail[3] = l4_len;
+        tail[7] = proto;
+        return net_csum(tail, 8, net_csum(l3 + 8, 32, 0));
+    }
+    tail[1] = proto;
+    tail[2] = l4_len >> 8;
+    tail[3] = l4_len;
+    return net_csum(tail, 4, net_csum(l3 + 12, 8, 0));
+}
+
+// Offset and EtherType of the network header, skipping one VLAN tag.
+static size_t eth_l3(const uint8_t *pkt, size_t len, uint16_t *type) {
+    if (len < 14) {
+        return 0;
+    }
+    *type = get_be16(pkt + 12);
+    if (*type == ETH_P_8021Q) {
+        if (len < 18) {
+            return 0;
+        }
+        *type = get_be16(pkt + 16);
+        return 18;
+    }
+    return 14;
+}
+
+int net_l4_csum_ok(const uint8_t *pkt, size_t len) {
+    uint16_t type;
+    size_t l3 = eth_l3(pkt, len, &type), l4, end;
+    uint8_t proto;
+    uint32_t sum;
+
+    if (l3 == 0) {
+        return -1;
+    }
+    if (type == ETH_P_IPV4 && len >= l3 + 20 && pkt[l3] >> 4 == 4) {
+        l4 = l3 + (pkt[l3] & 0xf) * 4;
+        end = l3 + get_be16(pkt + l3 + 2);
+        proto = pkt[l3 + 9];
+    } else if (type == ETH_P_IPV6 && len >= l3 + 40 && pkt[l3] >> 4 == 6) {
+        l4 = l3 + 40;
+        end = l4 + get_be16(pkt + l3 + 4);
+        proto = pkt[l3 + 6];
+    } else {
+        return -1;
+    }
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) || end > len || l4 + 8 > end) {
+        return -1;
+    }
+    if (proto == IP_PROTO_UDP && type == ETH_P_IPV4 && get_be16(pkt + l4 + 6) == 0) {
+        return 1;               // no checksum
+    }
+    sum = net_pseudo_sum(pkt + l3, type == ETH_P_IPV6, proto, end - l4);
+    return net_csum_fold(net_csum(pkt + l4, end - l4, sum)) == 0;
+}
+
+int net_gso_init(NetGso *g, const VirtioNetHdr *vh, const struct iovec *iov,
+                 unsigned niov, size_t offset, size_t len) {
+    uint8_t gso_type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    size_t have = iov_gather(iov, niov, offset, g->hdr,
+                             len < NET_GSO_HDR_MAX ? len : NET_GSO_HDR_MAX);
+    uint16_t type;
+    size_t l3 = eth_l3(g->hdr, have, &type), l4;
+
+    if (l3 == 0 || vh->gso_size == 0) {
+        return -1;
+    }
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 && type == ETH_P_IPV4 &&
+        have >= l3 + 20 && g->hdr[l3] >> 4 == 4 && g->hdr[l3 + 9] == IP_PROTO_TCP) {
+        l4 = l3 + (g->hdr[l3] & 0xf) * 4;
+        g->ipv6 = 0;
+    } else if (gso_type == VIRTIO_NET_HDR_GSO_TCPV6 && type == ETH_P_IPV6 &&
+               have >= l3 + 40 && g->hdr[l3] >> 4 == 6 &&
+               g->hdr[l3 + 6] == IP_PROTO_TCP) {
+        l4 = l3 + 40;           // extension headers are not supported
+        g->ipv6 = 1;
+    } else {
+        return -1;
+    }
+    if (l4 < l3 + 20 || have < l4 + 20) {
+        return -1;
+    }
+    g->l3_off = l3;
+    g->l4_off = l4;
+    g->hdr_len = l4 + (g->hdr[l4 + 12] >> 4) * 4;
+    if (g->hdr_len < l4 + 20 || g->hdr_len > have || g->hdr_len >= len) {
+        return -1;
+    }
+    g->mss = vh->gso_size;
+    g->payload_len = len - g->hdr_len;
+    g->nsegs = (g->payload_len + g->mss - 1) / g->mss;
+    return 0;
+}
+
+void net_gso_segment(const NetGso *g, uint32_t i, uint8_t *out) {
+    uint8_t *l3 = out + g->l3_off, *th = out + g->l4_off;
+    uint32_t l4_len = g->hdr_len - g->l4_off + net_gso_seg_len(g, i);
+    uint32_t seq;
+    uint16_t csum;
+
+    memcpy(out, g->hdr, g->hdr_len);
+    if (g->ipv6) {
+        put_be16(l3 + 4, l4_len);
+    } else {
+        put_be16(l3 + 2, g->l4_off - g->l3_off + l4_len);
+        put_be16(l3 + 4, get_be16(l3 + 4) + i);
+        l3[10] = l3[11] = 0;
+        csum = net_csum_fold(net_csum(l3, g->l4_off - g->l3_off, 0));
+        memcpy(l3 + 10, &csum, sizeof(csum));
+    }
+
+    seq = (uint32_t)th[4] << 24 | th[5] << 16 | th[6] << 8 | th[7];
+    seq += i * g->mss;
+    th[4] = seq >> 24;
+    th[5] = seq >> 16;
+    th[6] = seq >> 8;
+    th[7] = seq;
+    if (i + 1 < g->nsegs) {
+        th[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+    if (i > 0) {
+        th[13] &= ~TCP_FLAG_CWR;
+    }
+    csum = csum_fold16(net_pseudo_sum(l3, g->ipv6, IP_PROTO_TCP, l4_len));
+    memcpy(th + NET_TCP_CSUM_OFF, &csum, sizeof(csum));
+}
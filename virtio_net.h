@@ -0,0 +1,123 @@
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// virtio-net frame header and the checksum and segmentation work behind
+// VIRTIO_NET_F_CSUM and VIRTIO_NET_F_HOST_TSO4/6: when a driver hands over a
+// frame with a partial checksum or one large TCP send, the device finishes
+// the checksum and cuts the send into segments for a receiver that cannot
+// take them as they are.
+
+#define VIRTIO_NET_HDR_SIZE         12
+#define VIRTIO_NET_HDR_NUM_BUFFERS  10  // offset of num_buffers in the header
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE     0
+#define VIRTIO_NET_HDR_GSO_TCPV4    1
+#define VIRTIO_NET_HDR_GSO_UDP      3
+#define VIRTIO_NET_HDR_GSO_TCPV6    4
+#define VIRTIO_NET_HDR_GSO_ECN      0x80
+
+// Little-endian, as every field is with VIRTIO_F_VERSION_1.
+typedef struct VirtioNetHdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;           // Ethernet, IP and TCP headers of a GSO frame
+    uint16_t gso_size;          // payload bytes per segment
+    uint16_t csum_start;        // from the start of the Ethernet frame
+    uint16_t csum_offset;       // from csum_start to the checksum field
+    uint16_t num_buffers;
+} VirtioNetHdr;
+
+// Internet checksum (RFC 1071). A partial sum is a 32-bit value that is
+// neither folded nor inverted, so sums of adjacent ranges can be added with
+// net_csum_add(). Sums are in host byte order: folded and inverted, the
+// result is stored into the packet as a native 16-bit value.
+typedef enum NetCsumImpl {
+    NET_CSUM_SCALAR,
+    NET_CSUM_SSE42,
+    NET_CSUM_AVX2,
+    NET_CSUM_IMPLS,
+} NetCsumImpl;
+
+// Add the partial sum of len bytes at buf to sum, with the fastest kernel
+// the CPU supports unless net_csum_select() chose another.
+uint32_t net_csum(const void *buf, size_t len, uint32_t sum);
+
+// Use impl from now on, for benchmarks and tests. Returns -1 if this CPU or
+// build does not support it.
+int net_csum_select(NetCsumImpl impl);
+NetCsumImpl net_csum_selected(void);
+const char *net_csum_impl_name(NetCsumImpl impl);
+
+static inline uint32_t net_csum_add(uint32_t a, uint32_t b) {
+    a += b;
+    return a + (a < b);
+}
+
+// Final 16-bit checksum of a partial sum.
+static inline uint16_t net_csum_fold(uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// net_csum() over len bytes of a scatter list, starting offset bytes in.
+uint32_t net_csum_iov(const struct iovec *iov, unsigned niov, size_t offset,
+                      size_t len, uint32_t sum);
+
+// Finish a VIRTIO_NET_HDR_F_NEEDS_CSUM checksum in a frame of len bytes
+// that starts offset bytes into iov: sum from csum_start to the end of the
+// frame and store the result csum_offset bytes further. Returns -1 if the
+// checksum field lies outside the frame.
+int net_csum_complete(const struct iovec *iov, unsigned niov, size_t offset,
+                      size_t len, unsigned csum_start, unsigned csum_offset);
+
+// Partial sum of the IPv4 or IPv6 pseudo header that precedes l4_len bytes
+// of protocol proto in the TCP and UDP checksums; l3 is the IP header.
+uint32_t net_pseudo_sum(const uint8_t *l3, int ipv6, uint8_t proto, uint32_t l4_len);
+
+// Whether the TCP or UDP checksum of an IPv4 or IPv6 frame of len bytes at
+// pkt is correct; -1 if it is neither.
+int net_l4_csum_ok(const uint8_t *pkt, size_t len);
+
+// TCP segmentation. net_gso_init() parses the Ethernet (optionally 802.1Q),
+// IPv4 or IPv6 and TCP headers of a GSO frame once; net_gso_segment() then
+// writes the headers of each segment with lengths, IPv4 ID and header
+// checksum, sequence number and flags fixed up, and the TCP checksum field
+// holding the pseudo-header sum, ready to be finished like a
+// VIRTIO_NET_HDR_F_NEEDS_CSUM frame at l4_off with offset NET_TCP_CSUM_OFF.
+#define NET_GSO_HDR_MAX     128
+#define NET_TCP_CSUM_OFF    16
+
+typedef struct NetGso {
+    uint8_t hdr[NET_GSO_HDR_MAX];
+    uint16_t hdr_len;           // Ethernet, IP and TCP headers
+    uint16_t l3_off;
+    uint16_t l4_off;
+    uint16_t mss;
+    int ipv6;
+    uint32_t payload_len;       // TCP payload of the whole send
+    uint32_t nsegs;
+} NetGso;
+
+// Parse the frame of len bytes starting offset bytes into iov, as described
+// by vh. Returns -1 if it is not a TCP send that can be segmented.
+int net_gso_init(NetGso *g, const VirtioNetHdr *vh, const struct iovec *iov,
+                 unsigned niov, size_t offset, size_t len);
+
+// Payload bytes of segment i.
+static inline uint32_t net_gso_seg_len(const NetGso *g, uint32_t i) {
+    uint32_t off = i * g->mss;
+    return g->payload_len - off < g->mss ? g->payload_len - off : g->mss;
+}
+
+// Write the g->hdr_len header bytes of segment i to out.
+void net_gso_segment(const NetGso *g, uint32_t i, uint8_t *out);
+
+#endif
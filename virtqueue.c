@@ -0,0 +1,1035 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "virtqueue.h"
+
+int vq_map(Virtqueue *vq, const VhostMem *mem, uint64_t desc_uva,
+           uint64_t avail_uva, uint64_t used_uva) {
+    uint16_t num = vq->num;
+
+    if (num == 0 || (!vq->packed && (num & (num - 1)) != 0)) {
+        fprintf(stderr, "virtqueue: invalid ring size %u\n", num);
+        return -1;
+    }
+    if (vq->packed) {
+        vq->pdesc = vhost_mem_uva_to_hva(mem, desc_uva,
+                                         (uint64_t)num * sizeof(VringPackedDesc));
+        vq->driver_event = vhost_mem_uva_to_hva(mem, avail_uva,
+                                                sizeof(VringPackedDescEvent));
+        vq->device_event = vhost_mem_uva_to_hva(mem, used_uva,
+                                                sizeof(VringPackedDescEvent));
+    } else {
+        vq->desc = vhost_mem_uva_to_hva(mem, desc_uva, (uint64_t)num * sizeof(VringDesc));
+        // Including used_event and avail_event, which virtio 1.x always
+        // lays out
+        vq->avail = vhost_mem_uva_to_hva(mem, avail_uva, sizeof(VringAvail) +
+                                         ((uint64_t)num + 1) * sizeof(uint16_t));
+        vq->used = vhost_mem_uva_to_hva(mem, used_uva, sizeof(VringUsed) +
+                                        (uint64_t)num * sizeof(VringUsedElem) +
+                                        sizeof(uint16_t));
+    }
+    if (!vq->desc || !vq->avail || !vq->used) {
+        fprintf(stderr, "virtqueue: ring addresses outside guest memory\n");
+        return -1;
+    }
+    vq->mem = mem;
+    vq->mem_cache.generation = 0;
+    return 0;
+}
+
+void vq_set_base(Virtqueue *vq, uint32_t base) {
+    if (vq->packed) {
+        vq->last_avail_idx = base & ((1U << VRING_PACKED_WRAP_SHIFT) - 1);
+        vq->avail_wrap_counter = (base >> VRING_PACKED_WRAP_SHIFT) & 1;
+        vq->last_used_idx = vq->last_avail_idx;
+        vq->used_wrap_counter = vq->avail_wrap_counter;
+    } else {
+        vq->last_avail_idx = base;
+        vq->last_used_idx = base;
+    }
+    vq->signalled_valid = 0;
+}
+
+uint32_t vq_get_base(const Virtqueue *vq) {
+    if (vq->packed) {
+        return vq->last_avail_idx |
+               ((uint32_t)vq->avail_wrap_counter << VRING_PACKED_WRAP_SHIFT);
+    }
+    return vq->last_avail_idx;
+}
+
+static void chain_reset(VqChain *chain) {
+    chain->ndescs = 0;
+    chain->nout = 0;
+    chain->nin = 0;
+    chain->out_len = 0;
+    chain->in_len = 0;
+}
+
+// Append one descriptor's buffer to the chain.
+static int chain_add(Virtqueue *vq, VqChain *chain, uint64_t addr,
+                     uint32_t len, int writable) {
+    unsigned n = chain->nout + chain->nin;
+    int nsegs;
+
+    // Device-readable buffers must precede device-writable ones.
+    if (!writable && chain->nin) {
+        return -1;
+    }
+    nsegs = vhost_mem_gpa_to_iov(vq->mem, &vq->mem_cache, addr, len,
+                                 &chain->iov[n], VQ_MAX_SEGS - n);
+    if (nsegs < 0) {
+        return -1;
+    }
+    for (int i = 0; i < nsegs; i++) {
+        chain->gpa[n + i] = addr;
+        addr += chain->iov[n + i].iov_len;
+    }
+    if (writable) {
+        chain->nin += nsegs;
+        chain->in_len += len;
+    } else {
+        chain->nout += nsegs;
+        chain->out_len += len;
+    }
+    return 0;
+}
+
+// Append the buffers of the indirect table of len bytes at guest address
+// addr. The table is translated like any buffer; one that spans regions is
+// copied out first. Split tables are chained through next like the ring,
+// packed ones are used in order. Nested tables are refused.
+static int chain_add_indirect(Virtqueue *vq, VqChain *chain, uint64_t addr, uint32_t len) {
+    // Every entry takes a segment, so larger tables cannot fit a chain.
+    uint8_t copy[VQ_MAX_SEGS * sizeof(VringDesc)];
+    unsigned n = len / sizeof(VringDesc);
+    struct iovec iov[4];
+    const uint8_t *table;
+    int nspans;
+
+    if (!vq->indirect || len == 0 || len % sizeof(VringDesc) != 0 || n > VQ_MAX_SEGS) {
+        return -1;
+    }
+    nspans = vhost_mem_gpa_to_iov(vq->mem, &vq->mem_cache, addr, len, iov, 4);
+    if (nspans < 0) {
+        return -1;
+    }
+    if (nspans == 1) {
+        table = iov[0].iov_base;
+    } else {
+        iov_read(iov, nspans, 0, copy, len);
+        table = copy;
+    }
+
+    if (vq->packed) {
+        for (unsigned i = 0; i < n; i++) {
+            const VringPackedDesc *d = (const VringPackedDesc *)table + i;
+            uint16_t flags = d->flags;
+
+            if ((flags & VRING_DESC_F_INDIRECT) ||
+                chain_add(vq, chain, d->addr, d->len, flags & VRING_DESC_F_WRITE) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (unsigned i = 0, idx = 0;; i++) {
+        const VringDesc *d = (const VringDesc *)table + idx;
+        uint16_t flags = d->flags;
+
+        // i bounds a loop through next
+        if (i >= n || (flags & VRING_DESC_F_INDIRECT) ||
+            chain_add(vq, chain, d->addr, d->len, flags & VRING_DESC_F_WRITE) < 0) {
+            return -1;
+        }
+        if (!(flags & VRING_DESC_F_NEXT)) {
+            return 0;
+        }
+        idx = d->next;
+        if (idx >= n) {
+            return -1;
+        }
+    }
+}
+
+// Append the buffer, or indirect table, of one ring descriptor.
+static int chain_add_desc(Virtqueue *vq, VqChain *chain, uint64_t addr,
+                          uint32_t len, uint16_t flags) {
+    if (flags & VRING_DESC_F_INDIRECT) {
+        return chain_add_indirect(vq, chain, addr, len);
+    }
+    return chain_add(vq, chain, addr, len, flags & VRING_DESC_F_WRITE);
+}
+
+// Walk the split chain starting at descriptor head.
+static int vq_split_read_chain(Virtqueue *vq, uint16_t head, VqChain *chain) {
+    uint16_t idx = head;
+
+    chain_reset(chain);
+    chain->head = head;
+    for (;;) {
+        const VringDesc *d;
+
+        if (idx >= vq->num) {
+            return -1;
+        }
+        d = &vq->desc[idx];
+        if (chain_add_desc(vq, chain, d->addr, d->len, d->flags) < 0) {
+            return -1;
+        }
+        chain->ndescs++;
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            return 0;
+        }
+        idx = d->next;
+    }
+}
+
+// Number of chains the driver has made available, read once per call.
+static int vq_split_avail_count(Virtqueue *vq) {
+    uint16_t avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+    uint16_t count = avail_idx - vq->last_avail_idx;
+
+    return count > vq->num ? -1 : count;
+}
+
+static int vq_split_pop(Virtqueue *vq, VqChain *chain) {
+    int count = vq_split_avail_count(vq);
+    uint16_t head;
+
+    if (count <= 0) {
+        return count;
+    }
+    head = vq->avail->ring[vq->last_avail_idx & (vq->num - 1)];
+    vq->last_avail_idx++;
+    return vq_split_read_chain(vq, head, chain) < 0 ? -1 : 1;
+}
+
+static inline int packed_desc_is_avail(uint16_t flags, uint8_t wrap_counter) {
+    return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap_counter &&
+           !!(flags & VRING_PACKED_DESC_F_USED) != wrap_counter;
+}
+
+static int vq_packed_pop(Virtqueue *vq, VqChain *chain) {
+    uint16_t idx = vq->last_avail_idx;
+    uint8_t wrap = vq->avail_wrap_counter;
+    uint16_t flags = __atomic_load_n(&vq->pdesc[idx].flags, __ATOMIC_ACQUIRE);
+
+    if (!packed_desc_is_avail(flags, wrap)) {
+        return 0;
+    }
+
+    chain_reset(chain);
+    for (;;) {
+        const VringPackedDesc *d = &vq->pdesc[idx];
+
+        if (chain->ndescs >= vq->num ||
+            chain_add_desc(vq, chain, d->addr, d->len, flags) < 0) {
+            return -1;
+        }
+        chain->ndescs++;
+        // The buffer id is taken from the last descriptor of the chain.
+        chain->head = d->id;
+        if (++idx >= vq->num) {
+            idx = 0;
+            wrap ^= 1;
+        }
+        if (!(flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        flags = vq->pdesc[idx].flags;
+    }
+    vq->last_avail_idx = idx;
+    vq->avail_wrap_counter = wrap;
+    return 1;
+}
+
+// Log the first len bytes the device wrote into a chain.
+static void vq_log_chain(Virtqueue *vq, const VqChain *chain, uint32_t len) {
+    for (unsigned i = chain->nout; i < chain->nout + chain->nin && len > 0; i++) {
+        uint32_t n = chain->iov[i].iov_len < len ? chain->iov[i].iov_len : len;
+
+        vhost_log_write(vq->log, &vq->log_cache, chain->gpa[i], n);
+        len -= n;
+    }
+}
+
+// Log a used element (split) or used descriptor (packed) at ring slot idx.
+static void vq_log_used(Virtqueue *vq, uint16_t idx) {
+    if (!vq->log_ring) {
+        return;
+    }
+    if (vq->packed) {
+        vhost_log_write(vq->log, &vq->log_cache,
+                        vq->log_ring_gpa + (uint64_t)idx * sizeof(VringPackedDesc),
+                        sizeof(VringPackedDesc));
+    } else {
+        vhost_log_write(vq->log, &vq->log_cache,
+                        vq->log_ring_gpa + offsetof(VringUsed, ring) +
+                        (uint64_t)(idx & (vq->num - 1)) * sizeof(VringUsedElem),
+                        sizeof(VringUsedElem));
+    }
+}
+
+// Log the split used index and write the cached bits out.
+static void vq_log_flush(Virtqueue *vq) {
+    if (vq->log_ring && !vq->packed) {
+        vhost_log_write(vq->log, &vq->log_cache,
+                        vq->log_ring_gpa + offsetof(VringUsed, idx), sizeof(uint16_t));
+    }
+    vhost_log_flush(vq->log, &vq->log_cache);
+}
+
+static uint16_t vq_packed_used_base(const Virtqueue *vq) {
+    return vq->last_used_idx | (uint16_t)(vq->used_wrap_counter << VRING_PACKED_WRAP_SHIFT);
+}
+
+// Log a packed burst in the inflight area before its used descriptors are
+// written, and mark it done once they are.
+static void vq_inflight_log(Virtqueue *vq, const VqChain *chains, const uint32_t *lens,
+                            unsigned n) {
+    VqInflight *inf = vq->inflight;
+
+    for (unsigned i = 0; i < n; i++) {
+        inf->batch[i].id = chains[i].head;
+        inf->batch[i].ndescs = chains[i].ndescs;
+        inf->batch[i].len = lens ? lens[i] : 0;
+    }
+    inf->batch_base = vq_packed_used_base(vq);
+    __atomic_store_n(&inf->batch_len, n, __ATOMIC_RELEASE);
+}
+
+static void vq_inflight_done(Virtqueue *vq) {
+    VqInflight *inf = vq->inflight;
+
+    inf->used_base = vq_packed_used_base(vq);
+    __atomic_store_n(&inf->batch_len, 0, __ATOMIC_RELEASE);
+}
+
+// Finish the burst a previous backend logged. The USED bit of its first
+// descriptor is flipped only by the store that publishes the burst, and
+// stays so when the driver makes the slot available again in the next lap.
+// The frontend can write the area, so nothing is written unless the whole
+// burst lies inside the ring. Returns -1 if it does not.
+static int vq_inflight_replay(Virtqueue *vq) {
+    VqInflight *inf = vq->inflight;
+    uint16_t idx = inf->batch_base & ((1U << VRING_PACKED_WRAP_SHIFT) - 1);
+    uint8_t wrap = inf->batch_base >> VRING_PACKED_WRAP_SHIFT;
+    unsigned n = inf->batch_len;
+    VringPackedDesc *first;
+    int published;
+    uint16_t first_flags = 0;
+
+    if (n > VQ_BURST_MAX || idx >= vq->num) {
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        if (inf->batch[i].ndescs == 0 || inf->batch[i].ndescs > vq->num) {
+            return -1;
+        }
+    }
+    first = &vq->pdesc[idx];
+    published = !!(first->flags & VRING_PACKED_DESC_F_USED) == wrap;
+
+    for (unsigned i = 0; i < n; i++) {
+        VringPackedDesc *d = &vq->pdesc[idx];
+        uint16_t flags = wrap ? VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+        if (!published) {
+            d->id = inf->batch[i].id;
+            d->len = inf->batch[i].len;
+            if (i == 0) {
+                first_flags = flags;
+            } else {
+                __atomic_store_n(&d->flags, flags, __ATOMIC_RELAXED);
+            }
+        }
+        idx += inf->batch[i].ndescs;
+        if (idx >= vq->num) {
+            idx -= vq->num;
+            wrap ^= 1;
+        }
+    }
+    if (!published) {
+        __atomic_store_n(&first->flags, first_flags, __ATOMIC_RELEASE);
+    }
+    inf->used_base = idx | (uint16_t)(wrap << VRING_PACKED_WRAP_SHIFT);
+    __atomic_store_n(&inf->batch_len, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Claim the area for this ring from the position SET_VRING_BASE gave it.
+static void vq_inflight_reset(Virtqueue *vq) {
+    VqInflight *inflight = vq->inflight;
+
+    inflight->num = vq->num;
+    inflight->used_base = vq->packed ? vq_packed_used_base(vq) : vq->last_used_idx;
+    inflight->batch_len = 0;
+    __atomic_store_n(&inflight->version, VQ_INFLIGHT_VERSION, __ATOMIC_RELEASE);
+}
+
+int vq_inflight_attach(Virtqueue *vq, VqInflight *inflight) {
+    vq->inflight = inflight;
+    if (!inflight) {
+        return 0;
+    }
+    if (inflight->version != VQ_INFLIGHT_VERSION || inflight->num != vq->num) {
+        vq_inflight_reset(vq);
+        return 0;
+    }
+    if (vq->packed) {
+        if ((inflight->batch_len && vq_inflight_replay(vq) < 0) ||
+            (inflight->used_base & ((1U << VRING_PACKED_WRAP_SHIFT) - 1)) >= vq->num) {
+            fprintf(stderr, "virtqueue: corrupt inflight area, starting from the ring base\n");
+            vq_inflight_reset(vq);
+            return 0;
+        }
+        vq_set_base(vq, inflight->used_base);
+    } else {
+        vq_set_base(vq, __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE));
+    }
+    return 1;
+}
+
+void vq_inflight_detach(Virtqueue *vq) {
+    if (vq->inflight) {
+        __atomic_store_n(&vq->inflight->version, 0, __ATOMIC_RELEASE);
+        vq->inflight = NULL;
+    }
+}
+
+int vq_pop(Virtqueue *vq, VqChain *chain) {
+    return vq->packed ? vq_packed_pop(vq, chain) : vq_split_pop(vq, chain);
+}
+
+void vq_push(Virtqueue *vq, const VqChain *chain, uint32_t len) {
+    if (vq->packed) {
+        VringPackedDesc *d = &vq->pdesc[vq->last_used_idx];
+        uint16_t flags = vq->used_wrap_counter ?
+                         VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+        if (vq->inflight) {
+            vq_inflight_log(vq, chain, &len, 1);
+        }
+        d->id = chain->head;
+        d->len = len;
+        __atomic_store_n(&d->flags, flags, __ATOMIC_RELEASE);
+        if (vq->log) {
+            vq_log_chain(vq, chain, len);
+            vq_log_used(vq, vq->last_used_idx);
+        }
+        vq->last_used_idx += chain->ndescs;
+        if (vq->last_used_idx >= vq->num) {
+            vq->last_used_idx -= vq->num;
+            vq->used_wrap_counter ^= 1;
+        }
+        if (vq->inflight) {
+            vq_inflight_done(vq);
+        }
+    } else {
+        VringUsedElem *elem = &vq->used->ring[vq->last_used_idx & (vq->num - 1)];
+
+        elem->id = chain->head;
+        elem->len = len;
+        if (vq->log) {
+            vq_log_chain(vq, chain, len);
+            vq_log_used(vq, vq->last_used_idx);
+        }
+        vq->last_used_idx++;
+        __atomic_store_n(&vq->used->idx, vq->last_used_idx, __ATOMIC_RELEASE);
+    }
+    if (vq->log) {
+        vq_log_flush(vq);
+    }
+}
+
+void vq_unpop(Virtqueue *vq, const VqChain *chains, unsigned n) {
+    if (vq->packed) {
+        unsigned ndescs = 0;
+
+        for (unsigned i = 0; i < n; i++) {
+            ndescs += chains[i].ndescs;
+        }
+        if (ndescs > vq->last_avail_idx) {
+            vq->last_avail_idx += vq->num;
+            vq->avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= ndescs;
+    } else {
+        vq->last_avail_idx -= n;
+    }
+}
+
+int vq_dequeue_burst(Virtqueue *vq, VqChain *chains, unsigned max) {
+    unsigned n;
+    int count;
+
+    if (vq->packed) {
+        // Each packed descriptor carries its own availability flag.
+        for (n = 0; n < max; n++) {
+            int ret = vq_packed_pop(vq, &chains[n]);
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret == 0) {
+                break;
+            }
+        }
+        return n;
+    }
+
+    count = vq_split_avail_count(vq);
+    if (count <= 0) {
+        return count;
+    }
+    n = (unsigned)count < max ? (unsigned)count : max;
+    for (unsigned i = 0; i < n; i++) {
+        uint16_t head = vq->avail->ring[(uint16_t)(vq->last_avail_idx + i) & (vq->num - 1)];
+        if (vq_split_read_chain(vq, head, &chains[i]) < 0) {
+            vq->last_avail_idx += i + 1;
+            return -1;
+        }
+    }
+    vq->last_avail_idx += n;
+    return n;
+}
+
+void vq_enqueue_burst(Virtqueue *vq, const VqChain *chains, const uint32_t *lens,
+                      unsigned n) {
+    if (n == 0) {
+        return;
+    }
+    if (vq->packed && vq->inflight && n > VQ_BURST_MAX) {
+        // One logged burst at a time
+        vq_enqueue_burst(vq, chains, lens, VQ_BURST_MAX);
+        vq_enqueue_burst(vq, chains + VQ_BURST_MAX, lens ? lens + VQ_BURST_MAX : NULL,
+                         n - VQ_BURST_MAX);
+        return;
+    }
+    if (vq->packed) {
+        VringPackedDesc *first = &vq->pdesc[vq->last_used_idx];
+        uint16_t first_flags = 0;
+
+        if (vq->inflight) {
+            vq_inflight_log(vq, chains, lens, n);
+        }
+        // Mark every descriptor but the first used, then release the first:
+        // the driver reads used descriptors in order, so that single store
+        // publishes the whole burst.
+        for (unsigned i = 0; i < n; i++) {
+            VringPackedDesc *d = &vq->pdesc[vq->last_used_idx];
+            uint16_t flags = vq->used_wrap_counter ?
+                             VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+            d->id = chains[i].head;
+            d->len = lens ? lens[i] : 0;
+            if (vq->log) {
+                vq_log_chain(vq, &chains[i], lens ? lens[i] : 0);
+                vq_log_used(vq, vq->last_used_idx);
+            }
+            if (i == 0) {
+                first_flags = flags;
+            } else {
+                __atomic_store_n(&d->flags, flags, __ATOMIC_RELAXED);
+            }
+            vq->last_used_idx += chains[i].ndescs;
+            if (vq->last_used_idx >= vq->num) {
+                vq->last_used_idx -= vq->num;
+                vq->used_wrap_counter ^= 1;
+            }
+        }
+        __atomic_store_n(&first->flags, first_flags, __ATOMIC_RELEASE);
+        if (vq->inflight) {
+            vq_inflight_done(vq);
+        }
+    } else {
+        for (unsigned i = 0; i < n; i++) {
+            VringUsedElem *elem =
+                &vq->used->ring[(uint16_t)(vq->last_used_idx + i) & (vq->num - 1)];
+            elem->id = chains[i].head;
+            elem->len = lens ? lens[i] : 0;
+            if (vq->log) {
+                vq_log_chain(vq, &chains[i], lens ? lens[i] : 0);
+                vq_log_used(vq, vq->last_used_idx + i);
+            }
+        }
+        vq->last_used_idx += n;
+        __atomic_store_n(&vq->used->idx, vq->last_used_idx, __ATOMIC_RELEASE);
+    }
+    if (vq->log) {
+        vq_log_flush(vq);
+    }
+}
+
+// Whether the used index passed the driver's used_event since the last
+// vq_notify(). A packed event in the previous lap counts num descriptors back.
+static int vq_used_event_passed(const Virtqueue *vq) {
+    uint16_t off_wrap, event, used_since;
+
+    if (!vq->packed) {
+        event = __atomic_load_n(vring_used_event(vq->avail, vq->num), __ATOMIC_RELAXED);
+        return vring_need_event(event, vq->last_used_idx, vq->signalled_used);
+    }
+    off_wrap = __atomic_load_n(&vq->driver_event->off_wrap, __ATOMIC_RELAXED);
+    used_since = vq->last_used_idx - vq->signalled_used +
+                 (vq->used_wrap_counter != vq->signalled_wrap ? vq->num : 0);
+    event = off_wrap & ((1U << VRING_PACKED_WRAP_SHIFT) - 1);
+    if ((off_wrap >> VRING_PACKED_WRAP_SHIFT) != vq->used_wrap_counter) {
+        event -= vq->num;
+    }
+    return vring_need_event(event, vq->last_used_idx, vq->last_used_idx - used_since);
+}
+
+int vq_notify(Virtqueue *vq) {
+    uint64_t one = 1;
+    int notify;
+
+    if (vq->call_fd < 0) {
+        return 0;
+    }
+    // Order the used ring stores before reading the driver's flags.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (vq->packed) {
+        uint16_t flags = __atomic_load_n(&vq->driver_event->flags, __ATOMIC_RELAXED);
+
+        notify = flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+        if (flags == VRING_PACKED_EVENT_FLAG_DESC && vq->event_idx && vq->signalled_valid) {
+            notify = vq_used_event_passed(vq);
+        }
+    } else if (vq->event_idx) {
+        notify = !vq->signalled_valid || vq_used_event_passed(vq);
+    } else {
+        notify = !(__atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED) &
+                   VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    // Checked up to here, whether or not the driver wants the call
+    vq->signalled_used = vq->last_used_idx;
+    vq->signalled_wrap = vq->used_wrap_counter;
+    vq->signalled_valid = 1;
+    if (!notify) {
+        return 0;
+    }
+    if (write(vq->call_fd, &one, sizeof(one)) < 0) {
+        perror("write call eventfd");
+    }
+    return 1;
+}
+
+int vq_avail_pending(const Virtqueue *vq) {
+    if (vq->packed) {
+        uint16_t flags = __atomic_load_n(&vq->pdesc[vq->last_avail_idx].flags,
+                                         __ATOMIC_ACQUIRE);
+        return packed_desc_is_avail(flags, vq->avail_wrap_counter);
+    }
+    return __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE) != vq->last_avail_idx;
+}
+
+// Split rings: publish avail_event, which lives in the (logged) used ring.
+static void vq_set_avail_event(Virtqueue *vq, uint16_t idx) {
+    __atomic_store_n(vring_avail_event(vq->used, vq->num), idx, __ATOMIC_RELAXED);
+    if (vq->log && vq->log_ring) {
+        vhost_log_write(vq->log, &vq->log_cache, vq->log_ring_gpa +
+                        offsetof(VringUsed, ring) + (uint64_t)vq->num * sizeof(VringUsedElem),
+                        sizeof(uint16_t));
+        vhost_log_flush(vq->log, &vq->log_cache);
+    }
+}
+
+void vq_disable_kicks(Virtqueue *vq) {
+    if (vq->packed) {
+        __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_DISABLE,
+                         __ATOMIC_RELAXED);
+    } else if (vq->event_idx) {
+        // Half the index space away: the driver cannot get there before
+        // kicks are enabled again.
+        vq_set_avail_event(vq, vq->last_avail_idx + 0x8000);
+    } else {
+        __atomic_store_n(&vq->used->flags, vq->used->flags | VRING_USED_F_NO_NOTIFY,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+int vq_enable_kicks(Virtqueue *vq) {
+    if (vq->packed && vq->event_idx) {
+        __atomic_store_n(&vq->device_event->off_wrap, vq->last_avail_idx |
+                         (uint16_t)(vq->avail_wrap_counter << VRING_PACKED_WRAP_SHIFT),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_DESC,
+                         __ATOMIC_RELEASE);
+    } else if (vq->packed) {
+        __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_ENABLE,
+                         __ATOMIC_RELAXED);
+    } else if (vq->event_idx) {
+        vq_set_avail_event(vq, vq->last_avail_idx);
+    } else {
+        __atomic_store_n(&vq->used->flags, vq->used->flags & ~VRING_USED_F_NO_NOTIFY,
+                         __ATOMIC_RELAXED);
+    }
+    // Pairs with the fence in vq_driver_needs_kick(): either the driver sees
+    // kicks enabled, or we see what it published before checking.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return vq_avail_pending(vq);
+}
+
+size_t iov_copy_at(const struct iovec *dst, unsigned ndst, size_t dst_off,
+                   const struct iovec *src, unsigned nsrc, size_t src_off, size_t len) {
+    size_t copied = 0, doff = dst_off, soff = src_off;
+    unsigned d = 0, s = 0;
+
+    while (d < ndst && doff >= dst[d].iov_len) {
+        doff -= dst[d++].iov_len;
+    }
+    while (s < nsrc && soff >= src[s].iov_len) {
+        soff -= src[s++].iov_len;
+    }
+    while (copied < len && d < ndst && s < nsrc) {
+        size_t n = dst[d].iov_len - doff;
+
+        if (src[s].iov_len - soff < n) {
+            n = src[s].iov_len - soff;
+        }
+        if (len - copied < n) {
+            n = len - copied;
+        }
+        memcpy((uint8_t *)dst[d].iov_base + doff,
+               (const uint8_t *)src[s].iov_base + soff, n);
+        copied += n;
+        doff += n;
+        soff += n;
+        if (doff == dst[d].iov_len) {
+            d++;
+            doff = 0;
+        }
+        if (soff == src[s].iov_len) {
+            s++;
+            soff = 0;
+        }
+    }
+    return copied;
+}
+
+size_t iov_copy(const struct iovec *dst, unsigned ndst,
+                const struct iovec *src, unsigned nsrc, size_t len) {
+    return iov_copy_at(dst, ndst, 0, src, nsrc, 0, len);
+}
+
+size_t iov_write(const struct iovec *iov, unsigned niov, size_t offset,
+                 const void *buf, size_t len) {
+    size_t copied = 0;
+
+    for (unsigned i = 0; i < niov && copied < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset;
+        if (len - copied < n) {
+            n = len - copied;
+        }
+        memcpy((uint8_t *)iov[i].iov_base + offset, (const uint8_t *)buf + copied, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+size_t iov_read(const struct iovec *iov, unsigned niov, size_t offset,
+                void *buf, size_t len) {
+    size_t copied = 0;
+
+    for (unsigned i = 0; i < niov && copied < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - offset;
+        if (len - copied < n) {
+            n = len - copied;
+        }
+        memcpy((uint8_t *)buf + copied, (const uint8_t *)iov[i].iov_base + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+int vq_driver_init(VqDriver *drv, uint16_t num, int packed, void *ring) {
+    memset(drv, 0, sizeof(*drv));
+    drv->num = num;
+    drv->packed = packed;
+    drv->num_free = num;
+
+    if (packed) {
+        memset(ring, 0, vring_packed_size(num));
+        drv->pdesc = ring;
+        drv->driver_event = (VringPackedDescEvent *)((uint8_t *)ring +
+                                                     vring_packed_driver_offset(num));
+        drv->device_event = (VringPackedDescEvent *)((uint8_t *)ring +
+                                                     vring_packed_device_offset(num));
+        drv->avail_wrap_counter = 1;
+        drv->used_wrap_counter = 1;
+        drv->kicked_avail_wrap = 1;
+        drv->id_next = calloc(num, sizeof(uint16_t));
+        drv->id_ndescs = calloc(num, sizeof(uint16_t));
+        if (!drv->id_next || !drv->id_ndescs) {
+            vq_driver_cleanup(drv);
+            return -1;
+        }
+        for (uint16_t i = 0; i < num - 1; i++) {
+            drv->id_next[i] = i + 1;
+        }
+        return 0;
+    }
+
+    memset(ring, 0, vring_split_size(num));
+    drv->desc = ring;
+    drv->avail = (VringAvail *)((uint8_t *)ring + vring_avail_offset(num));
+    drv->used = (VringUsed *)((uint8_t *)ring + vring_used_offset(num));
+    for (uint16_t i = 0; i < num - 1; i++) {
+        drv->desc[i].next = i + 1;
+    }
+    return 0;
+}
+
+void vq_driver_cleanup(VqDriver *drv) {
+    free(drv->id_next);
+    free(drv->id_ndescs);
+    drv->id_next = NULL;
+    drv->id_ndescs = NULL;
+}
+
+static int vq_driver_add_packed(VqDriver *drv, const VringDesc *segs,
+                                uint16_t nsegs) {
+    uint16_t id = drv->free_head;
+    uint16_t head = drv->avail_idx, idx = head;
+    uint16_t avail_used = drv->avail_wrap_counter ? VRING_PACKED_DESC_F_AVAIL
+                                                  : VRING_PACKED_DESC_F_USED;
+    uint16_t head_flags = 0;
+
+    for (uint16_t i = 0; i < nsegs; i++) {
+        VringPackedDesc *d = &drv->pdesc[idx];
+        uint16_t flags = (segs[i].flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)) |
+                         (i + 1 < nsegs ? VRING_DESC_F_NEXT : 0) | avail_used;
+        d->addr = segs[i].addr;
+        d->len = segs[i].len;
+        d->id = id;
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            d->flags = flags;
+        }
+        if (++idx >= drv->num) {
+            idx = 0;
+            drv->avail_wrap_counter ^= 1;
+            avail_used = drv->avail_wrap_counter ? VRING_PACKED_DESC_F_AVAIL
+                                                 : VRING_PACKED_DESC_F_USED;
+        }
+    }
+    drv->avail_idx = idx;
+    drv->free_head = drv->id_next[id];
+    drv->id_ndescs[id] = nsegs;
+    drv->num_free -= nsegs;
+
+    // Writing the head flags last makes the whole chain visible at once.
+    __atomic_store_n(&drv->pdesc[head].flags, head_flags, __ATOMIC_RELEASE);
+    return id;
+}
+
+int vq_driver_add(VqDriver *drv, const VringDesc *segs, uint16_t nsegs) {
+    uint16_t head = drv->free_head;
+    uint16_t idx = head, last = head;
+
+    if (nsegs == 0 || nsegs > drv->num_free) {
+        return -1;
+    }
+    if (drv->packed) {
+        return vq_driver_add_packed(drv, segs, nsegs);
+    }
+    for (uint16_t i = 0; i < nsegs; i++) {
+        VringDesc *d = &drv->desc[idx];
+        d->addr = segs[i].addr;
+        d->len = segs[i].len;
+        d->flags = (segs[i].flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)) |
+                   (i + 1 < nsegs ? VRING_DESC_F_NEXT : 0);
+        last = idx;
+        idx = d->next;
+    }
+    drv->free_head = drv->desc[last].next;
+    drv->num_free -= nsegs;
+
+    drv->avail->ring[drv->avail_idx & (drv->num - 1)] = head;
+    drv->avail_idx++;
+    return head;
+}
+
+int vq_driver_add_indirect(VqDriver *drv, const VringDesc *segs, uint16_t nsegs,
+                           void *table, uint64_t table_gpa) {
+    VringDesc desc = {
+        .addr = table_gpa,
+        .len = (uint32_t)nsegs * sizeof(VringDesc),
+        .flags = VRING_DESC_F_INDIRECT,
+    };
+
+    if (nsegs == 0 || drv->num_free == 0) {
+        return -1;
+    }
+    for (uint16_t i = 0; i < nsegs; i++) {
+        if (drv->packed) {
+            VringPackedDesc *d = (VringPackedDesc *)table + i;
+
+            *d = (VringPackedDesc){
+                .addr = segs[i].addr,
+                .len = segs[i].len,
+                .flags = segs[i].flags & VRING_DESC_F_WRITE,
+            };
+        } else {
+            VringDesc *d = (VringDesc *)table + i;
+
+            *d = (VringDesc){
+                .addr = segs[i].addr,
+                .len = segs[i].len,
+                .flags = (segs[i].flags & VRING_DESC_F_WRITE) |
+                         (i + 1 < nsegs ? VRING_DESC_F_NEXT : 0),
+                .next = i + 1,
+            };
+        }
+    }
+    return vq_driver_add(drv, &desc, 1);
+}
+
+void vq_driver_publish(VqDriver *drv) {
+    if (!drv->packed) {
+        __atomic_store_n(&drv->avail->idx, drv->avail_idx, __ATOMIC_RELEASE);
+    }
+}
+
+int vq_driver_needs_kick(VqDriver *drv) {
+    uint16_t old = drv->kicked_avail_idx, off_wrap, event, flags, added;
+    uint8_t old_wrap = drv->kicked_avail_wrap;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    drv->kicked_avail_idx = drv->avail_idx;
+    drv->kicked_avail_wrap = drv->avail_wrap_counter;
+    if (!drv->packed) {
+        if (drv->event_idx) {
+            event = __atomic_load_n(vring_avail_event(drv->used, drv->num), __ATOMIC_RELAXED);
+            return vring_need_event(event, drv->avail_idx, old);
+        }
+        return !(__atomic_load_n(&drv->used->flags, __ATOMIC_RELAXED) &
+                 VRING_USED_F_NO_NOTIFY);
+    }
+    flags = __atomic_load_n(&drv->device_event->flags, __ATOMIC_RELAXED);
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC || !drv->event_idx) {
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+    // Same as the device's check of used_event in vq_notify()
+    off_wrap = __atomic_load_n(&drv->device_event->off_wrap, __ATOMIC_RELAXED);
+    added = drv->avail_idx - old + (drv->avail_wrap_counter != old_wrap ? drv->num : 0);
+    event = off_wrap & ((1U << VRING_PACKED_WRAP_SHIFT) - 1);
+    if ((off_wrap >> VRING_PACKED_WRAP_SHIFT) != drv->avail_wrap_counter) {
+        event -= drv->num;
+    }
+    return vring_need_event(event, drv->avail_idx, drv->avail_idx - added);
+}
+
+void vq_driver_disable_interrupts(VqDriver *drv) {
+    if (drv->packed) {
+        __atomic_store_n(&drv->driver_event->flags, VRING_PACKED_EVENT_FLAG_DISABLE,
+                         __ATOMIC_RELAXED);
+    } else if (drv->event_idx) {
+        // As far from the used index as vq_disable_kicks() puts avail_event
+        __atomic_store_n(vring_used_event(drv->avail, drv->num),
+                         (uint16_t)(drv->last_used_idx + 0x8000), __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&drv->avail->flags, VRING_AVAIL_F_NO_INTERRUPT, __ATOMIC_RELAXED);
+    }
+}
+
+int vq_driver_enable_interrupts(VqDriver *drv) {
+    if (drv->packed && drv->event_idx) {
+        __atomic_store_n(&drv->driver_event->off_wrap, drv->last_used_idx |
+                         (uint16_t)(drv->used_wrap_counter << VRING_PACKED_WRAP_SHIFT),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&drv->driver_event->flags, VRING_PACKED_EVENT_FLAG_DESC,
+                         __ATOMIC_RELEASE);
+    } else if (drv->packed) {
+        __atomic_store_n(&drv->driver_event->flags, VRING_PACKED_EVENT_FLAG_ENABLE,
+                         __ATOMIC_RELAXED);
+    } else if (drv->event_idx) {
+        __atomic_store_n(vring_used_event(drv->avail, drv->num), drv->last_used_idx,
+                         __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&drv->avail->flags, 0, __ATOMIC_RELAXED);
+    }
+    // Pairs with the fence in vq_notify()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (drv->packed) {
+        uint16_t flags = __atomic_load_n(&drv->pdesc[drv->last_used_idx].flags,
+                                         __ATOMIC_ACQUIRE);
+        return !!(flags & VRING_PACKED_DESC_F_USED) == drv->used_wrap_counter;
+    }
+    return __atomic_load_n(&drv->used->idx, __ATOMIC_ACQUIRE) != drv->last_used_idx;
+}
+
+static int vq_driver_get_used_packed(VqDriver *drv, uint32_t *len) {
+    VringPackedDesc *d = &drv->pdesc[drv->last_used_idx];
+    uint16_t flags = __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE);
+    uint8_t wrap = drv->used_wrap_counter;
+    uint16_t id;
+
+    if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != wrap ||
+        !!(flags & VRING_PACKED_DESC_F_USED) != wrap) {
+        return -1;
+    }
+    id = d->id;
+    if (len) {
+        *len = d->len;
+    }
+    drv->last_used_idx += drv->id_ndescs[id];
+    if (drv->last_used_idx >= drv->num) {
+        drv->last_used_idx -= drv->num;
+        drv->used_wrap_counter ^= 1;
+    }
+    drv->num_free += drv->id_ndescs[id];
+    drv->id_next[id] = drv->free_head;
+    drv->free_head = id;
+    return id;
+}
+
+int vq_driver_get_used(VqDriver *drv, uint32_t *len) {
+    uint16_t used_idx;
+    const VringUsedElem *elem;
+    uint16_t head, idx;
+
+    if (drv->packed) {
+        return vq_driver_get_used_packed(drv, len);
+    }
+    used_idx = __atomic_load_n(&drv->used->idx, __ATOMIC_ACQUIRE);
+    if (used_idx == drv->last_used_idx) {
+        return -1;
+    }
+    elem = &drv->used->ring[drv->last_used_idx & (drv->num - 1)];
+    head = elem->id;
+    if (len) {
+        *len = elem->len;
+    }
+    drv->last_used_idx++;
+
+    // Put the whole chain back on the free list.
+    idx = head;
+    drv->num_free++;
+    while (drv->desc[idx].flags & VRING_DESC_F_NEXT) {
+        idx = drv->desc[idx].next;
+        drv->num_free++;
+    }
+    drv->desc[idx].next = drv->free_head;
+    drv->free_head = head;
+    return head;
+}
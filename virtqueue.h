@@ -0,0 +1,358 @@
+#ifndef VIRTQUEUE_H
+#define VIRTQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "vhost_mem.h"
+
+// Split virtqueue layout (virtio 1.x, section 2.7).
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+#define VRING_DESC_F_INDIRECT       4
+
+#define VRING_USED_F_NO_NOTIFY      1
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+
+// Packed virtqueue layout (virtio 1.x, section 2.8).
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
+// SET/GET_VRING_BASE for packed rings carry the wrap counter in bit 15.
+#define VRING_PACKED_WRAP_SHIFT     15
+
+#define VQ_MAX_RING_SIZE            32768
+#define VQ_MAX_SEGS                 64
+#define VQ_BURST_MAX                64
+
+typedef struct VringDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VringDesc;
+
+typedef struct VringAvail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} VringAvail;
+
+typedef struct VringUsedElem {
+    uint32_t id;
+    uint32_t len;
+} VringUsedElem;
+
+typedef struct VringUsed {
+    uint16_t flags;
+    uint16_t idx;
+    VringUsedElem ring[];
+} VringUsed;
+
+typedef struct VringPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VringPackedDesc;
+
+typedef struct VringPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VringPackedDescEvent;
+
+// Contiguous layouts used by our frontends. The parts written by the device
+// start on their own cache line so the two sides do not share a line.
+#define VRING_USED_ALIGN 64
+
+static inline size_t vring_align(size_t off) {
+    return (off + VRING_USED_ALIGN - 1) & ~(size_t)(VRING_USED_ALIGN - 1);
+}
+
+static inline size_t vring_avail_offset(uint16_t num) {
+    return (size_t)num * sizeof(VringDesc);
+}
+
+static inline size_t vring_used_offset(uint16_t num) {
+    return vring_align(vring_avail_offset(num) + sizeof(VringAvail) +
+                       ((size_t)num + 1) * sizeof(uint16_t));
+}
+
+static inline size_t vring_split_size(uint16_t num) {
+    return vring_used_offset(num) + sizeof(VringUsed) +
+           (size_t)num * sizeof(VringUsedElem) + sizeof(uint16_t);
+}
+
+// VIRTIO_RING_F_EVENT_IDX (virtio 1.x, section 2.7.10): instead of the
+// NO_INTERRUPT/NO_NOTIFY flags, each side publishes the index at which it
+// next wants to be notified, used_event after the avail ring and
+// avail_event after the used ring. Packed rings put it in off_wrap of the
+// event suppression areas, with flags set to VRING_PACKED_EVENT_FLAG_DESC.
+static inline uint16_t *vring_used_event(VringAvail *avail, uint16_t num) {
+    return &avail->ring[num];
+}
+
+static inline uint16_t *vring_avail_event(VringUsed *used, uint16_t num) {
+    return (uint16_t *)&used->ring[num];
+}
+
+// Whether moving an index from old to new_idx passed event.
+static inline int vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+// Packed: descriptor ring, then driver and device event suppression areas.
+// These are the "avail" and "used" addresses of SET_VRING_ADDR.
+static inline size_t vring_packed_driver_offset(uint16_t num) {
+    return (size_t)num * sizeof(VringPackedDesc);
+}
+
+static inline size_t vring_packed_device_offset(uint16_t num) {
+    return vring_align(vring_packed_driver_offset(num) +
+                       sizeof(VringPackedDescEvent));
+}
+
+static inline size_t vring_packed_size(uint16_t num) {
+    return vring_packed_device_offset(num) + sizeof(VringPackedDescEvent);
+}
+
+// Inflight tracking (VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD). The frontend
+// keeps a shared area across backend restarts, one VqInflight per vring, so
+// that a new backend picks up a ring where the old one stopped. The device
+// uses chains in the order it takes them, so the chains in flight are the
+// ones between the used and the avail position, and a restarted backend
+// takes them again from the used position. A split ring keeps that position
+// in its used index. A packed ring does not, and using a chain overwrites
+// its head descriptor, so each burst of used descriptors is logged here
+// before it is written; a backend that finds the burst unpublished writes
+// it again.
+#define VQ_INFLIGHT_VERSION         1
+
+typedef struct VqInflightUsed {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VqInflightUsed;
+
+typedef struct VqInflight {
+    uint16_t version;           // 0 until a backend runs the ring
+    uint16_t num;
+    uint16_t used_base;         // packed: used position, as in SET_VRING_BASE
+    uint16_t batch_base;        // packed: where the logged burst starts
+    uint16_t batch_len;         // packed: chains in the logged burst, 0 if none
+    uint16_t padding[3];
+    VqInflightUsed batch[VQ_BURST_MAX];
+} VqInflight;
+
+// Bytes of the shared area per vring.
+static inline size_t vq_inflight_size(void) {
+    return vring_align(sizeof(VqInflight));
+}
+
+// A descriptor chain translated into our address space. The nout
+// device-readable segments come first, followed by nin device-writable ones.
+// A descriptor that crosses guest memory regions takes one segment per region.
+// The buffers of an indirect table (VRING_DESC_F_INDIRECT) join the chain
+// in place of the ring descriptor that points to the table.
+typedef struct VqChain {
+    uint16_t head;              // split: head index, packed: buffer id
+    uint16_t ndescs;            // ring slots the chain occupies
+    uint16_t nout;
+    uint16_t nin;
+    uint32_t out_len;
+    uint32_t in_len;
+    struct iovec iov[VQ_MAX_SEGS];
+    uint64_t gpa[VQ_MAX_SEGS];  // guest address of each segment, for the dirty log
+} VqChain;
+
+// Device (backend) side of a virtqueue.
+typedef struct Virtqueue {
+    uint16_t num;
+    int packed;
+    union {
+        struct {
+            VringDesc *desc;
+            VringAvail *avail;
+            VringUsed *used;
+        };
+        struct {
+            VringPackedDesc *pdesc;
+            VringPackedDescEvent *driver_event;
+            VringPackedDescEvent *device_event;
+        };
+    };
+    uint16_t last_avail_idx;
+    uint16_t last_used_idx;
+    uint8_t avail_wrap_counter;
+    uint8_t used_wrap_counter;
+    const VhostMem *mem;
+    VhostMemCache mem_cache;    // last region a descriptor of this queue hit
+    int call_fd;
+    int indirect;               // VIRTIO_RING_F_INDIRECT_DESC negotiated
+    VqInflight *inflight;       // NULL without inflight tracking
+    // VIRTIO_RING_F_EVENT_IDX: where the used index stood at the last
+    // vq_notify().
+    int event_idx;
+    int signalled_valid;
+    uint16_t signalled_used;
+    uint8_t signalled_wrap;
+    // Dirty page logging (VHOST_F_LOG_ALL): NULL when off. log_ring says
+    // whether our ring writes are logged too, at log_ring_gpa: the used
+    // ring (split) or the descriptor ring (packed).
+    VhostLog *log;
+    int log_ring;
+    uint64_t log_ring_gpa;
+    VhostLogCache log_cache;
+} Virtqueue;
+
+// Translate the ring addresses (frontend virtual addresses, as sent in
+// SET_VRING_ADDR) and attach the queue to a memory table. num and packed
+// must already be set.
+int vq_map(Virtqueue *vq, const VhostMem *mem, uint64_t desc_uva,
+           uint64_t avail_uva, uint64_t used_uva);
+
+// SET_VRING_BASE / GET_VRING_BASE encoding of the ring position.
+void vq_set_base(Virtqueue *vq, uint32_t base);
+uint32_t vq_get_base(const Virtqueue *vq);
+
+// Attach the ring's inflight area, after vq_map() and vq_set_base(). If a
+// previous backend ran the ring, its position is taken from the ring and
+// the area instead, a packed burst it left unpublished is written out, and
+// 1 is returned. Otherwise, or if the area holds a position or burst that
+// lies outside the ring, the area is claimed for this ring from its current
+// position and 0 is returned.
+int vq_inflight_attach(Virtqueue *vq, VqInflight *inflight);
+
+// Mark the ring stopped cleanly, so that the next backend starts from
+// SET_VRING_BASE again, and detach the area.
+void vq_inflight_detach(Virtqueue *vq);
+
+// Take the next available chain. Returns 1 with *chain filled in, 0 when
+// the ring is empty and -1 when the frontend handed us a malformed chain.
+int vq_pop(Virtqueue *vq, VqChain *chain);
+
+// Return a chain to the driver, len being the number of bytes written.
+// With a dirty log attached, those bytes and the ring entry are logged.
+void vq_push(Virtqueue *vq, const VqChain *chain, uint32_t len);
+
+// Give back the last n chains taken by vq_pop()/vq_dequeue_burst(), none of
+// which may have been pushed yet, so that the next pop returns them again.
+void vq_unpop(Virtqueue *vq, const VqChain *chains, unsigned n);
+
+// Burst variants of vq_pop()/vq_push(). The split avail index is read
+// once per burst and the used index (or, for packed rings, the first used
+// descriptor's flags) is released once, after the whole burst is written.
+// vq_dequeue_burst() returns the number of chains taken, up to max, or -1 on
+// a malformed chain. lens may be NULL when nothing was written. The dirty
+// log, if any, is flushed once per enqueued burst.
+int vq_dequeue_burst(Virtqueue *vq, VqChain *chains, unsigned max);
+void vq_enqueue_burst(Virtqueue *vq, const VqChain *chains, const uint32_t *lens,
+                      unsigned n);
+
+// Signal the call eventfd unless the driver suppressed interrupts, or,
+// with event_idx, unless the used index has not passed its used_event
+// since the last call. Returns 1 if the eventfd was written.
+int vq_notify(Virtqueue *vq);
+
+// Whether vq_pop() would find a chain, without consuming it.
+int vq_avail_pending(const Virtqueue *vq);
+
+// Ask the driver to stop kicking while we poll the ring, and to resume
+// before we sleep on the kick eventfd. vq_enable_kicks() returns 1 if a
+// chain became available in between, in which case the caller must poll
+// again rather than sleep. With event_idx on a split ring these move
+// avail_event to the next chain, or out of the driver's reach.
+void vq_disable_kicks(Virtqueue *vq);
+int vq_enable_kicks(Virtqueue *vq);
+
+// Copy up to len bytes between two scatter lists without an intermediate
+// buffer. Returns the number of bytes copied.
+size_t iov_copy(const struct iovec *dst, unsigned ndst,
+                const struct iovec *src, unsigned nsrc, size_t len);
+
+// iov_copy() starting dst_off bytes into dst and src_off bytes into src.
+size_t iov_copy_at(const struct iovec *dst, unsigned ndst, size_t dst_off,
+                   const struct iovec *src, unsigned nsrc, size_t src_off, size_t len);
+
+// Copy len bytes from buf into a scatter list, starting offset bytes in.
+// Returns the number of bytes copied.
+size_t iov_write(const struct iovec *iov, unsigned niov, size_t offset,
+                 const void *buf, size_t len);
+
+// Copy len bytes out of a scatter list, starting offset bytes in, into buf.
+// Returns the number of bytes copied.
+size_t iov_read(const struct iovec *iov, unsigned niov, size_t offset,
+                void *buf, size_t len);
+
+// Driver (frontend) side of a virtqueue in guest memory.
+typedef struct VqDriver {
+    uint16_t num;
+    int packed;
+    union {
+        struct {
+            VringDesc *desc;
+            VringAvail *avail;
+            VringUsed *used;
+        };
+        struct {
+            VringPackedDesc *pdesc;
+            VringPackedDescEvent *driver_event;
+            VringPackedDescEvent *device_event;
+        };
+    };
+    uint16_t free_head;         // head (split) or id (packed) of the next add
+    uint16_t num_free;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+    uint8_t avail_wrap_counter;
+    uint8_t used_wrap_counter;
+    uint16_t *id_next;          // packed only: free id list and chain lengths
+    uint16_t *id_ndescs;
+    // VIRTIO_RING_F_EVENT_IDX: set by the caller after vq_driver_init().
+    // kicked_* is where the avail index stood at the last kick check.
+    int event_idx;
+    uint16_t kicked_avail_idx;
+    uint8_t kicked_avail_wrap;
+} VqDriver;
+
+// ring points at vring_split_size(num) or vring_packed_size(num) bytes
+// laid out as above.
+int vq_driver_init(VqDriver *drv, uint16_t num, int packed, void *ring);
+void vq_driver_cleanup(VqDriver *drv);
+
+// Queue a chain of nsegs buffers (addr/len/WRITE flag taken from segs).
+// Split chains become visible to the device on vq_driver_publish(); packed
+// chains are visible as soon as they are added. Returns the head (split)
+// or buffer id (packed), or -1 if the ring is full.
+int vq_driver_add(VqDriver *drv, const VringDesc *segs, uint16_t nsegs);
+
+// vq_driver_add() through an indirect table (VIRTIO_RING_F_INDIRECT_DESC):
+// the nsegs buffers are written to table, which the device sees at
+// table_gpa, and the chain takes a single ring slot. table must hold nsegs
+// descriptors and stay untouched until the chain is used; tables indexed by
+// free_head, the head or id of the next add, satisfy that.
+int vq_driver_add_indirect(VqDriver *drv, const VringDesc *segs, uint16_t nsegs,
+                           void *table, uint64_t table_gpa);
+
+void vq_driver_publish(VqDriver *drv);
+
+// Whether the device wants a kick for the chains published since the last
+// call, which with event_idx depends on whether they passed avail_event.
+int vq_driver_needs_kick(VqDriver *drv);
+
+// Ask the device to stop signalling used chains while we poll, and to
+// resume before we sleep on the call eventfd. vq_driver_enable_interrupts()
+// returns 1 if a chain was used in between, in which case the caller must
+// poll again rather than sleep.
+void vq_driver_disable_interrupts(VqDriver *drv);
+int vq_driver_enable_interrupts(VqDriver *drv);
+
+// Reclaim one used chain. Returns its head/id, or -1 if none is pending.
+int vq_driver_get_used(VqDriver *drv, uint32_t *len);
+
+#endif